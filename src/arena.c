@@ -0,0 +1,162 @@
+/*
+ * arena.c
+ *
+ * The arena is a list of chunks. Allocation bumps ptr inside the current
+ * chunk and moves on to the next chunk (reusing it if it is already there)
+ * when the current one is full.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN 16
+
+struct ArenaChunk {
+    ArenaChunk *next;
+    size_t size;
+    bool large;
+    _Alignas(ARENA_ALIGN) char data[];
+};
+
+static size_t align_up(size_t size) {
+    return (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+}
+
+void arena_init(Arena *arena, size_t chunk_size) {
+    arena->first = NULL;
+    arena->current = NULL;
+    arena->ptr = NULL;
+    arena->end = NULL;
+    arena->chunk_size = chunk_size;
+    arena->has_large = FALSE;
+}
+
+void arena_destroy(Arena *arena) {
+    ArenaChunk *chunk = arena->first;
+    while (chunk != NULL) {
+        ArenaChunk *next = chunk->next;
+        g_free(chunk);
+        chunk = next;
+    }
+    arena_init(arena, arena->chunk_size);
+}
+
+static ArenaChunk *chunk_new(size_t size, bool large) {
+    ArenaChunk *chunk = g_malloc(sizeof(ArenaChunk) + size);
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->large = large;
+    return chunk;
+}
+
+static void use_chunk(Arena *arena, ArenaChunk *chunk) {
+    arena->current = chunk;
+    arena->ptr = chunk->data;
+    arena->end = chunk->data + chunk->size;
+}
+
+/* Makes the current chunk one with at least size free bytes. */
+static void arena_grow(Arena *arena, size_t size) {
+    // Reuse the chunks kept from earlier requests first.
+    ArenaChunk *next = arena->current != NULL ? arena->current->next : arena->first;
+    if (next != NULL && next->size >= size) {
+        use_chunk(arena, next);
+        return;
+    }
+
+    bool large = size > arena->chunk_size;
+    ArenaChunk *chunk = chunk_new(large ? size : arena->chunk_size, large);
+    arena->has_large |= large;
+
+    // Link the new chunk in right after the current one.
+    if (arena->current == NULL) {
+        chunk->next = arena->first;
+        arena->first = chunk;
+    }
+    else {
+        chunk->next = arena->current->next;
+        arena->current->next = chunk;
+    }
+    use_chunk(arena, chunk);
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+    size = align_up(size > 0 ? size : 1);
+    if (arena->ptr == NULL || (size_t) (arena->end - arena->ptr) < size) {
+        arena_grow(arena, size);
+    }
+    void *result = arena->ptr;
+    arena->ptr += size;
+    return result;
+}
+
+char *arena_strndup(Arena *arena, const char *str, size_t len) {
+    char *copy = arena_alloc(arena, len + 1);
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+char *arena_vprintf(Arena *arena, size_t *len, const char *format, va_list args) {
+    va_list copy;
+    va_copy(copy, args);
+
+    // Try to format straight into the free space of the current chunk.
+    size_t avail = arena->ptr != NULL ? (size_t) (arena->end - arena->ptr) : 0;
+    int n = vsnprintf(avail > 0 ? arena->ptr : NULL, avail, format, args);
+    if (n < 0) {
+        n = 0;
+    }
+
+    char *result;
+    if ((size_t) n < avail) {
+        result = arena_alloc(arena, (size_t) n + 1);
+    }
+    else {
+        result = arena_alloc(arena, (size_t) n + 1);
+        vsnprintf(result, (size_t) n + 1, format, copy);
+    }
+    va_end(copy);
+
+    if (len != NULL) {
+        *len = (size_t) n;
+    }
+    return result;
+}
+
+char *arena_printf(Arena *arena, size_t *len, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    char *result = arena_vprintf(arena, len, format, args);
+    va_end(args);
+    return result;
+}
+
+void arena_reset(Arena *arena) {
+    // Large chunks are rare, so only then is the list walked to give them back.
+    if (arena->has_large) {
+        ArenaChunk **link = &arena->first;
+        while (*link != NULL) {
+            ArenaChunk *chunk = *link;
+            if (chunk->large) {
+                *link = chunk->next;
+                g_free(chunk);
+            }
+            else {
+                link = &chunk->next;
+            }
+        }
+        arena->has_large = FALSE;
+    }
+
+    arena->current = NULL;
+    arena->ptr = NULL;
+    arena->end = NULL;
+    if (arena->first != NULL) {
+        use_chunk(arena, arena->first);
+    }
+}
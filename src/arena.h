@@ -0,0 +1,52 @@
+/*
+ * arena.h
+ *
+ * Bump allocator for per-request scratch memory. Each connection owns one
+ * arena; everything the request and its response need is carved out of it
+ * and released all at once by arena_reset(), which only rewinds a pointer.
+ * The chunks are kept for the next request, so a connection in steady state
+ * does no heap allocations at all.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct ArenaChunk ArenaChunk;
+
+typedef struct {
+    ArenaChunk *first;
+    ArenaChunk *current;
+    char *ptr;
+    char *end;
+    size_t chunk_size;
+    // Set when an allocation did not fit a regular chunk, see arena_reset().
+    bool has_large;
+} Arena;
+
+/* Initializes an empty arena. No memory is allocated until the first arena_alloc(). */
+void arena_init(Arena *arena, size_t chunk_size);
+
+/* Frees every chunk of the arena. */
+void arena_destroy(Arena *arena);
+
+/* Returns size bytes aligned for any type. Never fails (g_malloc aborts on OOM). */
+void *arena_alloc(Arena *arena, size_t size);
+
+/* Copies len bytes of str and NUL terminates the copy. */
+char *arena_strndup(Arena *arena, const char *str, size_t len);
+
+/* printf into the arena. The length of the result is stored in *len if len is not NULL. */
+char *arena_printf(Arena *arena, size_t *len, const char *format, ...)
+    __attribute__((format(printf, 3, 4)));
+char *arena_vprintf(Arena *arena, size_t *len, const char *format, va_list args)
+    __attribute__((format(printf, 3, 0)));
+
+/* Releases everything allocated since the last reset. Oversized chunks made
+    for a single large allocation are freed, regular chunks are kept. */
+void arena_reset(Arena *arena);
+
+#endif
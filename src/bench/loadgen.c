@@ -0,0 +1,655 @@
+/*
+ * loadgen.c
+ *
+ * HTTP load generator. Every thread drives its share of the connections
+ * from its own epoll loop. Closed-loop by default: a connection keeps
+ * --pipeline requests outstanding and sends the next one as soon as a
+ * response is complete, so the offered load follows what the server
+ * manages. With --rate it is open-loop: requests are issued on a fixed
+ * schedule over the connections whatever the server does, which is how an
+ * overloaded server is tested. Latency is measured per request, from the
+ * moment it is written (or was due, with --rate) to the moment its response
+ * is complete, and the result is printed as one line of JSON; with
+ * --per-connection it also tells how evenly the connections were served.
+ *
+ *   ./bench/loadgen [OPTION...]   (see --help)
+ */
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include "histogram.h"
+
+// Requests a connection can have outstanding.
+#define PIPELINE_MAX 256
+#define READ_SIZE (64 * 1024)
+
+typedef enum {
+    METHOD_GET,
+    METHOD_POST,
+    METHOD_HEAD
+} Method;
+
+typedef struct {
+    int fd;
+    bool connected;
+    // When connect() was called, until the connection is established.
+    uint64_t connect_ns;
+    // Outstanding requests, oldest first: when each was written and with which method.
+    uint64_t sent_ns[PIPELINE_MAX];
+    Method method[PIPELINE_MAX];
+    int head;
+    int inflight;
+    // Bytes of requests not written yet.
+    GString *out;
+    size_t out_done;
+    // Bytes of responses not parsed yet.
+    GString *in;
+    // With --per-connection: what this connection got, over all the sockets it opened.
+    Histogram *latency;
+    uint64_t requests;
+} Client;
+
+typedef struct {
+    int id;
+    pthread_t thread;
+    int connections;
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t non_2xx;
+    uint64_t bytes;
+    uint64_t connects;
+    uint32_t random;
+    Histogram latency;
+    Histogram connect_latency;
+    // Responses with a 2xx status and their latency, what the clients actually got served.
+    uint64_t ok;
+    Histogram ok_latency;
+    // With --rate: requests issued so far, those no connection could take, and where to try first.
+    uint64_t issued;
+    uint64_t unsent;
+    int next_client;
+    Client *clients;
+} Thread;
+
+// Command line options
+static gchar *opt_host = "127.0.0.1";
+static gint opt_port = 8080;
+static gint opt_connections = 64;
+static gint opt_threads = 4;
+static gdouble opt_duration = 10;
+static gint opt_pipeline = 1;
+static gboolean opt_close = FALSE;
+static gchar *opt_path = "/";
+static gchar *opt_mix = "get";
+static gint opt_body_size = 1024;
+static gchar *opt_body_file = "data.txt";
+static gchar *opt_label = NULL;
+static gdouble opt_rate = 0;
+static gboolean opt_per_connection = FALSE;
+
+static struct sockaddr_storage server;
+static socklen_t server_len;
+// Complete requests per method, and the mix as cumulative percentages.
+static GString *templates[3];
+static int mix_limit[3];
+static uint64_t start_ns;
+static uint64_t deadline_ns;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+static uint32_t next_random(Thread *thread) {
+    // xorshift32, good enough to pick methods.
+    uint32_t x = thread->random;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    thread->random = x;
+    return x;
+}
+
+/* Parses "get:80,post:10,head:10" into mix_limit. Returns FALSE if it makes no sense. */
+static bool parse_mix(const char *mix) {
+    int weights[3] = { 0, 0, 0 };
+    gchar **items = g_strsplit(mix, ",", -1);
+    bool ok = TRUE;
+    for (gchar **item = items; *item != NULL && ok; item++) {
+        gchar **pair = g_strsplit(*item, ":", 2);
+        int weight = pair[1] != NULL ? atoi(pair[1]) : 1;
+        if (g_ascii_strcasecmp(pair[0], "get") == 0) {
+            weights[METHOD_GET] = weight;
+        }
+        else if (g_ascii_strcasecmp(pair[0], "post") == 0) {
+            weights[METHOD_POST] = weight;
+        }
+        else if (g_ascii_strcasecmp(pair[0], "head") == 0) {
+            weights[METHOD_HEAD] = weight;
+        }
+        else {
+            ok = FALSE;
+        }
+        ok = ok && weight >= 0;
+        g_strfreev(pair);
+    }
+    g_strfreev(items);
+
+    int total = weights[0] + weights[1] + weights[2];
+    if (!ok || total == 0) {
+        return FALSE;
+    }
+    int sum = 0;
+    for (int m = 0; m < 3; m++) {
+        sum += weights[m];
+        mix_limit[m] = (int) ((int64_t) sum * 100 / total);
+    }
+    return TRUE;
+}
+
+/* Builds the request of every method once. POST bodies are taken from the body file. */
+static bool build_templates(void) {
+    gchar *data = NULL;
+    gsize data_len = 0;
+    if (opt_body_size > 0 && !g_file_get_contents(opt_body_file, &data, &data_len, NULL)) {
+        fprintf(stderr, "Can not read %s for the POST bodies\n", opt_body_file);
+        return FALSE;
+    }
+    if (opt_body_size > 0 && data_len == 0) {
+        fprintf(stderr, "%s is empty, there is nothing to make the POST bodies of\n", opt_body_file);
+        g_free(data);
+        return FALSE;
+    }
+    const char *connection = opt_close ? "close" : "keep-alive";
+    const char *names[3] = { "GET", "POST", "HEAD" };
+    for (int m = 0; m < 3; m++) {
+        templates[m] = g_string_new(NULL);
+        g_string_append_printf(templates[m], "%s %s HTTP/1.1\r\n"
+                               "Host: %s:%d\r\n"
+                               "User-Agent: loadgen\r\n"
+                               "Connection: %s\r\n", names[m], opt_path, opt_host, opt_port, connection);
+        if (m == METHOD_POST) {
+            g_string_append_printf(templates[m], "Content-Type: text/plain\r\nContent-Length: %d\r\n\r\n",
+                                   opt_body_size);
+            // A body file shorter than the body is repeated.
+            for (gint n = 0; n < opt_body_size; ) {
+                gint chunk = MIN(opt_body_size - n, (gint) data_len);
+                g_string_append_len(templates[m], data, chunk);
+                n += chunk;
+            }
+        }
+        else {
+            g_string_append(templates[m], "\r\n");
+        }
+    }
+    g_free(data);
+    return TRUE;
+}
+
+static bool resolve_server(void) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *result;
+    char port[16];
+    snprintf(port, sizeof(port), "%d", opt_port);
+    int r = getaddrinfo(opt_host, port, &hints, &result);
+    if (r != 0) {
+        fprintf(stderr, "%s: %s\n", opt_host, gai_strerror(r));
+        return FALSE;
+    }
+    memcpy(&server, result->ai_addr, result->ai_addrlen);
+    server_len = result->ai_addrlen;
+    freeaddrinfo(result);
+    return TRUE;
+}
+
+/* Queues one request of the mix, its latency counts from sent_ns. */
+static void queue_request(Thread *thread, Client *client, uint64_t sent_ns) {
+    uint32_t pick = next_random(thread) % 100;
+    Method method = pick < (uint32_t) mix_limit[METHOD_GET] ? METHOD_GET :
+        pick < (uint32_t) mix_limit[METHOD_POST] ? METHOD_POST : METHOD_HEAD;
+    int slot = (client->head + client->inflight) % PIPELINE_MAX;
+    client->method[slot] = method;
+    client->sent_ns[slot] = sent_ns;
+    client->inflight++;
+    g_string_append_len(client->out, templates[method]->str, (gssize) templates[method]->len);
+}
+
+/* Queues requests until the connection has --pipeline of them outstanding. With --rate the
+    schedule decides instead, see issue_due(). */
+static void fill_pipeline(Thread *thread, Client *client) {
+    int depth = opt_close ? 1 : opt_pipeline;
+    uint64_t now = now_ns();
+    while (opt_rate == 0 && client->inflight < depth && now < deadline_ns) {
+        queue_request(thread, client, now);
+    }
+}
+
+static void open_client(Thread *thread, int epfd, Client *client) {
+    client->fd = socket(server.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    int on = 1;
+    setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (connect(client->fd, (struct sockaddr *) &server, server_len) == -1 && errno != EINPROGRESS) {
+        thread->errors++;
+    }
+    client->connected = FALSE;
+    client->connect_ns = now_ns();
+    client->head = 0;
+    client->inflight = 0;
+    g_string_truncate(client->out, 0);
+    client->out_done = 0;
+    g_string_truncate(client->in, 0);
+    thread->connects++;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = client;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, client->fd, &ev);
+    fill_pipeline(thread, client);
+}
+
+static void close_client(Client *client) {
+    if (opt_close) {
+        // Resets instead of lingering in TIME_WAIT, which would use up the local ports in seconds.
+        struct linger linger = { 1, 0 };
+        setsockopt(client->fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    }
+    close(client->fd);
+    client->fd = -1;
+}
+
+/* Writes what the socket takes. Returns FALSE on an error. */
+static bool write_client(Client *client) {
+    while (client->out_done < client->out->len) {
+        ssize_t n = send(client->fd, client->out->str + client->out_done, client->out->len - client->out_done,
+                         MSG_NOSIGNAL);
+        if (n < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+        client->out_done += (size_t) n;
+    }
+    g_string_truncate(client->out, 0);
+    client->out_done = 0;
+    return TRUE;
+}
+
+/* Length of the complete response at the start of data, 0 if it is not complete yet, -1 if it is
+    broken. Sets *status and *close_conn to what the response says. */
+static ssize_t response_length(const char *data, size_t len, Method method, int *status, bool *close_conn) {
+    const char *end = g_strstr_len(data, (gssize) len, "\r\n\r\n");
+    if (end == NULL) {
+        return 0;
+    }
+    size_t head_len = (size_t) (end - data) + 4;
+    if (head_len < 16 || strncmp(data, "HTTP/1.", 7) != 0) {
+        return -1;
+    }
+    *status = atoi(data + 9);
+
+    long content_length = 0;
+    bool chunked = FALSE;
+    *close_conn = FALSE;
+    for (const char *line = strstr(data, "\r\n") + 2; line < end; line = strstr(line, "\r\n") + 2) {
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            content_length = strtol(line + 15, NULL, 10);
+        }
+        else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+            chunked = TRUE;
+        }
+        else if (strncasecmp(line, "Connection: close", 17) == 0) {
+            *close_conn = TRUE;
+        }
+    }
+    if (method == METHOD_HEAD || *status == 304 || *status == 204) {
+        return (ssize_t) head_len;
+    }
+    if (!chunked) {
+        return len >= head_len + (size_t) content_length ? (ssize_t) (head_len + (size_t) content_length) : 0;
+    }
+
+    // Chunked: walk the chunks up to the empty last one (no trailers are sent by httpd).
+    size_t pos = head_len;
+    while (TRUE) {
+        const char *line_end = g_strstr_len(data + pos, (gssize) (len - pos), "\r\n");
+        if (line_end == NULL) {
+            return 0;
+        }
+        size_t chunk = strtoul(data + pos, NULL, 16);
+        pos = (size_t) (line_end - data) + 2 + chunk + 2;
+        if (pos > len) {
+            return 0;
+        }
+        if (chunk == 0) {
+            return (ssize_t) pos;
+        }
+    }
+}
+
+/* Reads and takes the complete responses off the front. Returns FALSE if the connection has to be
+    opened again. */
+static bool read_client(Thread *thread, Client *client) {
+    bool eof = FALSE;
+    while (!eof) {
+        size_t used = client->in->len;
+        g_string_set_size(client->in, used + READ_SIZE);
+        ssize_t n = recv(client->fd, client->in->str + used, READ_SIZE, 0);
+        g_string_set_size(client->in, used + (n > 0 ? (size_t) n : 0));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            thread->errors++;
+            return FALSE;
+        }
+        eof = n == 0;
+        thread->bytes += (uint64_t) n;
+    }
+
+    uint64_t now = now_ns();
+    size_t consumed = 0;
+    bool close_conn = FALSE;
+    while (client->inflight > 0 && !close_conn) {
+        int status = 0;
+        ssize_t len = response_length(client->in->str + consumed, client->in->len - consumed,
+                                      client->method[client->head], &status, &close_conn);
+        if (len < 0) {
+            thread->errors++;
+            return FALSE;
+        }
+        if (len == 0) {
+            break;
+        }
+        consumed += (size_t) len;
+        uint64_t latency = (now - client->sent_ns[client->head]) / 1000;
+        histogram_record(&thread->latency, latency);
+        thread->requests++;
+        if (client->latency != NULL) {
+            histogram_record(client->latency, latency);
+            client->requests++;
+        }
+        if (status < 200 || status >= 300) {
+            thread->non_2xx++;
+        }
+        else {
+            histogram_record(&thread->ok_latency, latency);
+            thread->ok++;
+        }
+        client->head = (client->head + 1) % PIPELINE_MAX;
+        client->inflight--;
+    }
+    g_string_erase(client->in, 0, (gssize) consumed);
+    if (close_conn || eof) {
+        // Outstanding requests of a closed connection are lost.
+        thread->errors += (uint64_t) client->inflight;
+        return FALSE;
+    }
+    fill_pipeline(thread, client);
+    return TRUE;
+}
+
+/* With --rate: issues the requests that are due by now, each on the next connection that can take
+    one. Their latency counts from when they were due, so a server that falls behind is not let off
+    by the requests it held up. A request no connection can take is counted as unsent. */
+static void issue_due(Thread *thread, int epfd, Client *clients) {
+    uint64_t now = now_ns();
+    double rate = opt_rate / opt_threads;
+    uint64_t due = (uint64_t) ((double) (now - start_ns) * rate / 1e9);
+    int depth = opt_close ? 1 : PIPELINE_MAX;
+    for (; thread->issued < due; thread->issued++) {
+        Client *client = NULL;
+        for (int tried = 0; tried < thread->connections && client == NULL; tried++) {
+            Client *next = &clients[thread->next_client];
+            thread->next_client = (thread->next_client + 1) % thread->connections;
+            if (next->fd >= 0 && next->inflight < depth) {
+                client = next;
+            }
+        }
+        if (client == NULL) {
+            thread->unsent++;
+            continue;
+        }
+        queue_request(thread, client, start_ns + (uint64_t) ((double) thread->issued * 1e9 / rate));
+    }
+    for (int c = 0; c < thread->connections; c++) {
+        if (clients[c].fd >= 0 && clients[c].connected && !write_client(&clients[c])) {
+            thread->errors += (uint64_t) clients[c].inflight;
+            close_client(&clients[c]);
+            open_client(thread, epfd, &clients[c]);
+        }
+    }
+}
+
+static void *run_thread(void *data) {
+    Thread *thread = data;
+    int epfd = epoll_create1(0);
+    Client *clients = g_new0(Client, thread->connections);
+    thread->clients = clients;
+    for (int c = 0; c < thread->connections; c++) {
+        clients[c].out = g_string_sized_new(4096);
+        clients[c].in = g_string_sized_new(READ_SIZE);
+        if (opt_per_connection) {
+            clients[c].latency = g_new0(Histogram, 1);
+        }
+        open_client(thread, epfd, &clients[c]);
+    }
+
+    struct epoll_event events[256];
+    while (now_ns() < deadline_ns) {
+        // Open-loop, the schedule has to be kept to the millisecond.
+        int n = epoll_wait(epfd, events, 256, opt_rate > 0 ? 1 : 100);
+        for (int k = 0; k < n; k++) {
+            Client *client = events[k].data.ptr;
+            bool ok = TRUE;
+            if (events[k].events & (EPOLLERR | EPOLLHUP)) {
+                if (!client->connected) {
+                    thread->errors++;
+                }
+                ok = FALSE;
+            }
+            if (ok && (events[k].events & EPOLLOUT) && !client->connected) {
+                histogram_record(&thread->connect_latency, (now_ns() - client->connect_ns) / 1000);
+                client->connected = TRUE;
+            }
+            if (ok && (events[k].events & EPOLLIN)) {
+                ok = read_client(thread, client);
+            }
+            if (ok) {
+                ok = write_client(client);
+            }
+            if (!ok || (client->inflight == 0 && opt_close)) {
+                close_client(client);
+                if (now_ns() < deadline_ns) {
+                    open_client(thread, epfd, client);
+                    write_client(client);
+                }
+            }
+        }
+        if (opt_rate > 0) {
+            issue_due(thread, epfd, clients);
+        }
+    }
+
+    for (int c = 0; c < thread->connections; c++) {
+        if (clients[c].fd >= 0) {
+            close(clients[c].fd);
+        }
+        g_string_free(clients[c].out, TRUE);
+        g_string_free(clients[c].in, TRUE);
+    }
+    // The latency of every connection is reported by main().
+    close(epfd);
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* Prints the "per_connection" latencies and the "fairness" summary over them: the spread of the
+    connections' p99 and request counts, and Jain's index of the counts (1 when every connection
+    got as many responses, 1/n when one got them all). */
+static void print_per_connection(const Thread *threads) {
+    uint64_t *p99 = g_new(uint64_t, opt_connections);
+    uint64_t *served = g_new(uint64_t, opt_connections);
+    double sum = 0, squares = 0;
+    int n = 0;
+    printf(",\"per_connection\":[");
+    for (int t = 0; t < opt_threads; t++) {
+        for (int c = 0; c < threads[t].connections; c++, n++) {
+            const Client *client = &threads[t].clients[c];
+            p99[n] = histogram_percentile(client->latency, 0.99);
+            served[n] = client->requests;
+            sum += (double) client->requests;
+            squares += (double) client->requests * (double) client->requests;
+            printf("%s{\"requests\":%" G_GUINT64_FORMAT ",\"p50\":%" G_GUINT64_FORMAT ",\"p99\":%"
+                   G_GUINT64_FORMAT ",\"max\":%" G_GUINT64_FORMAT "}", n > 0 ? "," : "", client->requests,
+                   histogram_percentile(client->latency, 0.50), p99[n], client->latency->max);
+        }
+    }
+    qsort(p99, (size_t) n, sizeof(*p99), compare_u64);
+    qsort(served, (size_t) n, sizeof(*served), compare_u64);
+    printf("],\"fairness\":{\"p99_us_min\":%" G_GUINT64_FORMAT ",\"p99_us_median\":%" G_GUINT64_FORMAT
+           ",\"p99_us_max\":%" G_GUINT64_FORMAT ",\"requests_min\":%" G_GUINT64_FORMAT ",\"requests_max\":%"
+           G_GUINT64_FORMAT ",\"jain\":%.3f}", p99[0], p99[n / 2], p99[n - 1], served[0], served[n - 1],
+           squares > 0 ? sum * sum / (n * squares) : 0.0);
+    g_free(p99);
+    g_free(served);
+}
+
+int main(int argc, char **argv) {
+    GOptionEntry entries[] = {
+        { "host", 'H', 0, G_OPTION_ARG_STRING, &opt_host, "Server address (default 127.0.0.1)", "HOST" },
+        { "port", 'p', 0, G_OPTION_ARG_INT, &opt_port, "Server port (default 8080)", "PORT" },
+        { "connections", 'c', 0, G_OPTION_ARG_INT, &opt_connections, "Open connections (default 64)", "N" },
+        { "threads", 't', 0, G_OPTION_ARG_INT, &opt_threads, "Threads (default 4)", "N" },
+        { "duration", 'd', 0, G_OPTION_ARG_DOUBLE, &opt_duration, "Seconds to run (default 10)", "S" },
+        { "pipeline", 'P', 0, G_OPTION_ARG_INT, &opt_pipeline,
+            "Requests outstanding per connection (default 1)", "N" },
+        { "close", 0, 0, G_OPTION_ARG_NONE, &opt_close, "A new connection for every request", NULL },
+        { "path", 0, 0, G_OPTION_ARG_STRING, &opt_path, "Request path (default /)", "PATH" },
+        { "mix", 'm', 0, G_OPTION_ARG_STRING, &opt_mix,
+            "Method weights, e.g. get:80,post:15,head:5 (default get)", "MIX" },
+        { "body-size", 'b', 0, G_OPTION_ARG_INT, &opt_body_size, "Bytes of POST body (default 1024)", "BYTES" },
+        { "body-file", 0, 0, G_OPTION_ARG_FILENAME, &opt_body_file,
+            "Where POST bodies come from (default data.txt)", "FILE" },
+        { "label", 'l', 0, G_OPTION_ARG_STRING, &opt_label, "Name of the run in the JSON output", "NAME" },
+        { "per-connection", 0, 0, G_OPTION_ARG_NONE, &opt_per_connection,
+            "Also report the latency of every connection and how evenly they were served", NULL },
+        { "rate", 'r', 0, G_OPTION_ARG_DOUBLE, &opt_rate,
+            "Open-loop: issue R requests per second in all, whatever the responses (default 0, closed-loop)", "R" },
+        { NULL, 0, 0, 0, NULL, NULL, NULL }
+    };
+    GOptionContext *context = g_option_context_new("- HTTP load generator");
+    g_option_context_add_main_entries(context, entries, NULL);
+    GError *error = NULL;
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        fprintf(stderr, "%s\n", error->message);
+        return 1;
+    }
+    g_option_context_free(context);
+    if (opt_connections < 1 || opt_threads < 1 || opt_duration <= 0 || opt_pipeline < 1 ||
+            opt_pipeline > PIPELINE_MAX || opt_body_size < 0 || opt_rate < 0 || !parse_mix(opt_mix)) {
+        fprintf(stderr, "Invalid options, see --help\n");
+        return 1;
+    }
+    if (opt_threads > opt_connections) {
+        opt_threads = opt_connections;
+    }
+    if (!resolve_server() || !build_templates()) {
+        return 1;
+    }
+
+    Thread *threads = g_new0(Thread, opt_threads);
+    uint64_t start = now_ns();
+    start_ns = start;
+    deadline_ns = start + (uint64_t) (opt_duration * 1e9);
+    for (int t = 0; t < opt_threads; t++) {
+        threads[t].id = t;
+        threads[t].random = 2463534242u + (uint32_t) t * 7919u;
+        // The connections are spread as evenly as they go.
+        threads[t].connections = opt_connections / opt_threads + (t < opt_connections % opt_threads);
+        pthread_create(&threads[t].thread, NULL, run_thread, &threads[t]);
+    }
+
+    static Histogram latency;
+    static Histogram connect_latency;
+    static Histogram ok_latency;
+    histogram_reset(&latency);
+    histogram_reset(&connect_latency);
+    histogram_reset(&ok_latency);
+    uint64_t requests = 0, errors = 0, non_2xx = 0, bytes = 0, connects = 0, ok = 0, unsent = 0;
+    for (int t = 0; t < opt_threads; t++) {
+        pthread_join(threads[t].thread, NULL);
+        histogram_merge(&latency, &threads[t].latency);
+        histogram_merge(&connect_latency, &threads[t].connect_latency);
+        histogram_merge(&ok_latency, &threads[t].ok_latency);
+        ok += threads[t].ok;
+        unsent += threads[t].unsent;
+        requests += threads[t].requests;
+        errors += threads[t].errors;
+        non_2xx += threads[t].non_2xx;
+        bytes += threads[t].bytes;
+        connects += threads[t].connects;
+    }
+    double elapsed = (double) (now_ns() - start) / 1e9;
+
+    printf("{\"label\":\"%s\",\"connections\":%d,\"threads\":%d,\"pipeline\":%d,\"keep_alive\":%s,"
+           "\"path\":\"%s\",\"mix\":\"%s\",\"body_size\":%d,\"rate\":%.1f,\"duration_s\":%.3f,"
+           "\"requests\":%" G_GUINT64_FORMAT ",\"errors\":%" G_GUINT64_FORMAT ",\"non_2xx\":%" G_GUINT64_FORMAT
+           ",\"unsent\":%" G_GUINT64_FORMAT ",\"connects\":%" G_GUINT64_FORMAT ",\"bytes_read\":%" G_GUINT64_FORMAT ","
+           "\"requests_per_s\":%.1f,\"goodput_per_s\":%.1f,\"mb_per_s\":%.2f,"
+           "\"latency_us\":{\"mean\":%.1f,\"p50\":%" G_GUINT64_FORMAT ",\"p90\":%" G_GUINT64_FORMAT
+           ",\"p99\":%" G_GUINT64_FORMAT ",\"p999\":%" G_GUINT64_FORMAT ",\"max\":%" G_GUINT64_FORMAT "},"
+           "\"connect_us\":{\"p50\":%" G_GUINT64_FORMAT ",\"p99\":%" G_GUINT64_FORMAT ",\"p999\":%" G_GUINT64_FORMAT
+           ",\"max\":%" G_GUINT64_FORMAT "},"
+           "\"ok_latency_us\":{\"p50\":%" G_GUINT64_FORMAT ",\"p99\":%" G_GUINT64_FORMAT ",\"p999\":%" G_GUINT64_FORMAT
+           ",\"max\":%" G_GUINT64_FORMAT "}",
+           opt_label != NULL ? opt_label : "", opt_connections, opt_threads, opt_pipeline,
+           opt_close ? "false" : "true", opt_path, opt_mix, opt_body_size, opt_rate, elapsed,
+           requests, errors, non_2xx, unsent, connects, bytes,
+           (double) requests / elapsed, (double) ok / elapsed, (double) bytes / elapsed / 1e6,
+           latency.total > 0 ? (double) latency.sum / (double) latency.total : 0.0,
+           histogram_percentile(&latency, 0.50), histogram_percentile(&latency, 0.90),
+           histogram_percentile(&latency, 0.99), histogram_percentile(&latency, 0.999), latency.max,
+           histogram_percentile(&connect_latency, 0.50), histogram_percentile(&connect_latency, 0.99),
+           histogram_percentile(&connect_latency, 0.999), connect_latency.max,
+           histogram_percentile(&ok_latency, 0.50), histogram_percentile(&ok_latency, 0.99),
+           histogram_percentile(&ok_latency, 0.999), ok_latency.max);
+    if (opt_per_connection) {
+        print_per_connection(threads);
+    }
+    printf("}\n");
+
+    for (int m = 0; m < 3; m++) {
+        g_string_free(templates[m], TRUE);
+    }
+    for (int t = 0; t < opt_threads; t++) {
+        for (int c = 0; c < threads[t].connections; c++) {
+            g_free(threads[t].clients[c].latency);
+        }
+        g_free(threads[t].clients);
+    }
+    g_free(threads);
+    return errors > 0 && requests == 0 ? 1 : 0;
+}
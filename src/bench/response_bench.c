@@ -0,0 +1,155 @@
+/*
+ * response_bench.c
+ *
+ * Microbenchmark of the work done per request on the echo page path:
+ * fill_request(), generate_html() and generate_response(), each on its own
+ * and all three together the way process_requests() runs them. The arena
+ * is rewound after every iteration, as on a kept alive connection.
+ *
+ *   ./bench/response_bench [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "page.h"
+#include "response.h"
+
+typedef struct {
+    const char *name;
+    const char *text;
+} Sample;
+
+static const Sample samples[] = {
+    { "get",
+      "GET /index.html?lang=en HTTP/1.1\r\n"
+      "Host: localhost:8080\r\n"
+      "User-Agent: curl/7.88.1\r\n"
+      "Accept: */*\r\n"
+      "\r\n" },
+    { "head",
+      "HEAD /index.html HTTP/1.1\r\n"
+      "Host: localhost:8080\r\n"
+      "User-Agent: curl/7.88.1\r\n"
+      "\r\n" },
+    { "post",
+      "POST /form HTTP/1.1\r\n"
+      "Host: localhost:8080\r\n"
+      "Content-Type: application/x-www-form-urlencoded\r\n"
+      "Content-Length: 64\r\n"
+      "\r\n"
+      "name=S00ber+1337+S3rv3r&version=1.0&features=keep-alive,pipelining" },
+    { "http10",
+      "GET / HTTP/1.0\r\n"
+      "\r\n" },
+};
+
+// The body of the compressed sample, big enough to pass the compression threshold.
+#define GZIP_BODY_SIZE 2048
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+typedef enum {
+    STAGE_PARSE,
+    STAGE_HTML,
+    STAGE_RESPONSE,
+    STAGE_ALL
+} Stage;
+
+static const char *stage_names[] = { "parse", "html", "response", "all" };
+
+/* Runs stage on text iterations times. The stages that are not measured
+    are done once up front. Returns the elapsed time in seconds. */
+static double run(const char *text, Stage stage, Compressor *compressor, long iterations, size_t *checksum) {
+    // The setup lives in its own arena, so rewinding the measured one keeps it.
+    Arena setup;
+    Arena arena;
+    arena_init(&setup, 8192);
+    arena_init(&arena, 8192);
+    HttpParser parser;
+    Request request;
+    StrView html = { NULL, 0 };
+    StrView body;
+    size_t len = strlen(text);
+
+    // The request (and page) the later stages work on.
+    http_parser_init(&parser, HTTP_DEFAULT_MAX_HEADER_SIZE);
+    init_request(&request, &setup);
+    fill_request(&parser, text, len, &request);
+    if (stage == STAGE_RESPONSE) {
+        html = generate_html(&request, "127.0.0.1", 54321);
+    }
+    request.arena = &arena;
+
+    double start = now_seconds();
+    for (long it = 0; it < iterations; it++) {
+        if (stage == STAGE_PARSE || stage == STAGE_ALL) {
+            http_parser_init(&parser, HTTP_DEFAULT_MAX_HEADER_SIZE);
+            init_request(&request, &arena);
+            fill_request(&parser, text, len, &request);
+        }
+        if (stage == STAGE_HTML || stage == STAGE_ALL) {
+            html = generate_html(&request, "127.0.0.1", 54321);
+        }
+        if (stage == STAGE_RESPONSE || stage == STAGE_ALL) {
+            StrView header = generate_response(&request, html, false, compressor, &body);
+            *checksum += header.len + body.len;
+        }
+        *checksum += html.len + request.host.len;
+        arena_reset(&arena);
+    }
+    double elapsed = now_seconds() - start;
+    arena_destroy(&arena);
+    arena_destroy(&setup);
+    return elapsed;
+}
+
+static void report(const char *name, Stage stage, double elapsed, long iterations) {
+    printf("%-10s %-9s %12.0f %10.1f\n", name, stage_names[stage], iterations / elapsed, elapsed * 1e9 / iterations);
+}
+
+int main(int argc, char **argv) {
+    long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+    size_t checksum = 0;
+    response_init(30, 1);
+
+    printf("%-10s %-9s %12s %10s\n", "sample", "stage", "requests/s", "ns/req");
+    for (size_t s = 0; s < sizeof(samples) / sizeof(samples[0]); s++) {
+        for (Stage stage = STAGE_PARSE; stage <= STAGE_ALL; stage++) {
+            double elapsed = run(samples[s].text, stage, NULL, iterations, &checksum);
+            report(samples[s].name, stage, elapsed, iterations);
+        }
+    }
+
+    // A POST whose page is gzipped, at the default level and threshold.
+    char *gzip_text = malloc(512 + GZIP_BODY_SIZE);
+    int n = snprintf(gzip_text, 512, "POST /form HTTP/1.1\r\n"
+                     "Host: localhost:8080\r\n"
+                     "Accept-Encoding: gzip\r\n"
+                     "Content-Length: %d\r\n"
+                     "\r\n", GZIP_BODY_SIZE);
+    for (int i = 0; i < GZIP_BODY_SIZE; i++) {
+        gzip_text[n + i] = "S00ber 1337 S3rv3r "[i % 19];
+    }
+    gzip_text[n + GZIP_BODY_SIZE] = '\0';
+    Compressor compressor;
+    compressor_init(&compressor, 6, 1024);
+    // Compression costs far more per request, so it gets fewer iterations.
+    long gzip_iterations = iterations / 20 > 0 ? iterations / 20 : 1;
+    for (Stage stage = STAGE_RESPONSE; stage <= STAGE_ALL; stage++) {
+        double elapsed = run(gzip_text, stage, &compressor, gzip_iterations, &checksum);
+        report("post-gzip", stage, elapsed, gzip_iterations);
+    }
+    compressor_destroy(&compressor);
+    free(gzip_text);
+
+    // Keeps the compiler from optimizing the work away.
+    fprintf(stderr, "checksum %zu\n", checksum);
+    return 0;
+}
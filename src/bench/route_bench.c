@@ -0,0 +1,176 @@
+/*
+ * route_bench.c
+ *
+ * Microbenchmark of the router: how long picking the route of a request
+ * path takes in tables of 10 to 100000 routes, next to the longest prefix
+ * scan over a list that the proxy used to do, and how long finding the host
+ * of a Host header takes with as many hosts. A router lookup should cost
+ * the same whatever the size of the table.
+ *
+ *   ./bench/route_bench [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "router.h"
+
+// Looked up in every table: below API, static and user routes, an exact route and two that
+// only the catch-all "/" takes.
+static const char *paths[] = {
+    "/api/v1/service1/items/42",
+    "/static/app1/js/main.js",
+    "/health/1",
+    "/u/1/profile/settings",
+    "/api/v1/service1",
+    "/nothing/here.html",
+};
+
+#define PATH_COUNT (sizeof(paths) / sizeof(paths[0]))
+
+static const char *hosts[] = {
+    "site5.example.com:8080",
+    "img.cdn0.example.net",
+    "unknown.example.org",
+};
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static StrView view(const char *s) {
+    StrView v = { s, strlen(s) };
+    return v;
+}
+
+/* The i-th pattern of a table, spread over a few kinds of routes like a real table. */
+static void make_pattern(char *buf, size_t size, int i) {
+    switch (i % 4) {
+    case 0:
+        snprintf(buf, size, "/api/v1/service%d/", i / 4);
+        break;
+    case 1:
+        snprintf(buf, size, "/static/app%d/", i / 4);
+        break;
+    case 2:
+        snprintf(buf, size, "=/health/%d", i / 4);
+        break;
+    default:
+        snprintf(buf, size, "/u/%d/", i / 4);
+        break;
+    }
+}
+
+/* The longest prefix scan: every pattern is compared with the path. */
+static int linear_match(char **patterns, int count, StrView path) {
+    int best = -1;
+    size_t best_len = 0;
+    for (int i = 0; i < count; i++) {
+        const char *p = patterns[i];
+        bool exact = p[0] == '=';
+        p += exact;
+        size_t len = strlen(p);
+        if (path.len < len || memcmp(path.str, p, len) != 0 || (exact && path.len != len)) {
+            continue;
+        }
+        if (best == -1 || len > best_len || (exact && len == best_len)) {
+            best = i;
+            best_len = len;
+        }
+    }
+    return best;
+}
+
+int main(int argc, char **argv) {
+    long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+    size_t checksum = 0;
+    static const int sizes[] = { 10, 100, 1000, 10000, 100000 };
+    RouteTarget target;
+    memset(&target, 0, sizeof(target));
+    target.type = ROUTE_ECHO;
+
+    printf("%8s %10s %10s %10s\n", "routes", "build-ms", "trie-ns", "linear-ns");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int count = sizes[s];
+        char **patterns = malloc(sizeof(char *) * (size_t) count);
+        Router *router = router_new();
+        int host = router_add_host(router, "*");
+
+        double start = now_seconds();
+        for (int i = 0; i < count - 1; i++) {
+            char buf[64];
+            make_pattern(buf, sizeof(buf), i);
+            patterns[i] = strdup(buf);
+            router_add_route(router, host, buf, &target);
+        }
+        patterns[count - 1] = strdup("/");
+        router_add_route(router, host, "/", &target);
+        router_compile(router);
+        double build = now_seconds() - start;
+
+        StrView views[PATH_COUNT];
+        for (size_t p = 0; p < PATH_COUNT; p++) {
+            views[p] = view(paths[p]);
+        }
+        start = now_seconds();
+        for (long it = 0; it < iterations; it++) {
+            const RouteTarget *t = router_match(router, host, views[it % PATH_COUNT]);
+            checksum += t != NULL ? t->prefix_len : 0;
+        }
+        double trie = now_seconds() - start;
+
+        // The scan gets fewer iterations as the table grows, it takes that much longer.
+        long linear_iterations = iterations / (count / 100 + 1);
+        start = now_seconds();
+        for (long it = 0; it < linear_iterations; it++) {
+            checksum += (size_t) linear_match(patterns, count, views[it % PATH_COUNT]);
+        }
+        double linear = now_seconds() - start;
+
+        printf("%8d %10.2f %10.1f %10.1f\n", count, build * 1e3, trie * 1e9 / iterations,
+               linear * 1e9 / linear_iterations);
+        for (int i = 0; i < count; i++) {
+            free(patterns[i]);
+        }
+        free(patterns);
+        router_free(router);
+    }
+
+    printf("\n%8s %10s %11s %10s\n", "hosts", "exact-ns", "wildcard-ns", "default-ns");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        Router *router = router_new();
+        router_add_host(router, "*");
+        for (int i = 0; i < sizes[s]; i++) {
+            // Every tenth is a wildcard.
+            char name[64];
+            if (i % 10 == 0) {
+                snprintf(name, sizeof(name), "*.cdn%d.example.net", i);
+            }
+            else {
+                snprintf(name, sizeof(name), "site%d.example.com", i);
+            }
+            router_add_host(router, name);
+        }
+        router_compile(router);
+
+        printf("%8d", sizes[s]);
+        for (size_t h = 0; h < sizeof(hosts) / sizeof(hosts[0]); h++) {
+            StrView name = view(hosts[h]);
+            double start = now_seconds();
+            for (long it = 0; it < iterations; it++) {
+                checksum += (size_t) router_host(router, name);
+            }
+            printf(" %*.1f", h == 1 ? 11 : 10, (now_seconds() - start) * 1e9 / iterations);
+        }
+        printf("\n");
+        router_free(router);
+    }
+
+    // Keeps the compiler from optimizing the lookups away.
+    fprintf(stderr, "checksum %zu\n", checksum);
+    return 0;
+}
@@ -0,0 +1,77 @@
+#!/bin/sh
+#
+# Starts httpd on BENCH_PORT (default 18080) serving this directory, one
+# with only the echo page on the port after it and two proxies in front of
+# the first on the two ports after that, one keeping its upstream connections
+# and one connecting for every request, one more that sheds load and one that
+# lets every connection go on as long as it has work, on the ports after
+# those. Then runs the load generator against them in a few typical setups,
+# BENCH_DURATION (default 5) seconds each. Every run prints one line of JSON.
+#
+#   BENCH_WORKERS=4 BENCH_HTTPD_ARGS=--io-uring ./bench/run_load.sh
+
+PORT=${BENCH_PORT:-18080}
+DURATION=${BENCH_DURATION:-5}
+
+ECHO_PORT=$((PORT + 1))
+POOLED_PORT=$((PORT + 2))
+CONNECT_PORT=$((PORT + 3))
+SHED_PORT=$((PORT + 4))
+UNFAIR_PORT=$((PORT + 5))
+ARGS="--workers ${BENCH_WORKERS:-1} --log-level warn $BENCH_HTTPD_ARGS"
+
+./httpd --root . $ARGS "$PORT" > /dev/null 2>&1 &
+static_pid=$!
+./httpd $ARGS "$ECHO_PORT" > /dev/null 2>&1 &
+echo_pid=$!
+./httpd $ARGS --proxy "/=127.0.0.1:$PORT" "$POOLED_PORT" > /dev/null 2>&1 &
+pooled_pid=$!
+./httpd $ARGS --proxy "/=127.0.0.1:$PORT" --proxy-pool 0 "$CONNECT_PORT" > /dev/null 2>&1 &
+connect_pid=$!
+./httpd --root . $ARGS --max-connections 1024 --work-budget 16 --shed-delay 20 "$SHED_PORT" > /dev/null 2>&1 &
+shed_pid=$!
+./httpd --root . $ARGS --work-budget 0 --turn-bytes 0 "$UNFAIR_PORT" > /dev/null 2>&1 &
+unfair_pid=$!
+trap 'kill $static_pid $echo_pid $pooled_pid $connect_pid $shed_pid $unfair_pid 2> /dev/null' EXIT INT TERM
+sleep 0.5
+
+run() {
+    ./bench/loadgen --duration "$DURATION" "$@" || exit 1
+}
+
+# A small static file, kept alive, one request at a time and pipelined.
+# What the first one manages is taken as the capacity of the server.
+capacity=$(run --port "$PORT" --label static-keepalive --path /Makefile | tee /dev/stderr |
+           sed -n 's/.*"requests_per_s":\([0-9]*\).*/\1/p')
+run --port "$PORT" --label static-pipelined --path /Makefile --pipeline 16
+# A new connection for every request.
+run --port "$PORT" --label static-close --path /Makefile --close
+# The generated echo page, with 1KB POST bodies from data.txt mixed in.
+run --port "$ECHO_PORT" --label echo-mix --path /echo --mix get:80,post:15,head:5 --body-size 1024
+# A big file, sent with sendfile().
+run --port "$PORT" --label static-big --path /data.txt --connections 8 --threads 2
+# Many clients connecting at once, each for a single request: the accept path.
+run --port "$PORT" --label connect-storm --path /Makefile --close --connections 256 --threads 2
+# The small static file through the proxy, over pooled upstream connections and
+# over a new upstream connection for every request.
+run --port "$POOLED_PORT" --label proxy-pooled --path /Makefile
+run --port "$CONNECT_PORT" --label proxy-connect --path /Makefile
+# Twice the capacity, open-loop, without and with load shedding: what counts is
+# the goodput and the latency of the requests that got a 2xx.
+run --port "$PORT" --label overload --path /Makefile --connections 256 --threads 2 --rate $((capacity * 2))
+run --port "$SHED_PORT" --label overload-shed --path /Makefile --connections 256 --threads 2 --rate $((capacity * 2))
+# Small clients next to heavy ones (deep pipelines and 4MB uploads), with the
+# turns of the ready queue and without: the small ones' latency per connection.
+fairness() {
+    ./bench/loadgen --duration "$DURATION" --port "$1" --connections 4 --threads 1 --pipeline 256 \
+        --path /Makefile > /dev/null &
+    pipeline_pid=$!
+    ./bench/loadgen --duration "$DURATION" --port "$1" --connections 4 --threads 1 --mix post \
+        --body-size 4194304 > /dev/null &
+    upload_pid=$!
+    sleep 0.5
+    run --port "$1" --label "$2" --path /Makefile --connections 16 --threads 1 --per-connection
+    wait $pipeline_pid $upload_pid
+}
+fairness "$PORT" fairness
+fairness "$UNFAIR_PORT" fairness-unlimited
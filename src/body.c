@@ -0,0 +1,85 @@
+/*
+ * body.c
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include "body.h"
+
+void body_reader_init(BodyReader *reader, size_t length, BodyConsume consume, void *data) {
+    reader->consume = consume;
+    reader->data = data;
+    reader->length = length;
+    reader->received = 0;
+    reader->failed = FALSE;
+}
+
+size_t body_reader_feed(BodyReader *reader, const char *buf, size_t len) {
+    size_t n = reader->length - reader->received;
+    if (n > len) {
+        n = len;
+    }
+    if (n > 0 && !reader->failed && !reader->consume(reader->data, buf, n)) {
+        reader->failed = TRUE;
+    }
+    reader->received += n;
+    return n;
+}
+
+bool body_spool_open(BodySpool *spool, const char *dir) {
+    spool->length = 0;
+    spool->fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (spool->fd >= 0) {
+        return TRUE;
+    }
+    // Not every file system has O_TMPFILE, a named file is removed right away instead.
+    if (errno == EOPNOTSUPP || errno == EISDIR || errno == EINVAL) {
+        gchar *path = g_strdup_printf("%s/httpd-body-XXXXXX", dir);
+        spool->fd = mkostemp(path, O_CLOEXEC);
+        if (spool->fd >= 0) {
+            unlink(path);
+        }
+        g_free(path);
+    }
+    if (spool->fd < 0) {
+        perror("  spool file");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+bool body_spool_write(void *data, const char *buf, size_t len) {
+    BodySpool *spool = data;
+    while (len > 0) {
+        ssize_t n = write(spool->fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("  spool write");
+            return FALSE;
+        }
+        buf += n;
+        len -= (size_t) n;
+        spool->length += (size_t) n;
+    }
+    return TRUE;
+}
+
+void body_spool_close(BodySpool *spool) {
+    if (spool->fd >= 0) {
+        close(spool->fd);
+        spool->fd = -1;
+    }
+}
+
+bool body_discard(void *data, const char *buf, size_t len) {
+    (void) data;
+    (void) buf;
+    (void) len;
+    return TRUE;
+}
@@ -0,0 +1,61 @@
+/*
+ * body.h
+ *
+ * Request bodies that are taken in as they arrive. A body too big to wait
+ * for in the receive buffer is handed to a BodyReader once the head of its
+ * request is parsed: every read passes the new bytes of the body on to the
+ * reader's consumer and drops them from the buffer, so the memory a request
+ * needs does not depend on the size of its body. Two consumers come with it:
+ * body_spool_write() appends the body to an unnamed temporary file and
+ * body_discard() throws it away.
+ */
+
+#ifndef BODY_H
+#define BODY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Takes the next len bytes of the body. Returns false if they could not be taken. */
+typedef bool (*BodyConsume)(void *data, const char *buf, size_t len);
+
+typedef struct {
+    BodyConsume consume;
+    void *data;
+    // Content-Length, and the bytes of it that have come in so far.
+    size_t length;
+    size_t received;
+    // Set once the consumer failed, the rest of the body is dropped then.
+    bool failed;
+} BodyReader;
+
+/* Prepares reader for a body of length bytes, which go to consume with data. */
+void body_reader_init(BodyReader *reader, size_t length, BodyConsume consume, void *data);
+
+/* Passes the bytes at the front of buf[0 .. len) that belong to the body on to
+    the consumer. Returns how many that were, what follows is the next request. */
+size_t body_reader_feed(BodyReader *reader, const char *buf, size_t len);
+
+static inline bool body_reader_done(const BodyReader *reader) {
+    return reader->received == reader->length;
+}
+
+/* A body written to a file that has no name, so it is gone once the descriptor is closed. */
+typedef struct {
+    int fd;
+    size_t length;
+} BodySpool;
+
+/* Creates the file of spool in dir. Returns false if that failed. */
+bool body_spool_open(BodySpool *spool, const char *dir);
+
+/* BodyConsume that appends to the BodySpool data. */
+bool body_spool_write(void *data, const char *buf, size_t len);
+
+/* Closes the file, unless it was handed on (fd set to -1). */
+void body_spool_close(BodySpool *spool);
+
+/* BodyConsume that drops the body, for requests that have no use for it. */
+bool body_discard(void *data, const char *buf, size_t len);
+
+#endif
@@ -0,0 +1,218 @@
+/*
+ * cache.c
+ *
+ * The entries live in a hash table keyed by request path and are threaded
+ * on a GQueue through the GList embedded in each entry, so moving an entry
+ * to the front and evicting from the back need no allocation.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cache.h"
+
+void file_cache_entry_ref(FileCacheEntry *entry) {
+    entry->refs++;
+}
+
+void file_cache_entry_unref(void *data) {
+    FileCacheEntry *entry = data;
+    if (--entry->refs > 0) {
+        return;
+    }
+    g_free(entry->key);
+    g_free(entry->file_name);
+    g_free(entry->body);
+    g_free(entry->gzip_body);
+    g_free(entry);
+}
+
+FileCache *file_cache_new(size_t capacity) {
+    FileCache *cache = g_new0(FileCache, 1);
+    // The key is owned by the entry, so only the entry's reference needs to be dropped.
+    cache->entries = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, file_cache_entry_unref);
+    g_queue_init(&cache->lru);
+    cache->capacity = capacity;
+    return cache;
+}
+
+void file_cache_free(FileCache *cache) {
+    g_hash_table_destroy(cache->entries);
+    g_free(cache);
+}
+
+static void entry_remove(FileCache *cache, FileCacheEntry *entry) {
+    g_queue_unlink(&cache->lru, &entry->lru_link);
+    cache->size -= entry->charged;
+    // Responses still being sent keep the entry alive until they are done with it.
+    g_hash_table_remove(cache->entries, entry->key);
+}
+
+/* TRUE if st still describes the file the entry was read from. */
+static bool entry_matches(FileCacheEntry *entry, const struct stat *st) {
+    return entry->dev == st->st_dev && entry->ino == st->st_ino && entry->size == st->st_size &&
+        entry->mtime.tv_sec == st->st_mtim.tv_sec && entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+FileCacheEntry *file_cache_lookup(FileCache *cache, int root_fd, const char *key, gint64 now_ms) {
+    FileCacheEntry *entry = g_hash_table_lookup(cache->entries, key);
+    if (entry == NULL) {
+        cache->misses++;
+        return NULL;
+    }
+
+    if (now_ms - entry->checked_ms >= FILE_CACHE_VALID_MS) {
+        struct stat st;
+        if (fstatat(root_fd, entry->file_name, &st, 0) == -1 || !entry_matches(entry, &st)) {
+            entry_remove(cache, entry);
+            cache->misses++;
+            return NULL;
+        }
+        entry->checked_ms = now_ms;
+    }
+
+    // Move to the front of the LRU queue.
+    g_queue_unlink(&cache->lru, &entry->lru_link);
+    g_queue_push_head_link(&cache->lru, &entry->lru_link);
+    cache->hits++;
+    return entry;
+}
+
+/* Reads size bytes from the start of fd. */
+static bool read_file(int fd, char *buf, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(fd, buf + done, size - done, (off_t) done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return FALSE;
+        }
+        done += (size_t) n;
+    }
+    return TRUE;
+}
+
+/* Evicts least recently used entries other than keep until the cache has room for size more bytes. */
+static bool make_room(FileCache *cache, size_t size, FileCacheEntry *keep) {
+    while (cache->size + size > cache->capacity) {
+        FileCacheEntry *victim = g_queue_peek_tail(&cache->lru);
+        if (victim == NULL || victim == keep) {
+            return FALSE;
+        }
+        entry_remove(cache, victim);
+        cache->evictions++;
+    }
+    return TRUE;
+}
+
+FileCacheEntry *file_cache_insert(FileCache *cache, const char *key, StaticFile *file, gint64 now_ms) {
+    if (cache->capacity == 0) {
+        return NULL;
+    }
+
+    // Big files only have their metadata cached.
+    size_t size = (size_t) file->st.st_size;
+    bool keep_body = size <= FILE_CACHE_MAX_ENTRY_SIZE && size <= cache->capacity;
+
+    FileCacheEntry *entry = g_new0(FileCacheEntry, 1);
+    if (keep_body) {
+        entry->body = g_malloc(size > 0 ? size : 1);
+        if (!read_file(file->fd, entry->body, size)) {
+            g_free(entry->body);
+            g_free(entry);
+            return NULL;
+        }
+        entry->charged = size;
+    }
+    entry->key = g_strdup(key);
+    entry->file_name = g_strdup(file->name);
+    entry->dev = file->st.st_dev;
+    entry->ino = file->st.st_ino;
+    entry->size = file->st.st_size;
+    entry->mtime = file->st.st_mtim;
+    entry->checked_ms = now_ms;
+    entry->content_type = file->content_type;
+    static_etag(&file->st, entry->etag, sizeof(entry->etag));
+    static_http_date(file->st.st_mtim.tv_sec, entry->last_modified, sizeof(entry->last_modified));
+
+    // A stale entry for the same key may still be around if the file changed.
+    FileCacheEntry *old = g_hash_table_lookup(cache->entries, key);
+    if (old != NULL) {
+        entry_remove(cache, old);
+    }
+    make_room(cache, entry->charged, NULL);
+
+    entry->refs = 1;
+    entry->lru_link.data = entry;
+    g_queue_push_head_link(&cache->lru, &entry->lru_link);
+    g_hash_table_insert(cache->entries, entry->key, entry);
+    cache->size += entry->charged;
+    return entry;
+}
+
+/* Reads the precompressed name.gz below root_fd if it is up to date. */
+static char *read_precompressed(FileCacheEntry *entry, int root_fd, size_t *size) {
+    char *name = g_strconcat(entry->file_name, ".gz", NULL);
+    int fd = openat(root_fd, name, O_RDONLY | O_CLOEXEC);
+    g_free(name);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    char *body = NULL;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+            st.st_size <= FILE_CACHE_MAX_ENTRY_SIZE && st.st_mtim.tv_sec >= entry->mtime.tv_sec) {
+        body = g_malloc((size_t) st.st_size);
+        if (read_file(fd, body, (size_t) st.st_size)) {
+            *size = (size_t) st.st_size;
+        }
+        else {
+            g_free(body);
+            body = NULL;
+        }
+    }
+    close(fd);
+    return body;
+}
+
+bool file_cache_gzip(FileCache *cache, FileCacheEntry *entry, int root_fd, Compressor *compressor) {
+    if (entry->gzip_tried) {
+        return entry->gzip_body != NULL;
+    }
+    entry->gzip_tried = TRUE;
+    // A strong ETag has to differ between the codings: "tag" becomes "tag-gz".
+    size_t etag_len = strlen(entry->etag);
+    snprintf(entry->gzip_etag, sizeof(entry->gzip_etag), "%.*s-gz\"", (int) (etag_len - 1), entry->etag);
+
+    size_t size = 0;
+    char *body = read_precompressed(entry, root_fd, &size);
+    if (body == NULL && entry->body != NULL) {
+        body = g_malloc(compress_bound((size_t) entry->size));
+        if (compress_buffer(compressor, ENCODING_GZIP, entry->body, (size_t) entry->size, body, &size)) {
+            body = g_realloc(body, size);
+        }
+        else {
+            g_free(body);
+            body = NULL;
+        }
+    }
+    if (body == NULL) {
+        return FALSE;
+    }
+    if (!make_room(cache, size, entry)) {
+        g_free(body);
+        return FALSE;
+    }
+
+    entry->gzip_body = body;
+    entry->gzip_size = size;
+    entry->charged += size;
+    cache->size += size;
+    return TRUE;
+}
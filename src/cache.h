@@ -0,0 +1,96 @@
+/*
+ * cache.h
+ *
+ * A bounded LRU cache of static files, one per worker so it needs no
+ * locking. An entry holds everything needed to answer for a file:
+ * Content-Type, ETag and Last-Modified, the content itself if the file is
+ * small, and a gzip variant once one has been asked for. Entries are keyed
+ * by the directory and the resolved request path and revalidated against
+ * the file's inode, size and mtime at most once every FILE_CACHE_VALID_MS.
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <glib.h>
+
+#include "compress.h"
+#include "static.h"
+
+// Files (and gzip variants) bigger than this are not kept in memory, files are sent with sendfile() instead.
+#define FILE_CACHE_MAX_ENTRY_SIZE (1 << 20)
+#define FILE_CACHE_VALID_MS 1000
+
+typedef struct {
+    // Link in the LRU queue, the most recently used entry is at the head.
+    GList lru_link;
+    char *key;
+    // The file actually served (index.html for a directory), relative to the root.
+    char *file_name;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    gint64 checked_ms;
+    const char *content_type;
+    char etag[STATIC_ETAG_SIZE];
+    char last_modified[STATIC_DATE_SIZE];
+    // NULL if the file is bigger than FILE_CACHE_MAX_ENTRY_SIZE.
+    char *body;
+    // The gzip variant, from a precompressed .gz file next to it or compressed by us.
+    char *gzip_body;
+    size_t gzip_size;
+    char gzip_etag[STATIC_ETAG_SIZE + 4];
+    // Set once building the gzip variant has been attempted, so it is only tried once.
+    bool gzip_tried;
+    // Bytes of the cache's capacity this entry takes up.
+    size_t charged;
+    // One reference is held by the cache while the entry is in it, one by every queued response.
+    int refs;
+} FileCacheEntry;
+
+typedef struct {
+    GHashTable *entries;
+    GQueue lru;
+    // Bytes of file content and gzip variants held, never more than capacity.
+    size_t size;
+    size_t capacity;
+    guint64 hits;
+    guint64 misses;
+    guint64 evictions;
+} FileCache;
+
+/* Creates a cache that holds up to capacity bytes of file content. */
+FileCache *file_cache_new(size_t capacity);
+
+void file_cache_free(FileCache *cache);
+
+/* Takes a reference, so the body stays valid after the entry is evicted. */
+void file_cache_entry_ref(FileCacheEntry *entry);
+
+/* Drops a reference, the last one frees the entry. Matches OutputRelease. */
+void file_cache_entry_unref(void *entry);
+
+/* Returns the entry for key, or NULL on a miss. An entry that has not been
+    checked for FILE_CACHE_VALID_MS is compared with the file below root_fd
+    first and dropped if the file changed. */
+FileCacheEntry *file_cache_lookup(FileCache *cache, int root_fd, const char *key, gint64 now_ms);
+
+/* Creates the entry for key from the open file, reading its content if it is
+    small enough, and evicts the least recently used entries to make room.
+    Returns NULL if the cache is disabled or the file could not be read; the
+    caller keeps ownership of file->fd. */
+FileCacheEntry *file_cache_insert(FileCache *cache, const char *key, StaticFile *file, gint64 now_ms);
+
+/* Makes sure entry has its gzip variant: the file's precompressed .gz
+    sibling if that is at least as new as the file, otherwise the cached
+    body compressed with compressor. This is done once per entry, and sets
+    gzip_etag either way. Returns FALSE if there is no variant (the file is
+    too big to keep, compressing did not pay off or it did not fit). */
+bool file_cache_gzip(FileCache *cache, FileCacheEntry *entry, int root_fd, Compressor *compressor);
+
+#endif
@@ -0,0 +1,221 @@
+/*
+ * compress.c
+ *
+ * "gzip" is deflate with the gzip wrapper (windowBits 15 + 16), "deflate"
+ * in HTTP means the zlib wrapper (windowBits 15), not raw deflate.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include "compress.h"
+
+// Bytes read from the file per deflate() call of a CompressStream.
+#define COMPRESS_READ_SIZE (16 * 1024)
+
+void compressor_init(Compressor *compressor, int level, size_t min_size) {
+    memset(compressor, 0, sizeof(*compressor));
+    compressor->level = level;
+    compressor->min_size = min_size;
+}
+
+void compressor_destroy(Compressor *compressor) {
+    if (compressor->gzip_ready) {
+        deflateEnd(&compressor->gzip);
+    }
+    if (compressor->deflate_ready) {
+        deflateEnd(&compressor->deflate);
+    }
+    compressor->gzip_ready = FALSE;
+    compressor->deflate_ready = FALSE;
+}
+
+/* Returns the stream for encoding, ready for a new body. */
+static z_stream *get_stream(Compressor *compressor, ContentEncoding encoding) {
+    bool gzip = encoding == ENCODING_GZIP;
+    z_stream *stream = gzip ? &compressor->gzip : &compressor->deflate;
+    bool *ready = gzip ? &compressor->gzip_ready : &compressor->deflate_ready;
+
+    if (*ready) {
+        deflateReset(stream);
+        return stream;
+    }
+    memset(stream, 0, sizeof(*stream));
+    if (deflateInit2(stream, compressor->level, Z_DEFLATED, gzip ? 15 + 16 : 15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+    *ready = TRUE;
+    return stream;
+}
+
+/* The q value of one Accept-Encoding element, 1 if it has none. */
+static double parse_quality(const char *params, size_t len) {
+    const char *q = g_strstr_len(params, (gssize) len, "q=");
+    if (q == NULL) {
+        return 1.0;
+    }
+    char value[8];
+    size_t n = 0;
+    for (q += 2; q < params + len && n < sizeof(value) - 1 && (g_ascii_isdigit(*q) || *q == '.'); q++) {
+        value[n++] = *q;
+    }
+    value[n] = '\0';
+    return n > 0 ? g_ascii_strtod(value, NULL) : 1.0;
+}
+
+ContentEncoding compress_negotiate(StrView accept_encoding) {
+    // -1 means the coding was not mentioned at all.
+    double gzip = -1;
+    double deflate = -1;
+    double any = -1;
+
+    const char *p = accept_encoding.str;
+    const char *end = accept_encoding.str + accept_encoding.len;
+    while (p < end) {
+        const char *comma = memchr(p, ',', (size_t) (end - p));
+        const char *element_end = comma != NULL ? comma : end;
+        while (p < element_end && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+        const char *name_end = p;
+        while (name_end < element_end && *name_end != ';') {
+            name_end++;
+        }
+        const char *semicolon = name_end < element_end ? name_end : NULL;
+        while (name_end > p && (name_end[-1] == ' ' || name_end[-1] == '\t')) {
+            name_end--;
+        }
+        StrView name = { p, (size_t) (name_end - p) };
+        double q = semicolon != NULL ? parse_quality(semicolon, (size_t) (element_end - semicolon)) : 1.0;
+
+        if (view_equals(name, "gzip") || view_equals(name, "x-gzip")) {
+            gzip = q;
+        }
+        else if (view_equals(name, "deflate")) {
+            deflate = q;
+        }
+        else if (view_equals(name, "*")) {
+            any = q;
+        }
+        p = element_end + 1;
+    }
+
+    if (gzip < 0) {
+        gzip = any;
+    }
+    if (deflate < 0) {
+        deflate = any;
+    }
+    if (gzip > 0 && gzip >= deflate) {
+        return ENCODING_GZIP;
+    }
+    if (deflate > 0) {
+        return ENCODING_DEFLATE;
+    }
+    return ENCODING_IDENTITY;
+}
+
+const char *compress_encoding_name(ContentEncoding encoding) {
+    switch (encoding) {
+    case ENCODING_GZIP:
+        return "gzip";
+    case ENCODING_DEFLATE:
+        return "deflate";
+    default:
+        return NULL;
+    }
+}
+
+bool compress_type_ok(const char *content_type) {
+    return g_str_has_prefix(content_type, "text/") ||
+        g_str_has_prefix(content_type, "application/javascript") ||
+        g_str_has_prefix(content_type, "application/json") ||
+        g_str_has_prefix(content_type, "application/xml") ||
+        g_str_has_prefix(content_type, "image/svg+xml");
+}
+
+size_t compress_bound(size_t len) {
+    // compressBound() covers the zlib wrapper, the gzip one is 12 bytes longer.
+    return compressBound((uLong) len) + 32;
+}
+
+bool compress_buffer(Compressor *compressor, ContentEncoding encoding, const char *in, size_t len,
+                     char *out, size_t *out_len) {
+    z_stream *stream = get_stream(compressor, encoding);
+    if (stream == NULL) {
+        return FALSE;
+    }
+    stream->next_in = (Bytef *) in;
+    stream->avail_in = (uInt) len;
+    stream->next_out = (Bytef *) out;
+    stream->avail_out = (uInt) compress_bound(len);
+    if (deflate(stream, Z_FINISH) != Z_STREAM_END) {
+        return FALSE;
+    }
+    *out_len = stream->total_out;
+    return *out_len < len;
+}
+
+struct CompressStream {
+    z_stream zs;
+    int fd;
+    off_t size;
+    off_t offset;
+    char in[COMPRESS_READ_SIZE];
+};
+
+CompressStream *compress_stream_new(int level, int fd, off_t size) {
+    CompressStream *stream = g_new0(CompressStream, 1);
+    if (deflateInit2(&stream->zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        g_free(stream);
+        close(fd);
+        return NULL;
+    }
+    stream->fd = fd;
+    stream->size = size;
+    return stream;
+}
+
+StreamStatus compress_stream_produce(void *data, char *buf, size_t size, size_t *len) {
+    CompressStream *stream = data;
+    z_stream *zs = &stream->zs;
+    zs->next_out = (Bytef *) buf;
+    zs->avail_out = (uInt) size;
+
+    // zlib holds on to input until it has a block worth writing, so this may read several times.
+    while (zs->avail_out > 0) {
+        if (zs->avail_in == 0 && stream->offset < stream->size) {
+            size_t want = (size_t) MIN((off_t) COMPRESS_READ_SIZE, stream->size - stream->offset);
+            ssize_t n = pread(stream->fd, stream->in, want, stream->offset);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                // The file shrank underneath us.
+                return STREAM_ERROR;
+            }
+            stream->offset += n;
+            zs->next_in = (Bytef *) stream->in;
+            zs->avail_in = (uInt) n;
+        }
+        int r = deflate(zs, stream->offset == stream->size ? Z_FINISH : Z_NO_FLUSH);
+        if (r == Z_STREAM_END) {
+            *len = size - zs->avail_out;
+            return STREAM_DONE;
+        }
+        if (r != Z_OK && r != Z_BUF_ERROR) {
+            return STREAM_ERROR;
+        }
+    }
+    *len = size;
+    return STREAM_MORE;
+}
+
+void compress_stream_free(void *data) {
+    CompressStream *stream = data;
+    deflateEnd(&stream->zs);
+    close(stream->fd);
+    g_free(stream);
+}
@@ -0,0 +1,73 @@
+/*
+ * compress.h
+ *
+ * gzip/deflate content coding with zlib. Each worker owns a Compressor whose
+ * zlib streams are set up once and reset between responses, so compressing
+ * a body does not allocate the ~256 KB of zlib state every time.
+ */
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+#include "request.h"
+#include "stream.h"
+
+typedef enum {
+    ENCODING_IDENTITY,
+    ENCODING_GZIP,
+    ENCODING_DEFLATE
+} ContentEncoding;
+
+typedef struct {
+    z_stream gzip;
+    z_stream deflate;
+    bool gzip_ready;
+    bool deflate_ready;
+    int level;
+    // Smaller bodies are not worth compressing.
+    size_t min_size;
+} Compressor;
+
+/* Sets up a compressor for zlib level 1-9. The streams are created on first use. */
+void compressor_init(Compressor *compressor, int level, size_t min_size);
+
+void compressor_destroy(Compressor *compressor);
+
+/* Picks the coding for a response from an Accept-Encoding header: gzip if the
+    client takes it, otherwise deflate, otherwise identity. q=0 rules a coding out. */
+ContentEncoding compress_negotiate(StrView accept_encoding);
+
+/* The Content-Encoding value of encoding, NULL for identity. */
+const char *compress_encoding_name(ContentEncoding encoding);
+
+/* TRUE for text types that are worth compressing (not images or archives). */
+bool compress_type_ok(const char *content_type);
+
+/* The most compress_buffer() can produce for len bytes of input. */
+size_t compress_bound(size_t len);
+
+/* Compresses in[0 .. len) into out, which has room for compress_bound(len)
+    bytes. Returns FALSE if that failed or did not make the body smaller. */
+bool compress_buffer(Compressor *compressor, ContentEncoding encoding, const char *in, size_t len,
+                     char *out, size_t *out_len);
+
+/* gzips a file while it is sent, for files too big to keep a gzip variant of.
+    Every stream has its own zlib state (~256 KB) and a read buffer. */
+typedef struct CompressStream CompressStream;
+
+/* Starts gzipping the first size bytes of fd, which is closed with the
+    stream. Returns NULL (and closes fd) if zlib could not be set up. */
+CompressStream *compress_stream_new(int level, int fd, off_t size);
+
+/* The StreamProduce of a CompressStream. */
+StreamStatus compress_stream_produce(void *stream, char *buf, size_t size, size_t *len);
+
+/* The StreamFree of a CompressStream. */
+void compress_stream_free(void *stream);
+
+#endif
@@ -0,0 +1,94 @@
+/*
+ * event.c
+ *
+ * epoll(7) backend for the event engine declared in event.h.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include "event.h"
+
+struct EventLoop {
+    int epfd;
+    int max_events;
+    struct epoll_event *events;
+    // The events of the batch being dispatched and the one dispatched now.
+    int ready;
+    int current;
+};
+
+EventLoop *event_loop_new(int max_events) {
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        perror("epoll_create1");
+        return NULL;
+    }
+
+    EventLoop *loop = g_new0(EventLoop, 1);
+    loop->epfd = epfd;
+    loop->max_events = max_events;
+    loop->events = g_new0(struct epoll_event, max_events);
+    return loop;
+}
+
+void event_loop_free(EventLoop *loop) {
+    if (loop == NULL) {
+        return;
+    }
+    close(loop->epfd);
+    g_free(loop->events);
+    g_free(loop);
+}
+
+static int event_loop_ctl(EventLoop *loop, int op, EventHandler *handler, uint32_t events) {
+    struct epoll_event ev;
+    ev.events = events | EPOLLET;
+    ev.data.ptr = handler;
+    return epoll_ctl(loop->epfd, op, handler->fd, &ev);
+}
+
+int event_loop_add(EventLoop *loop, EventHandler *handler, uint32_t events) {
+    return event_loop_ctl(loop, EPOLL_CTL_ADD, handler, events);
+}
+
+int event_loop_modify(EventLoop *loop, EventHandler *handler, uint32_t events) {
+    return event_loop_ctl(loop, EPOLL_CTL_MOD, handler, events);
+}
+
+int event_loop_remove(EventLoop *loop, EventHandler *handler) {
+    // The event argument is ignored for EPOLL_CTL_DEL but must be non-NULL on old kernels.
+    struct epoll_event ev = { 0 };
+    // The handler may be freed right after this, so the rest of the batch must not reach it.
+    for (int k = loop->current + 1; k < loop->ready; k++) {
+        if (loop->events[k].data.ptr == handler) {
+            loop->events[k].data.ptr = NULL;
+        }
+    }
+    return epoll_ctl(loop->epfd, EPOLL_CTL_DEL, handler->fd, &ev);
+}
+
+int event_loop_fd(const EventLoop *loop) {
+    return loop->epfd;
+}
+
+int event_loop_wait(EventLoop *loop, int timeout_ms) {
+    int n = epoll_wait(loop->epfd, loop->events, loop->max_events, timeout_ms);
+    if (n < 0) {
+        // A signal is not an error, the caller simply loops again.
+        return errno == EINTR ? 0 : -1;
+    }
+
+    // Only the descriptors that are actually ready are visited.
+    loop->ready = n;
+    for (loop->current = 0; loop->current < n; loop->current++) {
+        EventHandler *handler = loop->events[loop->current].data.ptr;
+        if (handler != NULL) {
+            handler->callback(handler, loop->events[loop->current].events);
+        }
+    }
+    loop->ready = 0;
+    return n;
+}
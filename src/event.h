@@ -0,0 +1,54 @@
+/*
+ * event.h
+ *
+ * Edge-triggered epoll event engine. Every watched descriptor is described
+ * by an EventHandler that the owner embeds in its own state (listening
+ * socket, connection, ...). The epoll user data points straight at that
+ * handler, so a wakeup costs O(ready events) and there is no fixed limit
+ * on the number of descriptors.
+ */
+
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+typedef struct EventHandler EventHandler;
+
+/* Called with the epoll event mask of a ready descriptor. */
+typedef void (*EventCallback)(EventHandler *handler, uint32_t events);
+
+struct EventHandler {
+    int fd;
+    EventCallback callback;
+};
+
+typedef struct EventLoop EventLoop;
+
+/* Creates an event loop that handles at most max_events per wakeup. */
+EventLoop *event_loop_new(int max_events);
+
+/* Closes the epoll descriptor and frees the loop. */
+void event_loop_free(EventLoop *loop);
+
+/* Starts watching handler->fd. EPOLLET is always added to events. */
+int event_loop_add(EventLoop *loop, EventHandler *handler, uint32_t events);
+
+/* Changes the event mask of an already watched descriptor. */
+int event_loop_modify(EventLoop *loop, EventHandler *handler, uint32_t events);
+
+/* Stops watching handler->fd. Must be called before the fd is closed
+    if the descriptor may have been dup()ed, or if a handler other than this
+    one may free it: events of the current batch that are still to be
+    dispatched to it are dropped. */
+int event_loop_remove(EventLoop *loop, EventHandler *handler);
+
+/* The epoll descriptor, readable while handlers are ready. Lets another loop wait for this one. */
+int event_loop_fd(const EventLoop *loop);
+
+/* Waits up to timeout_ms (-1 = forever) and dispatches every ready handler.
+    Returns the number of dispatched events, 0 on timeout and -1 on error. */
+int event_loop_wait(EventLoop *loop, int timeout_ms);
+
+#endif
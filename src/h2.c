@@ -0,0 +1,1230 @@
+/*
+ * h2.c
+ *
+ * A stream goes through three stages. While its request comes in, the
+ * header fields are checked and written out as HTTP/1 header lines and the
+ * body is collected (in memory, or spooled once it is big). With END_STREAM
+ * the request is served: the handler queues the response into the stream's
+ * own output queue, head first, and may leave a Stream producing the body.
+ * From then on the stream waits in the send queue, where h2_send() turns
+ * the head into a HEADERS frame and moves the body on to the connection's
+ * queue one DATA frame at a time. Once its last frame is queued the stream
+ * is closed, but its memory is only freed when the frames are sent.
+ */
+
+#include <string.h>
+#include <glib.h>
+
+#include "h2.h"
+#include "hpack.h"
+#include "stream.h"
+
+#define FRAME_HEADER_SIZE 9
+
+enum {
+    FRAME_DATA = 0x0,
+    FRAME_HEADERS = 0x1,
+    FRAME_PRIORITY = 0x2,
+    FRAME_RST_STREAM = 0x3,
+    FRAME_SETTINGS = 0x4,
+    FRAME_PUSH_PROMISE = 0x5,
+    FRAME_PING = 0x6,
+    FRAME_GOAWAY = 0x7,
+    FRAME_WINDOW_UPDATE = 0x8,
+    FRAME_CONTINUATION = 0x9
+};
+
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+enum {
+    ERROR_NONE = 0x0,
+    ERROR_PROTOCOL = 0x1,
+    ERROR_INTERNAL = 0x2,
+    ERROR_FLOW_CONTROL = 0x3,
+    ERROR_STREAM_CLOSED = 0x5,
+    ERROR_FRAME_SIZE = 0x6,
+    ERROR_REFUSED_STREAM = 0x7,
+    ERROR_COMPRESSION = 0x9,
+    ERROR_ENHANCE_YOUR_CALM = 0xb
+};
+
+enum {
+    SETTINGS_HEADER_TABLE_SIZE = 0x1,
+    SETTINGS_ENABLE_PUSH = 0x2,
+    SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+    SETTINGS_MAX_FRAME_SIZE = 0x5
+};
+
+// What the protocol starts with, and the largest window and frame there may be.
+#define DEFAULT_WINDOW 65535
+#define DEFAULT_FRAME_SIZE 16384
+#define MAX_WINDOW 0x7fffffff
+#define MAX_FRAME_SIZE 0xffffff
+// The windows we give the client, per stream and for the connection. A window is opened up
+// again once half of it is used, the body has been taken by then.
+#define STREAM_WINDOW (256 * 1024)
+#define CONNECTION_WINDOW (1024 * 1024)
+// A header block may not be bigger than this compressed, nor the header lines it makes.
+#define MAX_HEADER_BLOCK (64 * 1024)
+// Bytes of a response body that are produced ahead of being framed.
+#define STREAM_HIGH_WATER (64 * 1024)
+
+typedef struct {
+    uint32_t id;
+    GList link;
+    // In the session's send queue (through link), or closed and waiting in its closing queue.
+    bool sending;
+    bool closed;
+    // Set once the client's END_STREAM came in, the request was served, the HEADERS of the
+    // response were queued and its last frame was.
+    bool remote_closed;
+    bool served;
+    bool head_sent;
+    bool end_queued;
+    // What the client may still send, and what we may.
+    int64_t recv_window;
+    int64_t send_window;
+
+    // The request as it comes in: the pseudo-header fields (str NULL if absent), the other
+    // fields as HTTP/1 header lines and Cookie put back together.
+    StrView method;
+    StrView scheme;
+    StrView path;
+    StrView authority;
+    StrView host;
+    GString *lines;
+    GString *cookie;
+    bool regular_seen;
+    bool malformed;
+    bool trailers;
+    bool has_content_length;
+    size_t content_length;
+    // The body, while it fits body_buffer, and its length so far. A bigger one goes to request.spool.
+    GString *body;
+    size_t body_length;
+    // A status to answer with whatever the handler would do: 413, 431 or 500.
+    int status;
+
+    H2Request request;
+    // The response: what the handler queued that is not framed yet, and the memory of both.
+    OutputQueue out;
+    Arena arena;
+    // Where the last frame ends in the connection's output, counted like H2Session.sent.
+    uint64_t queued_end;
+} H2Stream;
+
+struct H2Session {
+    const H2Config *config;
+    OutputQueue *out;
+    Arena *arena;
+    void *data;
+    bool preface_received;
+    bool settings_received;
+    bool goaway_sent;
+    bool goaway_received;
+    bool failed;
+    HpackTable decoder;
+    HpackTable encoder;
+    GString *scratch;
+    // The header block being received, or encoded.
+    GString *block;
+    // Set while a header block continues in CONTINUATION frames: its stream and flags.
+    uint32_t header_id;
+    uint8_t header_flags;
+    // The stream the header block being decoded belongs to, NULL if it is thrown away.
+    H2Stream *decoding;
+    // The open streams by id, the highest id the client used, and the streams with a response to send.
+    GHashTable *streams;
+    uint32_t last_id;
+    GQueue sending;
+    // Closed streams whose frames are not all sent yet, in the order they were closed.
+    GQueue closing;
+    // The client's settings and windows.
+    uint32_t max_frame_size;
+    int64_t initial_window;
+    int64_t send_window;
+    // Our window of the connection.
+    int64_t recv_window;
+    // Bytes of out sent so far, see h2_sent().
+    uint64_t sent;
+    uint64_t received_ns;
+};
+
+static uint32_t get_u32(const uint8_t *p) {
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+static void put_u32(uint8_t *p, uint32_t value) {
+    p[0] = (uint8_t) (value >> 24);
+    p[1] = (uint8_t) (value >> 16);
+    p[2] = (uint8_t) (value >> 8);
+    p[3] = (uint8_t) value;
+}
+
+/* Exact comparison, for what HTTP/2 has in lowercase (view_equals() ignores case). */
+static bool view_is(StrView view, const char *str) {
+    size_t len = strlen(str);
+    return view.len == len && memcmp(view.str, str, len) == 0;
+}
+
+static void write_frame_header(uint8_t *frame, uint8_t type, uint8_t flags, uint32_t id, size_t len) {
+    frame[0] = (uint8_t) (len >> 16);
+    frame[1] = (uint8_t) (len >> 8);
+    frame[2] = (uint8_t) len;
+    frame[3] = type;
+    frame[4] = flags;
+    put_u32(frame + 5, id);
+}
+
+/* Queues a frame with room for len bytes of payload, which is returned for the caller to fill. */
+static uint8_t *queue_frame(H2Session *session, uint8_t type, uint8_t flags, uint32_t id, size_t len) {
+    uint8_t *frame = arena_alloc(session->arena, FRAME_HEADER_SIZE + len);
+    write_frame_header(frame, type, flags, id, len);
+    output_add_mem(session->out, session->arena, (const char *) frame, FRAME_HEADER_SIZE + len, NULL, NULL);
+    return frame + FRAME_HEADER_SIZE;
+}
+
+static void queue_window_update(H2Session *session, uint32_t id, uint32_t increment) {
+    put_u32(queue_frame(session, FRAME_WINDOW_UPDATE, 0, id, 4), increment);
+}
+
+static void queue_goaway(H2Session *session, uint32_t error) {
+    uint8_t *payload = queue_frame(session, FRAME_GOAWAY, 0, 0, 8);
+    put_u32(payload, session->last_id);
+    put_u32(payload + 4, error);
+    session->goaway_sent = TRUE;
+}
+
+/* A connection error: GOAWAY, and the connection closes once that is sent. */
+static void connection_error(H2Session *session, uint32_t error) {
+    if (!session->failed) {
+        queue_goaway(session, error);
+        session->failed = TRUE;
+    }
+}
+
+static void destroy_stream(H2Stream *stream) {
+    output_clear(&stream->out);
+    if (stream->request.reply.stream != NULL) {
+        stream_free(stream->request.reply.stream);
+    }
+    body_spool_close(&stream->request.spool);
+    if (stream->body != NULL) {
+        g_string_free(stream->body, TRUE);
+    }
+    g_string_free(stream->lines, TRUE);
+    if (stream->cookie != NULL) {
+        g_string_free(stream->cookie, TRUE);
+    }
+    arena_destroy(&stream->arena);
+    g_free(stream);
+}
+
+static H2Stream *open_stream(H2Session *session, uint32_t id) {
+    H2Stream *stream = g_new0(H2Stream, 1);
+    stream->id = id;
+    stream->link.data = stream;
+    stream->recv_window = STREAM_WINDOW;
+    stream->send_window = session->initial_window;
+    stream->lines = g_string_new(NULL);
+    stream->request.spool.fd = -1;
+    output_init(&stream->out);
+    arena_init(&stream->arena, 4096);
+    g_hash_table_insert(session->streams, GUINT_TO_POINTER(id), stream);
+    return stream;
+}
+
+/* Ends a stream. Its memory stays until the frames queued for it are sent, the body producer
+    goes right away. */
+static void close_stream(H2Session *session, H2Stream *stream) {
+    if (stream->closed) {
+        return;
+    }
+    stream->closed = TRUE;
+    g_hash_table_remove(session->streams, GUINT_TO_POINTER(stream->id));
+    if (stream->sending) {
+        g_queue_unlink(&session->sending, &stream->link);
+        stream->sending = FALSE;
+    }
+    if (stream->request.reply.stream != NULL) {
+        stream_free(stream->request.reply.stream);
+        stream->request.reply.stream = NULL;
+    }
+    stream->queued_end = session->sent + session->out->bytes;
+    g_queue_push_tail_link(&session->closing, &stream->link);
+}
+
+/* A stream error: RST_STREAM and the stream is done. */
+static void reset_stream(H2Session *session, uint32_t id, uint32_t error) {
+    put_u32(queue_frame(session, FRAME_RST_STREAM, 0, id, 4), error);
+    H2Stream *stream = g_hash_table_lookup(session->streams, GUINT_TO_POINTER(id));
+    if (stream != NULL) {
+        close_stream(session, stream);
+    }
+}
+
+/* Our SETTINGS, and the connection window opened up beyond its default. */
+static void queue_preface(H2Session *session) {
+    uint8_t *payload = queue_frame(session, FRAME_SETTINGS, 0, 0, 18);
+    static const uint16_t ids[] = { SETTINGS_ENABLE_PUSH, SETTINGS_MAX_CONCURRENT_STREAMS,
+                                    SETTINGS_INITIAL_WINDOW_SIZE };
+    uint32_t values[] = { 0, session->config->max_streams, STREAM_WINDOW };
+    for (int i = 0; i < 3; i++) {
+        payload[i * 6] = (uint8_t) (ids[i] >> 8);
+        payload[i * 6 + 1] = (uint8_t) ids[i];
+        put_u32(payload + i * 6 + 2, values[i]);
+    }
+    queue_window_update(session, 0, CONNECTION_WINDOW - DEFAULT_WINDOW);
+}
+
+static H2Session *session_create(const H2Config *config, OutputQueue *out, Arena *arena, void *data) {
+    H2Session *session = g_new0(H2Session, 1);
+    session->config = config;
+    session->out = out;
+    session->arena = arena;
+    session->data = data;
+    hpack_table_init(&session->decoder, HPACK_TABLE_SIZE);
+    hpack_table_init(&session->encoder, HPACK_TABLE_SIZE);
+    session->scratch = g_string_new(NULL);
+    session->block = g_string_new(NULL);
+    session->streams = g_hash_table_new(g_direct_hash, g_direct_equal);
+    g_queue_init(&session->sending);
+    g_queue_init(&session->closing);
+    session->max_frame_size = DEFAULT_FRAME_SIZE;
+    session->initial_window = DEFAULT_WINDOW;
+    session->send_window = DEFAULT_WINDOW;
+    session->recv_window = CONNECTION_WINDOW;
+    return session;
+}
+
+H2Session *h2_session_new(const H2Config *config, OutputQueue *out, Arena *arena, void *data) {
+    H2Session *session = session_create(config, out, arena, data);
+    queue_preface(session);
+    return session;
+}
+
+/* Applies the client's settings. Returns 0, or the error code they are wrong with. */
+static uint32_t apply_settings(H2Session *session, const uint8_t *payload, size_t len) {
+    for (size_t i = 0; i + 6 <= len; i += 6) {
+        uint16_t id = (uint16_t) (payload[i] << 8 | payload[i + 1]);
+        uint32_t value = get_u32(payload + i + 2);
+        switch (id) {
+        case SETTINGS_HEADER_TABLE_SIZE:
+            hpack_encoder_resize(&session->encoder, value);
+            break;
+        case SETTINGS_ENABLE_PUSH:
+            if (value > 1) {
+                return ERROR_PROTOCOL;
+            }
+            break;
+        case SETTINGS_INITIAL_WINDOW_SIZE: {
+            if (value > MAX_WINDOW) {
+                return ERROR_FLOW_CONTROL;
+            }
+            // Changes the window of every stream by as much as the setting changes.
+            int64_t delta = (int64_t) value - session->initial_window;
+            GHashTableIter iter;
+            gpointer key, item;
+            g_hash_table_iter_init(&iter, session->streams);
+            while (g_hash_table_iter_next(&iter, &key, &item)) {
+                H2Stream *stream = item;
+                stream->send_window += delta;
+                if (stream->send_window > MAX_WINDOW) {
+                    return ERROR_FLOW_CONTROL;
+                }
+            }
+            session->initial_window = value;
+            break;
+        }
+        case SETTINGS_MAX_FRAME_SIZE:
+            if (value < DEFAULT_FRAME_SIZE || value > MAX_FRAME_SIZE) {
+                return ERROR_PROTOCOL;
+            }
+            session->max_frame_size = value;
+            break;
+        default:
+            // MAX_CONCURRENT_STREAMS limits pushes, which we never make; the rest is advisory or unknown.
+            break;
+        }
+    }
+    return 0;
+}
+
+bool h2_upgrade_requested(const Request *request) {
+    return view_equals(request->http_version, "HTTP/1.1") && request->http2_settings.len > 0 &&
+        view_has_token(request->upgrade, "h2c") && view_has_token(request->connection, "upgrade");
+}
+
+/* Decodes unpadded base64url (what HTTP2-Settings is) into out, which has room for
+    3 / 4 of len. Returns the decoded length, -1 if value is not base64url. */
+static gssize base64url_decode(StrView value, uint8_t *out) {
+    uint32_t bits = 0;
+    int count = 0;
+    gssize n = 0;
+    size_t len = value.len;
+    // Padding is not supposed to be there, but is harmless.
+    while (len > 0 && value.str[len - 1] == '=') {
+        len--;
+    }
+    for (size_t i = 0; i < len; i++) {
+        char c = value.str[i];
+        int digit;
+        if (c >= 'A' && c <= 'Z') {
+            digit = c - 'A';
+        }
+        else if (c >= 'a' && c <= 'z') {
+            digit = c - 'a' + 26;
+        }
+        else if (c >= '0' && c <= '9') {
+            digit = c - '0' + 52;
+        }
+        else if (c == '-') {
+            digit = 62;
+        }
+        else if (c == '_') {
+            digit = 63;
+        }
+        else {
+            return -1;
+        }
+        bits = (bits << 6) | (uint32_t) digit;
+        count += 6;
+        if (count >= 8) {
+            count -= 8;
+            out[n++] = (uint8_t) (bits >> count);
+        }
+    }
+    return count >= 6 ? -1 : n;
+}
+
+static void dispatch(H2Session *session, H2Stream *stream, GString *head, int *budget);
+
+/* Connection-specific header fields, which HTTP/2 does not have (RFC 9113 8.2.2). A response
+    from the handlers may have them, they are left out. */
+static bool connection_specific(StrView name) {
+    return view_equals(name, "connection") || view_equals(name, "keep-alive") ||
+        view_equals(name, "proxy-connection") || view_equals(name, "transfer-encoding") ||
+        view_equals(name, "upgrade");
+}
+
+H2Session *h2_upgrade(const H2Config *config, OutputQueue *out, Arena *arena, void *data,
+                      const Request *request, const HttpParser *parser, const char *buf) {
+    uint8_t *settings = g_malloc(request->http2_settings.len * 3 / 4 + 1);
+    gssize len = base64url_decode(request->http2_settings, settings);
+    H2Session *session = session_create(config, out, arena, data);
+    if (len < 0 || len % 6 != 0 || apply_settings(session, settings, (size_t) len) != 0) {
+        g_free(settings);
+        h2_session_free(session);
+        return NULL;
+    }
+    g_free(settings);
+
+    static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\n"
+                                    "Connection: Upgrade\r\n"
+                                    "Upgrade: h2c\r\n\r\n";
+    output_add_mem(out, arena, switching, sizeof(switching) - 1, NULL, NULL);
+    queue_preface(session);
+
+    // The request becomes stream 1, half-closed already: it is answered over HTTP/2.
+    H2Stream *stream = open_stream(session, 1);
+    session->last_id = 1;
+    stream->remote_closed = TRUE;
+    GString *head = g_string_sized_new(parser->header_end);
+    g_string_append_len(head, request->method.str, (gssize) request->method.len);
+    g_string_append_c(head, ' ');
+    g_string_append_len(head, buf + parser->target.off, parser->target.len);
+    g_string_append(head, " HTTP/1.0\r\n");
+    for (int i = 0; i < parser->nheaders; i++) {
+        StrView name = { buf + parser->headers[i].name.off, parser->headers[i].name.len };
+        if (connection_specific(name) || view_equals(name, "http2-settings") || view_equals(name, "te")) {
+            continue;
+        }
+        g_string_append_len(head, name.str, (gssize) name.len);
+        g_string_append(head, ": ");
+        g_string_append_len(head, buf + parser->headers[i].value.off, parser->headers[i].value.len);
+        g_string_append(head, "\r\n");
+    }
+    g_string_append(head, "\r\n");
+    if (request->msg_body.len > 0) {
+        stream->body = g_string_new_len(request->msg_body.str, (gssize) request->msg_body.len);
+        stream->body_length = request->msg_body.len;
+    }
+    dispatch(session, stream, head, NULL);
+    g_string_free(head, TRUE);
+    return session;
+}
+
+/* Lowercase token characters, what a field name may be made of. */
+static bool valid_name(StrView name) {
+    if (name.len == 0) {
+        return FALSE;
+    }
+    for (size_t i = 0; i < name.len; i++) {
+        unsigned char c = (unsigned char) name.str[i];
+        if (!((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || strchr("!#$%&'*+-.^_`|~", c) != NULL) ||
+                c == '\0') {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static bool valid_value(StrView value) {
+    if (value.len > 0 && (value.str[0] == ' ' || value.str[0] == '\t' ||
+                          value.str[value.len - 1] == ' ' || value.str[value.len - 1] == '\t')) {
+        return FALSE;
+    }
+    for (size_t i = 0; i < value.len; i++) {
+        if (value.str[i] == '\0' || value.str[i] == '\r' || value.str[i] == '\n') {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/* HpackField: checks a field of the request on session->decoding and notes it down. */
+static void take_field(void *data, StrView name, StrView value) {
+    H2Session *session = data;
+    H2Stream *stream = session->decoding;
+    if (stream == NULL || stream->malformed) {
+        return;
+    }
+    if (stream->trailers) {
+        // Trailers are checked, but the handlers have no use for them.
+        stream->malformed = (name.len > 0 && name.str[0] == ':') || !valid_name(name) || !valid_value(value);
+        return;
+    }
+    if (name.len > 0 && name.str[0] == ':') {
+        StrView *field = NULL;
+        if (view_is(name, ":method")) {
+            field = &stream->method;
+        }
+        else if (view_is(name, ":scheme")) {
+            field = &stream->scheme;
+        }
+        else if (view_is(name, ":path")) {
+            field = &stream->path;
+        }
+        else if (view_is(name, ":authority")) {
+            field = &stream->authority;
+        }
+        // Pseudo-header fields come first, once each, and only those of a request.
+        if (field == NULL || field->str != NULL || stream->regular_seen || !valid_value(value)) {
+            stream->malformed = TRUE;
+            return;
+        }
+        field->str = arena_strndup(&stream->arena, value.str, value.len);
+        field->len = value.len;
+        return;
+    }
+    stream->regular_seen = TRUE;
+    if (!valid_name(name) || !valid_value(value) || connection_specific(name) ||
+            (view_is(name, "te") && !view_is(value, "trailers"))) {
+        stream->malformed = TRUE;
+        return;
+    }
+    if (view_is(name, "te")) {
+        return;
+    }
+    if (view_is(name, "host")) {
+        // :authority takes its place, Host only counts without it.
+        if (stream->host.str == NULL) {
+            stream->host.str = arena_strndup(&stream->arena, value.str, value.len);
+            stream->host.len = value.len;
+        }
+        return;
+    }
+    if (view_is(name, "content-length")) {
+        // Checked against the DATA frames, the head gets the length they add up to.
+        size_t length;
+        if (!parse_content_length(value, &length) ||
+                (stream->has_content_length && length != stream->content_length)) {
+            stream->malformed = TRUE;
+            return;
+        }
+        stream->has_content_length = TRUE;
+        stream->content_length = length;
+        return;
+    }
+    if (stream->lines->len + name.len + value.len > HTTP_DEFAULT_MAX_HEADER_SIZE) {
+        stream->status = 431;
+        return;
+    }
+    if (view_is(name, "cookie")) {
+        // Split into fields of their own for better compression, joined again for HTTP/1 (RFC 9113 8.2.3).
+        if (stream->cookie == NULL) {
+            stream->cookie = g_string_new(NULL);
+        }
+        else {
+            g_string_append(stream->cookie, "; ");
+        }
+        g_string_append_len(stream->cookie, value.str, (gssize) value.len);
+        return;
+    }
+    g_string_append_len(stream->lines, name.str, (gssize) name.len);
+    g_string_append(stream->lines, ": ");
+    g_string_append_len(stream->lines, value.str, (gssize) value.len);
+    g_string_append(stream->lines, "\r\n");
+}
+
+/* TRUE if the pseudo-header fields make a request (RFC 9113 8.3.1). */
+static bool request_complete(const H2Stream *stream) {
+    if (stream->malformed || stream->method.str == NULL) {
+        return FALSE;
+    }
+    if (view_is(stream->method, "CONNECT")) {
+        return stream->authority.str != NULL && stream->scheme.str == NULL && stream->path.str == NULL;
+    }
+    return stream->scheme.str != NULL && stream->path.len > 0 &&
+        (stream->path.str[0] == '/' || (view_is(stream->path, "*") &&
+                                        view_is(stream->method, "OPTIONS")));
+}
+
+/* Writes the request of stream out as an HTTP/1.0 head and serves it. */
+static void serve_stream(H2Session *session, H2Stream *stream, int *budget) {
+    StrView authority = stream->authority.str != NULL ? stream->authority : stream->host;
+    bool connect = view_is(stream->method, "CONNECT");
+    GString *head = g_string_sized_new(stream->lines->len + 256);
+    g_string_append_len(head, stream->method.str, (gssize) stream->method.len);
+    g_string_append_c(head, ' ');
+    if (connect) {
+        g_string_append_len(head, authority.str, (gssize) authority.len);
+    }
+    else {
+        g_string_append_len(head, stream->path.str, (gssize) stream->path.len);
+    }
+    g_string_append(head, " HTTP/1.0\r\n");
+    if (authority.str != NULL) {
+        g_string_append(head, "Host: ");
+        g_string_append_len(head, authority.str, (gssize) authority.len);
+        g_string_append(head, "\r\n");
+    }
+    g_string_append_len(head, stream->lines->str, (gssize) stream->lines->len);
+    if (stream->cookie != NULL) {
+        g_string_append_printf(head, "Cookie: %s\r\n", stream->cookie->str);
+    }
+    if (stream->body_length > 0 || stream->has_content_length) {
+        g_string_append_printf(head, "Content-Length: %zu\r\n", stream->body_length);
+    }
+    g_string_append(head, "\r\n");
+    dispatch(session, stream, head, budget);
+    g_string_free(head, TRUE);
+}
+
+/* Hands the request in head to the handler and queues the stream for sending. */
+static void dispatch(H2Session *session, H2Stream *stream, GString *head, int *budget) {
+    H2Request *request = &stream->request;
+    init_request(&request->request, &stream->arena);
+    http_parser_init(&request->parser, HTTP_DEFAULT_MAX_HEADER_SIZE);
+    request->head = arena_strndup(&stream->arena, head->str, head->len);
+    // Only the body is missing from the head, it is in memory or spooled.
+    if (fill_request(&request->parser, request->head, head->len, &request->request) != HTTP_PARSE_ERROR &&
+            stream->body != NULL && stream->status == 0) {
+        request->request.msg_body.str = stream->body->str;
+        request->request.msg_body.len = stream->body->len;
+    }
+    if (stream->status != 0 && request->request.status_code == 0) {
+        request->request.status_code = stream->status;
+    }
+    request->reply.output = &stream->out;
+    request->reply.arena = &stream->arena;
+    request->reply.stream = NULL;
+    request->reply.close_conn = FALSE;
+    request->received_ns = session->received_ns;
+    stream->served = TRUE;
+    session->config->serve(session->data, request);
+    // A handler that did not take the spooled body over has no more use for it.
+    body_spool_close(&request->spool);
+    if (budget != NULL) {
+        (*budget)--;
+    }
+    g_queue_push_tail_link(&session->sending, &stream->link);
+    stream->sending = TRUE;
+}
+
+/* The client sent END_STREAM: the request is complete, unless it was answered already. */
+static void end_of_request(H2Session *session, H2Stream *stream, int *budget) {
+    stream->remote_closed = TRUE;
+    if (stream->served) {
+        return;
+    }
+    if (!request_complete(stream) || (stream->has_content_length && stream->content_length != stream->body_length)) {
+        reset_stream(session, stream->id, ERROR_PROTOCOL);
+        return;
+    }
+    serve_stream(session, stream, budget);
+}
+
+/* Takes a piece of the request body. One over max_body, or one that can not be spooled, is
+    answered right away and the rest of it dropped. */
+static void take_data(H2Session *session, H2Stream *stream, const uint8_t *data, size_t len, int *budget) {
+    if (stream->served || len == 0) {
+        return;
+    }
+    const H2Config *config = session->config;
+    BodySpool *spool = &stream->request.spool;
+    stream->body_length += len;
+    if (stream->body_length > config->max_body) {
+        stream->status = 413;
+    }
+    else if (spool->fd >= 0) {
+        if (!body_spool_write(spool, (const char *) data, len)) {
+            stream->status = 500;
+        }
+    }
+    else if (stream->body_length > config->body_buffer) {
+        if (!body_spool_open(spool, config->spool_dir) ||
+                (stream->body != NULL && !body_spool_write(spool, stream->body->str, stream->body->len)) ||
+                !body_spool_write(spool, (const char *) data, len)) {
+            stream->status = 500;
+        }
+        if (stream->body != NULL) {
+            g_string_free(stream->body, TRUE);
+            stream->body = NULL;
+        }
+    }
+    else {
+        if (stream->body == NULL) {
+            stream->body = g_string_sized_new(len);
+        }
+        g_string_append_len(stream->body, (const char *) data, (gssize) len);
+    }
+    if (stream->status != 0) {
+        body_spool_close(spool);
+        if (request_complete(stream)) {
+            serve_stream(session, stream, budget);
+        }
+        else {
+            reset_stream(session, stream->id, ERROR_PROTOCOL);
+        }
+    }
+}
+
+static void handle_data(H2Session *session, uint8_t flags, uint32_t id, const uint8_t *payload, size_t len,
+                        int *budget) {
+    if (id == 0) {
+        connection_error(session, ERROR_PROTOCOL);
+        return;
+    }
+    // The whole frame counts against the windows, padding included.
+    size_t frame_len = len;
+    session->recv_window -= (int64_t) frame_len;
+    if (session->recv_window < 0) {
+        connection_error(session, ERROR_FLOW_CONTROL);
+        return;
+    }
+    if (session->recv_window <= CONNECTION_WINDOW / 2) {
+        queue_window_update(session, 0, (uint32_t) (CONNECTION_WINDOW - session->recv_window));
+        session->recv_window = CONNECTION_WINDOW;
+    }
+    size_t pad = 0;
+    if (flags & FLAG_PADDED) {
+        if (len < 1 || payload[0] >= len) {
+            connection_error(session, ERROR_PROTOCOL);
+            return;
+        }
+        pad = payload[0];
+        payload++;
+        len--;
+    }
+    H2Stream *stream = g_hash_table_lookup(session->streams, GUINT_TO_POINTER(id));
+    if (stream == NULL) {
+        // Frames of a stream we reset or answered early may still be on their way.
+        if (id > session->last_id) {
+            connection_error(session, ERROR_PROTOCOL);
+        }
+        return;
+    }
+    if (stream->remote_closed) {
+        reset_stream(session, id, ERROR_STREAM_CLOSED);
+        return;
+    }
+    stream->recv_window -= (int64_t) frame_len;
+    if (stream->recv_window < 0) {
+        reset_stream(session, id, ERROR_FLOW_CONTROL);
+        return;
+    }
+    take_data(session, stream, payload, len - pad, budget);
+    if (flags & FLAG_END_STREAM) {
+        end_of_request(session, stream, budget);
+    }
+    else if (!stream->closed && stream->recv_window <= STREAM_WINDOW / 2) {
+        queue_window_update(session, id, (uint32_t) (STREAM_WINDOW - stream->recv_window));
+        stream->recv_window = STREAM_WINDOW;
+    }
+}
+
+/* The header block in session->block is complete. */
+static void end_of_headers(H2Session *session, int *budget) {
+    uint32_t id = session->header_id;
+    bool end_stream = (session->header_flags & FLAG_END_STREAM) != 0;
+    session->header_id = 0;
+    H2Stream *stream = g_hash_table_lookup(session->streams, GUINT_TO_POINTER(id));
+    uint32_t refuse = 0;
+    if (stream == NULL && id > session->last_id) {
+        session->last_id = id;
+        if (session->goaway_sent || g_hash_table_size(session->streams) >= session->config->max_streams) {
+            refuse = ERROR_REFUSED_STREAM;
+        }
+        else {
+            stream = open_stream(session, id);
+        }
+    }
+    else if (stream != NULL && (stream->remote_closed || !end_stream)) {
+        // A second block is only allowed as trailers, which end the stream.
+        refuse = stream->remote_closed ? ERROR_STREAM_CLOSED : ERROR_PROTOCOL;
+        stream = NULL;
+    }
+    else if (stream != NULL) {
+        stream->trailers = TRUE;
+    }
+
+    // Even a block that is thrown away has to be decoded: it changes the dynamic table.
+    session->decoding = stream;
+    bool ok = hpack_decode(&session->decoder, (const uint8_t *) session->block->str, session->block->len,
+                           session->scratch, take_field, session);
+    session->decoding = NULL;
+    g_string_truncate(session->block, 0);
+    if (!ok) {
+        connection_error(session, ERROR_COMPRESSION);
+        return;
+    }
+    if (refuse != 0) {
+        reset_stream(session, id, refuse);
+        return;
+    }
+    if (stream == NULL) {
+        return;
+    }
+    if (!request_complete(stream)) {
+        reset_stream(session, id, ERROR_PROTOCOL);
+        return;
+    }
+    if (end_stream) {
+        end_of_request(session, stream, budget);
+    }
+    else if (!stream->served && stream->has_content_length && stream->content_length > session->config->max_body) {
+        // Refused before the body is sent, like take_body() does.
+        stream->status = 413;
+        serve_stream(session, stream, budget);
+    }
+}
+
+static void handle_headers(H2Session *session, uint8_t type, uint8_t flags, uint32_t id,
+                           const uint8_t *payload, size_t len, int *budget) {
+    if (type == FRAME_CONTINUATION) {
+        if (session->header_id == 0 || id != session->header_id) {
+            connection_error(session, ERROR_PROTOCOL);
+            return;
+        }
+    }
+    else {
+        if (id == 0 || id % 2 == 0) {
+            connection_error(session, ERROR_PROTOCOL);
+            return;
+        }
+        size_t skip = 0, pad = 0;
+        if (flags & FLAG_PADDED) {
+            if (len < 1) {
+                connection_error(session, ERROR_PROTOCOL);
+                return;
+            }
+            pad = payload[0];
+            skip = 1;
+        }
+        // The priority is advisory, and the streams take turns anyway.
+        if (flags & FLAG_PRIORITY) {
+            skip += 5;
+        }
+        if (skip + pad > len) {
+            connection_error(session, ERROR_PROTOCOL);
+            return;
+        }
+        payload += skip;
+        len -= skip + pad;
+        session->header_id = id;
+        session->header_flags = flags;
+    }
+    if (session->block->len + len > MAX_HEADER_BLOCK) {
+        connection_error(session, ERROR_ENHANCE_YOUR_CALM);
+        return;
+    }
+    g_string_append_len(session->block, (const char *) payload, (gssize) len);
+    if (flags & FLAG_END_HEADERS) {
+        end_of_headers(session, budget);
+    }
+}
+
+static void handle_settings(H2Session *session, uint8_t flags, uint32_t id, const uint8_t *payload, size_t len) {
+    if (id != 0) {
+        connection_error(session, ERROR_PROTOCOL);
+        return;
+    }
+    if ((flags & FLAG_ACK) ? len != 0 : len % 6 != 0) {
+        connection_error(session, ERROR_FRAME_SIZE);
+        return;
+    }
+    if (flags & FLAG_ACK) {
+        return;
+    }
+    uint32_t error = apply_settings(session, payload, len);
+    if (error != 0) {
+        connection_error(session, error);
+        return;
+    }
+    queue_frame(session, FRAME_SETTINGS, FLAG_ACK, 0, 0);
+}
+
+static void handle_window_update(H2Session *session, uint32_t id, const uint8_t *payload, size_t len) {
+    if (len != 4) {
+        connection_error(session, ERROR_FRAME_SIZE);
+        return;
+    }
+    uint32_t increment = get_u32(payload) & 0x7fffffff;
+    if (id == 0) {
+        session->send_window += increment;
+        if (increment == 0 || session->send_window > MAX_WINDOW) {
+            connection_error(session, increment == 0 ? ERROR_PROTOCOL : ERROR_FLOW_CONTROL);
+        }
+        return;
+    }
+    H2Stream *stream = g_hash_table_lookup(session->streams, GUINT_TO_POINTER(id));
+    if (stream == NULL) {
+        if (id > session->last_id) {
+            connection_error(session, ERROR_PROTOCOL);
+        }
+        return;
+    }
+    stream->send_window += increment;
+    if (increment == 0 || stream->send_window > MAX_WINDOW) {
+        reset_stream(session, id, increment == 0 ? ERROR_PROTOCOL : ERROR_FLOW_CONTROL);
+    }
+}
+
+static void handle_frame(H2Session *session, uint8_t type, uint8_t flags, uint32_t id,
+                         const uint8_t *payload, size_t len, int *budget) {
+    // The client's first frame is its SETTINGS, and nothing may come between a header block's frames.
+    if ((!session->settings_received && type != FRAME_SETTINGS) ||
+            (session->header_id != 0 && type != FRAME_CONTINUATION)) {
+        connection_error(session, ERROR_PROTOCOL);
+        return;
+    }
+    switch (type) {
+    case FRAME_DATA:
+        handle_data(session, flags, id, payload, len, budget);
+        break;
+    case FRAME_HEADERS:
+    case FRAME_CONTINUATION:
+        handle_headers(session, type, flags, id, payload, len, budget);
+        break;
+    case FRAME_PRIORITY:
+        if (id == 0) {
+            connection_error(session, ERROR_PROTOCOL);
+        }
+        else if (len != 5) {
+            reset_stream(session, id, ERROR_FRAME_SIZE);
+        }
+        break;
+    case FRAME_RST_STREAM:
+        if (id == 0 || id > session->last_id) {
+            connection_error(session, ERROR_PROTOCOL);
+        }
+        else if (len != 4) {
+            connection_error(session, ERROR_FRAME_SIZE);
+        }
+        else {
+            H2Stream *stream = g_hash_table_lookup(session->streams, GUINT_TO_POINTER(id));
+            if (stream != NULL) {
+                close_stream(session, stream);
+            }
+        }
+        break;
+    case FRAME_SETTINGS:
+        session->settings_received = TRUE;
+        handle_settings(session, flags, id, payload, len);
+        break;
+    case FRAME_PING:
+        if (id != 0) {
+            connection_error(session, ERROR_PROTOCOL);
+        }
+        else if (len != 8) {
+            connection_error(session, ERROR_FRAME_SIZE);
+        }
+        else if (!(flags & FLAG_ACK)) {
+            memcpy(queue_frame(session, FRAME_PING, FLAG_ACK, 0, 8), payload, 8);
+        }
+        break;
+    case FRAME_GOAWAY:
+        if (id != 0) {
+            connection_error(session, ERROR_PROTOCOL);
+        }
+        else if (len < 8) {
+            connection_error(session, ERROR_FRAME_SIZE);
+        }
+        else {
+            // The streams we have are answered, then the connection closes.
+            session->goaway_received = TRUE;
+        }
+        break;
+    case FRAME_WINDOW_UPDATE:
+        handle_window_update(session, id, payload, len);
+        break;
+    case FRAME_PUSH_PROMISE:
+        // Only a server may push.
+        connection_error(session, ERROR_PROTOCOL);
+        break;
+    default:
+        // Unknown frame types are ignored (RFC 9113 5.5).
+        break;
+    }
+}
+
+size_t h2_receive(H2Session *session, const char *buf, size_t len, int *budget, uint64_t received_ns) {
+    size_t pos = 0;
+    if (!session->preface_received) {
+        size_t n = len < H2_PREFACE_SIZE ? len : H2_PREFACE_SIZE;
+        if (memcmp(buf, H2_PREFACE, n) != 0) {
+            connection_error(session, ERROR_PROTOCOL);
+            return len;
+        }
+        if (n < H2_PREFACE_SIZE) {
+            return 0;
+        }
+        session->preface_received = TRUE;
+        pos = H2_PREFACE_SIZE;
+    }
+    session->received_ns = received_ns;
+    while (!session->failed && *budget > 0 && len - pos >= FRAME_HEADER_SIZE) {
+        const uint8_t *frame = (const uint8_t *) buf + pos;
+        size_t length = (size_t) frame[0] << 16 | (size_t) frame[1] << 8 | frame[2];
+        // We never raise SETTINGS_MAX_FRAME_SIZE.
+        if (length > DEFAULT_FRAME_SIZE) {
+            connection_error(session, ERROR_FRAME_SIZE);
+            break;
+        }
+        if (len - pos - FRAME_HEADER_SIZE < length) {
+            break;
+        }
+        handle_frame(session, frame[3], frame[4], get_u32(frame + 5) & 0x7fffffff, frame + FRAME_HEADER_SIZE,
+                     length, budget);
+        pos += FRAME_HEADER_SIZE + length;
+    }
+    // After a connection error nothing more is read.
+    return session->failed ? len : pos;
+}
+
+/* Turns the HTTP/1 head at the front of stream->out into a HEADERS frame (and CONTINUATION
+    frames if it does not fit one). Returns FALSE if there is no complete head there. */
+static bool send_headers(H2Session *session, H2Stream *stream) {
+    OutputSegment *first = stream->out.head;
+    const char *head = first->data;
+    const char *end = head != NULL ? g_strstr_len(head, (gssize) first->len, "\r\n\r\n") : NULL;
+    if (end == NULL || end - head < 12 || !g_ascii_isdigit(head[9]) || !g_ascii_isdigit(head[10]) ||
+            !g_ascii_isdigit(head[11])) {
+        return FALSE;
+    }
+    GString *block = session->block;
+    g_string_truncate(block, 0);
+    hpack_encode_start(&session->encoder, block);
+    hpack_encode(&session->encoder, block, (StrView) { ":status", 7 }, (StrView) { head + 9, 3 }, TRUE);
+    char name[256];
+    const char *line = memchr(head, '\n', (size_t) (end - head)) + 1;
+    while (line < end + 2) {
+        const char *eol = memchr(line, '\r', (size_t) (end + 2 - line));
+        const char *colon = memchr(line, ':', (size_t) (eol - line));
+        if (colon != NULL && (size_t) (colon - line) < sizeof(name)) {
+            StrView field = { name, (size_t) (colon - line) };
+            for (size_t i = 0; i < field.len; i++) {
+                name[i] = g_ascii_tolower(line[i]);
+            }
+            StrView value = { colon + 1, (size_t) (eol - colon - 1) };
+            while (value.len > 0 && (value.str[0] == ' ' || value.str[0] == '\t')) {
+                value.str++;
+                value.len--;
+            }
+            // Values that change with every response would only push the others out of the table.
+            bool index = !view_equals(field, "content-length") && !view_equals(field, "content-range") &&
+                !view_equals(field, "set-cookie");
+            if (!connection_specific(field)) {
+                hpack_encode(&session->encoder, block, field, value, index);
+            }
+        }
+        line = eol + 2;
+    }
+    output_consume(&stream->out, (size_t) (end + 4 - head));
+
+    bool end_stream = output_empty(&stream->out) && stream->request.reply.stream == NULL;
+    size_t frames = block->len / session->max_frame_size + 1;
+    size_t offset = 0;
+    for (size_t i = 0; i < frames; i++) {
+        size_t len = MIN(block->len - offset, session->max_frame_size);
+        uint8_t flags = i + 1 == frames ? FLAG_END_HEADERS : 0;
+        if (i == 0 && end_stream) {
+            flags |= FLAG_END_STREAM;
+        }
+        memcpy(queue_frame(session, i == 0 ? FRAME_HEADERS : FRAME_CONTINUATION, flags, stream->id, len),
+               block->str + offset, len);
+        offset += len;
+    }
+    g_string_truncate(block, 0);
+    stream->head_sent = TRUE;
+    stream->end_queued = end_stream;
+    return TRUE;
+}
+
+/* The last frame of the response is queued. */
+static void end_of_response(H2Session *session, H2Stream *stream) {
+    session->config->done(session->data, &stream->request);
+    // Answered before the request was complete: the client can stop sending it (RFC 9113 8.1).
+    if (!stream->remote_closed) {
+        reset_stream(session, stream->id, ERROR_NONE);
+    }
+    close_stream(session, stream);
+}
+
+/* Gives stream a turn: produces more of its body and queues at most one frame of it.
+    Returns TRUE if that got anywhere. */
+static bool send_turn(H2Session *session, H2Stream *stream) {
+    bool progress = FALSE;
+    Stream *body = stream->request.reply.stream;
+    if (body != NULL && stream->out.bytes < STREAM_HIGH_WATER) {
+        size_t queued = stream->out.bytes;
+        StreamStatus status = stream_pump(body, &stream->out, &stream->arena, STREAM_HIGH_WATER);
+        progress = stream->out.bytes > queued;
+        if (status == STREAM_ERROR) {
+            // The client can only tell that the body is incomplete by the reset.
+            reset_stream(session, stream->id, ERROR_INTERNAL);
+            return TRUE;
+        }
+        if (status == STREAM_DONE) {
+            stream_free(body);
+            stream->request.reply.stream = NULL;
+            body = NULL;
+            progress = TRUE;
+        }
+    }
+    if (!stream->head_sent) {
+        if (output_empty(&stream->out)) {
+            // The producer has not come up with the head yet.
+            return progress;
+        }
+        if (!send_headers(session, stream)) {
+            reset_stream(session, stream->id, ERROR_INTERNAL);
+            return TRUE;
+        }
+        if (stream->end_queued) {
+            end_of_response(session, stream);
+        }
+        return TRUE;
+    }
+
+    // A window goes below zero when the client lowers SETTINGS_INITIAL_WINDOW_SIZE after
+    // DATA went out; nothing but an empty last frame may be sent until it is opened again.
+    int64_t window = MIN(stream->send_window, session->send_window);
+    if (window <= 0 && !output_empty(&stream->out)) {
+        return progress;
+    }
+    size_t len = MIN(stream->out.bytes, session->max_frame_size);
+    if (window > 0) {
+        len = (size_t) MIN((int64_t) len, window);
+    }
+    bool end_stream = body == NULL && len == stream->out.bytes;
+    if (len == 0 && !end_stream) {
+        return progress;
+    }
+    // The payload is moved over from the stream's queue as it is, file pieces included.
+    uint8_t *header = arena_alloc(session->arena, FRAME_HEADER_SIZE);
+    write_frame_header(header, FRAME_DATA, end_stream ? FLAG_END_STREAM : 0, stream->id, len);
+    output_add_mem(session->out, session->arena, (const char *) header, FRAME_HEADER_SIZE, NULL, NULL);
+    output_move(&stream->out, session->out, session->arena, len);
+    stream->send_window -= (int64_t) len;
+    session->send_window -= (int64_t) len;
+    if (end_stream) {
+        stream->end_queued = TRUE;
+        end_of_response(session, stream);
+    }
+    return TRUE;
+}
+
+void h2_send(H2Session *session, size_t high_water) {
+    // Every stream gets a turn per round, until a round gets nowhere.
+    bool progress = TRUE;
+    while (progress && session->out->bytes < high_water && !session->failed) {
+        progress = FALSE;
+        guint turns = session->sending.length;
+        for (guint i = 0; i < turns && session->out->bytes < high_water; i++) {
+            GList *link = g_queue_pop_head_link(&session->sending);
+            H2Stream *stream = link->data;
+            stream->sending = FALSE;
+            progress |= send_turn(session, stream);
+            if (!stream->closed) {
+                g_queue_push_tail_link(&session->sending, link);
+                stream->sending = TRUE;
+            }
+        }
+    }
+}
+
+void h2_sent(H2Session *session, size_t n) {
+    session->sent += n;
+    while (session->closing.head != NULL) {
+        H2Stream *stream = session->closing.head->data;
+        if (stream->queued_end > session->sent) {
+            break;
+        }
+        g_queue_pop_head_link(&session->closing);
+        destroy_stream(stream);
+    }
+}
+
+void h2_shutdown(H2Session *session) {
+    if (!session->goaway_sent) {
+        queue_goaway(session, ERROR_NONE);
+    }
+}
+
+bool h2_finished(const H2Session *session) {
+    return session->failed ||
+        ((session->goaway_sent || session->goaway_received) && g_hash_table_size(session->streams) == 0);
+}
+
+bool h2_idle(const H2Session *session) {
+    return g_hash_table_size(session->streams) == 0;
+}
+
+void h2_cancel(H2Session *session) {
+    GHashTableIter iter;
+    gpointer key, item;
+    g_hash_table_iter_init(&iter, session->streams);
+    while (g_hash_table_iter_next(&iter, &key, &item)) {
+        H2Stream *stream = item;
+        if (stream->request.reply.stream != NULL) {
+            stream_free(stream->request.reply.stream);
+            stream->request.reply.stream = NULL;
+        }
+    }
+}
+
+void h2_session_free(H2Session *session) {
+    GHashTableIter iter;
+    gpointer key, item;
+    g_hash_table_iter_init(&iter, session->streams);
+    while (g_hash_table_iter_next(&iter, &key, &item)) {
+        destroy_stream(item);
+    }
+    g_hash_table_destroy(session->streams);
+    GList *link;
+    while ((link = g_queue_pop_head_link(&session->closing)) != NULL) {
+        destroy_stream(link->data);
+    }
+    hpack_table_free(&session->decoder);
+    hpack_table_free(&session->encoder);
+    g_string_free(session->scratch, TRUE);
+    g_string_free(session->block, TRUE);
+    g_free(session);
+}
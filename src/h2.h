@@ -0,0 +1,112 @@
+/*
+ * h2.h
+ *
+ * HTTP/2 over cleartext TCP (h2c, RFC 9113), for clients that start with the
+ * connection preface (prior knowledge) or upgrade an HTTP/1.1 request. A
+ * session runs the frames of one connection: many requests are in flight at
+ * once, each on a stream of its own, their headers HPACK compressed (hpack.h)
+ * and their bodies flow controlled. Every request is handed to the same
+ * handlers as one that came over HTTP/1.x, written out as an HTTP/1.0 head,
+ * so the response comes back with a head to translate and a body that is
+ * neither chunked nor needs the connection to close. The streams' responses
+ * go out interleaved, a DATA frame of each in turn, as far as the windows of
+ * the client let them; a body in a file is still sent with sendfile().
+ */
+
+#ifndef H2_H
+#define H2_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "body.h"
+#include "http_parser.h"
+#include "output.h"
+#include "reply.h"
+#include "request.h"
+
+// What a client sends first, with prior knowledge or after the 101 of an upgrade.
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_SIZE 24
+
+/* The request of a stream, made into an HTTP/1.0 request for the handlers. */
+typedef struct {
+    Request request;
+    HttpParser parser;
+    // The head request and parser point into.
+    const char *head;
+    // A body too big to keep in memory, fd is -1 otherwise. The handler may take the file over.
+    BodySpool spool;
+    // Queues into the stream, not the connection.
+    Reply reply;
+    // When the frame that completed the request was read.
+    uint64_t received_ns;
+} H2Request;
+
+/* Answers a request into request->reply. data is what the session was created with. */
+typedef void (*H2Serve)(void *data, H2Request *request);
+
+/* Called once the last frame of the response to request is queued. */
+typedef void (*H2Done)(void *data, H2Request *request);
+
+typedef struct {
+    // SETTINGS_MAX_CONCURRENT_STREAMS: more streams at a time are refused.
+    uint32_t max_streams;
+    // Request bodies up to body_buffer bytes are kept in memory, bigger ones go to a file
+    // in spool_dir, and one of more than max_body bytes is answered with 413.
+    size_t body_buffer;
+    size_t max_body;
+    const char *spool_dir;
+    H2Serve serve;
+    H2Done done;
+} H2Config;
+
+typedef struct H2Session H2Session;
+
+/* Starts a session for a client that sent the preface, or is about to: it queues our
+    SETTINGS on out. The frames are allocated from arena, which must not be reset while
+    out holds any. config must outlive the session. */
+H2Session *h2_session_new(const H2Config *config, OutputQueue *out, Arena *arena, void *data);
+
+/* TRUE if request (an HTTP/1.1 one, complete with its body) asks to be upgraded to h2c. */
+bool h2_upgrade_requested(const Request *request);
+
+/* Upgrades the connection of request, whose head starts at buf: queues the 101 Switching
+    Protocols and starts a session with the settings of its HTTP2-Settings, in which the
+    request is stream 1 and is served right away. Returns NULL, with nothing queued, if
+    HTTP2-Settings is malformed; the request is then answered over HTTP/1.1 as usual. */
+H2Session *h2_upgrade(const H2Config *config, OutputQueue *out, Arena *arena, void *data,
+                      const Request *request, const HttpParser *parser, const char *buf);
+
+/* Takes the frames in buf[0 .. len) and serves the requests they complete, at most *budget
+    of them (which is counted down). received_ns is when they were read. Returns how many
+    bytes were taken: what is left is an incomplete frame, or has to wait for more budget. */
+size_t h2_receive(H2Session *session, const char *buf, size_t len, int *budget, uint64_t received_ns);
+
+/* Frames more of the responses onto out, until it holds high_water bytes or the client's
+    flow control windows are used up. */
+void h2_send(H2Session *session, size_t high_water);
+
+/* Counts n more bytes of out as sent, which frees the streams whose frames are all out. */
+void h2_sent(H2Session *session, size_t n);
+
+/* Sends GOAWAY: no new streams are taken, the ones in progress are answered. */
+void h2_shutdown(H2Session *session);
+
+/* Stops producing the responses, for a connection that is closing: the upstreams of proxied
+    streams are let go. What is queued on out stays valid. */
+void h2_cancel(H2Session *session);
+
+/* TRUE once the connection should close after what is queued on out: after an error,
+    or after GOAWAY once no stream is left. */
+bool h2_finished(const H2Session *session);
+
+/* TRUE while no request is in progress. */
+bool h2_idle(const H2Session *session);
+
+/* Frees the session. out has to be cleared (or sent) first, it may point into the streams. */
+void h2_session_free(H2Session *session);
+
+#endif
@@ -0,0 +1,94 @@
+/*
+ * histogram.c
+ *
+ * Bucket b < 128 holds the value b. Above that a value with its highest bit
+ * at position msb is shifted right by msb - 6, which leaves 64..127, and
+ * every shift has its own row of 64 buckets.
+ */
+
+#include <string.h>
+
+#include "histogram.h"
+
+void histogram_reset(Histogram *histogram) {
+    memset(histogram, 0, sizeof(*histogram));
+}
+
+int histogram_bucket(uint64_t value) {
+    if (value < 2 * HISTOGRAM_SUB_BUCKETS) {
+        return (int) value;
+    }
+    int msb = 63 - __builtin_clzll(value);
+    if (msb >= HISTOGRAM_MAX_BITS) {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+    int shift = msb - 6;
+    return 2 * HISTOGRAM_SUB_BUCKETS + (shift - 1) * HISTOGRAM_SUB_BUCKETS +
+        (int) (value >> shift) - HISTOGRAM_SUB_BUCKETS;
+}
+
+uint64_t histogram_bucket_limit(int bucket) {
+    if (bucket < 2 * HISTOGRAM_SUB_BUCKETS) {
+        return (uint64_t) bucket;
+    }
+    int row = (bucket - 2 * HISTOGRAM_SUB_BUCKETS) / HISTOGRAM_SUB_BUCKETS;
+    int sub = (bucket - 2 * HISTOGRAM_SUB_BUCKETS) % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS;
+    int shift = row + 1;
+    return (((uint64_t) sub + 1) << shift) - 1;
+}
+
+// Only the owner writes, so a relaxed load and store is as good as an atomic increment
+// (and as cheap as a plain one), but lets another thread read the counts while they change.
+static inline void add(uint64_t *counter, uint64_t n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t get(const uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+void histogram_record(Histogram *histogram, uint64_t value) {
+    add(&histogram->counts[histogram_bucket(value)], 1);
+    add(&histogram->total, 1);
+    add(&histogram->sum, value);
+    if (value > histogram->max) {
+        __atomic_store_n(&histogram->max, value, __ATOMIC_RELAXED);
+    }
+}
+
+void histogram_merge(Histogram *into, const Histogram *from) {
+    // The total is taken from the counts read, so it agrees with them even if from changed meanwhile.
+    uint64_t total = 0;
+    for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        uint64_t count = get(&from->counts[b]);
+        into->counts[b] += count;
+        total += count;
+    }
+    into->total += total;
+    into->sum += get(&from->sum);
+    uint64_t max = get(&from->max);
+    if (max > into->max) {
+        into->max = max;
+    }
+}
+
+uint64_t histogram_percentile(const Histogram *histogram, double p) {
+    if (histogram->total == 0) {
+        return 0;
+    }
+    // The rank of the value we are after, counting from 1.
+    uint64_t rank = (uint64_t) (p * (double) histogram->total + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        seen += histogram->counts[b];
+        if (seen >= rank) {
+            uint64_t limit = histogram_bucket_limit(b);
+            // Never more than the biggest value actually recorded.
+            return limit < histogram->max ? limit : histogram->max;
+        }
+    }
+    return histogram->max;
+}
@@ -0,0 +1,46 @@
+/*
+ * histogram.h
+ *
+ * A log-linear histogram in the style of HdrHistogram: values below 128 get
+ * a bucket each, above that every power of two is split into 64 buckets, so
+ * a percentile is off by less than 1.6% whatever the magnitude. Recording is
+ * an index computation and an increment, and the buckets are a flat array
+ * that can be merged or copied without locks. A histogram has one writer,
+ * but another thread may merge it while it is being recorded into.
+ */
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+// Values up to 2^HISTOGRAM_MAX_BITS - 1 are told apart, bigger ones count as the biggest.
+#define HISTOGRAM_MAX_BITS 40
+#define HISTOGRAM_SUB_BUCKETS 64
+#define HISTOGRAM_BUCKETS (2 * HISTOGRAM_SUB_BUCKETS + (HISTOGRAM_MAX_BITS - 7) * HISTOGRAM_SUB_BUCKETS)
+
+typedef struct {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t max;
+} Histogram;
+
+void histogram_reset(Histogram *histogram);
+
+void histogram_record(Histogram *histogram, uint64_t value);
+
+/* Adds the counts of from to into. from may be recorded into meanwhile, into may not. */
+void histogram_merge(Histogram *into, const Histogram *from);
+
+/* The index of the bucket value is counted in. */
+int histogram_bucket(uint64_t value);
+
+/* The biggest value counted in bucket. */
+uint64_t histogram_bucket_limit(int bucket);
+
+/* The value below which a fraction p (0..1) of the recorded values lie,
+    as the upper end of its bucket. 0 if nothing was recorded. */
+uint64_t histogram_percentile(const Histogram *histogram, double p);
+
+#endif
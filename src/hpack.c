@@ -0,0 +1,524 @@
+/*
+ * hpack.c
+ *
+ * The Huffman code is canonical: the codes of one length are consecutive
+ * numbers, and shorter codes come first. So the codes of length n are below
+ * limit[n] once the first n bits are read as a number, and decoding a symbol
+ * takes one comparison per code length rather than a walk down a tree.
+ */
+
+#include <string.h>
+
+#include "hpack.h"
+
+struct HpackEntry {
+    size_t name_len;
+    size_t value_len;
+    char data[];  // the name, then the value
+};
+
+// RFC 7541 Appendix A. Index 1 is the first entry.
+#define STATIC_COUNT 61
+static const struct {
+    const char *name;
+    const char *value;
+} static_table[STATIC_COUNT] = {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+static size_t static_name_len[STATIC_COUNT];
+static size_t static_value_len[STATIC_COUNT];
+
+// RFC 7541 Appendix B, by symbol: the byte values and EOS (256), which only ever
+// shows up as padding, as its first 1 to 7 bits.
+#define HUFFMAN_SYMBOLS 257
+#define HUFFMAN_EOS 256
+#define HUFFMAN_MAX_LEN 30
+static const uint32_t huffman_codes[HUFFMAN_SYMBOLS] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+    0x3fffffff,
+};
+
+static const uint8_t huffman_lens[HUFFMAN_SYMBOLS] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+// The decoding tables: the codes of length n are first[n] .. limit[n] - 1, and the
+// symbol of code first[n] + i is symbols[offset[n] + i].
+static uint32_t huffman_first[HUFFMAN_MAX_LEN + 1];
+static uint32_t huffman_limit[HUFFMAN_MAX_LEN + 1];
+static uint16_t huffman_offset[HUFFMAN_MAX_LEN + 1];
+static uint16_t huffman_symbols[HUFFMAN_SYMBOLS];
+
+// Every entry counts its name and value and this much more towards the table size.
+#define ENTRY_OVERHEAD 32
+
+void hpack_init(void) {
+    for (int i = 0; i < STATIC_COUNT; i++) {
+        static_name_len[i] = strlen(static_table[i].name);
+        static_value_len[i] = strlen(static_table[i].value);
+    }
+
+    // The symbols sorted by code length, and by value within a length, are the order of the codes.
+    uint16_t count[HUFFMAN_MAX_LEN + 1] = { 0 };
+    for (int s = 0; s < HUFFMAN_SYMBOLS; s++) {
+        count[huffman_lens[s]]++;
+    }
+    uint32_t code = 0;
+    uint16_t offset = 0;
+    for (int n = 1; n <= HUFFMAN_MAX_LEN; n++) {
+        huffman_first[n] = code;
+        huffman_limit[n] = code + count[n];
+        huffman_offset[n] = offset;
+        code = (code + count[n]) << 1;
+        offset = (uint16_t) (offset + count[n]);
+    }
+    uint16_t next[HUFFMAN_MAX_LEN + 1];
+    memcpy(next, huffman_offset, sizeof(next));
+    for (int s = 0; s < HUFFMAN_SYMBOLS; s++) {
+        uint16_t i = next[huffman_lens[s]]++;
+        huffman_symbols[i] = (uint16_t) s;
+        // The table above is the RFC's, the canonical codes have to come out the same.
+        g_assert(huffman_first[huffman_lens[s]] + (i - huffman_offset[huffman_lens[s]]) == huffman_codes[s]);
+    }
+}
+
+void hpack_table_init(HpackTable *table, size_t limit) {
+    memset(table, 0, sizeof(*table));
+    table->max_size = limit;
+    table->limit = limit;
+}
+
+void hpack_table_free(HpackTable *table) {
+    for (size_t i = 0; i < table->count; i++) {
+        g_free(table->entries[(table->first + i) % table->capacity]);
+    }
+    g_free(table->entries);
+    table->entries = NULL;
+    table->count = 0;
+    table->size = 0;
+}
+
+static size_t entry_size(const HpackEntry *entry) {
+    return entry->name_len + entry->value_len + ENTRY_OVERHEAD;
+}
+
+/* Dynamic index 62 + i, 0 being the newest entry. */
+static HpackEntry *table_get(const HpackTable *table, size_t i) {
+    return table->entries[(table->first + i) % table->capacity];
+}
+
+/* Drops the oldest entries until the table is at most max_size - room. */
+static void table_evict(HpackTable *table, size_t room) {
+    while (table->count > 0 && table->size + room > table->max_size) {
+        HpackEntry *oldest = table_get(table, table->count - 1);
+        table->size -= entry_size(oldest);
+        g_free(oldest);
+        table->count--;
+    }
+}
+
+static void table_add(HpackTable *table, StrView name, StrView value) {
+    size_t size = name.len + value.len + ENTRY_OVERHEAD;
+    if (size > table->max_size) {
+        // Not an error: the table just ends up empty.
+        table_evict(table, table->max_size + 1);
+        return;
+    }
+    // The name may be an entry of the table, so it is copied before anything is evicted.
+    HpackEntry *entry = g_malloc(sizeof(HpackEntry) + name.len + value.len);
+    entry->name_len = name.len;
+    entry->value_len = value.len;
+    memcpy(entry->data, name.str, name.len);
+    memcpy(entry->data + name.len, value.str, value.len);
+    table_evict(table, size);
+
+    if (table->count == table->capacity) {
+        size_t capacity = table->capacity > 0 ? table->capacity * 2 : 16;
+        HpackEntry **entries = g_new(HpackEntry *, capacity);
+        for (size_t i = 0; i < table->count; i++) {
+            entries[i] = table_get(table, i);
+        }
+        g_free(table->entries);
+        table->entries = entries;
+        table->capacity = capacity;
+        table->first = 0;
+    }
+    table->first = (table->first + table->capacity - 1) % table->capacity;
+    table->entries[table->first] = entry;
+    table->count++;
+    table->size += size;
+}
+
+/* The field at index (1 and up) of the static and then the dynamic table. */
+static bool table_field(const HpackTable *table, size_t index, StrView *name, StrView *value) {
+    if (index == 0) {
+        return FALSE;
+    }
+    if (index <= STATIC_COUNT) {
+        *name = (StrView) { static_table[index - 1].name, static_name_len[index - 1] };
+        *value = (StrView) { static_table[index - 1].value, static_value_len[index - 1] };
+        return TRUE;
+    }
+    if (index - STATIC_COUNT - 1 >= table->count) {
+        return FALSE;
+    }
+    HpackEntry *entry = table_get(table, index - STATIC_COUNT - 1);
+    *name = (StrView) { entry->data, entry->name_len };
+    *value = (StrView) { entry->data + entry->name_len, entry->value_len };
+    return TRUE;
+}
+
+/* Decodes an integer with a prefix of bits in the first byte (RFC 7541 5.1). */
+static bool decode_int(const uint8_t **p, const uint8_t *end, int bits, size_t *value) {
+    size_t max = ((size_t) 1 << bits) - 1;
+    size_t v = *(*p)++ & max;
+    if (v < max) {
+        *value = v;
+        return TRUE;
+    }
+    for (int shift = 0; *p < end && shift <= 28; shift += 7) {
+        uint8_t byte = *(*p)++;
+        v += (size_t) (byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            *value = v;
+            return TRUE;
+        }
+    }
+    // Cut short, or bigger than anything in a header block can be.
+    return FALSE;
+}
+
+/* Appends the Huffman decoding of buf[0 .. len) to out. */
+static bool huffman_decode(const uint8_t *buf, size_t len, GString *out) {
+    uint64_t bits = 0;
+    int count = 0;
+    size_t i = 0;
+    for (;;) {
+        while (count <= 56 && i < len) {
+            bits = (bits << 8) | buf[i++];
+            count += 8;
+        }
+        int n = 5;
+        uint32_t code = 0;
+        for (; n <= HUFFMAN_MAX_LEN && n <= count; n++) {
+            code = (uint32_t) (bits >> (count - n)) & ((1u << n) - 1);
+            if (code < huffman_limit[n]) {
+                break;
+            }
+        }
+        if (n > HUFFMAN_MAX_LEN || n > count) {
+            // The end: what is left has to be padding, up to 7 bits of the start of EOS (all ones).
+            return i == len && count <= 7 && (bits & ((1u << count) - 1)) == (1u << count) - 1;
+        }
+        uint16_t symbol = huffman_symbols[huffman_offset[n] + (code - huffman_first[n])];
+        if (symbol == HUFFMAN_EOS) {
+            return FALSE;
+        }
+        g_string_append_c(out, (char) symbol);
+        count -= n;
+    }
+}
+
+/* Decodes a string literal (RFC 7541 5.2). One that is not Huffman coded is left where it is,
+    with *at set to SIZE_MAX, otherwise it is appended to scratch and *at is where it starts. */
+static bool decode_string(const uint8_t **p, const uint8_t *end, GString *scratch, StrView *str, size_t *at) {
+    if (*p >= end) {
+        return FALSE;
+    }
+    bool huffman = (**p & 0x80) != 0;
+    size_t len;
+    if (!decode_int(p, end, 7, &len) || len > (size_t) (end - *p)) {
+        return FALSE;
+    }
+    if (huffman) {
+        *at = scratch->len;
+        if (!huffman_decode(*p, len, scratch)) {
+            return FALSE;
+        }
+        str->len = scratch->len - *at;
+    } else {
+        *at = SIZE_MAX;
+        *str = (StrView) { (const char *) *p, len };
+    }
+    *p += len;
+    return TRUE;
+}
+
+bool hpack_decode(HpackTable *table, const uint8_t *buf, size_t len, GString *scratch,
+                  HpackField field, void *data) {
+    const uint8_t *p = buf;
+    const uint8_t *end = buf + len;
+    bool first = TRUE;
+    while (p < end) {
+        uint8_t byte = *p;
+        StrView name, value;
+        size_t index;
+        if (byte & 0x80) {
+            // Indexed field.
+            if (!decode_int(&p, end, 7, &index) || !table_field(table, index, &name, &value)) {
+                return FALSE;
+            }
+            field(data, name, value);
+            first = FALSE;
+            continue;
+        }
+        if ((byte & 0xe0) == 0x20) {
+            // Dynamic table size update, only allowed before the first field.
+            size_t size;
+            if (!first || !decode_int(&p, end, 5, &size) || size > table->limit) {
+                return FALSE;
+            }
+            table->max_size = size;
+            table_evict(table, 0);
+            continue;
+        }
+        // A literal: with incremental indexing (01), without indexing (0000) or never indexed (0001).
+        bool add = (byte & 0xc0) == 0x40;
+        if (!decode_int(&p, end, add ? 6 : 4, &index)) {
+            return FALSE;
+        }
+        g_string_truncate(scratch, 0);
+        size_t name_at = SIZE_MAX, value_at;
+        if (index > 0) {
+            StrView ignored;
+            if (!table_field(table, index, &name, &ignored)) {
+                return FALSE;
+            }
+        } else if (!decode_string(&p, end, scratch, &name, &name_at)) {
+            return FALSE;
+        }
+        if (!decode_string(&p, end, scratch, &value, &value_at)) {
+            return FALSE;
+        }
+        // Decoded strings point into scratch only now that it no longer grows.
+        if (name_at != SIZE_MAX) {
+            name.str = scratch->str + name_at;
+        }
+        if (value_at != SIZE_MAX) {
+            value.str = scratch->str + value_at;
+        }
+        field(data, name, value);
+        if (add) {
+            table_add(table, name, value);
+        }
+        first = FALSE;
+    }
+    return TRUE;
+}
+
+void hpack_encoder_resize(HpackTable *table, size_t size) {
+    if (size > table->limit) {
+        size = table->limit;
+    }
+    if (size == table->max_size) {
+        return;
+    }
+    if (!table->size_changed || size < table->smallest) {
+        table->smallest = size;
+    }
+    table->size_changed = TRUE;
+    table->max_size = size;
+    table_evict(table, 0);
+}
+
+/* Appends an integer with a prefix of bits, the bits above them in the first byte are flags. */
+static void encode_int(GString *out, uint8_t flags, int bits, size_t value) {
+    size_t max = ((size_t) 1 << bits) - 1;
+    if (value < max) {
+        g_string_append_c(out, (char) (flags | value));
+        return;
+    }
+    g_string_append_c(out, (char) (flags | max));
+    value -= max;
+    while (value >= 0x80) {
+        g_string_append_c(out, (char) (0x80 | (value & 0x7f)));
+        value >>= 7;
+    }
+    g_string_append_c(out, (char) value);
+}
+
+static void encode_string(GString *out, StrView str) {
+    size_t bits = 0;
+    for (size_t i = 0; i < str.len; i++) {
+        bits += huffman_lens[(uint8_t) str.str[i]];
+    }
+    size_t huffman_len = (bits + 7) / 8;
+    if (huffman_len >= str.len) {
+        encode_int(out, 0x00, 7, str.len);
+        g_string_append_len(out, str.str, (gssize) str.len);
+        return;
+    }
+    encode_int(out, 0x80, 7, huffman_len);
+    uint64_t acc = 0;
+    int count = 0;
+    for (size_t i = 0; i < str.len; i++) {
+        uint8_t c = (uint8_t) str.str[i];
+        acc = (acc << huffman_lens[c]) | huffman_codes[c];
+        count += huffman_lens[c];
+        while (count >= 8) {
+            count -= 8;
+            g_string_append_c(out, (char) (acc >> count));
+        }
+    }
+    if (count > 0) {
+        // Padded with the first bits of EOS, which are all ones.
+        g_string_append_c(out, (char) ((acc << (8 - count)) | (0xff >> count)));
+    }
+}
+
+void hpack_encode_start(HpackTable *table, GString *out) {
+    if (table->size_changed) {
+        if (table->smallest < table->max_size) {
+            encode_int(out, 0x20, 5, table->smallest);
+        }
+        encode_int(out, 0x20, 5, table->max_size);
+        table->size_changed = FALSE;
+    }
+}
+
+static bool view_is(StrView view, const char *str, size_t len) {
+    return view.len == len && memcmp(view.str, str, len) == 0;
+}
+
+void hpack_encode(HpackTable *table, GString *out, StrView name, StrView value, bool index) {
+    size_t name_index = 0;
+    for (int i = 0; i < STATIC_COUNT; i++) {
+        if (view_is(name, static_table[i].name, static_name_len[i])) {
+            if (view_is(value, static_table[i].value, static_value_len[i])) {
+                encode_int(out, 0x80, 7, (size_t) i + 1);
+                return;
+            }
+            if (name_index == 0) {
+                name_index = (size_t) i + 1;
+            }
+        }
+    }
+    for (size_t i = 0; i < table->count; i++) {
+        HpackEntry *entry = table_get(table, i);
+        if (view_is(name, entry->data, entry->name_len)) {
+            if (view_is(value, entry->data + entry->name_len, entry->value_len)) {
+                encode_int(out, 0x80, 7, STATIC_COUNT + 1 + i);
+                return;
+            }
+            if (name_index == 0) {
+                name_index = STATIC_COUNT + 1 + i;
+            }
+        }
+    }
+    encode_int(out, index ? 0x40 : 0x00, index ? 6 : 4, name_index);
+    if (name_index == 0) {
+        encode_string(out, name);
+    }
+    encode_string(out, value);
+    if (index) {
+        table_add(table, name, value);
+    }
+}
@@ -0,0 +1,73 @@
+/*
+ * hpack.h
+ *
+ * HPACK (RFC 7541), the header compression of HTTP/2. Each direction of a
+ * connection has a dynamic table of the fields sent last, which a header
+ * block refers to by index, so a field that repeats from one message to the
+ * next costs a byte or two. Strings may be Huffman coded with the fixed code
+ * of the RFC. The decoder takes anything a peer may send; the encoder indexes
+ * what it is told to and Huffman codes a string whenever that is shorter.
+ */
+
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <glib.h>
+
+#include "request.h"
+
+// The size of a dynamic table until SETTINGS_HEADER_TABLE_SIZE says otherwise, and the most we use.
+#define HPACK_TABLE_SIZE 4096
+
+typedef struct HpackEntry HpackEntry;
+
+typedef struct {
+    // A ring of the entries, newest first: dynamic index 62 + i is entries[(first + i) % capacity].
+    HpackEntry **entries;
+    size_t capacity;
+    size_t first;
+    size_t count;
+    // What the entries take up (name, value and 32 bytes each), the most they may take now
+    // and the most a size update may set.
+    size_t size;
+    size_t max_size;
+    size_t limit;
+    // Encoder only: max_size changed, the next block has to say so. If it went through a smaller
+    // size on the way, smallest, the peer has to be told about that first.
+    bool size_changed;
+    size_t smallest;
+} HpackTable;
+
+/* Builds the Huffman decoding tables. Call once, before any worker starts. */
+void hpack_init(void);
+
+/* An empty table that may grow to limit bytes. */
+void hpack_table_init(HpackTable *table, size_t limit);
+
+void hpack_table_free(HpackTable *table);
+
+/* Called with every field of a decoded block, in order. The views are only valid during
+    the call. */
+typedef void (*HpackField)(void *data, StrView name, StrView value);
+
+/* Decodes the header block buf[0 .. len), scratch holds the Huffman decoded strings. Returns
+    FALSE on a compression error: the table is out of step with the peer's from then on and
+    the connection can not go on. */
+bool hpack_decode(HpackTable *table, const uint8_t *buf, size_t len, GString *scratch,
+                  HpackField field, void *data);
+
+/* Sets the most the encoder's table may take, what the peer allows (SETTINGS_HEADER_TABLE_SIZE)
+    capped at its limit. The next block starts with the size update that tells the peer. */
+void hpack_encoder_resize(HpackTable *table, size_t size);
+
+/* Starts a header block in out. */
+void hpack_encode_start(HpackTable *table, GString *out);
+
+/* Appends a field to the block in out: by index if the static or the dynamic table has it,
+    otherwise as a literal, which goes into the dynamic table if index. name has to be lowercase. */
+void hpack_encode(HpackTable *table, GString *out, StrView name, StrView value, bool index);
+
+#endif
@@ -0,0 +1,329 @@
+/*
+ * http_parser.c
+ *
+ * Byte driven state machine for the request head (RFC 7230 section 3).
+ * All positions are offsets from the start of the request in the buffer.
+ * The long runs of plain text, the request target and the header values,
+ * are skipped with SSE2 or AVX2 compares of 16 or 32 bytes at a time.
+ */
+
+#include <stdbool.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HTTP_SCAN_SIMD 1
+#endif
+
+#include "http_parser.h"
+
+enum {
+    S_START,
+    S_METHOD,
+    S_TARGET_START,
+    S_TARGET,
+    S_VERSION_START,
+    S_VERSION,
+    S_LINE_LF,
+    S_HEADER_START,
+    S_NAME,
+    S_VALUE_START,
+    S_VALUE,
+    S_HEADER_LF,
+    S_END_LF,
+    S_DONE,
+    S_ERROR
+};
+
+// tchar from RFC 7230: the characters allowed in methods and header names.
+static const unsigned char token_chars[256] = {
+    ['!'] = 1, ['#'] = 1, ['$'] = 1, ['%'] = 1, ['&'] = 1, ['\''] = 1,
+    ['*'] = 1, ['+'] = 1, ['-'] = 1, ['.'] = 1, ['^'] = 1, ['_'] = 1,
+    ['`'] = 1, ['|'] = 1, ['~'] = 1,
+    ['0' ... '9'] = 1, ['A' ... 'Z'] = 1, ['a' ... 'z'] = 1
+};
+
+static bool is_ctl(unsigned char c) {
+    return c < 0x20 || c == 0x7f;
+}
+
+static size_t scan_text_scalar(const char *p, size_t len, unsigned char stop) {
+    size_t i = 0;
+    while (i < len && !is_ctl((unsigned char) p[i]) && (unsigned char) p[i] != stop) {
+        i++;
+    }
+    return i;
+}
+
+#ifdef HTTP_SCAN_SIMD
+// Both scan whole vectors, the last one overlapping the one before it, so len must be at
+// least one vector. A byte hits if it is <= 0x1f (min(c, 0x1f) == c, compared without
+// sign), DEL or stop.
+
+static size_t scan_text_sse2(const char *p, size_t len, unsigned char stop) {
+    const __m128i ctl = _mm_set1_epi8(0x1f);
+    const __m128i del = _mm_set1_epi8(0x7f);
+    const __m128i end = _mm_set1_epi8((char) stop);
+    size_t i = 0;
+    while (true) {
+        // The bytes of the last vector that were scanned before are shifted out of the mask.
+        size_t skip = 0;
+        if (i + 16 > len) {
+            if (i == len) {
+                return len;
+            }
+            skip = i + 16 - len;
+            i = len - 16;
+        }
+        __m128i v = _mm_loadu_si128((const __m128i *) (p + i));
+        __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(v, ctl), v),
+                                   _mm_or_si128(_mm_cmpeq_epi8(v, del), _mm_cmpeq_epi8(v, end)));
+        unsigned mask = (unsigned) _mm_movemask_epi8(hit) >> skip;
+        if (mask != 0) {
+            return i + skip + (size_t) __builtin_ctz(mask);
+        }
+        i += 16;
+    }
+}
+
+__attribute__((target("avx2")))
+static size_t scan_text_avx2(const char *p, size_t len, unsigned char stop) {
+    const __m256i ctl = _mm256_set1_epi8(0x1f);
+    const __m256i del = _mm256_set1_epi8(0x7f);
+    const __m256i end = _mm256_set1_epi8((char) stop);
+    size_t i = 0;
+    while (true) {
+        size_t skip = 0;
+        if (i + 32 > len) {
+            if (i == len) {
+                return len;
+            }
+            skip = i + 32 - len;
+            i = len - 32;
+        }
+        __m256i v = _mm256_loadu_si256((const __m256i *) (p + i));
+        __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(v, ctl), v),
+                                      _mm256_or_si256(_mm256_cmpeq_epi8(v, del), _mm256_cmpeq_epi8(v, end)));
+        unsigned mask = (unsigned) _mm256_movemask_epi8(hit) >> skip;
+        if (mask != 0) {
+            return i + skip + (size_t) __builtin_ctz(mask);
+        }
+        i += 32;
+    }
+}
+#endif
+
+/* The number of bytes at p, at most len, before the first control character (CR and LF
+    among them), DEL or stop. */
+static size_t scan_text(const char *p, size_t len, unsigned char stop) {
+#ifdef HTTP_SCAN_SIMD
+    if (len >= 32 && __builtin_cpu_supports("avx2")) {
+        return scan_text_avx2(p, len, stop);
+    }
+    if (len >= 16) {
+        return scan_text_sse2(p, len, stop);
+    }
+#endif
+    return scan_text_scalar(p, len, stop);
+}
+
+void http_parser_init(HttpParser *parser, size_t max_header_size) {
+    parser->state = S_START;
+    parser->pos = 0;
+    parser->max_header_size = max_header_size;
+    parser->value_end = 0;
+    parser->nheaders = 0;
+    parser->header_end = 0;
+    parser->error_status = 0;
+}
+
+static HttpParseResult parse_error(HttpParser *parser, size_t pos, int status) {
+    parser->state = S_ERROR;
+    parser->pos = pos;
+    parser->error_status = status;
+    return HTTP_PARSE_ERROR;
+}
+
+HttpParseResult http_parser_execute(HttpParser *parser, const char *buf, size_t len) {
+    if (parser->state == S_DONE) {
+        return HTTP_PARSE_DONE;
+    }
+    if (parser->state == S_ERROR) {
+        return HTTP_PARSE_ERROR;
+    }
+
+    // Never look further than the header size limit allows.
+    size_t end = len < parser->max_header_size ? len : parser->max_header_size;
+    size_t i;
+
+    for (i = parser->pos; i < end; i++) {
+        unsigned char c = (unsigned char) buf[i];
+
+        switch (parser->state) {
+        case S_START:
+            // Robustness: ignore empty lines before the request line.
+            if (c == '\r' || c == '\n') {
+                break;
+            }
+            if (!token_chars[c]) {
+                return parse_error(parser, i, 400);
+            }
+            parser->method.off = (uint32_t) i;
+            parser->state = S_METHOD;
+            break;
+
+        case S_METHOD:
+            if (c == ' ') {
+                parser->method.len = (uint32_t) (i - parser->method.off);
+                parser->state = S_TARGET_START;
+            }
+            else if (!token_chars[c]) {
+                return parse_error(parser, i, 400);
+            }
+            break;
+
+        case S_TARGET_START:
+            if (c == ' ' || is_ctl(c)) {
+                return parse_error(parser, i, 400);
+            }
+            parser->target.off = (uint32_t) i;
+            parser->state = S_TARGET;
+            break;
+
+        case S_TARGET: {
+            // Everything up to the space (or a control character) in one go.
+            size_t run = scan_text(buf + i, end - i, ' ');
+            if (run > 0) {
+                i += run - 1;
+                break;
+            }
+            if (c == ' ') {
+                parser->target.len = (uint32_t) (i - parser->target.off);
+                parser->state = S_VERSION_START;
+            }
+            else if (is_ctl(c)) {
+                return parse_error(parser, i, 400);
+            }
+            break;
+        }
+
+        case S_VERSION_START:
+            parser->version.off = (uint32_t) i;
+            parser->state = S_VERSION;
+            /* fall through */
+        case S_VERSION:
+            if (c == '\r' || c == '\n') {
+                parser->version.len = (uint32_t) (i - parser->version.off);
+                parser->state = c == '\r' ? S_LINE_LF : S_HEADER_START;
+            }
+            else if (is_ctl(c) || c == ' ') {
+                return parse_error(parser, i, 400);
+            }
+            break;
+
+        case S_LINE_LF:
+        case S_HEADER_LF:
+            if (c != '\n') {
+                return parse_error(parser, i, 400);
+            }
+            parser->state = S_HEADER_START;
+            break;
+
+        case S_HEADER_START:
+            if (c == '\r') {
+                parser->state = S_END_LF;
+                break;
+            }
+            if (c == '\n') {
+                // A bare LF also ends the head.
+                parser->header_end = i + 1;
+                parser->pos = i + 1;
+                parser->state = S_DONE;
+                return HTTP_PARSE_DONE;
+            }
+            if (!token_chars[c]) {
+                return parse_error(parser, i, 400);
+            }
+            if (parser->nheaders == HTTP_MAX_HEADERS) {
+                return parse_error(parser, i, 431);
+            }
+            parser->headers[parser->nheaders].name.off = (uint32_t) i;
+            parser->state = S_NAME;
+            break;
+
+        case S_NAME: {
+            // Names are short, a tight loop over them beats a trip through the switch per byte.
+            size_t j = i;
+            while (j < end && token_chars[(unsigned char) buf[j]]) {
+                j++;
+            }
+            if (j > i) {
+                i = j - 1;
+                break;
+            }
+            if (c == ':') {
+                HttpHeader *header = &parser->headers[parser->nheaders];
+                header->name.len = (uint32_t) (i - header->name.off);
+                parser->state = S_VALUE_START;
+            }
+            else {
+                return parse_error(parser, i, 400);
+            }
+            break;
+        }
+
+        case S_VALUE_START:
+            // Skip the optional whitespace before the value.
+            if (c == ' ' || c == '\t') {
+                break;
+            }
+            parser->headers[parser->nheaders].value.off = (uint32_t) i;
+            parser->value_end = i;
+            parser->state = S_VALUE;
+            /* fall through */
+        case S_VALUE: {
+            // Skip to the end of the line in one go, minding where the last non-space was.
+            size_t run = scan_text(buf + i, end - i, 0);
+            if (run > 0) {
+                size_t last = i + run;
+                while (last > i && buf[last - 1] == ' ') {
+                    last--;
+                }
+                if (last > i) {
+                    parser->value_end = last;
+                }
+                i += run - 1;
+                break;
+            }
+            if (c == '\r' || c == '\n') {
+                // Trailing whitespace is not part of the value.
+                HttpHeader *header = &parser->headers[parser->nheaders];
+                header->value.len = (uint32_t) (parser->value_end - header->value.off);
+                parser->nheaders++;
+                parser->state = c == '\r' ? S_HEADER_LF : S_HEADER_START;
+            }
+            else if (c != ' ' && c != '\t') {
+                if (is_ctl(c)) {
+                    return parse_error(parser, i, 400);
+                }
+                parser->value_end = i + 1;
+            }
+            break;
+        }
+
+        case S_END_LF:
+            if (c != '\n') {
+                return parse_error(parser, i, 400);
+            }
+            parser->header_end = i + 1;
+            parser->pos = i + 1;
+            parser->state = S_DONE;
+            return HTTP_PARSE_DONE;
+        }
+    }
+
+    parser->pos = i;
+    if (len >= parser->max_header_size) {
+        return parse_error(parser, i, 431);
+    }
+    return HTTP_PARSE_INCOMPLETE;
+}
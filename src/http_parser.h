@@ -0,0 +1,63 @@
+/*
+ * http_parser.h
+ *
+ * Resumable HTTP/1.x request head parser. It walks the connection's receive
+ * buffer once and records the request line and every header as (offset,
+ * length) slices of that buffer, so nothing is copied or allocated. When a
+ * read only delivers part of the head, call http_parser_execute() again
+ * with the grown buffer and it continues where it stopped.
+ */
+
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HTTP_MAX_HEADERS 64
+#define HTTP_DEFAULT_MAX_HEADER_SIZE 8192
+
+typedef enum {
+    HTTP_PARSE_INCOMPLETE,
+    HTTP_PARSE_DONE,
+    HTTP_PARSE_ERROR
+} HttpParseResult;
+
+/* A piece of the receive buffer. Offsets survive the buffer being reallocated. */
+typedef struct {
+    uint32_t off;
+    uint32_t len;
+} HttpSlice;
+
+typedef struct {
+    HttpSlice name;
+    HttpSlice value;
+} HttpHeader;
+
+typedef struct {
+    int state;
+    size_t pos;
+    size_t max_header_size;
+    size_t value_end;
+
+    HttpSlice method;
+    HttpSlice target;
+    HttpSlice version;
+    HttpHeader headers[HTTP_MAX_HEADERS];
+    int nheaders;
+
+    // Offset of the first body byte, valid once the parser is done.
+    size_t header_end;
+    // 400 or 431, valid once the parser failed.
+    int error_status;
+} HttpParser;
+
+/* Prepares the parser for a new request. A request head (request line and
+    headers) larger than max_header_size bytes is rejected with 431. */
+void http_parser_init(HttpParser *parser, size_t max_header_size);
+
+/* Parses buf[parser->pos .. len). buf must start at the first byte of the
+    request and contain the bytes that were passed on previous calls. */
+HttpParseResult http_parser_execute(HttpParser *parser, const char *buf, size_t len);
+
+#endif
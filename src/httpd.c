@@ -24,643 +24,2368 @@
 
 #include <sys/socket.h>
 #include <sys/types.h>
-#include <sys/ioctl.h>
-#include <sys/poll.h>
+#include <fcntl.h>
 #include <sys/time.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <errno.h>
+#include <limits.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <ctype.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <glib.h>
 #include <regex.h>
 #include <arpa/inet.h>
+#include <sys/eventfd.h>
+
+#include "arena.h"
+#include "body.h"
+#include "cache.h"
+#include "compress.h"
+#include "event.h"
+#include "h2.h"
+#include "hpack.h"
+#include "log.h"
+#include "metrics.h"
+#include "output.h"
+#include "page.h"
+#include "proxy.h"
+#include "reply.h"
+#include "request.h"
+#include "response.h"
+#include "router.h"
+#include "static.h"
+#include "stream.h"
+#include "timer.h"
+#include "upgrade.h"
+#include "uring.h"
 
 /* ----- GLOBAL VARIABLES ----- */
-const ssize_t BUFFER_SIZE = 1024;
+const ssize_t BUFFER_SIZE = 4096;
 const int TIMEOUT = 30;
+const int MAX_EVENTS = 256;
+const unsigned TIMER_TICK_MS = 100;
+// How long an io_uring worker waits before accepting again when it ran out of descriptors or memory.
+const unsigned ACCEPT_RETRY_MS = 100;
+const size_t ARENA_CHUNK_SIZE = 8192;
+// Reading from a client stops while more than OUTPUT_HIGH_WATER bytes of responses are queued
+// for it, or INPUT_HIGH_WATER bytes of requests wait behind a response that is not out yet.
+// It starts again once the output queue is below OUTPUT_LOW_WATER.
+const size_t OUTPUT_HIGH_WATER = 256 * 1024;
+const size_t OUTPUT_LOW_WATER = 64 * 1024;
+const size_t INPUT_HIGH_WATER = 64 * 1024;
+// Submission queue entries and provided receive buffers (of BUFFER_SIZE bytes) of a worker's io_uring.
+const unsigned URING_ENTRIES = 1024;
+const unsigned URING_BUFFERS = 256;
+
+// Command line options
+gint opt_workers = 1;
+gboolean opt_pin_cpus = FALSE;
+gchar *opt_root = NULL;
+gint opt_cache_size = 32;
+gchar *opt_log_level = NULL;
+gint opt_log_flush_ms = 100;
+gchar *opt_log_full = NULL;
+gint opt_compress_level = 6;
+gint opt_compress_min_size = 1024;
+gboolean opt_io_uring = FALSE;
+gchar *opt_bind = NULL;
+gint opt_backlog = 4096;
+gint opt_accept_batch = 64;
+gint opt_defer_accept = 5;
+gint opt_body_buffer = 64;
+gint opt_max_body_size = 1024;
+gchar *opt_spool_dir = NULL;
+gchar **opt_proxy = NULL;
+gchar *opt_proxy_balance = NULL;
+gint opt_proxy_pool = 32;
+gint opt_max_connections = 0;
+gint opt_work_budget = 32;
+gint opt_turn_bytes = 256;
+gchar **opt_client_weight = NULL;
+gint opt_drain_timeout = 30;
+gint opt_shed_delay = 0;
+gint opt_retry_after = 1;
+gboolean opt_no_h2c = FALSE;
+gint opt_h2_streams = 100;
+gchar *opt_routes = NULL;
+
+// What answers which request, from --routes or from --root and --proxy.
+Router *router = NULL;
+// The number of proxy routes, the workers only keep upstream connections when there are any.
+int proxy_routes = 0;
+ProxyBalance proxy_balance = PROXY_ROUND_ROBIN;
+// Admission control, from the options: the connections a worker takes (0 for no limit), the requests
+// it answers and the bytes it reads per connection and turn, and the queue delay after which a request is shed.
+guint worker_max_connections = 0;
+int work_budget = INT_MAX;
+size_t turn_bytes = SIZE_MAX;
+uint64_t shed_delay_ns = 0;
+// What the HTTP/2 sessions of every worker run with.
+H2Config h2_config;
+
+/* A class of clients from --client-weight, whose turns are weight times as long. */
+typedef struct {
+    int family;
+    unsigned char addr[16];
+    int bits;
+    int weight;
+} ClientClass;
+
+ClientClass *client_classes = NULL;
+int client_class_count = 0;
+
+// The command line httpd was started with, which an upgrade starts again, and the listening
+// sockets this process took over from the one it upgraded (see upgrade.h).
+char **saved_argv = NULL;
+int *inherited_fds = NULL;
+int inherited_count = 0;
+// Becomes readable, for every worker at once, when the new process accepts and this one drains.
+int drain_fd = -1;
+// How long the old process waits for the new one to be ready.
+#define UPGRADE_TIMEOUT_MS 10000
+
+/* Everything a worker thread owns. Workers share nothing but the log file:
+    each has its own SO_REUSEPORT listening socket, event loop and connections. */
+typedef struct {
+    EventHandler listener;
+    int id;
+    int port;
+    int cpu;
+    bool running;
+    EventLoop *loop;
+    // Set instead of loop when the worker runs on io_uring.
+    Uring *ring;
+    UringOp accept_op;
+    // Starts the multishot accept again after it failed for lack of descriptors or memory.
+    Timer accept_timer;
+    TimerWheel *timers;
+    GHashTable *connections;
+    FileCache *cache;
+    Compressor compressor;
+    // Only written by this worker, read by whichever worker serves METRICS_PATH.
+    Metrics metrics;
+    // The upstream connections, NULL without --proxy. On io_uring they have an epoll
+    // instance of their own in loop, which the ring polls with upstream_op.
+    Proxy *proxy;
+    UringOp upstream_op;
+    // Connections that used up their turn with work left, served round-robin between wakeups.
+    GQueue ready;
+    // Set once the process upgraded: the worker no longer accepts and stops when its connections
+    // are closed, or at drain_deadline_ms at the latest. drain wakes it up on epoll, drain_op on io_uring.
+    EventHandler drain;
+    UringOp drain_op;
+    bool draining;
+    uint64_t drain_deadline_ms;
+    GThread *thread;
+} Worker;
+
+// All opt_workers workers, for the metrics page.
+Worker *workers = NULL;
+
+/* A response that is queued but not completely sent yet. Allocated from the connection's arena. */
+typedef struct PendingResponse PendingResponse;
+
+struct PendingResponse {
+    PendingResponse *next;
+    // Where the response ends in the connection's output, counted in bytes since it was opened.
+    uint64_t end;
+    uint64_t received_ns;
+};
 
-FILE *logfile = NULL;
-int sockfd;
-int r, i, j, len;
-struct sockaddr_in server, client;
-struct pollfd fds[200];
-int nfds = 1;
-int new_sd = -1;
-int current_size = 0;
-bool close_conn = FALSE;
-bool compress_array = FALSE;
-char poll_buffer[80];
+typedef struct {
+    EventHandler handler;
+    Worker *worker;
+    struct sockaddr_storage addr;
+    char ip[INET6_ADDRSTRLEN];
+    uint16_t port;
+    bool close_conn;
+    Timer timer;
+    // Bytes received but not consumed yet, and how far the parser got into them.
+    GString *inbuf;
+    // Responses that have not been sent yet, as segments pointing into the arena,
+    // the file cache or files.
+    OutputQueue output;
+    // Set while the output queue is over the high-water mark and the socket is not read.
+    bool read_paused;
+    // The response whose body is being produced, requests behind it wait until it is done.
+    Stream *stream;
+    HttpParser parser;
+    // Request and response memory. Only reset once everything queued from it has been sent.
+    Arena arena;
+    // When the last read that brought in data finished, and that time for the request being answered.
+    // A request's total time runs from there until the last byte of its response is sent.
+    uint64_t received_ns;
+    uint64_t request_ns;
+    // With --shed-delay: when the kernel received the newest bytes in inbuf, on the same clock.
+    uint64_t arrived_ns;
+    // What is left of the current turn: requests to answer and bytes to read, see --work-budget
+    // and --turn-bytes. A connection that runs out with work left waits in the worker's ready
+    // queue, through ready_link, for its next turn.
+    int budget;
+    size_t turn_left;
+    int weight;
+    bool ready;
+    GList ready_link;
+    // Bytes sent so far, and the responses that are not out completely, oldest first.
+    uint64_t sent_total;
+    PendingResponse *pending;
+    PendingResponse **pending_tail;
+    // Set while the body of the request at the front of inbuf is taken in piece by piece,
+    // see take_body(). A POST body goes to the spool file.
+    bool body_pending;
+    BodyReader body;
+    BodySpool spool;
+    // A 100 Continue went out for the request at the front of inbuf.
+    bool continue_sent;
+    // The upstream exchange of a proxied request until its response stream takes it over.
+    ProxyConn *proxy;
+    // Set once the connection speaks HTTP/2: inbuf holds frames from then on, and the responses
+    // are produced by the streams of the session, see process_frames().
+    H2Session *h2;
+    // io_uring only: the operations in flight for this connection and the iovecs of the writev.
+    // A closed connection is freed once the kernel has given all of them back.
+    UringOp recv_op;
+    UringOp send_op;
+    UringOp poll_op;
+    int uring_pending;
+    bool recv_armed;
+    bool send_busy;
+    bool closed;
+    struct iovec *iov;
+} Connection;
+
+/* Creates a non-blocking TCP socket listening on port of address (NULL for every IPv6 and
+    IPv4 address). With reuseport every worker can bind its own socket to the same port. */
+int create_listener(const char *address, int port, bool reuseport);
+
+/* Builds the router: the hosts and routes of the --routes file, or one host for every request
+    with METRICS_PATH, the --proxy prefixes and below them files from --root or the echo page.
+    Returns FALSE if a route can not be set up. */
+bool router_init(void);
+
+/* RouterResolve of the --routes file: opens the directory of a static route, each one once
+    (roots maps the directories to their descriptors), or adds the upstreams of a proxy route. */
+bool resolve_route(void *roots, RouteTarget *target, const char *arg);
+
+/* Sets up the event loop and listening socket of a worker. */
+bool worker_init(Worker *worker, int id, int port);
+
+/* Sets up the upstream connections of a worker when there are proxy routes. */
+bool worker_proxy_init(Worker *worker);
+
+/* Runs the event loop of a worker until it stops. Used as the thread function. */
+gpointer worker_run(Worker *worker);
+
+/* Waits for SIGUSR2 and upgrades: starts httpd anew on the listening sockets and, once it
+    accepts, has every worker drain. Runs on a thread of its own, which SIGUSR2 is left to. */
+gpointer upgrade_thread(gpointer data);
+
+/* Stops accepting, closes the idle connections and has the others closed after their current
+    response. Called in every worker when the process upgraded. */
+void start_draining(Worker *worker);
+
+/* The drain_fd handlers of the epoll loop and io_uring. */
+void handle_drain(EventHandler *handler, uint32_t events);
+void uring_drain(UringOp *op, int res, uint32_t flags);
+
+/* TRUE if conn has nothing buffered, queued or in flight on our side. */
+bool connection_idle(Connection *conn);
+
+/* TRUE if a draining worker can close conn now: it is idle and no request of the client
+    is waiting to be read. With io_uring a pending recv is cancelled first, and conn closes
+    once that completes. */
+bool connection_drained(Connection *conn);
+
+/* Accepts the pending connections on the listening socket, at most opt_accept_batch per wakeup. */
+void accept_connections(EventHandler *handler, uint32_t events);
+
+/* Answers a connection the worker has no room for with response_overloaded() and closes it. */
+void shed_connection(Worker *worker, int fd);
+
+/* Sets up the Connection of a newly accepted socket and starts watching it.
+    Returns NULL if that failed, the socket is closed then. */
+Connection *add_connection(Worker *worker, int fd, const struct sockaddr *addr);
+
+/* Called by the event loop when a client connection becomes ready. */
+void handle_connection(EventHandler *handler, uint32_t events);
+
+/* Closes the socket of a connection and frees it.
+    Used as the value destroy function of the connections hash table. */
+void free_connection(Connection *conn);
+
+/* Frees the memory of a closed connection, once no io_uring operation refers to it any more. */
+void release_connection(Connection *conn);
+
+/* Parses a --client-weight "ADDRESS[/BITS]=WEIGHT" into client_classes. Returns FALSE if it is malformed. */
+bool add_client_class(const char *spec);
+
+/* The weight of the first client class addr belongs to, 1 if there is none. */
+int client_weight(const struct sockaddr *addr);
+
+/* Gives conn a fresh turn: --work-budget requests and --turn-bytes bytes, times its weight. */
+void start_turn(Connection *conn);
+
+/* Called at the end of a turn of conn. If it used up its turn with requests left in inbuf or
+    data left in the socket, nothing would wake it up for them, so it goes to the back of the
+    worker's ready queue. */
+void yield_connection(Connection *conn);
+
+/* Gives every connection that was in the ready queue its next turn, in order. One that
+    yields again goes to the back and waits for the next round. */
+void run_ready_queue(Worker *worker);
+
+/* Closes the connection if it is done: close_conn is set and its responses are out. */
+void finish_connection(Connection *conn);
+
+/* io_uring completion handlers, the counterparts of accept_connections() and handle_connection(). */
+void uring_accepted(UringOp *op, int res, uint32_t flags);
+void uring_received(UringOp *op, int res, uint32_t flags);
+void uring_sent(UringOp *op, int res, uint32_t flags);
+void uring_writable(UringOp *op, int res, uint32_t flags);
+void uring_upstreams(UringOp *op, int res, uint32_t flags);
 
-GHashTable *connections;
+/* TimerCallback of accept_timer: accepting on io_uring goes on. */
+void uring_accept_retry(Timer *timer);
 
-typedef struct {
-	GString *method;
-	GString *path;
-    GString *query;
-    GString *http_version;
-    GString *host;
-	GString *user_agent;
-	GString *content_type;
-    GString *content_length;
-    GString *accept;
-	GString *accept_language;
-	GString *accept_encoding;
-	GString *connection;
-    GString *msg_body;
-    GString *status_code;
-} Request;
-
-void array_compression(bool compress_array);
-void handle_timeout(int connfd, GTimer *timer);
-void serve_next_client(int connfd);
-
-/* Takes in a status code number ast str. 
-    and gets returned appropriate header status code. */
-char *get_status_code(char *status_code);
-
-/* Generates the response to send back. 
-    Header & body (when needed). */
-GString *generate_response(Request *request, GString *html);
-
-/* Generate the in memory html response */
-GString *generate_html(Request *request, char *ip, uint16_t port);
-
-/* Should be passed one line that contains 1 header field.
-    Header field name is extracted and it's content appended
-    appropriately in the request struct. */
-void parse_header(gchar *line, Request *request);
-
-/* Checks if the passed string includes a ?,
-    if so, the string(path) includes a query. */
-bool str_contains_query(const char* strv);
-
-/* Parse the request header and keep track of needed info in request struct. */
-bool fill_request(GString *message, Request *request);
-
-/* Initializes the request struct with NULL. */
-void init_request(Request *req);
-
-/* free's the strings inside the request struct. */
-void reset_request(Request *req);
-
-/* Writes to the logfile defined as global variable. */
+/* Finishes a send (sent bytes, or -errno) like EPOLLOUT would. */
+void uring_output_done(Connection *conn, int sent);
+
+/* Starts the next recv on an io_uring connection, unless reading is paused or it is closing. */
+void uring_read(Connection *conn);
+
+/* Sends the front of the output queue through io_uring. OUTPUT_AGAIN means a send is in flight. */
+OutputResult uring_send(Connection *conn, size_t *sent);
+
+/* Closes a connection that has been idle for TIMEOUT seconds. Called by the timer wheel. */
+void handle_timeout(Timer *timer);
+void serve_next_client(Connection *conn);
+
+/* recv() that also notes in conn->arrived_ns when the kernel received the data, for --shed-delay. */
+ssize_t recv_timestamped(Connection *conn, char *buf, size_t len);
+
+/* Reads everything available into conn->inbuf, or until reading_throttled().
+    Returns FALSE once the client closed its side of the connection or the read failed. */
+bool receive_requests(Connection *conn);
+
+/* TRUE while the client has so many responses (or requests) waiting that we should
+    not read more from it. */
+bool reading_throttled(Connection *conn);
+
+/* Answers the complete requests in conn->inbuf, in order, by adding the
+    responses to conn->output, until the queue reaches the high-water mark.
+    Leftover bytes stay in conn->inbuf. Returns TRUE if any response was queued. */
+bool process_requests(Connection *conn);
+
+/* process_requests() of an HTTP/2 connection: takes the frames in conn->inbuf and frames
+    the responses of the streams onto conn->output. */
+bool process_frames(Connection *conn);
+
+/* Sends as much of conn->output as the socket takes.
+    Returns TRUE when everything has been sent. */
+bool flush_output(Connection *conn);
+
+/* Queues more of the streamed response's body, and drops the stream once its end is queued.
+    Returns TRUE if anything was queued. */
+bool pump_stream(Connection *conn);
+
+/* Throws away everything queued and the stream, when the response can not be sent any more. */
+void drop_output(Connection *conn);
+
+/* Counts sent bytes that have left the output queue, and records the total time of the
+    responses that are out with them. */
+void output_sent(Connection *conn, size_t sent);
+
+/* Notes that the response to the request that arrived at received_ns ends with what is
+    queued now. */
+void response_queued(Connection *conn, uint64_t received_ns);
+
+/* Alternates between answering requests and sending the responses until
+    the socket is full or there is nothing left to do. */
+void respond(Connection *conn);
+
+/* Called for a request whose head is parsed but whose body is not all in the buffer. A request
+    that is going to fail is answered right away, a body of at most opt_body_buffer KB is waited
+    for in the buffer and a larger one is passed to conn->body as it arrives. Sends the 100
+    Continue the client may wait for. Returns TRUE once the request can be answered, with
+    message_length set to what it takes up of the buffer at offset. */
+bool take_body(Connection *conn, Request *request, size_t offset, bool *queued);
+
+/* Answers a complete request of conn into reply, whichever handler it goes to. head and parser
+    are what the request was parsed from, spool holds a body too big for memory (fd -1 if there
+    is none). start is when parsing finished. */
+void serve_request(Connection *conn, Reply *reply, Request *request, const char *head, const HttpParser *parser,
+                   BodySpool *spool, uint64_t start);
+
+/* H2Serve and H2Done of the HTTP/2 sessions, data is the Connection. */
+void serve_h2_request(void *data, H2Request *request);
+void finish_h2_request(void *data, H2Request *request);
+
+/* Queues the echo page of a POST whose body is in spool, which the page takes over. */
+void respond_spooled(Connection *conn, Reply *reply, Request *request, BodySpool *spool);
+
+/* Sends request, whose head starts at head, to an upstream of route.
+    Returns NULL if no upstream connection could be had. */
+ProxyConn *start_proxy(Connection *conn, Request *request, const char *head, const HttpParser *parser, int route);
+
+/* Answers a request from an upstream of route, streaming the response as it comes in. The
+    exchange take_body() started in conn->proxy is taken over, otherwise one is started.
+    A body in spool is sent after the head, the upstream connection takes the file over. */
+void proxy_response(Connection *conn, Reply *reply, Request *request, const char *head, const HttpParser *parser,
+                    BodySpool *spool, int route);
+
+/* ProxyWake: the upstream of conn has something for it, or took more of the request body. */
+void proxy_wake(void *client);
+
+/* Queues a response without a body that only carries status. */
+void respond_status(Reply *reply, Request *request, int status);
+
+/* Answers a GET or HEAD from the directory of a static route. The body of a small file is
+    queued straight from the worker's file cache, bigger ones as a file segment
+    that is sent with sendfile(). */
+void serve_file(Connection *conn, Reply *reply, Request *request, const RouteTarget *target);
+
+/* Answers a GET or HEAD of METRICS_PATH with the counters of all workers, in the Prometheus text format. */
+void serve_metrics(Reply *reply, Request *request);
+
+/* Answers with entry's file gzipped on the fly, as a chunked body (close-delimited for HTTP/1.0).
+    fd is the open file below root or -1, it is owned by the stream from here on. */
+void stream_file_gzip(Reply *reply, Request *request, int root, int fd, FileCacheEntry *entry,
+                      const char *last_modified, const char *vary);
+
+/* Queues the access log line for a request, the log writer thread writes it to httpd.log. */
 void write_to_log(Request *request, char *ip, uint16_t port);
 
+/* SIGUSR1 switches debug logging on and off. */
+void toggle_debug_log(int signum);
+
 int main(int argc, char **argv)
 {
+    GOptionEntry entries[] = {
+        { "workers", 'w', 0, G_OPTION_ARG_INT, &opt_workers,
+            "Number of worker threads, 0 for one per CPU (default 1)", "N" },
+        { "pin-cpus", 0, 0, G_OPTION_ARG_NONE, &opt_pin_cpus,
+            "Pin worker N to CPU N", NULL },
+        { "root", 'r', 0, G_OPTION_ARG_FILENAME, &opt_root,
+            "Serve GET and HEAD requests from files below DIR", "DIR" },
+        { "cache-size", 0, 0, G_OPTION_ARG_INT, &opt_cache_size,
+            "Megabytes of small files each worker keeps in memory, 0 to disable (default 32)", "MB" },
+        { "log-level", 0, 0, G_OPTION_ARG_STRING, &opt_log_level,
+            "error, warn, info or debug (default info), SIGUSR1 toggles debug", "LEVEL" },
+        { "log-flush-ms", 0, 0, G_OPTION_ARG_INT, &opt_log_flush_ms,
+            "How often the log is written out (default 100)", "MS" },
+        { "log-full", 0, 0, G_OPTION_ARG_STRING, &opt_log_full,
+            "drop (default) or block when the log can not keep up", "POLICY" },
+        { "compress-level", 0, 0, G_OPTION_ARG_INT, &opt_compress_level,
+            "gzip/deflate level 1-9, 0 turns compression off (default 6)", "N" },
+        { "compress-min-size", 0, 0, G_OPTION_ARG_INT, &opt_compress_min_size,
+            "Smaller bodies are sent uncompressed (default 1024)", "BYTES" },
+        { "io-uring", 0, 0, G_OPTION_ARG_NONE, &opt_io_uring,
+            "Use io_uring instead of epoll, if the kernel has it", NULL },
+        { "bind", 0, 0, G_OPTION_ARG_STRING, &opt_bind,
+            "Listen on this IPv4 or IPv6 address only (default every address, IPv6 and IPv4)", "ADDRESS" },
+        { "backlog", 0, 0, G_OPTION_ARG_INT, &opt_backlog,
+            "Length of the queue of connections waiting to be accepted (default 4096)", "N" },
+        { "accept-batch", 0, 0, G_OPTION_ARG_INT, &opt_accept_batch,
+            "Connections a worker accepts per wakeup before it serves the others (default 64)", "N" },
+        { "defer-accept", 0, 0, G_OPTION_ARG_INT, &opt_defer_accept,
+            "Hand over connections once the request arrives, waiting up to SECONDS, 0 to disable (default 5)",
+            "SECONDS" },
+        { "body-buffer", 0, 0, G_OPTION_ARG_INT, &opt_body_buffer,
+            "Request bodies up to KB are kept in memory, bigger ones go to a file (default 64)", "KB" },
+        { "max-body-size", 0, 0, G_OPTION_ARG_INT, &opt_max_body_size,
+            "Bigger request bodies are refused with 413 (default 1024)", "MB" },
+        { "spool-dir", 0, 0, G_OPTION_ARG_FILENAME, &opt_spool_dir,
+            "Directory for the files of big request bodies (default $TMPDIR or /tmp)", "DIR" },
+        { "proxy", 0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_proxy,
+            "Forward requests below PREFIX to the upstream servers, may be given more than once",
+            "PREFIX=HOST:PORT[,HOST:PORT...]" },
+        { "proxy-balance", 0, 0, G_OPTION_ARG_STRING, &opt_proxy_balance,
+            "round-robin (default) or least-conn", "POLICY" },
+        { "proxy-pool", 0, 0, G_OPTION_ARG_INT, &opt_proxy_pool,
+            "Idle connections each worker keeps per upstream, 0 to connect for every request (default 32)", "N" },
+        { "max-connections", 0, 0, G_OPTION_ARG_INT, &opt_max_connections,
+            "Connections over N get a 503 and are closed, 0 for no limit (default 0)", "N" },
+        { "work-budget", 0, 0, G_OPTION_ARG_INT, &opt_work_budget,
+            "Requests answered per connection before the others get a turn, 0 for no limit (default 32)", "N" },
+        { "turn-bytes", 0, 0, G_OPTION_ARG_INT, &opt_turn_bytes,
+            "KB read per connection before the others get a turn, 0 for no limit (default 256)", "KB" },
+        { "client-weight", 0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_client_weight,
+            "Clients from ADDRESS[/BITS] get WEIGHT times as long turns, may be repeated", "ADDRESS[/BITS]=WEIGHT" },
+        { "drain-timeout", 0, 0, G_OPTION_ARG_INT, &opt_drain_timeout,
+            "After SIGUSR2 started a new httpd, close the connections still open after SECONDS (default 30)", "SECONDS" },
+        { "shed-delay", 0, 0, G_OPTION_ARG_INT, &opt_shed_delay,
+            "Requests that waited longer than MS get a 503, 0 to never shed (default 0)", "MS" },
+        { "retry-after", 0, 0, G_OPTION_ARG_INT, &opt_retry_after,
+            "Seconds a shed client is told to wait before it tries again (default 1)", "SECONDS" },
+        { "no-h2c", 0, 0, G_OPTION_ARG_NONE, &opt_no_h2c,
+            "Speak HTTP/1.x only, neither HTTP/2 with prior knowledge nor an upgrade to it", NULL },
+        { "h2-streams", 0, 0, G_OPTION_ARG_INT, &opt_h2_streams,
+            "Requests an HTTP/2 client may have in progress at once (default 100)", "N" },
+        { "routes", 0, 0, G_OPTION_ARG_FILENAME, &opt_routes,
+            "Take the virtual hosts and their routes from FILE instead of --root and --proxy", "FILE" },
+        { NULL, 0, 0, 0, NULL, NULL, NULL }
+    };
+    // Parsing takes the options out of argv, an upgrade needs them all.
+    saved_argv = g_strdupv(argv);
+    GError *error = NULL;
+    GOptionContext *context = g_option_context_new("<port>");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        fprintf(stderr, "%s\n", error->message);
+        exit(EXIT_FAILURE);
+    }
+    g_option_context_free(context);
+
 	// Check if number of arguments are correct
-    if(argc != 2) {
-		fprintf(stderr, "Usage: %s <port>\n", argv[0]);
+    int level = opt_log_level != NULL ? log_level_from_name(opt_log_level) : LOG_LEVEL_INFO;
+    bool log_full_block = opt_log_full != NULL && strcmp(opt_log_full, "block") == 0;
+    bool log_full_valid = opt_log_full == NULL || log_full_block || strcmp(opt_log_full, "drop") == 0;
+    bool least_conn = opt_proxy_balance != NULL && strcmp(opt_proxy_balance, "least-conn") == 0;
+    bool balance_valid = opt_proxy_balance == NULL || least_conn || strcmp(opt_proxy_balance, "round-robin") == 0;
+    if(argc != 2 || opt_workers < 0 || opt_cache_size < 0 || level < 0 || opt_log_flush_ms <= 0 || !log_full_valid ||
+            opt_compress_level < 0 || opt_compress_level > 9 || opt_compress_min_size < 0 ||
+            opt_backlog < 1 || opt_accept_batch < 1 || opt_defer_accept < 0 || opt_body_buffer < 0 ||
+            opt_max_body_size < 0 || !balance_valid || opt_proxy_pool < 0 || opt_max_connections < 0 ||
+            opt_work_budget < 0 || opt_turn_bytes < 0 || opt_shed_delay < 0 || opt_retry_after < 0 ||
+            opt_drain_timeout < 0 || opt_h2_streams < 1 ||
+            (opt_routes != NULL && (opt_root != NULL || opt_proxy != NULL))) {
+		fprintf(stderr, "Usage: %s [OPTION...] <port>, see --help for the options\n", argv[0]);
 		exit(EXIT_FAILURE);
 	}
 
 	// Get the port number form command line
 	int port = atoi(argv[1]);
 
-	// Open the log file
-	logfile = fopen("httpd.log","a");
-	if (logfile == NULL) {
-		perror("Failed to open/create log file");
+    if (opt_workers == 0) {
+        opt_workers = g_get_num_processors();
+    }
+
+    if (opt_spool_dir == NULL) {
+        opt_spool_dir = g_strdup(g_get_tmp_dir());
+    }
+
+    // Upstream host names are resolved once, here, and the directories of static routes opened.
+    if (!router_init()) {
+        exit(EXIT_FAILURE);
+    }
+    proxy_balance = least_conn ? PROXY_LEAST_CONN : PROXY_ROUND_ROBIN;
+
+    // Every worker has its own connections, so each takes its share of the limit.
+    if (opt_max_connections > 0) {
+        worker_max_connections = (guint) ((opt_max_connections + opt_workers - 1) / opt_workers);
+    }
+    if (opt_work_budget > 0) {
+        work_budget = opt_work_budget;
+    }
+    if (opt_turn_bytes > 0) {
+        turn_bytes = (size_t) opt_turn_bytes * 1024;
+    }
+    for (int i = 0; opt_client_weight != NULL && opt_client_weight[i] != NULL; i++) {
+        if (!add_client_class(opt_client_weight[i])) {
+            fprintf(stderr, "Invalid --client-weight %s, expected ADDRESS[/BITS]=WEIGHT\n", opt_client_weight[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    shed_delay_ns = (uint64_t) opt_shed_delay * 1000000;
+    h2_config.max_streams = (uint32_t) opt_h2_streams;
+    h2_config.body_buffer = (size_t) opt_body_buffer * 1024;
+    h2_config.max_body = (size_t) opt_max_body_size * 1024 * 1024;
+    h2_config.spool_dir = opt_spool_dir;
+    h2_config.serve = serve_h2_request;
+    h2_config.done = finish_h2_request;
+
+    // Started by an upgrade, the workers take over the listening sockets of the old process.
+    inherited_count = upgrade_inherited(&inherited_fds);
+    if (inherited_count < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    // Status lines and fixed header fragments are built once, up front, and so are the Huffman tables.
+    response_init(TIMEOUT, opt_retry_after);
+    hpack_init();
+
+    // SIGUSR2 is only taken by upgrade_thread(), every other thread is started with it blocked.
+    sigset_t usr2;
+    sigemptyset(&usr2);
+    sigaddset(&usr2, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &usr2, NULL);
+
+	// Open the log file, it is written by a thread of its own.
+    log_set_level(level);
+    if (!log_open("httpd.log", (unsigned) opt_log_flush_ms, log_full_block ? LOG_FULL_BLOCK : LOG_FULL_DROP)) {
 		exit(EXIT_FAILURE);
 	}
+    signal(SIGUSR1, toggle_debug_log);
+    // writev() and sendfile() to a client that went away must fail with EPIPE, not kill us.
+    signal(SIGPIPE, SIG_IGN);
+    drain_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (drain_fd == -1) {
+        perror("eventfd");
+        exit(EXIT_FAILURE);
+    }
 
-    // Create and bind a TCP socket.
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    // Set every worker up before starting any of them, so bind errors are reported right away.
+    workers = g_new0(Worker, opt_workers);
+    for (int w = 0; w < opt_workers; w++) {
+        if (!worker_init(&workers[w], w, port)) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    // Closing a socket drops the connections in its backlog, so an upgrade should keep the
+    // number of workers.
+    for (int i = opt_workers; i < inherited_count; i++) {
+        log_warn("Closing inherited listening socket %d, there are only %d workers", inherited_fds[i], opt_workers);
+        close(inherited_fds[i]);
+    }
+	fprintf(stdout, "Listening on port %d with %d worker(s)...\n", port, opt_workers);
+    upgrade_ready();
+    g_thread_unref(g_thread_new("upgrade", upgrade_thread, NULL));
+
+    // The first worker runs on the main thread, the rest get a thread each.
+    for (int w = 1; w < opt_workers; w++) {
+        workers[w].thread = g_thread_new("worker", (GThreadFunc) worker_run, &workers[w]);
+    }
+    worker_run(&workers[0]);
+    for (int w = 1; w < opt_workers; w++) {
+        g_thread_join(workers[w].thread);
+    }
+
+    g_free(workers);
+    log_close();
+}
+
+void toggle_debug_log(int signum) {
+    (void) signum;
+    static int saved_level = LOG_LEVEL_INFO;
+    int level = atomic_load(&log_level);
+    if (level == LOG_LEVEL_DEBUG) {
+        log_set_level(saved_level);
+    }
+    else {
+        saved_level = level;
+        log_set_level(LOG_LEVEL_DEBUG);
+    }
+}
+
+bool router_init(void) {
+    router = router_new();
+    if (opt_routes != NULL) {
+        GHashTable *roots = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+        bool loaded = router_load(router, opt_routes, resolve_route, roots);
+        g_hash_table_destroy(roots);
+        return loaded && router_compile(router);
+    }
+
+    int host = router_add_host(router, "*");
+    RouteTarget target;
+    memset(&target, 0, sizeof(target));
+    target.root = -1;
+    target.proxy = -1;
+    target.type = ROUTE_METRICS;
+    router_add_route(router, host, "=" METRICS_PATH, &target);
+    bool proxy_all = FALSE;
+    for (int i = 0; opt_proxy != NULL && opt_proxy[i] != NULL; i++) {
+        const char *eq = strchr(opt_proxy[i], '=');
+        if (eq == NULL || opt_proxy[i][0] != '/') {
+            fprintf(stderr, "Proxy route %s: expected PREFIX=HOST:PORT[,HOST:PORT...]\n", opt_proxy[i]);
+            return FALSE;
+        }
+        target.type = ROUTE_PROXY;
+        target.proxy = proxy_add_route(eq + 1);
+        if (target.proxy < 0) {
+            return FALSE;
+        }
+        proxy_routes++;
+        proxy_all = proxy_all || eq == opt_proxy[i] + 1;
+        char *prefix = g_strndup(opt_proxy[i], (gsize) (eq - opt_proxy[i]));
+        router_add_route(router, host, prefix, &target);
+        g_free(prefix);
+    }
+    // A proxy for / takes everything the other routes do not.
+    if (proxy_all) {
+        return router_compile(router);
+    }
+    target.proxy = -1;
+    target.type = ROUTE_ECHO;
+    if (opt_root != NULL) {
+        target.type = ROUTE_STATIC;
+        target.root = static_open_root(opt_root);
+        if (target.root == -1) {
+            return FALSE;
+        }
+    }
+    router_add_route(router, host, "/", &target);
+    return router_compile(router);
+}
+
+bool resolve_route(void *roots, RouteTarget *target, const char *arg) {
+    if (target->type == ROUTE_PROXY) {
+        target->proxy = proxy_add_route(arg);
+        proxy_routes += target->proxy >= 0;
+        return target->proxy >= 0;
+    }
+    gpointer fd = g_hash_table_lookup(roots, arg);
+    if (fd == NULL) {
+        int root = static_open_root(arg);
+        if (root == -1) {
+            return FALSE;
+        }
+        fd = GINT_TO_POINTER(root + 1);
+        g_hash_table_insert(roots, g_strdup(arg), fd);
+    }
+    target->root = GPOINTER_TO_INT(fd) - 1;
+    return TRUE;
+}
+
+int create_listener(const char *address, int port, bool reuseport) {
+    struct sockaddr_storage server;
+    socklen_t server_len;
+
+    // Without an address we take IPv6 connections and, through mapped addresses, IPv4 ones
+    // on the same socket. A kernel without IPv6 gets an IPv4 socket.
+    memset(&server, 0, sizeof(server));
+    struct sockaddr_in6 *server6 = (struct sockaddr_in6 *) &server;
+    struct sockaddr_in *server4 = (struct sockaddr_in *) &server;
+    if (address == NULL || inet_pton(AF_INET6, address, &server6->sin6_addr) == 1) {
+        server6->sin6_family = AF_INET6;
+        server6->sin6_port = htons(port);
+        server_len = (socklen_t) sizeof(*server6);
+    }
+    else if (inet_pton(AF_INET, address, &server4->sin_addr) == 1) {
+        server4->sin_family = AF_INET;
+        server4->sin_port = htons(port);
+        server_len = (socklen_t) sizeof(*server4);
+    }
+    else {
+        fprintf(stderr, "Not an IPv4 or IPv6 address: %s\n", address);
+        return -1;
+    }
+
+    // Create a non-blocking TCP socket. Accepted sockets do not inherit this on Linux,
+    // accept4() asks for it for each of them.
+    int sockfd = socket(server.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sockfd == -1 && address == NULL && errno == EAFNOSUPPORT) {
+        memset(&server, 0, sizeof(server));
+        server4->sin_family = AF_INET;
+        server4->sin_addr.s_addr = htonl(INADDR_ANY);
+        server4->sin_port = htons(port);
+        server_len = (socklen_t) sizeof(*server4);
+        sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    }
     if (sockfd == -1) {
         perror("socket");
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
     int on = 1;
-    connections = g_hash_table_new_full(g_int_hash, g_int_equal, NULL, (GDestroyNotify) g_timer_destroy);
+    int off = 0;
 
     // Allow socket descriptor to be reuseable  
-    r = setsockopt(sockfd, SOL_SOCKET,  SO_REUSEADDR, (char *)&on, sizeof(on));
+    int r = setsockopt(sockfd, SOL_SOCKET,  SO_REUSEADDR, (char *)&on, sizeof(on));
     if (r < 0)
     {
         perror("setsockopt() failed");
         close(sockfd);
-        exit(-1);
+        return -1;
     }
 
-    // Set socket to be nonblocking. All of the sockets for the incoming connections 
-    // will also be nonblocking since they will inherit that state from the listening socket.
-    r = ioctl(sockfd, FIONBIO, (char *)&on);
-    if (r < 0)
-    {
-      perror("ioctl() failed");
-      close(sockfd);
-      exit(-1);
+    // Let the kernel spread incoming connections over one listening socket per worker.
+    if (reuseport) {
+        r = setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, (char *)&on, sizeof(on));
+        if (r < 0)
+        {
+            perror("setsockopt(SO_REUSEPORT) failed");
+            close(sockfd);
+            return -1;
+        }
     }
 
-    // Network functions need arguments in network byte order instead of
-    // host byte order. The macros htonl, htons convert the values.
-    memset(&server, 0, sizeof(server));
-    server.sin_family = AF_INET;
-    server.sin_addr.s_addr = htonl(INADDR_ANY);
-    server.sin_port = htons(port);
-    r = bind(sockfd, (struct sockaddr *) &server, (socklen_t) sizeof(server));
+    // Dual-stack, whatever the system default (net.ipv6.bindv6only) says.
+    if (server.ss_family == AF_INET6 && address == NULL &&
+            setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)) < 0) {
+        perror("setsockopt(IPV6_V6ONLY) failed");
+    }
+
+    // The kernel keeps a connection to itself until its first bytes arrive, so we are not
+    // woken up for clients that connect and then take their time, and the first recv() finds
+    // the request. Only an optimization, so a failure is not fatal.
+    if (opt_defer_accept > 0 &&
+            setsockopt(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &opt_defer_accept, sizeof(opt_defer_accept)) < 0) {
+        perror("setsockopt(TCP_DEFER_ACCEPT) failed");
+    }
+
+    // The kernel stamps what it receives, which tells how long a request waited before we read
+    // it. Set here, the accepted sockets inherit it and the first request is stamped as well.
+    if (shed_delay_ns > 0 && setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0) {
+        perror("setsockopt(SO_TIMESTAMPNS) failed");
+    }
+
+    r = bind(sockfd, (struct sockaddr *) &server, server_len);
     if (r == -1) {
         perror("bind");
         close(sockfd);
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
     // Before the server can accept messages, it has to listen to the
-    // welcome port. A backlog of one connection is allowed.
-    r = listen(sockfd, 32);
+    // welcome port. Up to opt_backlog connections wait to be accepted (the kernel caps
+    // it at net.core.somaxconn).
+    r = listen(sockfd, opt_backlog);
     if (r == -1) {
         perror("listen");
         close(sockfd);
-        exit(EXIT_FAILURE);
+        return -1;
 	}
-	fprintf(stdout, "Listening on port %d...\n", port);
-	
-    // Initialize the pollfd structure  
-    memset(fds, 0, sizeof(fds));
+    return sockfd;
+}
+
+bool worker_init(Worker *worker, int id, int port) {
+    worker->id = id;
+    worker->port = port;
+    worker->cpu = opt_pin_cpus ? id % (int) g_get_num_processors() : -1;
+    worker->running = TRUE;
 
-    // Set up the initial listening socket  
-    fds[0].fd = sockfd;
-    fds[0].events = POLLIN;
+    worker->listener.fd = id < inherited_count ? inherited_fds[id] : create_listener(opt_bind, port, opt_workers > 1);
+    if (worker->listener.fd == -1) {
+        return FALSE;
+    }
+    worker->listener.callback = accept_connections;
+
+    worker->timers = timer_wheel_new(TIMER_TICK_MS);
+    worker->cache = file_cache_new((size_t) opt_cache_size << 20);
+    compressor_init(&worker->compressor, opt_compress_level, (size_t) opt_compress_min_size);
+    metrics_init(&worker->metrics);
+    // The key points into the Connection itself, so the table only needs to free the value.
+    worker->connections = g_hash_table_new_full(g_int_hash, g_int_equal, NULL, (GDestroyNotify) free_connection);
+
+    if (opt_io_uring) {
+        worker->ring = uring_new(URING_ENTRIES, URING_BUFFERS, (unsigned) BUFFER_SIZE);
+        if (worker->ring != NULL) {
+            worker->accept_op.callback = uring_accepted;
+            timer_init(&worker->accept_timer, uring_accept_retry);
+            uring_accept_multishot(worker->ring, &worker->accept_op, worker->listener.fd);
+            worker->drain_op.callback = uring_drain;
+            uring_poll_in(worker->ring, &worker->drain_op, drain_fd);
+            return worker_proxy_init(worker);
+        }
+        log_warn("Worker %d: io_uring is not available (%s), using epoll", id, strerror(errno));
+    }
 
-    bool server_is_running = TRUE;
+    worker->loop = event_loop_new(MAX_EVENTS);
+    if (worker->loop == NULL) {
+        close(worker->listener.fd);
+        return FALSE;
+    }
+
+    // Set up the initial listening socket
+    worker->drain.fd = drain_fd;
+    worker->drain.callback = handle_drain;
+    if (event_loop_add(worker->loop, &worker->listener, EPOLLIN) == -1 ||
+            event_loop_add(worker->loop, &worker->drain, EPOLLIN) == -1) {
+        perror("epoll_ctl");
+        close(worker->listener.fd);
+        return FALSE;
+    }
+    return worker_proxy_init(worker);
+}
 
-    while (server_is_running) {
+bool worker_proxy_init(Worker *worker) {
+    if (proxy_routes == 0) {
+        return TRUE;
+    }
+    if (worker->ring != NULL) {
+        worker->loop = event_loop_new(MAX_EVENTS);
+        if (worker->loop == NULL) {
+            return FALSE;
+        }
+        worker->upstream_op.callback = uring_upstreams;
+        uring_poll_in(worker->ring, &worker->upstream_op, event_loop_fd(worker->loop));
+    }
+    worker->proxy = proxy_new(worker->loop, &worker->metrics, proxy_balance, opt_proxy_pool, proxy_wake);
+    return TRUE;
+}
 
-        printf("\n###########################################################\n");
+gpointer worker_run(Worker *worker) {
+    if (worker->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(worker->cpu, &cpus);
+        int r = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (r != 0) {
+            fprintf(stderr, "Worker %d: could not pin to CPU %d: %s\n", worker->id, worker->cpu, strerror(r));
+        }
+    }
 
-        printf("Waiting on poll()...\n");
-        r = poll(fds, nfds, 1000*60);
-        // Check if poll() failed
+    while (worker->running) {
+        log_debug("Worker %d waiting on epoll_wait()...", worker->id);
+        // Sleep until the next keep-alive deadline, or forever if there is none. Connections waiting
+        // for their turn only let new events in first.
+        uint64_t now = timer_now_ms();
+        int timeout = worker->ready.head != NULL ? 0 : timer_wheel_next_timeout(worker->timers, now);
+        if (worker->draining && (timeout < 0 || now + (uint64_t) timeout > worker->drain_deadline_ms)) {
+            timeout = worker->drain_deadline_ms > now ? (int) (worker->drain_deadline_ms - now) : 0;
+        }
+        // Dispatches only the descriptors that are ready (or the completed operations), the handlers do the rest.
+        int r = worker->ring != NULL ? uring_wait(worker->ring, timeout) : event_loop_wait(worker->loop, timeout);
+        // Check if epoll_wait() failed
         if (r < 0) {
-            perror("  poll() failed. Stopping server.");
+            perror("  epoll_wait() failed. Stopping worker.");
             break;
         }
-        // Check if poll() timed out
+        // Check if epoll_wait() timed out
         if (r == 0) {
-            printf("  poll() timed out, retrying...\n");
+            log_debug("Worker %d: epoll_wait() timed out, checking for idle connections...", worker->id);
+        }
+
+        // Only the connections whose deadline has passed are visited.
+        timer_wheel_advance(worker->timers, timer_now_ms());
+
+        run_ready_queue(worker);
+
+        // Draining ends once the last connection is closed, or when its time is up.
+        if (worker->draining && (g_hash_table_size(worker->connections) == 0 ||
+                                 timer_now_ms() >= worker->drain_deadline_ms)) {
+            log_info("Worker %d: drained, %u connection(s) left", worker->id, g_hash_table_size(worker->connections));
+            worker->running = FALSE;
+        }
+
+        // Upstream connections closed meanwhile, no event refers to them any more.
+        if (worker->proxy != NULL) {
+            proxy_collect(worker->proxy);
+        }
+    }   // End of worker running
+
+    // Closing the ring first gives every buffer back, so the connections can be freed right away.
+    uring_free(worker->ring);
+    worker->ring = NULL;
+
+    // Clean up all of the sockets that are open
+    g_hash_table_destroy(worker->connections);
+    if (worker->proxy != NULL) {
+        proxy_free(worker->proxy);
+    }
+    timer_wheel_free(worker->timers);
+    log_info("Worker %d file cache: %" G_GUINT64_FORMAT " hits, %" G_GUINT64_FORMAT " misses, %"
+             G_GUINT64_FORMAT " evictions", worker->id, worker->cache->hits, worker->cache->misses,
+           worker->cache->evictions);
+    file_cache_free(worker->cache);
+    compressor_destroy(&worker->compressor);
+    event_loop_free(worker->loop);
+    if (worker->listener.fd >= 0) {
+        close(worker->listener.fd);
+    }
+    return NULL;
+}
+
+gpointer upgrade_thread(gpointer data) {
+    (void) data;
+    sigset_t usr2;
+    sigemptyset(&usr2);
+    sigaddset(&usr2, SIGUSR2);
+    int *fds = g_new(int, opt_workers);
+    for (int w = 0; w < opt_workers; w++) {
+        fds[w] = workers[w].listener.fd;
+    }
+    while (TRUE) {
+        int signum;
+        if (sigwait(&usr2, &signum) != 0) {
             continue;
         }
+        log_info("SIGUSR2: upgrading to %s", saved_argv[0]);
+        if (upgrade_exec(saved_argv, fds, opt_workers, UPGRADE_TIMEOUT_MS)) {
+            break;
+        }
+    }
+    g_free(fds);
+    // The counter stays non-zero, so every worker sees drain_fd readable once.
+    uint64_t one = 1;
+    if (write(drain_fd, &one, sizeof(one)) != sizeof(one)) {
+        perror("write(drain_fd)");
+    }
+    return NULL;
+}
+
+void handle_drain(EventHandler *handler, uint32_t events) {
+    (void) events;
+    start_draining((Worker *) ((char *) handler - offsetof(Worker, drain)));
+}
+
+void uring_drain(UringOp *op, int res, uint32_t flags) {
+    (void) flags;
+    if (res >= 0) {
+        start_draining((Worker *) ((char *) op - offsetof(Worker, drain_op)));
+    }
+}
+
+static gboolean close_if_idle(gpointer key, gpointer value, gpointer data) {
+    (void) key;
+    (void) data;
+    return connection_drained(value);
+}
+
+void start_draining(Worker *worker) {
+    if (worker->draining) {
+        return;
+    }
+    worker->draining = TRUE;
+    worker->drain_deadline_ms = timer_now_ms() + (uint64_t) opt_drain_timeout * 1000;
+    // The new process has the same sockets, what is in their backlogs waits for it.
+    if (worker->ring != NULL) {
+        uring_cancel(worker->ring, &worker->accept_op);
+        timer_cancel(worker->timers, &worker->accept_timer);
+    }
+    else {
+        event_loop_remove(worker->loop, &worker->listener);
+    }
+    close(worker->listener.fd);
+    worker->listener.fd = -1;
+    // An idle keep-alive connection is closed now, the client opens its next one to the new process.
+    guint closed = g_hash_table_foreach_remove(worker->connections, close_if_idle, NULL);
+    log_info("Worker %d: draining, closed %u idle connection(s), %u left", worker->id, closed,
+             g_hash_table_size(worker->connections));
+}
+
+bool connection_idle(Connection *conn) {
+    return conn->inbuf->len == 0 && output_empty(&conn->output) && conn->stream == NULL && conn->proxy == NULL &&
+        !conn->body_pending && !conn->close_conn && (conn->h2 == NULL || h2_idle(conn->h2));
+}
+
+bool connection_drained(Connection *conn) {
+    if (!connection_idle(conn)) {
+        return FALSE;
+    }
+    // The client may have sent its next request already. A recv in flight is cancelled instead,
+    // its completion brings either the request, which is answered, or -ECANCELED and the close.
+    if (conn->recv_armed) {
+        uring_cancel(conn->worker->ring, &conn->recv_op);
+        return FALSE;
+    }
+    char byte;
+    return conn->worker->ring != NULL || recv(conn->handler.fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) <= 0;
+}
 
-        // One or more descriptors are readable. Need to determine which ones they are. 
-        current_size = nfds;
-        for (i = 0; i < current_size; i++) {
-            // Loop through to find the descriptors that returned POLLIN and determine whether 
-            // it's the listening or the active connection.
-            if(fds[i].revents == 0) {
+void accept_connections(EventHandler *handler, uint32_t events) {
+    Worker *worker = (Worker *) handler;
+
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        log_error("Worker %d: events = %u on listening socket", worker->id, events);
+        worker->running = FALSE;
+        return;
+    }
+
+    // Listening descriptor is readable.
+    log_debug("Worker %d: listening socket is readable", worker->id);
+
+    metrics_count(&worker->metrics.accept_wakeups, 1);
+
+    // Accept the incoming connections that are queued up on the listening socket, but at most
+    // opt_accept_batch of them, so a flood of new clients can not hold up the ones we have.
+    for (int accepted = 0; accepted < opt_accept_batch; accepted++) {
+        struct sockaddr_storage client;
+        socklen_t socklen = (socklen_t) sizeof(client);
+        uint64_t start = metrics_now_ns();
+        // Accept each incoming connection, already non-blocking. If accept fails with EWOULDBLOCK,
+        // then we have accepted all of them. Any other failure on accept will cause us to end the worker.
+        int new_sd = accept4(handler->fd, (struct sockaddr *) &client, &socklen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (new_sd < 0) {
+            if (errno == EINTR) {
+                accepted--;
                 continue;
             }
-
-            // If revents is not POLLIN, it's an unexpected result, log and end the server.
-            if(fds[i].revents != POLLIN) {
-                printf("  Error! revents = %d\n", fds[i].revents);
-                server_is_running = FALSE;
-                break;
+            // A client that gave up before we got to it is no reason to stop.
+            if (errno == ECONNABORTED) {
+                continue;
             }
-
-            // There is data to read
-            if (fds[i].fd == sockfd) {
-                // Listening descriptor is readable.
-                printf("  Listening socket is readable\n");
-
-                // Accept all incoming connections that are queued up on the listening socket 
-                // before we loop back and call poll again.
-                do {
-                    socklen_t socklen = (socklen_t) sizeof(client);
-                    // Accept each incoming connection. If accept fails with EWOULDBLOCK, then we have 
-                    // accepted all of them. Any other failure on accept will cause us to end the server.
-                    new_sd = accept(sockfd, (struct sockaddr *) &client, &socklen);
-                    if (new_sd < 0) {
-                        // Check if we have accepted all of the connections
-                        if (errno != EWOULDBLOCK) {
-                            perror("  accept() failed");
-                            server_is_running = FALSE;
-                        }
-                        break;
-                    }
-                    
-                    printf("New connection from %s:%d on socket %d\n", 
-                        inet_ntoa(client.sin_addr), 
-                        ntohs(client.sin_port), 
-                        new_sd);
-                    
-
-                    // Add the new incoming connection to the pollfd structure.
-                    fds[nfds].fd = new_sd;
-                    fds[nfds].events = POLLIN;
-                    // Add connection to hash table with timer
-                    g_hash_table_insert(connections, &fds[nfds].fd, g_timer_new());
-                    nfds++;
-                    // Loop back up and accept another incoming connection
-
-                } while (new_sd != -1);
+            // Out of descriptors or memory: the waiting clients stay queued until the next
+            // connection wakes us up, rather than us spinning on them.
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                perror("  accept() failed");
+                return;
             }
-                
-            // This is not the listening socket, therefore an existing connection must be readable.
-            else {
-                printf("  Descriptor %d is readable\n", fds[i].fd);
-                close_conn = FALSE;
+            // Check if we have accepted all of the connections
+            if (errno != EWOULDBLOCK && errno != EAGAIN) {
+                perror("  accept() failed");
+                worker->running = FALSE;
+            }
+            return;
+        }
+        if (worker_max_connections > 0 && g_hash_table_size(worker->connections) >= worker_max_connections) {
+            shed_connection(worker, new_sd);
+            continue;
+        }
+        Connection *conn = add_connection(worker, new_sd, (struct sockaddr *) &client);
+        metrics_phase(&worker->metrics, PHASE_ACCEPT, start);
 
-                // Receive all incoming data on this socket before we loop back and call poll again.
-                serve_next_client(fds[i].fd);
+        // With TCP_DEFER_ACCEPT the request is already here, so it is answered now instead of
+        // after another trip through epoll_wait().
+        if (conn != NULL && opt_defer_accept > 0) {
+            handle_connection(&conn->handler, EPOLLIN);
+        }
+    }
 
-                // If the close_conn flag was turned on, we need to clean up this active connection. 
-                // This clean up process includes removing the descriptor.
-                if (close_conn) {
-                    printf("CLOSING THE MOTHER F-ING CONNECTION YO\n");
-                    close(fds[i].fd);
-                    g_hash_table_remove(connections, &fds[i].fd);
-                    fds[i].fd = -1;
-                    compress_array = TRUE;
-                }
+    // The listening socket is edge-triggered, so the ones left behind would not wake us up
+    // again. Re-arming it makes epoll report it once more after this round.
+    event_loop_modify(worker->loop, &worker->listener, EPOLLIN);
+}
 
+void shed_connection(Worker *worker, int fd) {
+    // What the client sent already is read first: closing with unread data resets the
+    // connection, and the client might lose the 503 with it.
+    char discard[4096];
+    ssize_t n = recv(fd, discard, sizeof(discard), MSG_DONTWAIT);
+    (void) n;
+    StrView response = response_overloaded(FALSE);
+    n = send(fd, response.str, response.len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(fd);
+    metrics_count(&worker->metrics.shed_connections, 1);
+    metrics_status(&worker->metrics, 503);
+}
 
-            }  /* End of existing connection is readable             */
-        } /* End of loop through pollable descriptors              */
+Connection *add_connection(Worker *worker, int fd, const struct sockaddr *addr) {
+    Connection *conn = g_new0(Connection, 1);
+    conn->handler.fd = fd;
+    conn->handler.callback = handle_connection;
+    conn->worker = worker;
+    timer_init(&conn->timer, handle_timeout);
+    conn->inbuf = g_string_sized_new(BUFFER_SIZE);
+    output_init(&conn->output);
+    conn->stream = NULL;
+    http_parser_init(&conn->parser, HTTP_DEFAULT_MAX_HEADER_SIZE);
+    arena_init(&conn->arena, ARENA_CHUNK_SIZE);
+    conn->pending_tail = &conn->pending;
+    conn->spool.fd = -1;
+    conn->ready_link.data = conn;
+    conn->weight = client_weight(addr);
+    start_turn(conn);
+    metrics_count(&worker->metrics.connections, 1);
+    // The peer address never changes, so it is formatted once here instead of per request.
+    // IPv4 clients of the dual-stack socket come as mapped IPv6 addresses and are shown as IPv4.
+    if (addr->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *addr6 = (const struct sockaddr_in6 *) addr;
+        memcpy(&conn->addr, addr6, sizeof(*addr6));
+        if (IN6_IS_ADDR_V4MAPPED(&addr6->sin6_addr)) {
+            inet_ntop(AF_INET, &addr6->sin6_addr.s6_addr[12], conn->ip, sizeof(conn->ip));
+        }
+        else {
+            inet_ntop(AF_INET6, &addr6->sin6_addr, conn->ip, sizeof(conn->ip));
+        }
+        conn->port = ntohs(addr6->sin6_port);
+    }
+    else {
+        const struct sockaddr_in *addr4 = (const struct sockaddr_in *) addr;
+        memcpy(&conn->addr, addr4, sizeof(*addr4));
+        inet_ntop(AF_INET, &addr4->sin_addr, conn->ip, sizeof(conn->ip));
+        conn->port = ntohs(addr4->sin_port);
+    }
 
-        // If the compress_array flag was turned on, we need to squeeze together the array and decrement 
-        // the number of file descriptors. We do not need to move back the events and revents fields 
-        // because the events will always be POLLIN in this case, and revents is output.
-        array_compression(compress_array);
+    // Responses are written whole with writev(), so there is nothing for Nagle's algorithm to
+    // gather, it would only hold back the last segment of a response. See output_flush() for TCP_CORK.
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
 
-        g_hash_table_foreach(connections, (GHFunc)handle_timeout, NULL);
+    log_debug("New connection from %s:%d on socket %d (worker %d)", conn->ip, conn->port, fd, worker->id);
 
-    }   // End of server running
+    if (worker->ring != NULL) {
+        conn->recv_op.callback = uring_received;
+        conn->send_op.callback = uring_sent;
+        conn->poll_op.callback = uring_writable;
+        conn->iov = g_new(struct iovec, OUTPUT_IOV_MAX);
+        uring_read(conn);
+    }
+    // Add the new incoming connection to the event loop, its user data points at the Connection.
+    // EPOLLOUT is edge-triggered too, so it only fires when a full socket buffer drains.
+    else if (event_loop_add(worker->loop, &conn->handler, EPOLLIN | EPOLLOUT | EPOLLRDHUP) == -1) {
+        perror("  epoll_ctl() failed");
+        free_connection(conn);
+        return NULL;
+    }
+    // Add connection to hash table and start its keep-alive timer
+    g_hash_table_insert(worker->connections, &conn->handler.fd, conn);
+    timer_arm(worker->timers, &conn->timer, timer_now_ms() + TIMEOUT * 1000);
+    return conn;
+}
 
-    // Clean up all of the sockets that are open
-    for (i = 0; i < nfds; i++) {
-        if(fds[i].fd >= 0)
-        close(fds[i].fd);
+void handle_connection(EventHandler *handler, uint32_t events) {
+    Connection *conn = (Connection *) handler;
+    log_debug("Descriptor %d is ready (events %#x)", handler->fd, events);
+    start_turn(conn);
+
+    // While reading is paused the data stays in the socket, which pushes back on the client.
+    if ((events & (EPOLLIN | EPOLLRDHUP)) && !conn->read_paused) {
+        // Receive all incoming data on this socket before we loop back and call epoll_wait again.
+        serve_next_client(conn);
+    }
+    if (events & EPOLLOUT) {
+        // The socket drained, send what the last batch could not and carry on with the next requests.
+        respond(conn);
+        // The socket is edge-triggered, so paused reads have to be picked up again by us.
+        if (conn->read_paused && conn->output.bytes < OUTPUT_LOW_WATER) {
+            serve_next_client(conn);
+        }
+    }
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        conn->close_conn = TRUE;
+        drop_output(conn);
     }
+
+    yield_connection(conn);
+    finish_connection(conn);
 }
 
-void serve_next_client(int connfd) {
+bool add_client_class(const char *spec) {
+    ClientClass class;
+    memset(&class, 0, sizeof(class));
+    gchar **parts = g_strsplit(spec, "=", 2);
+    gchar **address = g_strsplit(parts[0], "/", 2);
+    char *end = NULL;
+    bool ok = parts[1] != NULL;
+    if (ok) {
+        long weight = strtol(parts[1], &end, 10);
+        ok = *end == '\0' && weight >= 1 && weight <= 1000;
+        class.weight = (int) weight;
+    }
+    if (ok && inet_pton(AF_INET, address[0], class.addr) == 1) {
+        class.family = AF_INET;
+        class.bits = 32;
+    }
+    else if (ok && inet_pton(AF_INET6, address[0], class.addr) == 1) {
+        class.family = AF_INET6;
+        class.bits = 128;
+    }
+    else {
+        ok = FALSE;
+    }
+    if (ok && address[1] != NULL) {
+        long bits = strtol(address[1], &end, 10);
+        ok = *end == '\0' && bits >= 0 && bits <= class.bits;
+        class.bits = (int) bits;
+    }
+    if (ok) {
+        client_classes = g_renew(ClientClass, client_classes, client_class_count + 1);
+        client_classes[client_class_count++] = class;
+    }
+    g_strfreev(address);
+    g_strfreev(parts);
+    return ok;
+}
 
-    // Reset the timer of this client
-    g_hash_table_replace (connections, &connfd, g_timer_new());
+int client_weight(const struct sockaddr *addr) {
+    // IPv4 clients of the dual-stack socket come as mapped IPv6 addresses.
+    int family = addr->sa_family;
+    const unsigned char *bytes;
+    if (family == AF_INET6) {
+        const struct in6_addr *addr6 = &((const struct sockaddr_in6 *) addr)->sin6_addr;
+        bytes = addr6->s6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(addr6)) {
+            family = AF_INET;
+            bytes += 12;
+        }
+    }
+    else {
+        bytes = (const unsigned char *) &((const struct sockaddr_in *) addr)->sin_addr;
+    }
+    for (int i = 0; i < client_class_count; i++) {
+        const ClientClass *class = &client_classes[i];
+        if (class->family != family) {
+            continue;
+        }
+        int whole = class->bits / 8, rest = class->bits % 8;
+        if (memcmp(bytes, class->addr, (size_t) whole) == 0 &&
+                (rest == 0 || ((bytes[whole] ^ class->addr[whole]) & (0xff << (8 - rest))) == 0)) {
+            return class->weight;
+        }
+    }
+    return 1;
+}
 
-    socklen_t addrlen = (socklen_t) sizeof(client);
-    getpeername(connfd, (struct sockaddr*) &client, &addrlen);
+void start_turn(Connection *conn) {
+    conn->budget = work_budget > INT_MAX / conn->weight ? INT_MAX : work_budget * conn->weight;
+    conn->turn_left = turn_bytes > SIZE_MAX / (size_t) conn->weight ? SIZE_MAX : turn_bytes * (size_t) conn->weight;
+}
 
-    printf("\n---------------------------------\n");
-    printf("Now serving %s:%d on socket %d\n", 
-        inet_ntoa(client.sin_addr), 
-        ntohs(client.sin_port), 
-        connfd);
+void yield_connection(Connection *conn) {
+    if (conn->ready || conn->close_conn) {
+        return;
+    }
+    // Out of requests with more of them buffered, or out of bytes with more in the socket (reading
+    // stopped short of EAGAIN, so the edge-triggered socket is not reported again). One that waits
+    // for the client to take its responses is woken up by the socket draining instead.
+    bool requests_left = conn->budget <= 0 && conn->inbuf->len > 0 && conn->stream == NULL &&
+        conn->output.bytes < OUTPUT_HIGH_WATER;
+    bool bytes_left = conn->turn_left == 0 && conn->read_paused && !reading_throttled(conn);
+    if (requests_left || bytes_left) {
+        conn->ready = TRUE;
+        g_queue_push_tail_link(&conn->worker->ready, &conn->ready_link);
+    }
+}
 
+void run_ready_queue(Worker *worker) {
+    guint turns = worker->ready.length;
+    while (turns-- > 0 && worker->ready.head != NULL) {
+        Connection *conn = g_queue_pop_head_link(&worker->ready)->data;
+        conn->ready = FALSE;
+        start_turn(conn);
+        if (worker->ring != NULL) {
+            respond(conn);
+            uring_read(conn);
+        }
+        else {
+            serve_next_client(conn);
+        }
+        yield_connection(conn);
+        finish_connection(conn);
+    }
+}
 
-    GString *message = g_string_sized_new(BUFFER_SIZE);
-    char buffer[BUFFER_SIZE];
-    g_string_truncate (message, 0); // empty provided GString variable
-    ssize_t n;
+void finish_connection(Connection *conn) {
+    // While draining, a connection goes as soon as it has nothing left to do.
+    if (conn->worker->draining && connection_drained(conn)) {
+        conn->close_conn = TRUE;
+    }
+    // If the close_conn flag was turned on, we need to clean up this active connection once
+    // its responses are out. Removing it from the hash table closes the descriptor, which also
+    // removes it from epoll.
+    if (conn->close_conn && output_empty(&conn->output) && conn->stream == NULL) {
+        log_debug("Closing connection on socket %d", conn->handler.fd);
+        g_hash_table_remove(conn->worker->connections, &conn->handler.fd);
+    }
+}
 
-    // Receive data on this connection until the recv fails with EWOULDBLOCK. 
-    // If any other failure occurs, we will close the connection.
+void free_connection(Connection *conn) {
+    // An upstream's wakeup may close a connection whose own events are still to be dispatched.
+    // An io_uring worker has no loop without upstreams, and its ring is gone at the end of
+    // worker_run(), so a connection freed then was never on epoll either way.
+    if (conn->worker->ring == NULL && conn->worker->loop != NULL) {
+        event_loop_remove(conn->worker->loop, &conn->handler);
+    }
+    if (conn->ready) {
+        g_queue_unlink(&conn->worker->ready, &conn->ready_link);
+        conn->ready = FALSE;
+    }
+    close(conn->handler.fd);
+    metrics_count(&conn->worker->metrics.closed, 1);
+    timer_cancel(conn->worker->timers, &conn->timer);
+    // An upstream must not wake a client that is gone, so its exchange ends here.
+    if (conn->proxy != NULL) {
+        proxy_finish(conn->proxy);
+        conn->proxy = NULL;
+    }
+    if (conn->stream != NULL) {
+        stream_free(conn->stream);
+        conn->stream = NULL;
+    }
+    if (conn->h2 != NULL) {
+        h2_cancel(conn->h2);
+    }
+    Uring *ring = conn->worker->ring;
+    if (ring != NULL && conn->uring_pending > 0) {
+        // The kernel may still write into our buffers, the last completion frees the connection.
+        if (conn->recv_armed) {
+            uring_cancel(ring, &conn->recv_op);
+        }
+        if (conn->send_busy) {
+            uring_cancel(ring, &conn->send_op);
+            uring_cancel(ring, &conn->poll_op);
+        }
+        conn->closed = TRUE;
+        return;
+    }
+    release_connection(conn);
+}
+
+void release_connection(Connection *conn) {
+    g_string_free(conn->inbuf, TRUE);
+    body_spool_close(&conn->spool);
+    // Gives back the file cache references and descriptors before the arena the segments live in.
+    drop_output(conn);
+    // The streams of a session keep their memory until then, the output queue points into it.
+    if (conn->h2 != NULL) {
+        h2_session_free(conn->h2);
+    }
+    arena_destroy(&conn->arena);
+    g_free(conn->iov);
+    g_free(conn);
+}
+
+void uring_accepted(UringOp *op, int res, uint32_t flags) {
+    Worker *worker = (Worker *) ((char *) op - offsetof(Worker, accept_op));
+    // Cancelled by start_draining().
+    if (res == -ECANCELED && worker->draining) {
+        return;
+    }
+    // A failed accept may have stopped the multishot accept as well.
+    bool more = uring_more(flags);
+    if (res == -EINTR || res == -ECONNABORTED) {
+        // A client that gave up before we got to it is no reason to stop.
+        if (!more && !worker->draining) {
+            uring_accept_multishot(worker->ring, &worker->accept_op, worker->listener.fd);
+        }
+        return;
+    }
+    if (res == -EMFILE || res == -ENFILE || res == -ENOBUFS || res == -ENOMEM) {
+        // Out of descriptors or memory: the waiting clients stay queued, accepting again right
+        // away would only fail the same way, so it starts again a little later.
+        errno = -res;
+        perror("  accept() failed");
+        if (!more && !worker->draining) {
+            timer_arm(worker->timers, &worker->accept_timer, timer_now_ms() + ACCEPT_RETRY_MS);
+        }
+        return;
+    }
+    if (res < 0) {
+        errno = -res;
+        perror("  accept() failed");
+        worker->running = FALSE;
+        return;
+    }
+    // The kernel stops a multishot accept now and then, it has to be started again.
+    if (!more && !worker->draining) {
+        uring_accept_multishot(worker->ring, &worker->accept_op, worker->listener.fd);
+    }
+
+    // Multishot accept has no room for the peer address, so it is looked up.
+    // The accept itself happened in the kernel, only the setup is timed.
+    uint64_t start = metrics_now_ns();
+    metrics_count(&worker->metrics.accept_wakeups, 1);
+    if (worker_max_connections > 0 && g_hash_table_size(worker->connections) >= worker_max_connections) {
+        shed_connection(worker, res);
+        return;
+    }
+    struct sockaddr_storage client;
+    socklen_t socklen = (socklen_t) sizeof(client);
+    if (getpeername(res, (struct sockaddr *) &client, &socklen) == -1) {
+        close(res);
+        return;
+    }
+    add_connection(worker, res, (struct sockaddr *) &client);
+    metrics_phase(&worker->metrics, PHASE_ACCEPT, start);
+}
+
+void uring_accept_retry(Timer *timer) {
+    Worker *worker = (Worker *) ((char *) timer - offsetof(Worker, accept_timer));
+    if (!worker->draining) {
+        uring_accept_multishot(worker->ring, &worker->accept_op, worker->listener.fd);
+    }
+}
+
+void uring_upstreams(UringOp *op, int res, uint32_t flags) {
+    (void) res;
+    (void) flags;
+    Worker *worker = (Worker *) ((char *) op - offsetof(Worker, upstream_op));
+    event_loop_wait(worker->loop, 0);
+    uring_poll_in(worker->ring, &worker->upstream_op, event_loop_fd(worker->loop));
+}
+
+void uring_read(Connection *conn) {
+    if (conn->recv_armed || conn->close_conn) {
+        return;
+    }
+    if (reading_throttled(conn)) {
+        conn->read_paused = TRUE;
+        return;
+    }
+    conn->read_paused = FALSE;
+    conn->recv_armed = TRUE;
+    conn->uring_pending++;
+    uring_recv(conn->worker->ring, &conn->recv_op, conn->handler.fd);
+}
+
+void uring_received(UringOp *op, int res, uint32_t flags) {
+    Connection *conn = (Connection *) ((char *) op - offsetof(Connection, recv_op));
+    Uring *ring = conn->worker->ring;
+    conn->recv_armed = FALSE;
+    conn->uring_pending--;
+
+    // The data is copied out of the provided buffer right away, so the buffer goes straight back.
+    const char *buffer = uring_buffer(ring, flags);
+    if (res > 0 && buffer != NULL) {
+        g_string_append_len(conn->inbuf, buffer, res);
+        conn->received_ns = metrics_now_ns();
+        // Without a kernel timestamp only the wait after the completion counts.
+        conn->arrived_ns = conn->received_ns;
+        metrics_count(&conn->worker->metrics.bytes_in, (uint64_t) res);
+    }
+    uring_buffer_return(ring, flags);
+
+    // A connection closed meanwhile only waits for its operations to come back.
+    if (conn->closed) {
+        if (conn->uring_pending == 0) {
+            release_connection(conn);
+        }
+        return;
+    }
+    if (res == -ENOBUFS) {
+        // Every buffer is taken, by the time this is submitted some are back.
+        uring_read(conn);
+        return;
+    }
+
+    // Push the keep-alive deadline of this client back, O(1) on the timer wheel
+    timer_arm(conn->worker->timers, &conn->timer, timer_now_ms() + TIMEOUT * 1000);
+
+    // Answer everything that arrived, even if the client has already shut down its side.
+    start_turn(conn);
+    respond(conn);
+    if (res <= 0) {
+        if (res < 0 && res != -ECONNRESET && res != -ECANCELED) {
+            errno = -res;
+            perror("  recv() failed");
+        }
+        log_debug("Connection on socket %d closed by the client", conn->handler.fd);
+        conn->close_conn = TRUE;
+    }
+    uring_read(conn);
+    yield_connection(conn);
+    finish_connection(conn);
+}
+
+void uring_sent(UringOp *op, int res, uint32_t flags) {
+    (void) flags;
+    Connection *conn = (Connection *) ((char *) op - offsetof(Connection, send_op));
+    uring_output_done(conn, res);
+}
+
+void uring_writable(UringOp *op, int res, uint32_t flags) {
+    (void) flags;
+    Connection *conn = (Connection *) ((char *) op - offsetof(Connection, poll_op));
+    uring_output_done(conn, res < 0 ? res : 0);
+}
+
+void uring_output_done(Connection *conn, int sent) {
+    conn->send_busy = FALSE;
+    conn->uring_pending--;
+    if (conn->closed) {
+        if (conn->uring_pending == 0) {
+            release_connection(conn);
+        }
+        return;
+    }
+
+    if (sent < 0) {
+        // A failed send only affects this client.
+        if (sent != -EPIPE && sent != -ECONNRESET) {
+            errno = -sent;
+            perror("send");
+        }
+        conn->close_conn = TRUE;
+        drop_output(conn);
+    }
+    else if (sent > 0) {
+        output_consume(&conn->output, (size_t) sent);
+        output_sent(conn, (size_t) sent);
+    }
+
+    // What EPOLLOUT does: send the rest, carry on with the next requests and resume paused reads.
+    start_turn(conn);
+    respond(conn);
+    if (conn->read_paused && conn->output.bytes < OUTPUT_LOW_WATER) {
+        uring_read(conn);
+    }
+    yield_connection(conn);
+    finish_connection(conn);
+}
+
+OutputResult uring_send(Connection *conn, size_t *sent) {
+    if (conn->send_busy) {
+        return OUTPUT_AGAIN;
+    }
+    if (output_empty(&conn->output)) {
+        return OUTPUT_DONE;
+    }
+
+    // The memory segments at the front go out with one writev, completed in uring_sent().
+    Uring *ring = conn->worker->ring;
+    int count = output_iov(&conn->output, conn->iov, OUTPUT_IOV_MAX);
+    if (count > 0) {
+        uring_writev(ring, &conn->send_op, conn->handler.fd, conn->iov, count);
+    }
+    else {
+        // io_uring has no sendfile(), so a file is sent right here until the socket is full.
+        OutputResult result = output_flush(&conn->output, conn->handler.fd, sent);
+        if (result != OUTPUT_AGAIN) {
+            return result;
+        }
+        uring_poll_out(ring, &conn->poll_op, conn->handler.fd);
+    }
+    conn->send_busy = TRUE;
+    conn->uring_pending++;
+    return OUTPUT_AGAIN;
+}
+
+void serve_next_client(Connection *conn) {
+    // Push the keep-alive deadline of this client back, O(1) on the timer wheel
+    timer_arm(conn->worker->timers, &conn->timer, timer_now_ms() + TIMEOUT * 1000);
+
+    log_debug("Now serving %s:%d on socket %d", conn->ip, conn->port, conn->handler.fd);
+
+    bool open;
     do {
-        // Receive from connfd, not sockfd.
-        n = recv(connfd, buffer, BUFFER_SIZE, 0);
+        conn->read_paused = FALSE;
+        open = receive_requests(conn);
+
+        // Answer everything that arrived, even if the client has already shut down its side.
+        // All responses of this batch go out in a single writev().
+        respond(conn);
+
+        // If the responses went out right away there will be no EPOLLOUT to resume reading,
+        // so we carry on here.
+    } while (open && conn->read_paused && output_empty(&conn->output) && !conn->close_conn &&
+             !reading_throttled(conn) && conn->budget > 0 && conn->turn_left > 0);
+
+    if (!open) {
+        conn->close_conn = TRUE;
+    }
+}
+
+bool reading_throttled(Connection *conn) {
+    // A request body on its way upstream is read no faster than the upstream takes it.
+    if (conn->proxy != NULL && proxy_backlog(conn->proxy) >= OUTPUT_HIGH_WATER) {
+        return TRUE;
+    }
+    if (output_empty(&conn->output)) {
+        return FALSE;
+    }
+    return conn->output.bytes >= OUTPUT_HIGH_WATER || conn->inbuf->len >= INPUT_HIGH_WATER;
+}
+
+void respond(Connection *conn) {
+    while (flush_output(conn) && process_requests(conn)) {
+        // Keep going until the socket is full or every buffered request has been answered.
+    }
+}
+
+bool receive_requests(Connection *conn) {
+    GString *message = conn->inbuf;
+
+    // The socket is edge-triggered, so receive data on this connection until the recv
+    // fails with EWOULDBLOCK or we pause reading. If any other failure occurs, we will close the connection.
+    size_t received = 0;
+    while (TRUE) {
+        // At most INPUT_HIGH_WATER bytes per call, so the requests are answered before more is read,
+        // and no more than is left of the turn.
+        if (received >= INPUT_HIGH_WATER || conn->turn_left == 0 || reading_throttled(conn)) {
+            conn->read_paused = TRUE;
+            return TRUE;
+        }
+
+        // Receive straight into the free space at the end of the buffer.
+        size_t used = message->len;
+        g_string_set_size(message, used + BUFFER_SIZE);
+        uint64_t start = metrics_now_ns();
+        ssize_t n = shed_delay_ns > 0 ? recv_timestamped(conn, message->str + used, BUFFER_SIZE) :
+            recv(conn->handler.fd, message->str + used, BUFFER_SIZE, 0);
+        g_string_set_size(message, used + (n > 0 ? (size_t) n : 0));
+
         if (n < 0) {
-            if (errno != EWOULDBLOCK) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EWOULDBLOCK && errno != EAGAIN) {
                 perror("  recv() failed");
-                close_conn = TRUE;
+                return FALSE;
             }
-            break;
+            // Woken up (or called) for nothing.
+            if (received == 0) {
+                metrics_count(&conn->worker->metrics.empty_reads, 1);
+            }
+            return TRUE;
         }
 
         // Check to see if the connection has been closed by the client
         if (n == 0) {
-            printf("  Connection closed\n");
-            close_conn = TRUE;
-            return;
+            log_debug("Connection on socket %d closed by the client", conn->handler.fd);
+            return FALSE;
         }
-        // Data was received
-
-        g_string_append_len(message, buffer, n);
-    } while(n >= BUFFER_SIZE);
-    
-    printf("Length of message: %zd\n", message->len);
-    
-    printf("\nRECIEVED MESSAGE:\n%s\n", message->str);
-    
-    // Create a Request and fill into the various fields, using the message received
-    Request request;
-    init_request(&request);
-    fill_request(message, &request);
-
-    // Close connection if connection is not keep alive
-    if (request.connection->len > 0 && g_ascii_strcasecmp(request.connection->str, "keep-alive") != 0) {
-        close_conn = TRUE;
-    }
-
-    // Generate the response html for GET and POST
-    GString *html = generate_html(&request, inet_ntoa(client.sin_addr), ntohs(client.sin_port));
-    GString *response = generate_response(&request, html);
-
-    // Adding to log file timestamp, ip, port, requested URL
-    write_to_log(&request, inet_ntoa(client.sin_addr), ntohs(client.sin_port));
-   
-    // Send the message back.
-    r = send(connfd, response->str, (size_t) response->len, 0);
-    if (r == -1) {
-        perror("send");
-        exit(EXIT_FAILURE);
+        received += (size_t) n;
+        conn->turn_left = conn->turn_left > (size_t) n ? conn->turn_left - (size_t) n : 0;
+        conn->received_ns = metrics_phase(&conn->worker->metrics, PHASE_RECV, start);
+        metrics_count(&conn->worker->metrics.bytes_in, (uint64_t) n);
     }
-
-    reset_request(&request);
 }
 
-void handle_timeout(int connfd, GTimer *timer) {
-    gdouble time_elapsed = g_timer_elapsed(timer, NULL);
-    //printf("Checking timeout! Elapsed: %f\n", time_elapsed);
-    if (time_elapsed >= TIMEOUT) {
-        printf("\tConnection on socket %d timed out!\n", connfd);
-        for (int z = 0; z < nfds; z++) {
-            if (fds[z].fd == connfd) {
-                close(fds[z].fd);
-                g_hash_table_remove(connections, &fds[z].fd);
-                fds[z].fd = -1;
-                array_compression(TRUE);
-                break;
+ssize_t recv_timestamped(Connection *conn, char *buf, size_t len) {
+    struct iovec iov = { buf, len };
+    union {
+        char buf[CMSG_SPACE(sizeof(struct timespec))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    ssize_t n = recvmsg(conn->handler.fd, &msg, 0);
+    if (n <= 0) {
+        return n;
+    }
+    // The stamp is on the real-time clock and belongs to the last packet read, so the older bytes
+    // in inbuf may have waited longer: shedding errs on the side of answering.
+    uint64_t now = metrics_now_ns();
+    conn->arrived_ns = now;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec stamp, real;
+            memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+            clock_gettime(CLOCK_REALTIME, &real);
+            int64_t waited = (int64_t) (real.tv_sec - stamp.tv_sec) * 1000000000 + (real.tv_nsec - stamp.tv_nsec);
+            if (waited > 0 && (uint64_t) waited < now) {
+                conn->arrived_ns = now - (uint64_t) waited;
             }
         }
     }
+    return n;
 }
 
-void array_compression(bool compress_array) {
-    if (compress_array) {
-        compress_array = FALSE;
-        for (i = 0; i < nfds; i++) {
-            if (fds[i].fd == -1) {
-                for(j = i; j < nfds; j++) {
-                    fds[j].fd = fds[j+1].fd;
-                }
-                nfds--;
+bool process_requests(Connection *conn) {
+    GString *message = conn->inbuf;
+    Metrics *metrics = &conn->worker->metrics;
+    size_t consumed = 0;
+    bool queued = FALSE;
+
+    // Only the start of the message fits in a log record.
+    if (message->len > 0 && log_enabled(LOG_LEVEL_DEBUG)) {
+        log_debug("Received %zu bytes on socket %d:\n%.*s", message->len, conn->handler.fd,
+                  (int) MIN(message->len, (gsize) 160), message->str);
+    }
+
+    // Nothing queued points into the arena any more, so it can be rewound.
+    // Every response queued from it is out, so none is pending either.
+    if (output_empty(&conn->output)) {
+        arena_reset(&conn->arena);
+        conn->pending = NULL;
+        conn->pending_tail = &conn->pending;
+    }
+
+    if (conn->h2 != NULL) {
+        return process_frames(conn);
+    }
+    // A client with prior knowledge of HTTP/2 starts the connection with its preface, no request
+    // starts like that. All of it has to be there before the session takes over.
+    if (!opt_no_h2c && conn->sent_total == 0 && output_empty(&conn->output) && message->len > 0 &&
+            memcmp(message->str, H2_PREFACE, MIN(message->len, (gsize) H2_PREFACE_SIZE)) == 0) {
+        if (message->len < H2_PREFACE_SIZE) {
+            return FALSE;
+        }
+        conn->h2 = h2_session_new(&h2_config, &conn->output, &conn->arena, conn);
+        return process_frames(conn);
+    }
+
+    // A streamed response has to be finished before the requests behind it are answered.
+    if (conn->stream != NULL) {
+        queued = pump_stream(conn);
+    }
+
+    // Pipelined requests are answered in order, until one of them wants the connection closed,
+    // streams its response or the client has enough responses waiting.
+    while (conn->stream == NULL && consumed < message->len && !conn->close_conn && conn->output.bytes < OUTPUT_HIGH_WATER &&
+           conn->budget > 0) {
+        // Create a Request and fill into the various fields, using the message received.
+        // The parser picks up where it stopped, so a request split over several reads is fine.
+        Request request;
+        init_request(&request, &conn->arena);
+        uint64_t start = metrics_now_ns();
+        HttpParseResult result = fill_request(&conn->parser, message->str + consumed, message->len - consumed, &request);
+        // Once a body is being taken in, what follows the head is body until it is complete.
+        bool body_missing = result == HTTP_PARSE_INCOMPLETE && request.body_length > 0;
+        if ((body_missing || conn->body_pending) && result != HTTP_PARSE_ERROR) {
+            if (!take_body(conn, &request, consumed, &queued)) {
+                break;
+            }
+            result = HTTP_PARSE_DONE;
+        }
+        else if (result == HTTP_PARSE_INCOMPLETE) {
+            break;
+        }
+        start = metrics_phase(metrics, PHASE_PARSE, start);
+        conn->request_ns = conn->received_ns;
+
+        // An upgrade to h2c answers the request as stream 1 of the session. Its body has to be in
+        // the buffer, one that was spooled or went upstream is answered over HTTP/1.1.
+        if (!opt_no_h2c && !conn->worker->draining && result == HTTP_PARSE_DONE && request.keep_alive &&
+                conn->spool.fd < 0 && conn->proxy == NULL && h2_upgrade_requested(&request)) {
+            conn->h2 = h2_upgrade(&h2_config, &conn->output, &conn->arena, conn, &request, &conn->parser,
+                                  message->str + consumed);
+            if (conn->h2 != NULL) {
+                g_string_erase(message, 0, (gssize) (consumed + request.message_length));
+                http_parser_init(&conn->parser, HTTP_DEFAULT_MAX_HEADER_SIZE);
+                conn->continue_sent = FALSE;
+                process_frames(conn);
+                return TRUE;
             }
         }
+
+        // Close connection if connection is not keep alive, or the worker is draining
+        if (!request.keep_alive || conn->worker->draining) {
+            conn->close_conn = TRUE;
+        }
+
+        Reply reply = { &conn->output, &conn->arena, NULL, conn->close_conn };
+        serve_request(conn, &reply, &request, message->str + consumed, &conn->parser, &conn->spool, start);
+        conn->stream = reply.stream;
+        conn->close_conn = reply.close_conn;
+        // A body that went upstream for a request answered here after all.
+        if (conn->proxy != NULL) {
+            proxy_finish(conn->proxy);
+            conn->proxy = NULL;
+        }
+        // A streamed response is complete once its stream ends, see pump_stream().
+        if (conn->stream != NULL) {
+            // The first chunks go out with the header.
+            pump_stream(conn);
+        }
+        else {
+            response_queued(conn, conn->request_ns);
+        }
+        metrics_phase(metrics, PHASE_GENERATE, start);
+        metrics_count(&metrics->requests, 1);
+        metrics_status(metrics, request.status_code);
+        queued = TRUE;
+        conn->budget--;
+
+        // Adding to log file timestamp, ip, port, requested URL
+        write_to_log(&request, conn->ip, conn->port);
+
+        // After a parse error we can not tell where the next request starts.
+        consumed = result == HTTP_PARSE_ERROR ? message->len : consumed + request.message_length;
+
+        // The response still lives in the arena until it is sent, so only the parser starts over.
+        http_parser_init(&conn->parser, HTTP_DEFAULT_MAX_HEADER_SIZE);
+        body_spool_close(&conn->spool);
+        conn->continue_sent = FALSE;
     }
+
+    // Keep the bytes of an unfinished request for the next read.
+    g_string_erase(message, 0, (gssize) consumed);
+    return queued;
 }
 
-char *get_status_code(char *status_code) {
-    if (strcmp(status_code, "200") == 0) {
-        return "200 OK";
+void serve_request(Connection *conn, Reply *reply, Request *request, const char *head, const HttpParser *parser,
+                   BodySpool *spool, uint64_t start) {
+    Metrics *metrics = &conn->worker->metrics;
+    // A request that has waited too long is turned away before any work goes into it: its
+    // client has likely given up, and answering it would only make the next ones wait longer.
+    bool shed = shed_delay_ns > 0 && request->status_code == 0 && start - conn->arrived_ns > shed_delay_ns;
+    bool is_get = view_equals(request->method, "GET") || view_equals(request->method, "HEAD");
+    const RouteTarget *target = request->status_code == 0 ? router_lookup(router, request->host, request->path) : NULL;
+    RouteType type = target != NULL ? target->type : ROUTE_ECHO;
+    if (shed) {
+        StrView response = response_overloaded(!reply->close_conn);
+        output_add_mem(reply->output, reply->arena, response.str, response.len, NULL, NULL);
+        request->status_code = 503;
+        metrics_count(&metrics->shed_requests, 1);
     }
-    else if (strcmp(status_code, "405") == 0) {
-        return "405 Method Not Allowed";
+    else if (request->status_code == 0 && target == NULL) {
+        respond_status(reply, request, 404);
     }
-    else if (strcmp(status_code, "501") == 0) {
-        return "501 Not Implemented";
+    else if (type == ROUTE_METRICS && is_get) {
+        serve_metrics(reply, request);
     }
-    else if (strcmp(status_code, "505") == 0) {
-        return "505 HTTP Version not supported";
+    else if (type == ROUTE_PROXY) {
+        proxy_response(conn, reply, request, head, parser, spool, target->proxy);
     }
-    else if (strcmp(status_code, "500") == 0) {
-        return "500 Internal Server Error";
+    else if (type == ROUTE_STATIC && is_get) {
+        serve_file(conn, reply, request, target);
     }
-    else if (strcmp(status_code, "415") == 0) {
-        return "415 Unsupported Media Type";
+    else if (request->status_code == 0 && spool->fd >= 0) {
+        respond_spooled(conn, reply, request, spool);
     }
-    else if (strcmp(status_code, "408") == 0) {
-        return "408 Request Timeout";
+    else {
+        // Generate the response html for GET and POST, the header and body are queued as they are.
+        StrView html = generate_html(request, conn->ip, conn->port);
+        StrView body;
+        Compressor *compressor = opt_compress_level > 0 ? &conn->worker->compressor : NULL;
+        StrView header = generate_response(request, html, reply->close_conn, compressor, &body);
+        output_add_mem(reply->output, reply->arena, header.str, header.len, NULL, NULL);
+        output_add_mem(reply->output, reply->arena, body.str, body.len, NULL, NULL);
+    }
+}
+
+bool process_frames(Connection *conn) {
+    GString *message = conn->inbuf;
+    size_t queued = conn->output.bytes;
+    size_t consumed = h2_receive(conn->h2, message->str, message->len, &conn->budget, conn->received_ns);
+    g_string_erase(message, 0, (gssize) consumed);
+    // The streams in progress are answered, the client opens its next ones on a new connection.
+    if (conn->worker->draining) {
+        h2_shutdown(conn->h2);
     }
-    else if (strcmp(status_code, "417") == 0) {
-        return "417 Expectation Failed";
+    h2_send(conn->h2, OUTPUT_HIGH_WATER);
+    if (h2_finished(conn->h2)) {
+        conn->close_conn = TRUE;
     }
-    return "200 OK";
+    return conn->output.bytes > queued;
+}
+
+void serve_h2_request(void *data, H2Request *request) {
+    Connection *conn = data;
+    Metrics *metrics = &conn->worker->metrics;
+    uint64_t start = metrics_now_ns();
+    serve_request(conn, &request->reply, &request->request, request->head, &request->parser, &request->spool, start);
+    metrics_phase(metrics, PHASE_GENERATE, start);
+    metrics_count(&metrics->requests, 1);
+    metrics_status(metrics, request->request.status_code);
+    write_to_log(&request->request, conn->ip, conn->port);
 }
 
-GString *generate_response(Request *request, GString *html) {
-    GDateTime *time = g_date_time_new_now_local();
-    gchar *date_time = g_date_time_format(time, "%a, %m %b %Y %H:%M:%S %Z");
-    GString *response = g_string_new(NULL);
-    char *status;
-    if (request->status_code->len > 0) {
-         status = get_status_code(request->status_code->str);
+void finish_h2_request(void *data, H2Request *request) {
+    response_queued(data, request->received_ns);
+}
+
+bool flush_output(Connection *conn) {
+    size_t sent = 0;
+    uint64_t start = metrics_now_ns();
+    OutputResult result = conn->worker->ring != NULL ? uring_send(conn, &sent) :
+        output_flush(&conn->output, conn->handler.fd, &sent);
+    if (result == OUTPUT_ERROR) {
+        conn->close_conn = TRUE;
+        drop_output(conn);
     }
-    else {
-        status = "200 OK";
+
+    if (sent > 0) {
+        metrics_phase(&conn->worker->metrics, PHASE_SEND, start);
+        output_sent(conn, sent);
     }
-    
-    GString *http_version = g_string_new(request->http_version->str);
+    // The rest goes out when epoll reports EPOLLOUT.
+    return result == OUTPUT_DONE;
+}
 
-    int content_length = html->len;
-    if (g_ascii_strcasecmp(status, "200 OK") != 0 || g_ascii_strcasecmp(request->method->str, "HEAD") == 0) {
-        content_length = 0;
+bool pump_stream(Connection *conn) {
+    size_t queued = conn->output.bytes;
+    StreamStatus status = stream_pump(conn->stream, &conn->output, &conn->arena, OUTPUT_HIGH_WATER);
+    if (status != STREAM_MORE) {
+        // After a failure the client can only tell that the body is incomplete by the connection closing.
+        if (status == STREAM_ERROR) {
+            log_warn("Streamed response on socket %d failed", conn->handler.fd);
+            conn->close_conn = TRUE;
+        }
+        stream_free(conn->stream);
+        conn->stream = NULL;
+        response_queued(conn, conn->request_ns);
     }
+    return conn->output.bytes > queued;
+}
 
-    g_string_printf(response, "%s %s\r\n"
-                            "Date: %s\r\n"
-                            "Server: S00ber 1337 S3rv3r\r\n"
-                            "Content-Length: %d\r\n"
-                            "Content-Type: text/html; charset=utf-8\r\n",
-                            http_version->str, status, date_time, content_length);
-    if (strcmp(request->status_code->str, "405") == 0) {
-        g_string_append_printf(response, "Allow: GET, POST, HEAD\r\n");
+void drop_output(Connection *conn) {
+    output_clear(&conn->output);
+    if (conn->stream != NULL) {
+        stream_free(conn->stream);
+        conn->stream = NULL;
     }
-    if (close_conn) {
-        g_string_append(response, "Connection: close\r\n");
+    // Those responses are never going to be sent.
+    conn->pending = NULL;
+    conn->pending_tail = &conn->pending;
+}
+
+void output_sent(Connection *conn, size_t sent) {
+    Metrics *metrics = &conn->worker->metrics;
+    metrics_count(&metrics->bytes_out, sent);
+    conn->sent_total += sent;
+    if (conn->h2 != NULL) {
+        h2_sent(conn->h2, sent);
     }
-    else {
-        g_string_append(response, "Connection: keep-alive\r\n");
-		g_string_append_printf(response, "Keep-Alive: timeout=%d, max=100\r\n", TIMEOUT);
+    if (conn->pending != NULL && conn->pending->end <= conn->sent_total) {
+        uint64_t now = metrics_now_ns();
+        while (conn->pending != NULL && conn->pending->end <= conn->sent_total) {
+            histogram_record(&metrics->phases[PHASE_TOTAL], now - conn->pending->received_ns);
+            conn->pending = conn->pending->next;
+        }
+        if (conn->pending == NULL) {
+            conn->pending_tail = &conn->pending;
+        }
+    }
+    // A long download is not an idle connection.
+    timer_arm(conn->worker->timers, &conn->timer, timer_now_ms() + TIMEOUT * 1000);
+}
+
+void response_queued(Connection *conn, uint64_t received_ns) {
+    PendingResponse *pending = arena_alloc(&conn->arena, sizeof(*pending));
+    pending->next = NULL;
+    pending->end = conn->sent_total + conn->output.bytes;
+    pending->received_ns = received_ns;
+    *conn->pending_tail = pending;
+    conn->pending_tail = &pending->next;
+}
+
+void handle_timeout(Timer *timer) {
+    Connection *conn = (Connection *) ((char *) timer - offsetof(Connection, timer));
+    log_debug("Connection on socket %d timed out", conn->handler.fd);
+    metrics_count(&conn->worker->metrics.timeouts, 1);
+    g_hash_table_remove(conn->worker->connections, &conn->handler.fd);
+}
+
+bool take_body(Connection *conn, Request *request, size_t offset, bool *queued) {
+    GString *message = conn->inbuf;
+    size_t body_start = offset + conn->parser.header_end;
+
+    if (!conn->body_pending) {
+        // Refused before the body is there. The client may still send it, and it would be
+        // taken for the next request, so the connection is closed after the response.
+        if (request->status_code == 0 && request->body_length > (size_t) opt_max_body_size * 1024 * 1024) {
+            request->status_code = 413;
+        }
+        if (request->status_code != 0) {
+            request->keep_alive = FALSE;
+            request->message_length = message->len - offset;
+            return TRUE;
+        }
+
+        // The client waits for a go-ahead before it sends the body, if it asked for one.
+        if (request->expect_continue && !conn->continue_sent) {
+            static const char continue_line[] = "HTTP/1.1 100 Continue\r\n\r\n";
+            output_add_mem(&conn->output, &conn->arena, continue_line, sizeof(continue_line) - 1, NULL, NULL);
+            conn->continue_sent = TRUE;
+            *queued = TRUE;
+        }
+        if (request->body_length <= (size_t) opt_body_buffer * 1024) {
+            return FALSE;
+        }
+
+        // A proxied body goes upstream, only the echo page shows it otherwise, the other
+        // responses have no use for it.
+        const RouteTarget *target = router_lookup(router, request->host, request->path);
+        if (target != NULL && target->type == ROUTE_PROXY) {
+            conn->proxy = start_proxy(conn, request, message->str + offset, &conn->parser, target->proxy);
+            if (conn->proxy == NULL) {
+                request->status_code = 502;
+                request->keep_alive = FALSE;
+                request->message_length = message->len - offset;
+                return TRUE;
+            }
+            body_reader_init(&conn->body, request->body_length, proxy_body_write, conn->proxy);
+        }
+        else if (target == NULL || !view_equals(request->method, "POST")) {
+            body_reader_init(&conn->body, request->body_length, body_discard, NULL);
+        }
+        else if (body_spool_open(&conn->spool, opt_spool_dir)) {
+            body_reader_init(&conn->body, request->body_length, body_spool_write, &conn->spool);
+        }
+        else {
+            request->status_code = 500;
+            request->keep_alive = FALSE;
+            request->message_length = message->len - offset;
+            return TRUE;
+        }
+        conn->body_pending = TRUE;
+    }
+
+    // The body is cut out of the buffer as it arrives, the head stays for the response.
+    size_t n = body_reader_feed(&conn->body, message->str + body_start, message->len - body_start);
+    g_string_erase(message, (gssize) body_start, (gssize) n);
+    if (!body_reader_done(&conn->body)) {
+        return FALSE;
+    }
+    conn->body_pending = FALSE;
+    if (conn->body.failed) {
+        request->status_code = 500;
+        body_spool_close(&conn->spool);
     }
+    request->msg_body.str = "";
+    request->msg_body.len = 0;
+    request->message_length = conn->parser.header_end;
+    return TRUE;
+}
+
+void respond_spooled(Connection *conn, Reply *reply, Request *request, BodySpool *spool) {
+    // The page goes out around the body, which is sent from its file with sendfile() and not compressed.
+    StrView after;
+    StrView before = generate_html_around(request, conn->ip, conn->port, &after);
+    size_t length = before.len + spool->length + after.len;
+    StrView header = generate_header(request, 0, "text/html; charset=utf-8", length, "", reply->close_conn);
+    output_add_mem(reply->output, reply->arena, header.str, header.len, NULL, NULL);
+    output_add_mem(reply->output, reply->arena, before.str, before.len, NULL, NULL);
+    output_add_file(reply->output, reply->arena, spool->fd, 0, spool->length);
+    output_add_mem(reply->output, reply->arena, after.str, after.len, NULL, NULL);
+    // The output queue closes the file once it is sent.
+    spool->fd = -1;
+}
 
+ProxyConn *start_proxy(Connection *conn, Request *request, const char *head, const HttpParser *parser, int route) {
+    // The end of a response to HTTP/1.0 may only be told by the connection closing.
+    bool close_client = !request->keep_alive || view_equals(request->http_version, "HTTP/1.0");
+    return proxy_start(conn->worker->proxy, route, request, parser, head, conn->ip, close_client, conn);
+}
 
-    if (strcmp(request->method->str, "GET") == 0 || strcmp(request->method->str, "POST") == 0 ) {
-        g_string_append_printf(response, "\r\n%s", html->str);
+void proxy_response(Connection *conn, Reply *reply, Request *request, const char *head, const HttpParser *parser,
+                    BodySpool *spool, int route) {
+    if (view_equals(request->http_version, "HTTP/1.0")) {
+        reply->close_conn = TRUE;
     }
-    else {
-        g_string_append(response, "\r\n");
+    ProxyConn *proxy = conn->proxy != NULL ? conn->proxy : start_proxy(conn, request, head, parser, route);
+    conn->proxy = NULL;
+    if (proxy == NULL) {
+        respond_status(reply, request, 502);
+        return;
+    }
+    // Only an HTTP/2 body is spooled on its way upstream, it goes out from its file with sendfile().
+    if (spool->fd >= 0) {
+        proxy_body_file(proxy, spool->fd, spool->length);
+        spool->fd = -1;
     }
+    // The response is passed through as it comes, already framed for the client.
+    reply->stream = stream_new(proxy_produce, proxy_finish, proxy, FALSE);
+}
 
-    g_date_time_unref(time);
+void proxy_wake(void *client) {
+    Connection *conn = client;
+    start_turn(conn);
+    respond(conn);
+    // Reads paused while the upstream took the body go on once it has.
+    if (conn->read_paused && !reading_throttled(conn)) {
+        if (conn->worker->ring != NULL) {
+            uring_read(conn);
+        }
+        else {
+            serve_next_client(conn);
+        }
+    }
+    yield_connection(conn);
+    finish_connection(conn);
+}
 
-    return response;
+void respond_status(Reply *reply, Request *request, int status) {
+    request->status_code = status;
+    StrView header = generate_header(request, status, "text/html; charset=utf-8", 0, "", reply->close_conn);
+    output_add_mem(reply->output, reply->arena, header.str, header.len, NULL, NULL);
 }
 
-GString *generate_html(Request *request, char *ip, uint16_t port) {
-    GString *html = g_string_new(NULL);
-    GString *path_and_query = g_string_new(NULL);
-    
-    g_string_printf(path_and_query, "%s?%s", request->path->str, request->query->str);
-    if (request->query->len < 1) {
-        g_string_printf(path_and_query, "%s", request->path->str);
+void serve_metrics(Reply *reply, Request *request) {
+    // The other workers carry on recording meanwhile, see metrics.h.
+    Metrics *total = g_new0(Metrics, 1);
+    for (int w = 0; w < opt_workers; w++) {
+        metrics_merge(total, &workers[w].metrics);
+    }
+    GString *page = g_string_sized_new(16384);
+    metrics_render(total, opt_workers, page);
+    g_free(total);
+
+    StrView header = generate_header(request, 200, "text/plain; version=0.0.4; charset=utf-8", page->len, "",
+                                     reply->close_conn);
+    output_add_mem(reply->output, reply->arena, header.str, header.len, NULL, NULL);
+    if (view_equals(request->method, "HEAD")) {
+        g_string_free(page, TRUE);
+        return;
     }
-    g_string_printf(html, "<!DOCTYPE html>\n<html>\n<head>\r\n\t"
-                        "<title>S00b3r 1337 r3sp0ns3 p4g3</title>\n</head>\n<body>\n"
-                        "\thttp://%s%s %s:%d\n"
-                        "\t%s\n"
-                        "</body>\n</html>",
-                        request->host->str, path_and_query->str, ip, port, request->msg_body->str);
-    g_string_free(path_and_query, TRUE);
-    return html;
+    // The page is freed once it has been sent.
+    size_t len = page->len;
+    char *body = g_string_free(page, FALSE);
+    output_add_mem(reply->output, reply->arena, body, len, g_free, body);
 }
 
-void parse_header(gchar *line, Request *request) {
-    // Split line into token and info
-    gchar **split = g_strsplit(line, ":", 2);
-    gchar *token = g_strstrip(split[0]);
-    gchar *info = g_strstrip(split[1]);
+void serve_file(Connection *conn, Reply *reply, Request *request, const RouteTarget *target) {
+    FileCache *cache = conn->worker->cache;
+    int root = target->root;
+    // The prefix of the route is taken off the path, up to the slash that ends it: below a
+    // route for /static/, /static/app.js is app.js in the directory.
+    StrView path = request->path;
+    size_t skip = target->prefix_len;
+    if (skip > 0 && path.str[skip - 1] == '/') {
+        skip--;
+    }
+    path.str += skip;
+    path.len -= skip;
+    if (path.len == 0) {
+        path.str = "/";
+        path.len = 1;
+    }
+    // A route for /img matches /imgx too, but nothing below the directory is called that.
+    if (path.str[0] != '/') {
+        respond_status(reply, request, 404);
+        return;
+    }
+    const char *name = static_resolve(path, request->arena);
+    if (name == NULL) {
+        respond_status(reply, request, 400);
+        return;
+    }
 
-    if (g_ascii_strcasecmp(token, "Host") == 0) {
-        request->host = g_string_new(info);
+    // A hit answers without touching the file system (apart from a stat now and then). The
+    // directories of the routes share the cache, so the name is keyed with the directory.
+    gint64 now = (gint64) timer_now_ms();
+    const char *key = arena_printf(request->arena, NULL, "%d/%s", root, name);
+    StaticFile file;
+    file.fd = -1;
+    FileCacheEntry *entry = file_cache_lookup(cache, root, key, now);
+    if (entry == NULL) {
+        int status = static_open(root, name, request->arena, &file);
+        if (status != 200) {
+            respond_status(reply, request, status);
+            return;
+        }
+        entry = file_cache_insert(cache, key, &file, now);
     }
-    else if (g_ascii_strcasecmp(token, "User-Agent") == 0) {
-        request->user_agent = g_string_new(info);
+
+    // Without a cache entry the validators are formatted per request.
+    const char *content_type;
+    const char *etag;
+    const char *last_modified;
+    char etag_buf[STATIC_ETAG_SIZE];
+    char date_buf[STATIC_DATE_SIZE];
+    off_t size;
+    time_t mtime;
+    const char *body = NULL;
+    if (entry != NULL) {
+        content_type = entry->content_type;
+        etag = entry->etag;
+        last_modified = entry->last_modified;
+        size = entry->size;
+        mtime = entry->mtime.tv_sec;
+        body = entry->body;
     }
-    else if (g_ascii_strcasecmp(token, "Content-Type") == 0) {
-        request->content_type = g_string_new(info);
+    else {
+        static_etag(&file.st, etag_buf, sizeof(etag_buf));
+        static_http_date(file.st.st_mtim.tv_sec, date_buf, sizeof(date_buf));
+        content_type = file.content_type;
+        etag = etag_buf;
+        last_modified = date_buf;
+        size = file.st.st_size;
+        mtime = file.st.st_mtim.tv_sec;
     }
-    else if (g_ascii_strcasecmp(token, "Content-Length") == 0) {
-        request->content_length = g_string_new(info);
+
+    // The gzip variant is built once per cache entry and then sent like any cached body.
+    // Ranges are always served from the identity coding.
+    bool compressible = opt_compress_level > 0 && compress_type_ok(content_type) &&
+        size >= opt_compress_min_size;
+    // A file too big to keep a variant of is compressed while it is sent, with chunked coding.
+    const char *encoding = "";
+    bool stream_gzip = FALSE;
+    if (compressible && entry != NULL && request->range.len == 0 &&
+            compress_negotiate(request->accept_encoding) == ENCODING_GZIP) {
+        if (file_cache_gzip(cache, entry, root, &conn->worker->compressor)) {
+            encoding = "Content-Encoding: gzip\r\n";
+            etag = entry->gzip_etag;
+            body = entry->gzip_body;
+            size = (off_t) entry->gzip_size;
+        }
+        else if (entry->body == NULL) {
+            encoding = "Content-Encoding: gzip\r\n";
+            etag = entry->gzip_etag;
+            stream_gzip = TRUE;
+        }
     }
-    else if (g_ascii_strcasecmp(token, "Accept") == 0) {
-        request->accept = g_string_new(info);
+    const char *vary = compressible ? "Vary: Accept-Encoding\r\n" : "";
+
+    int status = 200;
+    off_t start = 0;
+    off_t length = size;
+    if (static_not_modified(request, etag, mtime)) {
+        status = 304;
     }
-    else if (g_ascii_strcasecmp(token, "Accept-Language") == 0) {
-        request->accept_language = g_string_new(info);
+    else if (stream_gzip) {
+        stream_file_gzip(reply, request, root, file.fd, entry, last_modified, vary);
+        return;
     }
-    else if (g_ascii_strcasecmp(token, "Accept-Encoding") == 0) {
-        request->accept_encoding = g_string_new(info);
+    else if (request->range.len > 0) {
+        status = static_parse_range(request->range, size, &start, &length);
     }
-    else if (g_ascii_strcasecmp(token, "Connection") == 0) {
-        request->connection = g_string_new(info);
+
+    char *extra;
+    if (status == 206) {
+        extra = arena_printf(request->arena, NULL, "ETag: %s\r\n"
+                             "Last-Modified: %s\r\n"
+                             "Accept-Ranges: bytes\r\n"
+                             "Content-Range: bytes %lld-%lld/%lld\r\n"
+                             "%s",
+                             etag, last_modified,
+                             (long long) start, (long long) (start + length - 1), (long long) size, vary);
     }
-    else if (g_ascii_strcasecmp(token, "Expect") == 0) {
-        // Expectation failed
-        request->status_code = g_string_new("417");
+    else if (status == 416) {
+        extra = arena_printf(request->arena, NULL, "Content-Range: bytes */%lld\r\n", (long long) size);
+        length = 0;
     }
     else {
-        printf("%s\n", "parse error");
+        extra = arena_printf(request->arena, NULL, "ETag: %s\r\n"
+                             "Last-Modified: %s\r\n"
+                             "Accept-Ranges: bytes\r\n"
+                             "%s%s",
+                             etag, last_modified, encoding, vary);
     }
 
-    g_strfreev(split);
-}
-
-bool str_contains_query(const char* strv) {
-    for(size_t i = 0; i < sizeof(strv); i++) {
-        if (strv[i] == '?') {
-            return TRUE;
+    // Like HEAD, a 304 carries the Content-Length of the full response but no body. The length
+    // of a gzip body that would be compressed while it is sent is not known, so it has none.
+    request->status_code = status;
+    size_t content_length = stream_gzip ? RESPONSE_NO_LENGTH : (size_t) length;
+    StrView header = generate_header(request, status, content_type, content_length, extra, reply->close_conn);
+    output_add_mem(reply->output, reply->arena, header.str, header.len, NULL, NULL);
+    bool has_body = status != 304 && length > 0 && !view_equals(request->method, "HEAD");
+
+    if (has_body && body != NULL) {
+        // The entry stays alive until the body has been sent, even if it is evicted meanwhile.
+        file_cache_entry_ref(entry);
+        output_add_mem(reply->output, reply->arena, body + start, (size_t) length,
+                       file_cache_entry_unref, entry);
+    }
+    else if (has_body) {
+        // The body is sent straight from the page cache with sendfile(), after the header.
+        // A cached entry of a big file has no descriptor open, so it is opened again.
+        if (file.fd == -1) {
+            file.fd = openat(root, entry->file_name, O_RDONLY | O_CLOEXEC);
         }
+        if (file.fd == -1) {
+            // The header is queued already, all we can do is cut the connection short.
+            reply->close_conn = TRUE;
+            return;
+        }
+        output_add_file(reply->output, reply->arena, file.fd, start, (size_t) length);
+        file.fd = -1;
+    }
+    if (file.fd >= 0) {
+        close(file.fd);
     }
-    return FALSE;
 }
 
-bool fill_request(GString *message, Request *request)
-{   
-    // Split message into header and body
-    gchar **header_and_body = g_strsplit(message->str, "\r\n\r\n", 2);
-    // Immediatly assign body to request
-
-    g_string_truncate(request->msg_body, 0);
-    request->msg_body = g_string_new(header_and_body[1]);
-    
-    // Split the message on a newline to simplify extracting headers
-    gchar **first_line_and_the_rest = g_strsplit(header_and_body[0], "\r\n", 2);
-    
-    // header_1[0] = method, [1] = path,  [2] = version
-    gchar **header_1 = g_strsplit(first_line_and_the_rest[0], " ", 3);
+void stream_file_gzip(Reply *reply, Request *request, int root, int fd, FileCacheEntry *entry,
+                      const char *last_modified, const char *vary) {
+    // HTTP/1.0 has no chunked coding, the end of the body is the end of the connection.
+    bool http_1_0 = view_equals(request->http_version, "HTTP/1.0");
+    bool head = view_equals(request->method, "HEAD");
+    if (http_1_0 && !head) {
+        reply->close_conn = TRUE;
+    }
 
-    if (g_ascii_strcasecmp(header_1[0], "GET") == 0) {
-        request->method = g_string_new("GET");
+    char *extra = arena_printf(request->arena, NULL, "ETag: %s\r\n"
+                               "Last-Modified: %s\r\n"
+                               "Content-Encoding: gzip\r\n"
+                               "%s",
+                               entry->gzip_etag, last_modified, vary);
+    request->status_code = 200;
+    StrView header = generate_header(request, 200, entry->content_type, RESPONSE_STREAMED, extra, reply->close_conn);
+    output_add_mem(reply->output, reply->arena, header.str, header.len, NULL, NULL);
+
+    if (fd == -1 && !head) {
+        fd = openat(root, entry->file_name, O_RDONLY | O_CLOEXEC);
     }
-    else if (g_ascii_strcasecmp(header_1[0], "HEAD") == 0) {
-        request->method = g_string_new("HEAD");
+    if (head || fd == -1) {
+        // A failed open leaves a header without body, the connection has to end there.
+        if (fd == -1 && !head) {
+            reply->close_conn = TRUE;
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
     }
-    else if (g_ascii_strcasecmp(header_1[0], "POST") == 0) {
-        request->method = g_string_new("POST");
+
+    CompressStream *compress = compress_stream_new(opt_compress_level, fd, entry->size);
+    if (compress == NULL) {
+        reply->close_conn = TRUE;
+        return;
     }
-    else {
-        // Method not implemented
-        request->method = g_string_new(header_1[0]);
-        request->status_code = g_string_new("501");
-    }
-
-    
-    //check if we have a query in our path. 
-    if(str_contains_query(header_1[1])) {
-        // Since we have a query, we split the string on "?".
-        gchar **path_and_query = g_strsplit(header_1[1], "?", 2);
-
-        // Set the request values correctly.
-        request->path = g_string_new(path_and_query[0]);
-        request->query = g_string_new(path_and_query[1]);
-
-    } else {
-        request->path = g_string_new(header_1[1]);
-        request->query = g_string_new("");
-    }
-    
-    // Assign the http version.
-    request->http_version = g_string_new(header_1[2]);
-    if (g_ascii_strcasecmp(request->http_version->str, "HTTP/1.1") != 0 && g_ascii_strcasecmp(request->http_version->str, "HTTP/1.0") != 0) {
-        // HTTP version not supported
-        request->status_code = g_string_new("505");
-    }
-
-    if (g_ascii_strcasecmp(request->http_version->str, "HTTP/1.1") == 0) {
-        request->connection = g_string_new("Keep-Alive");
-    }
-    
-    // Split the header into separate lines and parse each line one at a time.
-    gchar **lines = g_strsplit(first_line_and_the_rest[1], "\r\n", -1);
-
-    for (guint i = 0; i < g_strv_length(lines); i++) {
-        parse_header(lines[i], request);
-    }
-
-    g_strfreev(header_and_body);
-    g_strfreev(first_line_and_the_rest);
-    g_strfreev(header_1);
-    g_strfreev(lines);
-    return true;
-}
-
-void init_request(Request *req) {
-    req->method = g_string_new(NULL);
-    req->path = g_string_new(NULL);
-    req->query = g_string_new(NULL);
-    req->http_version = g_string_new(NULL);
-    req->host = g_string_new(NULL);
-    req->user_agent = g_string_new(NULL);
-    req->content_type = g_string_new(NULL);
-    req->content_length = g_string_new(NULL);
-    req->accept = g_string_new(NULL);
-    req->accept_language = g_string_new(NULL);
-    req->accept_encoding = g_string_new(NULL);
-    req->connection = g_string_new(NULL);
-    req->msg_body = g_string_new(NULL);
-    req->status_code = g_string_new(NULL);
-}
-
-void reset_request(Request *req) {
-    g_string_free(req->method, TRUE);
-    g_string_free(req->path, TRUE);
-    g_string_free(req->query, TRUE);
-    g_string_free(req->http_version, TRUE);
-    g_string_free(req->host, TRUE);
-    g_string_free(req->user_agent, TRUE);
-    g_string_free(req->content_type, TRUE);
-    g_string_free(req->content_length, TRUE);
-    g_string_free(req->accept, TRUE);
-    g_string_free(req->accept_language, TRUE);
-    g_string_free(req->accept_encoding, TRUE);
-    g_string_free(req->connection, TRUE);
-    g_string_free(req->msg_body, TRUE);
-    g_string_free(req->status_code, TRUE);
+    reply->stream = stream_new(compress_stream_produce, compress_stream_free, compress, !http_1_0);
 }
 
 void write_to_log(Request *request, char *ip, uint16_t port) {
-    GDateTime *time = g_date_time_new_now_local();
-    gchar *date_time = g_date_time_format(time, "%Y-%m-%dT%H:%M:%SZ");
-    if (request->status_code->len == 0) {
-        request->status_code = g_string_new("200");
-    }
-    fprintf(logfile, "%s : %s:%d %s %s : %s\n", date_time, ip, port, request->method->str, request->path->str, request->status_code->str);
-    fflush(logfile);
-    g_date_time_unref(time);
-    
-}
\ No newline at end of file
+    // The timestamp is added by the log writer thread.
+    int status_code = request->status_code != 0 ? request->status_code : 200;
+    log_info("%s:%d %.*s %.*s : %d", ip, port,
+             (int) request->method.len, request->method.str, (int) request->path.len, request->path.str, status_code);
+}
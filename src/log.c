@@ -0,0 +1,274 @@
+/*
+ * log.c
+ *
+ * The ring is a bounded multi-producer queue in the style of Dmitry Vyukov's:
+ * every slot carries a sequence number that tells producers when the slot is
+ * free for their position and the writer when the record in it is complete.
+ * Producers claim a position with a compare-and-swap on head and format the
+ * message in place, so logging does not allocate or take a lock.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+// Batches are written out once this much has been collected, or the ring is empty.
+#define LOG_WRITE_BUFFER_SIZE (64 * 1024)
+
+typedef struct {
+    atomic_size_t seq;
+    time_t time;
+    int level;
+    size_t len;
+    char text[LOG_RECORD_SIZE];
+} LogRecord;
+
+atomic_int log_level = LOG_LEVEL_INFO;
+
+static LogRecord *ring;
+static atomic_size_t head;
+// Only touched by the writer thread.
+static size_t tail;
+static atomic_ulong dropped;
+static LogFullPolicy full_policy;
+
+static int log_fd = -1;
+static unsigned flush_interval_ms;
+static pthread_t writer;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_wakeup = PTHREAD_COND_INITIALIZER;
+static bool stopping;
+
+static const char *level_names[] = { "error", "warn", "info", "debug" };
+
+void log_set_level(int level) {
+    atomic_store_explicit(&log_level, level, memory_order_relaxed);
+}
+
+int log_level_from_name(const char *name) {
+    for (int level = 0; level < (int) G_N_ELEMENTS(level_names); level++) {
+        if (g_ascii_strcasecmp(name, level_names[level]) == 0) {
+            return level;
+        }
+    }
+    return -1;
+}
+
+static void wake_writer(void) {
+    pthread_mutex_lock(&writer_lock);
+    pthread_cond_signal(&writer_wakeup);
+    pthread_mutex_unlock(&writer_lock);
+}
+
+/* Claims the slot for the next record. Returns NULL if the ring is full and
+    the policy is to drop. */
+static LogRecord *claim_record(size_t *pos_out) {
+    size_t pos = atomic_load_explicit(&head, memory_order_relaxed);
+    while (TRUE) {
+        LogRecord *record = &ring[pos & (LOG_RING_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&record->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&head, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                *pos_out = pos;
+                return record;
+            }
+            // pos has been reloaded by the failed exchange.
+        }
+        else if (diff < 0) {
+            // The writer has not drained this slot yet, so the ring is full.
+            if (full_policy == LOG_FULL_DROP) {
+                atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+                return NULL;
+            }
+            wake_writer();
+            sched_yield();
+            pos = atomic_load_explicit(&head, memory_order_relaxed);
+        }
+        else {
+            pos = atomic_load_explicit(&head, memory_order_relaxed);
+        }
+    }
+}
+
+void log_write(int level, const char *format, ...) {
+    if (ring == NULL) {
+        return;
+    }
+    size_t pos;
+    LogRecord *record = claim_record(&pos);
+    if (record == NULL) {
+        return;
+    }
+
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(record->text, sizeof(record->text), format, args);
+    va_end(args);
+    record->len = n < 0 ? 0 : ((size_t) n < sizeof(record->text) ? (size_t) n : sizeof(record->text) - 1);
+    record->level = level;
+    // The time is only formatted by the writer thread.
+    record->time = time(NULL);
+
+    // Hands the slot over to the writer.
+    atomic_store_explicit(&record->seq, pos + 1, memory_order_release);
+}
+
+/* Formatted timestamps are cached, most records share their second with the previous one. */
+static size_t format_time(time_t t, char *buf) {
+    static time_t cached_time = -1;
+    static char cached[32];
+    static size_t cached_len;
+    if (t != cached_time) {
+        struct tm tm;
+        cached_len = strftime(cached, sizeof(cached), "%Y-%m-%dT%H:%M:%SZ", gmtime_r(&t, &tm));
+        cached_time = t;
+    }
+    memcpy(buf, cached, cached_len);
+    return cached_len;
+}
+
+static void write_all(const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(log_fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("write log");
+            return;
+        }
+        buf += n;
+        len -= (size_t) n;
+    }
+}
+
+/* Appends one line to the batch, writing the batch out first if it is full. */
+static void append_line(char *batch, size_t *used, time_t t, int level, const char *text, size_t len) {
+    // Timestamp, level tag, text and newline.
+    if (*used + 32 + 10 + len + 1 > LOG_WRITE_BUFFER_SIZE) {
+        write_all(batch, *used);
+        *used = 0;
+    }
+    *used += format_time(t, batch + *used);
+    // Access log lines keep the old "time : client request : status" format.
+    if (level == LOG_LEVEL_INFO) {
+        memcpy(batch + *used, " : ", 3);
+        *used += 3;
+    }
+    else {
+        *used += (size_t) sprintf(batch + *used, " [%s] ", level_names[level]);
+    }
+    memcpy(batch + *used, text, len);
+    *used += len;
+    batch[(*used)++] = '\n';
+}
+
+/* Writes out every complete record in the ring. */
+static void drain(char *batch) {
+    size_t used = 0;
+    while (TRUE) {
+        LogRecord *record = &ring[tail & (LOG_RING_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&record->seq, memory_order_acquire);
+        if (seq != tail + 1) {
+            break;
+        }
+        append_line(batch, &used, record->time, record->level, record->text, record->len);
+        // The slot is free again for the producer that comes around the ring next.
+        atomic_store_explicit(&record->seq, tail + LOG_RING_SIZE, memory_order_release);
+        tail++;
+    }
+
+    unsigned long lost = atomic_exchange_explicit(&dropped, 0, memory_order_relaxed);
+    if (lost > 0) {
+        char text[64];
+        int len = snprintf(text, sizeof(text), "%lu log records dropped, the ring was full", lost);
+        append_line(batch, &used, time(NULL), LOG_LEVEL_WARN, text, (size_t) len);
+    }
+    if (used > 0) {
+        write_all(batch, used);
+    }
+}
+
+static void *writer_run(void *data) {
+    (void) data;
+    char *batch = g_malloc(LOG_WRITE_BUFFER_SIZE);
+
+    pthread_mutex_lock(&writer_lock);
+    while (!stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += flush_interval_ms / 1000;
+        deadline.tv_nsec += (long) (flush_interval_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&writer_wakeup, &writer_lock, &deadline);
+
+        pthread_mutex_unlock(&writer_lock);
+        drain(batch);
+        pthread_mutex_lock(&writer_lock);
+    }
+    pthread_mutex_unlock(&writer_lock);
+
+    // Whatever was logged before log_close() still goes out.
+    drain(batch);
+    g_free(batch);
+    return NULL;
+}
+
+bool log_open(const char *path, unsigned flush_ms, LogFullPolicy policy) {
+    log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log_fd == -1) {
+        perror("Failed to open/create log file");
+        return FALSE;
+    }
+
+    ring = g_new0(LogRecord, LOG_RING_SIZE);
+    for (size_t i = 0; i < LOG_RING_SIZE; i++) {
+        atomic_init(&ring[i].seq, i);
+    }
+    atomic_init(&head, 0);
+    tail = 0;
+    full_policy = policy;
+    flush_interval_ms = flush_ms > 0 ? flush_ms : 1;
+    stopping = FALSE;
+
+    int r = pthread_create(&writer, NULL, writer_run, NULL);
+    if (r != 0) {
+        fprintf(stderr, "Could not start the log writer: %s\n", strerror(r));
+        g_free(ring);
+        ring = NULL;
+        close(log_fd);
+        log_fd = -1;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void log_close(void) {
+    if (ring == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&writer_lock);
+    stopping = TRUE;
+    pthread_cond_signal(&writer_wakeup);
+    pthread_mutex_unlock(&writer_lock);
+    pthread_join(writer, NULL);
+
+    g_free(ring);
+    ring = NULL;
+    close(log_fd);
+    log_fd = -1;
+}
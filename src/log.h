@@ -0,0 +1,76 @@
+/*
+ * log.h
+ *
+ * Asynchronous logger. The event loops format a record straight into a slot
+ * of a lock-free ring and go on; a background thread drains the ring every
+ * flush interval and writes the records out in large batches, so no request
+ * ever waits for a write() or fflush(). When the ring is full records are
+ * either dropped (and counted) or the caller waits for a free slot.
+ *
+ * The level can be changed at any time with log_set_level(). Messages below
+ * LOG_COMPILE_LEVEL are compiled out completely, the rest cost one branch
+ * while their level is disabled. Build with -DLOG_COMPILE_LEVEL=LOG_LEVEL_INFO
+ * to remove the debug messages.
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <glib.h>
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+// Longer messages are truncated.
+#define LOG_RECORD_SIZE 240
+#define LOG_RING_SIZE 4096
+
+typedef enum {
+    LOG_FULL_DROP,
+    LOG_FULL_BLOCK
+} LogFullPolicy;
+
+// Messages above this level are not logged. Only changed through log_set_level().
+extern atomic_int log_level;
+
+#define log_enabled(level) \
+    ((level) <= LOG_COMPILE_LEVEL && (level) <= atomic_load_explicit(&log_level, memory_order_relaxed))
+
+#define log_at(level, ...) \
+    do { \
+        if (log_enabled(level)) { \
+            log_write(level, __VA_ARGS__); \
+        } \
+    } while (0)
+
+#define log_error(...) log_at(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_info(...) log_at(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+/* Opens (appends to) the log file and starts the writer thread, which
+    writes out what has been logged every flush_ms milliseconds. */
+bool log_open(const char *path, unsigned flush_ms, LogFullPolicy policy);
+
+/* Writes out everything that is still in the ring, stops the writer thread
+    and closes the file. */
+void log_close(void);
+
+void log_set_level(int level);
+
+/* Parses "error", "warn", "info" or "debug". Returns -1 for anything else. */
+int log_level_from_name(const char *name);
+
+/* Queues one message. Use the log_* macros instead, they skip the call
+    (and the formatting) when the level is disabled. */
+void log_write(int level, const char *format, ...) G_GNUC_PRINTF(2, 3);
+
+#endif
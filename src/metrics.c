@@ -0,0 +1,164 @@
+/*
+ * metrics.c
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include "metrics.h"
+
+static const char *phase_names[PHASE_COUNT] = { "accept", "recv", "parse", "generate", "send", "total" };
+
+// The le buckets of the Prometheus histograms. A bound falls into one of our
+// buckets, which is counted whole, so a bucket may hold values up to 1.6% above it.
+static const struct {
+    uint64_t ns;
+    const char *label;
+} bounds[] = {
+    { 1000, "0.000001" }, { 2500, "0.0000025" }, { 5000, "0.000005" },
+    { 10000, "0.00001" }, { 25000, "0.000025" }, { 50000, "0.00005" },
+    { 100000, "0.0001" }, { 250000, "0.00025" }, { 500000, "0.0005" },
+    { 1000000, "0.001" }, { 2500000, "0.0025" }, { 5000000, "0.005" },
+    { 10000000, "0.01" }, { 25000000, "0.025" }, { 50000000, "0.05" },
+    { 100000000, "0.1" }, { 250000000, "0.25" }, { 500000000, "0.5" },
+    { 1000000000, "1" }, { 2500000000, "2.5" }, { 5000000000, "5" }, { 10000000000, "10" },
+};
+
+static const struct {
+    double p;
+    const char *label;
+} quantiles[] = {
+    { 0.5, "0.5" }, { 0.9, "0.9" }, { 0.99, "0.99" }, { 0.999, "0.999" },
+};
+
+static uint64_t get(const uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+void metrics_init(Metrics *metrics) {
+    memset(metrics, 0, sizeof(*metrics));
+}
+
+uint64_t metrics_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+uint64_t metrics_phase(Metrics *metrics, MetricsPhase phase, uint64_t start_ns) {
+    uint64_t now = metrics_now_ns();
+    histogram_record(&metrics->phases[phase], now - start_ns);
+    return now;
+}
+
+void metrics_status(Metrics *metrics, int status) {
+    if (status == 0) {
+        status = 200;
+    }
+    if (status >= METRICS_STATUS_MIN && status < METRICS_STATUS_MAX) {
+        metrics_count(&metrics->status[status - METRICS_STATUS_MIN], 1);
+    }
+}
+
+void metrics_merge(Metrics *into, const Metrics *from) {
+    for (int phase = 0; phase < PHASE_COUNT; phase++) {
+        histogram_merge(&into->phases[phase], &from->phases[phase]);
+    }
+    into->connections += get(&from->connections);
+    into->closed += get(&from->closed);
+    into->accept_wakeups += get(&from->accept_wakeups);
+    into->empty_reads += get(&from->empty_reads);
+    into->timeouts += get(&from->timeouts);
+    into->requests += get(&from->requests);
+    into->bytes_in += get(&from->bytes_in);
+    into->bytes_out += get(&from->bytes_out);
+    into->upstream_connects += get(&from->upstream_connects);
+    into->upstream_requests += get(&from->upstream_requests);
+    into->shed_connections += get(&from->shed_connections);
+    into->shed_requests += get(&from->shed_requests);
+    for (int s = 0; s < METRICS_STATUS_MAX - METRICS_STATUS_MIN; s++) {
+        into->status[s] += get(&from->status[s]);
+    }
+}
+
+static void render_counter(GString *out, const char *name, const char *help, const char *type, uint64_t value) {
+    g_string_append_printf(out, "# HELP %s %s\n# TYPE %s %s\n%s %" G_GUINT64_FORMAT "\n",
+                           name, help, name, type, name, value);
+}
+
+void metrics_render(const Metrics *metrics, int workers, GString *out) {
+    render_counter(out, "httpd_workers", "Worker threads.", "gauge", (uint64_t) workers);
+    render_counter(out, "httpd_connections_accepted_total", "Connections accepted.", "counter",
+                   metrics->connections);
+    // A connection is accepted by one worker and closed by the same one, but not at the same time as
+    // the counters are read, so the difference may be off by a few for a moment.
+    uint64_t open = metrics->connections > metrics->closed ? metrics->connections - metrics->closed : 0;
+    render_counter(out, "httpd_connections_open", "Connections currently open.", "gauge", open);
+    render_counter(out, "httpd_accept_wakeups_total", "Times a worker was woken up to accept connections.",
+                   "counter", metrics->accept_wakeups);
+    render_counter(out, "httpd_empty_reads_total", "Reads of a connection that found no data.", "counter",
+                   metrics->empty_reads);
+    render_counter(out, "httpd_connection_timeouts_total", "Connections closed for being idle too long.",
+                   "counter", metrics->timeouts);
+    render_counter(out, "httpd_requests_total", "Requests answered.", "counter", metrics->requests);
+    render_counter(out, "httpd_received_bytes_total", "Bytes received from clients.", "counter",
+                   metrics->bytes_in);
+    render_counter(out, "httpd_sent_bytes_total", "Bytes sent to clients.", "counter", metrics->bytes_out);
+    render_counter(out, "httpd_upstream_connects_total", "Connections opened to upstream servers.", "counter",
+                   metrics->upstream_connects);
+    render_counter(out, "httpd_upstream_requests_total", "Requests forwarded to upstream servers.", "counter",
+                   metrics->upstream_requests);
+    render_counter(out, "httpd_shed_connections_total", "Connections turned away with 503 for being over "
+                   "the connection limit.", "counter", metrics->shed_connections);
+    render_counter(out, "httpd_shed_requests_total", "Requests turned away with 503 for having waited "
+                   "too long.", "counter", metrics->shed_requests);
+
+    g_string_append(out, "# HELP httpd_responses_total Responses by status code.\n"
+                     "# TYPE httpd_responses_total counter\n");
+    for (int s = 0; s < METRICS_STATUS_MAX - METRICS_STATUS_MIN; s++) {
+        if (metrics->status[s] > 0) {
+            g_string_append_printf(out, "httpd_responses_total{code=\"%d\"} %" G_GUINT64_FORMAT "\n",
+                                   s + METRICS_STATUS_MIN, metrics->status[s]);
+        }
+    }
+
+    g_string_append(out, "# HELP httpd_phase_duration_seconds Time spent per phase of handling requests.\n"
+                     "# TYPE httpd_phase_duration_seconds histogram\n");
+    for (int phase = 0; phase < PHASE_COUNT; phase++) {
+        const Histogram *histogram = &metrics->phases[phase];
+        // The buckets and bounds both go up, so one pass over each adds up the cumulative counts.
+        uint64_t count = 0;
+        int bucket = 0;
+        for (size_t i = 0; i < G_N_ELEMENTS(bounds); i++) {
+            int last = histogram_bucket(bounds[i].ns);
+            for (; bucket <= last; bucket++) {
+                count += histogram->counts[bucket];
+            }
+            g_string_append_printf(out, "httpd_phase_duration_seconds_bucket{phase=\"%s\",le=\"%s\"} %"
+                                   G_GUINT64_FORMAT "\n", phase_names[phase], bounds[i].label, count);
+        }
+        g_string_append_printf(out, "httpd_phase_duration_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %"
+                               G_GUINT64_FORMAT "\n", phase_names[phase], histogram->total);
+        g_string_append_printf(out, "httpd_phase_duration_seconds_sum{phase=\"%s\"} %.9f\n",
+                               phase_names[phase], (double) histogram->sum / 1e9);
+        g_string_append_printf(out, "httpd_phase_duration_seconds_count{phase=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                               phase_names[phase], histogram->total);
+    }
+
+    // The buckets above are too coarse for the tail, these come straight from the fine-grained ones.
+    g_string_append(out, "# HELP httpd_phase_duration_quantile_seconds Percentiles of the phase durations "
+                     "since the start.\n# TYPE httpd_phase_duration_quantile_seconds gauge\n");
+    for (int phase = 0; phase < PHASE_COUNT; phase++) {
+        for (size_t q = 0; q < G_N_ELEMENTS(quantiles); q++) {
+            uint64_t ns = histogram_percentile(&metrics->phases[phase], quantiles[q].p);
+            g_string_append_printf(out, "httpd_phase_duration_quantile_seconds{phase=\"%s\",quantile=\"%s\"} %.9f\n",
+                                   phase_names[phase], quantiles[q].label, (double) ns / 1e9);
+        }
+    }
+    g_string_append(out, "# HELP httpd_phase_duration_max_seconds Longest phase duration since the start.\n"
+                     "# TYPE httpd_phase_duration_max_seconds gauge\n");
+    for (int phase = 0; phase < PHASE_COUNT; phase++) {
+        g_string_append_printf(out, "httpd_phase_duration_max_seconds{phase=\"%s\"} %.9f\n",
+                               phase_names[phase], (double) metrics->phases[phase].max / 1e9);
+    }
+}
@@ -0,0 +1,78 @@
+/*
+ * metrics.h
+ *
+ * Counters and latency histograms of a worker, served on /__metrics. Every
+ * worker only ever writes its own Metrics, with relaxed atomic stores, so
+ * recording takes no lock and shares no cache line with other workers. The
+ * worker that answers /__metrics adds them all up while they keep changing.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <glib.h>
+
+#include "histogram.h"
+
+// The reserved path the metrics are served on.
+#define METRICS_PATH "/__metrics"
+
+/* The parts of handling a request that are timed, in nanoseconds. */
+typedef enum {
+    PHASE_ACCEPT,     // accepting a connection and setting it up
+    PHASE_RECV,       // one recv() that returned data
+    PHASE_PARSE,      // fill_request() of a complete request head
+    PHASE_GENERATE,   // building and queueing the response
+    PHASE_SEND,       // one writev()/sendfile() round that sent data
+    PHASE_TOTAL,      // from the read that brought a request in until its last byte was sent
+    PHASE_COUNT
+} MetricsPhase;
+
+// Status codes counted one by one.
+#define METRICS_STATUS_MIN 100
+#define METRICS_STATUS_MAX 600
+
+typedef struct {
+    Histogram phases[PHASE_COUNT];
+    uint64_t connections;
+    uint64_t closed;
+    // Wakeups of the listening socket, and reads that found nothing to read.
+    uint64_t accept_wakeups;
+    uint64_t empty_reads;
+    uint64_t timeouts;
+    uint64_t requests;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    // Connections opened to upstream servers and requests forwarded to them, see proxy.h.
+    uint64_t upstream_connects;
+    uint64_t upstream_requests;
+    // Connections over --max-connections and requests over --shed-delay, answered with 503.
+    uint64_t shed_connections;
+    uint64_t shed_requests;
+    uint64_t status[METRICS_STATUS_MAX - METRICS_STATUS_MIN];
+} Metrics;
+
+void metrics_init(Metrics *metrics);
+
+/* The monotonic clock in nanoseconds, what phases are timed with. */
+uint64_t metrics_now_ns(void);
+
+/* Adds n to a counter of the calling worker's own Metrics. */
+static inline void metrics_count(uint64_t *counter, uint64_t n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+/* Records the time from start_ns until now for phase. Returns now, so the next phase can start there. */
+uint64_t metrics_phase(Metrics *metrics, MetricsPhase phase, uint64_t start_ns);
+
+/* Counts a response with status code (0 means 200). */
+void metrics_status(Metrics *metrics, int status);
+
+/* Adds from to into. from may change meanwhile, into may not. */
+void metrics_merge(Metrics *into, const Metrics *from);
+
+/* Appends metrics in the Prometheus text format to out. */
+void metrics_render(const Metrics *metrics, int workers, GString *out);
+
+#endif
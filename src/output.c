@@ -0,0 +1,221 @@
+/*
+ * output.c
+ *
+ * Flushing gathers the memory segments at the front of the queue into one
+ * iovec array, so a header and its body (or a batch of pipelined responses)
+ * cost a single writev().
+ */
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "output.h"
+
+// The most bytes one sendfile() is asked for. It only bounds each call, output_flush()
+// goes on with the next one until the socket is full.
+#define OUTPUT_SENDFILE_CHUNK (1 << 20)
+
+void output_init(OutputQueue *queue) {
+    queue->head = NULL;
+    queue->tail = &queue->head;
+    queue->bytes = 0;
+}
+
+static void add_segment(OutputQueue *queue, OutputSegment *segment) {
+    segment->next = NULL;
+    *queue->tail = segment;
+    queue->tail = &segment->next;
+    queue->bytes += segment->len;
+}
+
+void output_add_mem(OutputQueue *queue, Arena *arena, const char *data, size_t len,
+                    OutputRelease release, void *release_data) {
+    if (len == 0) {
+        if (release != NULL) {
+            release(release_data);
+        }
+        return;
+    }
+    OutputSegment *segment = arena_alloc(arena, sizeof(OutputSegment));
+    segment->data = data;
+    segment->fd = -1;
+    segment->offset = 0;
+    segment->len = len;
+    segment->release = release;
+    segment->release_data = release_data;
+    segment->borrowed = false;
+    add_segment(queue, segment);
+}
+
+void output_add_file(OutputQueue *queue, Arena *arena, int fd, off_t offset, size_t len) {
+    if (len == 0) {
+        close(fd);
+        return;
+    }
+    OutputSegment *segment = arena_alloc(arena, sizeof(OutputSegment));
+    segment->data = NULL;
+    segment->fd = fd;
+    segment->offset = offset;
+    segment->len = len;
+    segment->release = NULL;
+    segment->release_data = NULL;
+    segment->borrowed = false;
+    add_segment(queue, segment);
+}
+
+/* Removes the head segment and gives back what it holds. */
+static void pop_segment(OutputQueue *queue) {
+    OutputSegment *segment = queue->head;
+    queue->head = segment->next;
+    if (queue->head == NULL) {
+        queue->tail = &queue->head;
+    }
+    queue->bytes -= segment->len;
+    if (segment->borrowed) {
+        return;
+    }
+    if (segment->fd >= 0) {
+        close(segment->fd);
+    }
+    if (segment->release != NULL) {
+        segment->release(segment->release_data);
+    }
+}
+
+void output_consume(OutputQueue *queue, size_t n) {
+    while (n > 0) {
+        OutputSegment *segment = queue->head;
+        if (n < segment->len) {
+            if (segment->data != NULL) {
+                segment->data += n;
+            }
+            else {
+                segment->offset += (off_t) n;
+            }
+            segment->len -= n;
+            queue->bytes -= n;
+            return;
+        }
+        n -= segment->len;
+        pop_segment(queue);
+    }
+}
+
+int output_iov(const OutputQueue *queue, struct iovec *iov, int max) {
+    int count = 0;
+    for (OutputSegment *segment = queue->head; segment != NULL && segment->data != NULL &&
+             count < max; segment = segment->next) {
+        iov[count].iov_base = (void *) segment->data;
+        iov[count].iov_len = segment->len;
+        count++;
+    }
+    return count;
+}
+
+/* True if the segment after the first count ones is a file segment. */
+static bool file_follows(const OutputQueue *queue, int count) {
+    OutputSegment *segment = queue->head;
+    for (int i = 0; i < count && segment != NULL; i++) {
+        segment = segment->next;
+    }
+    return segment != NULL && segment->data == NULL;
+}
+
+static void set_cork(int sockfd, int on) {
+    setsockopt(sockfd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+OutputResult output_flush(OutputQueue *queue, int sockfd, size_t *sent) {
+    // A header in memory in front of a file would leave as a small packet of its own (the
+    // sockets have TCP_NODELAY). Corked, it fills the first packets together with the file.
+    bool corked = false;
+    OutputResult result = OUTPUT_DONE;
+    while (queue->head != NULL) {
+        ssize_t n;
+        if (queue->head->data != NULL) {
+            struct iovec iov[OUTPUT_IOV_MAX];
+            int count = output_iov(queue, iov, OUTPUT_IOV_MAX);
+            if (!corked && file_follows(queue, count)) {
+                set_cork(sockfd, 1);
+                corked = true;
+            }
+            n = writev(sockfd, iov, count);
+        }
+        else {
+            OutputSegment *segment = queue->head;
+            size_t count = segment->len < OUTPUT_SENDFILE_CHUNK ? segment->len : OUTPUT_SENDFILE_CHUNK;
+            n = sendfile(sockfd, segment->fd, &segment->offset, count);
+            if (n == 0) {
+                // The file shrank underneath us, the response can not be completed.
+                result = OUTPUT_ERROR;
+                break;
+            }
+            // sendfile() has moved the offset already, output_consume() must not do it again.
+            if (n > 0) {
+                segment->offset -= n;
+            }
+        }
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EWOULDBLOCK || errno == EAGAIN) {
+                result = OUTPUT_AGAIN;
+                break;
+            }
+            // A failed send only affects this client.
+            if (errno != EPIPE && errno != ECONNRESET) {
+                perror("send");
+            }
+            result = OUTPUT_ERROR;
+            break;
+        }
+        output_consume(queue, (size_t) n);
+        *sent += (size_t) n;
+    }
+    // Uncorking sends whatever is held back, the socket is never left corked.
+    if (corked) {
+        set_cork(sockfd, 0);
+    }
+    return result;
+}
+
+size_t output_move(OutputQueue *from, OutputQueue *to, Arena *arena, size_t max) {
+    size_t moved = 0;
+    while (from->head != NULL && moved < max) {
+        OutputSegment *source = from->head;
+        OutputSegment *segment = arena_alloc(arena, sizeof(OutputSegment));
+        *segment = *source;
+        if (source->len <= max - moved) {
+            // The whole segment: taken off from without giving back what it holds.
+            from->head = source->next;
+            if (from->head == NULL) {
+                from->tail = &from->head;
+            }
+            from->bytes -= source->len;
+        }
+        else {
+            segment->len = max - moved;
+            segment->release = NULL;
+            segment->release_data = NULL;
+            segment->borrowed = true;
+            output_consume(from, segment->len);
+        }
+        moved += segment->len;
+        add_segment(to, segment);
+    }
+    return moved;
+}
+
+void output_clear(OutputQueue *queue) {
+    while (queue->head != NULL) {
+        pop_segment(queue);
+    }
+}
@@ -0,0 +1,91 @@
+/*
+ * output.h
+ *
+ * The output queue of a connection: a list of segments that are sent in
+ * order. A memory segment points at bytes owned by someone else (the
+ * connection's arena, a file cache entry), a file segment is a range of an
+ * open file. Consecutive memory segments go out with one writev(), file
+ * segments with sendfile(), so a response is never copied into a send buffer.
+ */
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "arena.h"
+
+// Segments sent by one writev().
+#define OUTPUT_IOV_MAX 64
+
+/* Called once a segment has been sent (or dropped) with the data given to output_add_*(). */
+typedef void (*OutputRelease)(void *data);
+
+typedef struct OutputSegment OutputSegment;
+
+struct OutputSegment {
+    OutputSegment *next;
+    // NULL for a file segment.
+    const char *data;
+    int fd;
+    off_t offset;
+    // Bytes not sent yet.
+    size_t len;
+    OutputRelease release;
+    void *release_data;
+    // A piece of a segment that was moved on in parts by output_move(), the last part
+    // closes fd and releases the data.
+    bool borrowed;
+};
+
+typedef struct {
+    OutputSegment *head;
+    OutputSegment **tail;
+    // Bytes queued in all segments.
+    size_t bytes;
+} OutputQueue;
+
+typedef enum {
+    OUTPUT_DONE,
+    OUTPUT_AGAIN,
+    OUTPUT_ERROR
+} OutputResult;
+
+void output_init(OutputQueue *queue);
+
+/* Queues len bytes at data. The segment is allocated from arena, which must
+    not be reset before the queue is empty. release (may be NULL) is called
+    with release_data when the bytes are no longer needed. */
+void output_add_mem(OutputQueue *queue, Arena *arena, const char *data, size_t len,
+                    OutputRelease release, void *release_data);
+
+/* Queues len bytes of fd starting at offset. fd is closed when the segment is done. */
+void output_add_file(OutputQueue *queue, Arena *arena, int fd, off_t offset, size_t len);
+
+/* Sends as much of the queue to sockfd as it takes. *sent is increased by
+    the number of bytes sent. OUTPUT_AGAIN means the socket is full. */
+OutputResult output_flush(OutputQueue *queue, int sockfd, size_t *sent);
+
+/* Fills iov with the memory segments at the front of the queue, at most max.
+    Returns how many, 0 if the queue is empty or starts with a file segment. */
+int output_iov(const OutputQueue *queue, struct iovec *iov, int max);
+
+/* Marks n bytes from the front of the queue as sent, for senders other than output_flush(). */
+void output_consume(OutputQueue *queue, size_t n);
+
+/* Moves up to max bytes from the front of from to the back of to, the new segments
+    are allocated from arena. What a whole segment holds goes along with it, a segment
+    that is split stays responsible for its data in from. Returns the bytes moved. */
+size_t output_move(OutputQueue *from, OutputQueue *to, Arena *arena, size_t max);
+
+/* Drops everything still queued. */
+void output_clear(OutputQueue *queue);
+
+static inline bool output_empty(const OutputQueue *queue) {
+    return queue->head == NULL;
+}
+
+#endif
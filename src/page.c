@@ -0,0 +1,88 @@
+/*
+ * page.c
+ */
+
+#include <string.h>
+
+#include "page.h"
+#include "response.h"
+
+StrView generate_header(Request *request, int status_code, const char *content_type,
+                        size_t content_length, const char *extra_headers, bool close_conn) {
+    // Requests that could not be parsed have no usable version to echo.
+    bool http_1_0 = view_equals(request->http_version, "HTTP/1.0");
+    return response_header(request->arena, http_1_0, status_code, content_type, content_length,
+                           extra_headers, close_conn);
+}
+
+StrView generate_response(Request *request, StrView html, bool close_conn, Compressor *compressor,
+                          StrView *body) {
+    const char *extra = "";
+    if (request->status_code == 405) {
+        extra = "Allow: GET, POST, HEAD\r\n";
+    }
+
+    // Pages above the threshold are compressed into the arena if the client takes gzip or deflate.
+    if (request->status_code == 0 && compressor != NULL && html.len >= compressor->min_size) {
+        ContentEncoding encoding = compress_negotiate(request->accept_encoding);
+        char *compressed = NULL;
+        size_t compressed_len = 0;
+        if (encoding != ENCODING_IDENTITY) {
+            compressed = arena_alloc(request->arena, compress_bound(html.len));
+        }
+        if (compressed != NULL && compress_buffer(compressor, encoding, html.str, html.len,
+                                                  compressed, &compressed_len)) {
+            html.str = compressed;
+            html.len = compressed_len;
+            extra = arena_printf(request->arena, NULL, "Content-Encoding: %s\r\n"
+                                 "Vary: Accept-Encoding\r\n", compress_encoding_name(encoding));
+        }
+        else {
+            extra = "Vary: Accept-Encoding\r\n";
+        }
+    }
+
+    // Error responses have no body. HEAD gets the headers of a GET, Content-Length included.
+    size_t content_length = request->status_code == 0 ? html.len : 0;
+    bool has_body = content_length > 0 && !view_equals(request->method, "HEAD");
+
+    StrView header = generate_header(request, request->status_code, "text/html; charset=utf-8",
+                                     content_length, extra, close_conn);
+
+    // The body must match Content-Length, otherwise the next response on a kept alive connection breaks.
+    body->str = html.str;
+    body->len = has_body ? html.len : 0;
+    return header;
+}
+
+// The echo page, with the request body in between.
+#define PAGE_BEFORE "<!DOCTYPE html>\n<html>\n<head>\r\n\t" \
+                    "<title>S00b3r 1337 r3sp0ns3 p4g3</title>\n</head>\n<body>\n" \
+                    "\thttp://%.*s%.*s%s%.*s %s:%d\n" \
+                    "\t"
+#define PAGE_AFTER "\n</body>\n</html>"
+
+StrView generate_html(Request *request, char *ip, uint16_t port) {
+    StrView html;
+    const char *separator = request->query.len > 0 ? "?" : "";
+
+    html.str = arena_printf(request->arena, &html.len, PAGE_BEFORE "%.*s" PAGE_AFTER,
+                        (int) request->host.len, request->host.str,
+                        (int) request->path.len, request->path.str, separator,
+                        (int) request->query.len, request->query.str, ip, port,
+                        (int) request->msg_body.len, request->msg_body.str);
+    return html;
+}
+
+StrView generate_html_around(Request *request, char *ip, uint16_t port, StrView *after) {
+    StrView before;
+    const char *separator = request->query.len > 0 ? "?" : "";
+
+    before.str = arena_printf(request->arena, &before.len, PAGE_BEFORE,
+                        (int) request->host.len, request->host.str,
+                        (int) request->path.len, request->path.str, separator,
+                        (int) request->query.len, request->query.str, ip, port);
+    after->str = PAGE_AFTER;
+    after->len = sizeof(PAGE_AFTER) - 1;
+    return before;
+}
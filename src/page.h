@@ -0,0 +1,39 @@
+/*
+ * page.h
+ *
+ * The generated echo page and the responses built around it: the page
+ * shows the requested URL, the client's address and the request body.
+ * Everything is allocated from the request's arena.
+ */
+
+#ifndef PAGE_H
+#define PAGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "compress.h"
+#include "request.h"
+
+/* Assembles the status line and headers of a response (status 0 means 200)
+    into the request's arena from the fragments in response.c. extra_headers
+    is inserted as is. */
+StrView generate_header(Request *request, int status_code, const char *content_type,
+                        size_t content_length, const char *extra_headers, bool close_conn);
+
+/* Generates the response to send back. 
+    Returns the header and sets body to the part of html to send after it (empty if none).
+    With a compressor, pages of at least its min_size are compressed as the request's
+    Accept-Encoding allows. */
+StrView generate_response(Request *request, StrView html, bool close_conn, Compressor *compressor,
+                          StrView *body);
+
+/* Generate the in memory html response, allocated from the request's arena */
+StrView generate_html(Request *request, char *ip, uint16_t port);
+
+/* The echo page for a body that is not in memory: returns the html that goes
+    before the body and sets after to what follows it. */
+StrView generate_html_around(Request *request, char *ip, uint16_t port, StrView *after);
+
+#endif
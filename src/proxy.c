@@ -0,0 +1,877 @@
+/*
+ * proxy.c
+ *
+ * An upstream connection carries one exchange at a time. The request goes
+ * out through its own OutputQueue: head and buffered body from its arena,
+ * streamed body pieces as copies that are freed once sent. The response head
+ * is read into a small buffer and rewritten for the client, the body is read
+ * straight into the client's stream buffers after that.
+ */
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include "arena.h"
+#include "log.h"
+#include "output.h"
+#include "proxy.h"
+#include "response.h"
+
+// The largest response head taken from an upstream. Rewritten it has to fit in one stream buffer.
+#define PROXY_HEAD_MAX 8192
+// What the rewritten head may add to it: the Content-Length or Transfer-Encoding and the
+// Connection lines.
+#define PROXY_HEAD_EXTRA 64
+// A chunk framed here: size line with a fixed number of digits, data, CRLF.
+#define CHUNK_PREFIX (sizeof("00000000\r\n") - 1)
+#define CHUNK_SUFFIX 2
+#define LAST_CHUNK "0\r\n\r\n"
+
+typedef struct {
+    // As given on the command line, for the Host header and the log.
+    char *name;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+} Upstream;
+
+typedef struct {
+    // The upstreams of the route are upstreams[first .. first + count).
+    int first;
+    int count;
+} Route;
+
+// Set up before the workers start and only read after that.
+static Upstream *upstreams = NULL;
+static int upstream_count = 0;
+static Route *routes = NULL;
+static int route_count = 0;
+
+typedef struct {
+    // Idle connections, the last one used first.
+    ProxyConn *idle;
+    int idle_count;
+    // Exchanges in flight, what least-conn goes by.
+    int active;
+} Pool;
+
+struct Proxy {
+    EventLoop *loop;
+    Metrics *metrics;
+    ProxyBalance balance;
+    int max_idle;
+    ProxyWake wake;
+    Pool *pools;      // one per upstream
+    unsigned *next;   // round-robin position per route
+    ProxyConn *dead;
+};
+
+typedef enum {
+    FRAMING_NONE,      // no body
+    FRAMING_LENGTH,    // Content-Length
+    FRAMING_CHUNKED,
+    FRAMING_CLOSE      // ends when the upstream closes the connection
+} Framing;
+
+typedef enum {
+    EXCHANGE_HEAD,
+    EXCHANGE_BODY,
+    EXCHANGE_DONE
+} ExchangeState;
+
+// Where the chunk scanner is in a chunked body.
+typedef enum {
+    CHUNK_SIZE,
+    CHUNK_EXTENSION,
+    CHUNK_SIZE_LF,
+    CHUNK_DATA,
+    CHUNK_DATA_CR,
+    CHUNK_DATA_LF,
+    CHUNK_TRAILER,       // at the start of a trailer line
+    CHUNK_TRAILER_LINE,
+    CHUNK_TRAILER_LF,
+    CHUNK_END_LF,
+    CHUNK_END,
+    CHUNK_INVALID
+} ChunkState;
+
+struct ProxyConn {
+    EventHandler handler;
+    Proxy *proxy;
+    int upstream;
+    // In the idle list of the pool or the dead list of the proxy.
+    ProxyConn *next;
+    bool connecting;
+    // The connection may carry another exchange after this one.
+    bool reusable;
+
+    // The exchange, client is NULL while the connection is idle.
+    void *client;
+    Arena arena;
+    OutputQueue out;
+    size_t body_left;     // request body still to come from the client
+    bool failed;          // no connection, the client gets a 502
+    bool broken;          // sending failed, the rest of the request is dropped
+    bool head_request;
+    bool client_1_0;
+    bool close_client;
+    ExchangeState state;
+
+    // The response head, and from in_pos on the body bytes that came with it.
+    char in[PROXY_HEAD_MAX];
+    size_t in_len;
+    size_t in_pos;
+    Framing framing;
+    uint64_t remaining;   // FRAMING_LENGTH
+    ChunkState chunk_state;
+    uint64_t chunk_left;
+    // Chunked coding is removed for an HTTP/1.0 client and added to a close-delimited
+    // body for an HTTP/1.1 one, which keeps its connection that way.
+    bool decode;
+    bool encode;
+};
+
+static void proxy_ready(EventHandler *handler, uint32_t events);
+
+static bool add_upstream(const char *target) {
+    // The port follows the last colon, an IPv6 address is in brackets.
+    const char *colon = strrchr(target, ':');
+    if (colon == NULL || colon == target || colon[1] == '\0') {
+        fprintf(stderr, "Proxy upstream %s: expected HOST:PORT\n", target);
+        return FALSE;
+    }
+    char *host;
+    if (target[0] == '[' && colon[-1] == ']') {
+        host = g_strndup(target + 1, (gsize) (colon - target - 2));
+    }
+    else {
+        host = g_strndup(target, (gsize) (colon - target));
+    }
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV;
+    struct addrinfo *result;
+    int r = getaddrinfo(host, colon + 1, &hints, &result);
+    g_free(host);
+    if (r != 0) {
+        fprintf(stderr, "Proxy upstream %s: %s\n", target, gai_strerror(r));
+        return FALSE;
+    }
+    upstreams = g_renew(Upstream, upstreams, upstream_count + 1);
+    Upstream *upstream = &upstreams[upstream_count++];
+    upstream->name = g_strdup(target);
+    memcpy(&upstream->addr, result->ai_addr, result->ai_addrlen);
+    upstream->addr_len = result->ai_addrlen;
+    freeaddrinfo(result);
+    return TRUE;
+}
+
+int proxy_add_route(const char *targets) {
+    if (targets[0] == '\0') {
+        fprintf(stderr, "Proxy route: expected HOST:PORT[,HOST:PORT...]\n");
+        return -1;
+    }
+    Route route;
+    route.first = upstream_count;
+    route.count = 0;
+    gchar **split = g_strsplit(targets, ",", -1);
+    for (int i = 0; split[i] != NULL; i++) {
+        if (!add_upstream(split[i])) {
+            g_strfreev(split);
+            return -1;
+        }
+        route.count++;
+    }
+    g_strfreev(split);
+    routes = g_renew(Route, routes, route_count + 1);
+    routes[route_count] = route;
+    return route_count++;
+}
+
+Proxy *proxy_new(EventLoop *loop, Metrics *metrics, ProxyBalance balance, int max_idle, ProxyWake wake) {
+    Proxy *proxy = g_new0(Proxy, 1);
+    proxy->loop = loop;
+    proxy->metrics = metrics;
+    proxy->balance = balance;
+    proxy->max_idle = max_idle;
+    proxy->wake = wake;
+    proxy->pools = g_new0(Pool, upstream_count > 0 ? upstream_count : 1);
+    proxy->next = g_new0(unsigned, route_count > 0 ? route_count : 1);
+    return proxy;
+}
+
+/* Closes conn, which is freed by the next proxy_collect(). */
+static void close_conn(ProxyConn *conn) {
+    Proxy *proxy = conn->proxy;
+    event_loop_remove(proxy->loop, &conn->handler);
+    close(conn->handler.fd);
+    output_clear(&conn->out);
+    conn->next = proxy->dead;
+    proxy->dead = conn;
+}
+
+void proxy_collect(Proxy *proxy) {
+    while (proxy->dead != NULL) {
+        ProxyConn *conn = proxy->dead;
+        proxy->dead = conn->next;
+        arena_destroy(&conn->arena);
+        g_free(conn);
+    }
+}
+
+void proxy_free(Proxy *proxy) {
+    for (int i = 0; i < upstream_count; i++) {
+        Pool *pool = &proxy->pools[i];
+        while (pool->idle != NULL) {
+            ProxyConn *conn = pool->idle;
+            pool->idle = conn->next;
+            close_conn(conn);
+        }
+    }
+    proxy_collect(proxy);
+    g_free(proxy->pools);
+    g_free(proxy->next);
+    g_free(proxy);
+}
+
+/* An idle connection has nothing to read. If it has, or the read fails, the
+    upstream closed it (or sent what it should not have). */
+static bool idle_alive(ProxyConn *conn) {
+    char c;
+    ssize_t n = recv(conn->handler.fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+static void unlink_idle(ProxyConn *conn) {
+    Pool *pool = &conn->proxy->pools[conn->upstream];
+    for (ProxyConn **link = &pool->idle; *link != NULL; link = &(*link)->next) {
+        if (*link == conn) {
+            *link = conn->next;
+            pool->idle_count--;
+            return;
+        }
+    }
+}
+
+static ProxyConn *open_conn(Proxy *proxy, int upstream) {
+    Upstream *target = &upstreams[upstream];
+    int fd = socket(target->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("  upstream socket");
+        return NULL;
+    }
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    bool connecting = FALSE;
+    if (connect(fd, (struct sockaddr *) &target->addr, target->addr_len) < 0) {
+        if (errno != EINPROGRESS) {
+            log_warn("Upstream %s: %s", target->name, strerror(errno));
+            close(fd);
+            return NULL;
+        }
+        connecting = TRUE;
+    }
+    ProxyConn *conn = g_new0(ProxyConn, 1);
+    conn->handler.fd = fd;
+    conn->handler.callback = proxy_ready;
+    conn->proxy = proxy;
+    conn->upstream = upstream;
+    conn->connecting = connecting;
+    arena_init(&conn->arena, 4096);
+    output_init(&conn->out);
+    if (event_loop_add(proxy->loop, &conn->handler, EPOLLIN | EPOLLOUT | EPOLLRDHUP) < 0) {
+        perror("  upstream epoll_ctl");
+        close(fd);
+        arena_destroy(&conn->arena);
+        g_free(conn);
+        return NULL;
+    }
+    metrics_count(&proxy->metrics->upstream_connects, 1);
+    return conn;
+}
+
+static int pick_upstream(Proxy *proxy, int route) {
+    const Route *r = &routes[route];
+    unsigned start = proxy->next[route]++;
+    if (proxy->balance == PROXY_ROUND_ROBIN) {
+        return r->first + (int) (start % (unsigned) r->count);
+    }
+    // Ties go round-robin as well, so an idle route still spreads its requests.
+    int best = -1;
+    for (int i = 0; i < r->count; i++) {
+        int upstream = r->first + (int) ((start + (unsigned) i) % (unsigned) r->count);
+        if (best == -1 || proxy->pools[upstream].active < proxy->pools[best].active) {
+            best = upstream;
+        }
+    }
+    return best;
+}
+
+/* An idle connection of upstream that is still open, or a new one. */
+static ProxyConn *acquire(Proxy *proxy, int upstream) {
+    Pool *pool = &proxy->pools[upstream];
+    while (pool->idle != NULL) {
+        ProxyConn *conn = pool->idle;
+        pool->idle = conn->next;
+        pool->idle_count--;
+        conn->next = NULL;
+        if (idle_alive(conn)) {
+            return conn;
+        }
+        close_conn(conn);
+    }
+    return open_conn(proxy, upstream);
+}
+
+static bool hop_by_hop(StrView name) {
+    return view_equals(name, "Connection") || view_equals(name, "Keep-Alive")
+        || view_equals(name, "Proxy-Connection") || view_equals(name, "TE") || view_equals(name, "Trailer")
+        || view_equals(name, "Transfer-Encoding") || view_equals(name, "Upgrade");
+}
+
+static char *append(char *p, const char *str, size_t len) {
+    memcpy(p, str, len);
+    return p + len;
+}
+
+#define APPEND_LITERAL(p, s) append((p), (s), sizeof(s) - 1)
+
+static void flush_request(ProxyConn *conn) {
+    size_t sent = 0;
+    if (output_flush(&conn->out, conn->handler.fd, &sent) == OUTPUT_ERROR) {
+        // The upstream may still answer what it got, but the connection ends with that.
+        log_warn("Upstream %s: %s", upstreams[conn->upstream].name, strerror(errno));
+        output_clear(&conn->out);
+        conn->broken = TRUE;
+        conn->reusable = FALSE;
+    }
+}
+
+ProxyConn *proxy_start(Proxy *proxy, int route, const Request *request, const HttpParser *parser,
+                       const char *buf, const char *client_ip, bool close_client, void *client) {
+    int upstream = pick_upstream(proxy, route);
+    ProxyConn *conn = acquire(proxy, upstream);
+    if (conn == NULL) {
+        return NULL;
+    }
+    proxy->pools[upstream].active++;
+    metrics_count(&proxy->metrics->upstream_requests, 1);
+    conn->client = client;
+    conn->reusable = TRUE;
+    conn->failed = FALSE;
+    conn->broken = FALSE;
+    conn->head_request = view_equals(request->method, "HEAD");
+    conn->client_1_0 = view_equals(request->http_version, "HTTP/1.0");
+    conn->close_client = close_client;
+    conn->body_left = request->body_length;
+    conn->state = EXCHANGE_HEAD;
+    conn->in_len = 0;
+    conn->in_pos = 0;
+    conn->decode = FALSE;
+    conn->encode = FALSE;
+
+    // The request line and headers as they came, each header line at most one byte
+    // longer ("Name:value" gets a space), without the hop-by-hop ones and Content-Length.
+    const char *name = upstreams[upstream].name;
+    size_t size = parser->header_end + (size_t) parser->nheaders + strlen(name) + strlen(client_ip) + 128;
+    char *head = arena_alloc(&conn->arena, size);
+    char *p = append(head, request->method.str, request->method.len);
+    p = APPEND_LITERAL(p, " ");
+    p = append(p, request->path.str, request->path.len);
+    if (request->query.len > 0) {
+        p = APPEND_LITERAL(p, "?");
+        p = append(p, request->query.str, request->query.len);
+    }
+    p = APPEND_LITERAL(p, " HTTP/1.1\r\n");
+    StrView forwarded_for = { NULL, 0 };
+    for (int i = 0; i < parser->nheaders; i++) {
+        StrView header = { buf + parser->headers[i].name.off, parser->headers[i].name.len };
+        StrView value = { buf + parser->headers[i].value.off, parser->headers[i].value.len };
+        // The length is written once below, from the body that is actually forwarded.
+        if (hop_by_hop(header) || view_equals(header, "Expect") || view_equals(header, "Content-Length")) {
+            continue;
+        }
+        if (view_equals(header, "X-Forwarded-For")) {
+            forwarded_for = value;
+            continue;
+        }
+        p = append(p, header.str, header.len);
+        p = APPEND_LITERAL(p, ": ");
+        p = append(p, value.str, value.len);
+        p = APPEND_LITERAL(p, "\r\n");
+    }
+    if (request->host.len == 0) {
+        p = APPEND_LITERAL(p, "Host: ");
+        p = append(p, name, strlen(name));
+        p = APPEND_LITERAL(p, "\r\n");
+    }
+    p = APPEND_LITERAL(p, "X-Forwarded-For: ");
+    if (forwarded_for.len > 0) {
+        p = append(p, forwarded_for.str, forwarded_for.len);
+        p = APPEND_LITERAL(p, ", ");
+    }
+    p = append(p, client_ip, strlen(client_ip));
+    p = APPEND_LITERAL(p, "\r\n");
+    if (request->has_content_length) {
+        p += snprintf(p, size - (size_t) (p - head), "Content-Length: %zu\r\n", request->body_length);
+    }
+    if (proxy->max_idle == 0) {
+        p = APPEND_LITERAL(p, "Connection: close\r\n");
+    }
+    p = APPEND_LITERAL(p, "\r\n");
+    output_add_mem(&conn->out, &conn->arena, head, (size_t) (p - head), NULL, NULL);
+
+    // The body, or the part of it that came with the head, is copied: buf moves on before it is sent.
+    if (request->msg_body.len > 0) {
+        char *body = arena_strndup(&conn->arena, request->msg_body.str, request->msg_body.len);
+        output_add_mem(&conn->out, &conn->arena, body, request->msg_body.len, NULL, NULL);
+        conn->body_left -= MIN(conn->body_left, request->msg_body.len);
+    }
+    if (!conn->connecting) {
+        flush_request(conn);
+    }
+    return conn;
+}
+
+bool proxy_body_write(void *data, const char *buf, size_t len) {
+    ProxyConn *conn = data;
+    conn->body_left -= MIN(conn->body_left, len);
+    if (conn->failed || conn->broken) {
+        // Nowhere to go, the response says what became of the request.
+        return TRUE;
+    }
+    char *copy = g_malloc(len);
+    memcpy(copy, buf, len);
+    output_add_mem(&conn->out, &conn->arena, copy, len, g_free, copy);
+    if (!conn->connecting) {
+        flush_request(conn);
+    }
+    return TRUE;
+}
+
+void proxy_body_file(ProxyConn *conn, int fd, size_t len) {
+    conn->body_left -= MIN(conn->body_left, len);
+    if (conn->failed || conn->broken) {
+        close(fd);
+        return;
+    }
+    output_add_file(&conn->out, &conn->arena, fd, 0, len);
+    if (!conn->connecting) {
+        flush_request(conn);
+    }
+}
+
+size_t proxy_backlog(const ProxyConn *conn) {
+    return conn->out.bytes;
+}
+
+static void proxy_ready(EventHandler *handler, uint32_t events) {
+    ProxyConn *conn = (ProxyConn *) handler;
+    if (conn->client == NULL) {
+        if (!idle_alive(conn)) {
+            unlink_idle(conn);
+            close_conn(conn);
+        }
+        return;
+    }
+    if (conn->connecting) {
+        if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+            return;
+        }
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (getsockopt(handler->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0) {
+            error = errno;
+        }
+        conn->connecting = FALSE;
+        if (error != 0) {
+            log_warn("Upstream %s: %s", upstreams[conn->upstream].name, strerror(error));
+            output_clear(&conn->out);
+            conn->failed = TRUE;
+            conn->reusable = FALSE;
+        }
+    }
+    if (!conn->failed && !conn->broken && !output_empty(&conn->out)) {
+        flush_request(conn);
+    }
+    // Last: the client may finish the exchange.
+    conn->proxy->wake(conn->client);
+}
+
+static StreamStatus bad_gateway(ProxyConn *conn, char *buf, size_t size, size_t *len) {
+    conn->reusable = FALSE;
+    conn->state = EXCHANGE_DONE;
+    StrView header = response_header(&conn->arena, conn->client_1_0, 502, "text/html; charset=utf-8", 0, "",
+                                     conn->close_client);
+    *len = MIN(header.len, size);
+    memcpy(buf, header.str, *len);
+    return STREAM_DONE;
+}
+
+/* Rewrites the response head in[0 .. head_end) for the client into buf and
+    sets up the framing of the body. */
+static StreamStatus rewrite_head(ProxyConn *conn, int status, size_t head_end, char *buf, size_t size,
+                                 size_t *len) {
+    if (size < head_end + PROXY_HEAD_EXTRA) {
+        log_warn("Upstream %s: response head too large", upstreams[conn->upstream].name);
+        return bad_gateway(conn, buf, size, len);
+    }
+    const char *line = conn->in;
+    const char *end = conn->in + head_end - 2;
+    const char *eol = memchr(line, '\r', (size_t) (end - line));
+    // HTTP/1.0 closes the connection unless it says otherwise.
+    bool upstream_close = conn->in[7] == '0';
+    bool keep_alive = FALSE;
+    bool chunked = FALSE;
+    bool has_length = FALSE;
+    size_t length = 0;
+
+    char *p = buf;
+    p = conn->client_1_0 ? APPEND_LITERAL(p, "HTTP/1.0") : APPEND_LITERAL(p, "HTTP/1.1");
+    p = append(p, line + 8, (size_t) (eol - line - 8));
+    p = APPEND_LITERAL(p, "\r\n");
+    for (line = eol + 2; line < end; line = eol + 2) {
+        eol = memchr(line, '\r', (size_t) (end - line) + 1);
+        const char *colon = memchr(line, ':', (size_t) (eol - line));
+        if (colon == NULL) {
+            continue;
+        }
+        StrView name = { line, (size_t) (colon - line) };
+        StrView value = { colon + 1, (size_t) (eol - colon - 1) };
+        while (value.len > 0 && (value.str[0] == ' ' || value.str[0] == '\t')) {
+            value.str++;
+            value.len--;
+        }
+        while (value.len > 0 && (value.str[value.len - 1] == ' ' || value.str[value.len - 1] == '\t')) {
+            value.len--;
+        }
+        if (view_equals(name, "Connection")) {
+            upstream_close |= view_has_token(value, "close");
+            keep_alive |= view_has_token(value, "keep-alive");
+            continue;
+        }
+        if (view_equals(name, "Transfer-Encoding")) {
+            // Only chunked as the last coding ends the body, anything else runs until the close.
+            chunked = value.len >= 7 && g_ascii_strncasecmp(value.str + value.len - 7, "chunked", 7) == 0;
+            has_length = FALSE;
+            if (!chunked || conn->client_1_0) {
+                continue;
+            }
+        }
+        else if (hop_by_hop(name)) {
+            continue;
+        }
+        else if (view_equals(name, "Content-Length")) {
+            // Written below once the framing is known: never next to Transfer-Encoding, and
+            // not for a body that is decoded for an HTTP/1.0 client.
+            if (!chunked) {
+                has_length = parse_content_length(value, &length);
+            }
+            continue;
+        }
+        p = append(p, line, (size_t) (eol - line) + 2);
+    }
+    if (conn->in[7] == '0' && keep_alive) {
+        upstream_close = FALSE;
+    }
+
+    if (conn->head_request || status == 204 || status == 304) {
+        conn->framing = FRAMING_NONE;
+    }
+    else if (chunked) {
+        conn->framing = FRAMING_CHUNKED;
+        conn->chunk_state = CHUNK_SIZE;
+        conn->chunk_left = 0;
+        conn->decode = conn->client_1_0;
+    }
+    else if (has_length) {
+        conn->framing = FRAMING_LENGTH;
+        conn->remaining = length;
+    }
+    else {
+        conn->framing = FRAMING_CLOSE;
+        conn->reusable = FALSE;
+        conn->encode = !conn->client_1_0;
+        if (conn->encode) {
+            p = APPEND_LITERAL(p, "Transfer-Encoding: chunked\r\n");
+        }
+    }
+    // A HEAD or 304 response keeps the length of the body it stands for.
+    if (has_length && (conn->framing == FRAMING_LENGTH || (conn->framing == FRAMING_NONE && status != 204))) {
+        p += snprintf(p, size - (size_t) (p - buf), "Content-Length: %zu\r\n", length);
+    }
+    if (upstream_close) {
+        conn->reusable = FALSE;
+    }
+    if (conn->close_client) {
+        p = APPEND_LITERAL(p, "Connection: close\r\n");
+    }
+    p = APPEND_LITERAL(p, "\r\n");
+    *len = (size_t) (p - buf);
+
+    conn->in_pos = head_end;
+    conn->state = EXCHANGE_BODY;
+    if (conn->framing == FRAMING_NONE || (conn->framing == FRAMING_LENGTH && conn->remaining == 0)) {
+        conn->state = EXCHANGE_DONE;
+        if (conn->in_pos < conn->in_len) {
+            conn->reusable = FALSE;
+        }
+        return STREAM_DONE;
+    }
+    return STREAM_MORE;
+}
+
+static StreamStatus produce_head(ProxyConn *conn, char *buf, size_t size, size_t *len) {
+    const char *name = upstreams[conn->upstream].name;
+    while (TRUE) {
+        if (conn->failed) {
+            return bad_gateway(conn, buf, size, len);
+        }
+        if (conn->connecting) {
+            return STREAM_WAIT;
+        }
+        const char *end = memmem(conn->in, conn->in_len, "\r\n\r\n", 4);
+        if (end != NULL) {
+            size_t head_end = (size_t) (end - conn->in) + 4;
+            const char *s = conn->in;
+            if (head_end < 16 || memcmp(s, "HTTP/1.", 7) != 0 || s[8] != ' ' || !g_ascii_isdigit(s[9])
+                || !g_ascii_isdigit(s[10]) || !g_ascii_isdigit(s[11])) {
+                log_warn("Upstream %s: invalid response", name);
+                conn->failed = TRUE;
+                continue;
+            }
+            int status = (s[9] - '0') * 100 + (s[10] - '0') * 10 + (s[11] - '0');
+            if (status >= 100 && status < 200) {
+                // 100 Continue is for us, the client got its own.
+                memmove(conn->in, conn->in + head_end, conn->in_len - head_end);
+                conn->in_len -= head_end;
+                continue;
+            }
+            return rewrite_head(conn, status, head_end, buf, size, len);
+        }
+        if (conn->in_len == sizeof(conn->in)) {
+            log_warn("Upstream %s: response head too large", name);
+            conn->failed = TRUE;
+            continue;
+        }
+        ssize_t n = recv(conn->handler.fd, conn->in + conn->in_len, sizeof(conn->in) - conn->in_len, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return STREAM_WAIT;
+        }
+        if (n <= 0) {
+            log_warn("Upstream %s: %s before the response", name, n == 0 ? "closed" : strerror(errno));
+            conn->failed = TRUE;
+            continue;
+        }
+        conn->in_len += (size_t) n;
+    }
+}
+
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c = g_ascii_tolower(c);
+    return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+/* Follows the chunked coding through buf[0 .. len). Returns how many bytes go to
+    the client: all up to the end of the body, or only the chunk data if decoding,
+    moved to the front of buf. */
+static size_t scan_chunks(ProxyConn *conn, char *buf, size_t len) {
+    size_t out = 0;
+    size_t i = 0;
+    while (i < len && conn->chunk_state != CHUNK_END && conn->chunk_state != CHUNK_INVALID) {
+        if (conn->chunk_state == CHUNK_DATA) {
+            size_t n = MIN(len - i, conn->chunk_left);
+            if (conn->decode) {
+                memmove(buf + out, buf + i, n);
+                out += n;
+            }
+            i += n;
+            conn->chunk_left -= n;
+            if (conn->chunk_left == 0) {
+                conn->chunk_state = CHUNK_DATA_CR;
+            }
+            continue;
+        }
+        char c = buf[i++];
+        switch (conn->chunk_state) {
+        case CHUNK_SIZE: {
+            int digit = hex_digit(c);
+            if (digit >= 0 && conn->chunk_left < (UINT64_C(1) << 56)) {
+                conn->chunk_left = conn->chunk_left * 16 + (uint64_t) digit;
+            }
+            else if (c == ';' || c == ' ' || c == '\t') {
+                conn->chunk_state = CHUNK_EXTENSION;
+            }
+            else if (c == '\r') {
+                conn->chunk_state = CHUNK_SIZE_LF;
+            }
+            else {
+                conn->chunk_state = CHUNK_INVALID;
+            }
+            break;
+        }
+        case CHUNK_EXTENSION:
+            if (c == '\r') {
+                conn->chunk_state = CHUNK_SIZE_LF;
+            }
+            break;
+        case CHUNK_SIZE_LF:
+            if (c != '\n') {
+                conn->chunk_state = CHUNK_INVALID;
+            }
+            else {
+                conn->chunk_state = conn->chunk_left > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+            }
+            break;
+        case CHUNK_DATA_CR:
+            conn->chunk_state = c == '\r' ? CHUNK_DATA_LF : CHUNK_INVALID;
+            break;
+        case CHUNK_DATA_LF:
+            conn->chunk_state = c == '\n' ? CHUNK_SIZE : CHUNK_INVALID;
+            break;
+        case CHUNK_TRAILER:
+            conn->chunk_state = c == '\r' ? CHUNK_END_LF : CHUNK_TRAILER_LINE;
+            break;
+        case CHUNK_TRAILER_LINE:
+            if (c == '\r') {
+                conn->chunk_state = CHUNK_TRAILER_LF;
+            }
+            break;
+        case CHUNK_TRAILER_LF:
+            conn->chunk_state = c == '\n' ? CHUNK_TRAILER : CHUNK_INVALID;
+            break;
+        case CHUNK_END_LF:
+            conn->chunk_state = c == '\n' ? CHUNK_END : CHUNK_INVALID;
+            break;
+        default:
+            break;
+        }
+    }
+    // Bytes after the last chunk would be the start of a response nobody asked for.
+    if (conn->chunk_state == CHUNK_END && i < len) {
+        conn->reusable = FALSE;
+    }
+    if (conn->decode) {
+        return out;
+    }
+    return conn->chunk_state == CHUNK_INVALID ? 0 : i;
+}
+
+static StreamStatus produce_body(ProxyConn *conn, char *buf, size_t size, size_t *len) {
+    char *data = buf;
+    size_t room = size;
+    if (conn->encode) {
+        data = buf + CHUNK_PREFIX;
+        room = size - CHUNK_PREFIX - CHUNK_SUFFIX - (sizeof(LAST_CHUNK) - 1);
+    }
+    if (conn->framing == FRAMING_LENGTH && room > conn->remaining) {
+        room = (size_t) conn->remaining;
+    }
+    size_t n;
+    bool done = FALSE;
+    if (conn->in_pos < conn->in_len) {
+        n = MIN(room, conn->in_len - conn->in_pos);
+        memcpy(data, conn->in + conn->in_pos, n);
+        conn->in_pos += n;
+    }
+    else {
+        ssize_t r;
+        do {
+            r = recv(conn->handler.fd, data, room, 0);
+        } while (r < 0 && errno == EINTR);
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return STREAM_WAIT;
+        }
+        if (r < 0 || (r == 0 && conn->framing != FRAMING_CLOSE)) {
+            log_warn("Upstream %s: %s in the middle of a response", upstreams[conn->upstream].name,
+                     r == 0 ? "closed" : strerror(errno));
+            conn->reusable = FALSE;
+            return STREAM_ERROR;
+        }
+        n = (size_t) r;
+        done = r == 0;
+    }
+
+    if (conn->framing == FRAMING_LENGTH) {
+        conn->remaining -= n;
+        done = conn->remaining == 0;
+    }
+    else if (conn->framing == FRAMING_CHUNKED) {
+        n = scan_chunks(conn, data, n);
+        if (conn->chunk_state == CHUNK_INVALID) {
+            log_warn("Upstream %s: invalid chunked body", upstreams[conn->upstream].name);
+            conn->reusable = FALSE;
+            return STREAM_ERROR;
+        }
+        done = conn->chunk_state == CHUNK_END;
+    }
+
+    *len = n;
+    if (conn->encode) {
+        *len = 0;
+        if (n > 0) {
+            char line[CHUNK_PREFIX + 1];
+            snprintf(line, sizeof(line), "%08x\r\n", (unsigned) n);
+            memcpy(buf, line, CHUNK_PREFIX);
+            memcpy(data + n, "\r\n", CHUNK_SUFFIX);
+            *len = CHUNK_PREFIX + n + CHUNK_SUFFIX;
+        }
+        if (done) {
+            memcpy(buf + *len, LAST_CHUNK, sizeof(LAST_CHUNK) - 1);
+            *len += sizeof(LAST_CHUNK) - 1;
+        }
+    }
+    if (done) {
+        conn->state = EXCHANGE_DONE;
+        // Whatever follows the response is not ours to pass on.
+        if (conn->in_pos < conn->in_len) {
+            conn->reusable = FALSE;
+        }
+        return STREAM_DONE;
+    }
+    return STREAM_MORE;
+}
+
+StreamStatus proxy_produce(void *data, char *buf, size_t size, size_t *len) {
+    ProxyConn *conn = data;
+    *len = 0;
+    if (conn->state == EXCHANGE_HEAD) {
+        return produce_head(conn, buf, size, len);
+    }
+    if (conn->state == EXCHANGE_DONE) {
+        return STREAM_DONE;
+    }
+    return produce_body(conn, buf, size, len);
+}
+
+void proxy_finish(void *data) {
+    ProxyConn *conn = data;
+    Proxy *proxy = conn->proxy;
+    Pool *pool = &proxy->pools[conn->upstream];
+    pool->active--;
+    conn->client = NULL;
+    // Only a connection whose exchange ended exactly where the response did can carry the next one.
+    if (!conn->reusable || conn->state != EXCHANGE_DONE || conn->body_left > 0 || !output_empty(&conn->out)
+        || pool->idle_count >= proxy->max_idle) {
+        close_conn(conn);
+        return;
+    }
+    arena_reset(&conn->arena);
+    conn->next = pool->idle;
+    pool->idle = conn;
+    pool->idle_count++;
+}
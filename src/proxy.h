@@ -0,0 +1,80 @@
+/*
+ * proxy.h
+ *
+ * Reverse proxy: a request the router sends to a proxy route is forwarded to
+ * one of the route's upstream servers, picked round-robin or by the fewest
+ * requests in flight. Every worker keeps a pool of idle keep-alive
+ * connections per upstream, so a proxied request normally costs no connect().
+ * Nothing is held whole in memory: the request body goes upstream as it
+ * arrives (proxy_body_write() is a BodyConsume) and the response is produced
+ * into the client's Stream as it comes in (proxy_produce() is a
+ * StreamProduce), head first, with the framing the client needs.
+ */
+
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "event.h"
+#include "http_parser.h"
+#include "metrics.h"
+#include "request.h"
+#include "stream.h"
+
+typedef enum {
+    PROXY_ROUND_ROBIN,
+    PROXY_LEAST_CONN
+} ProxyBalance;
+
+/* Adds a route to the upstreams of "HOST:PORT[,HOST:PORT...]" (an IPv6 host in brackets)
+    and returns its number, which requests are sent to a route by. Returns -1, and says why
+    on stderr, if it is malformed or a host can not be resolved. Called before the workers
+    start. Which requests go to a route is up to the router (router.h). */
+int proxy_add_route(const char *targets);
+
+typedef struct Proxy Proxy;
+typedef struct ProxyConn ProxyConn;
+
+/* Called with the client of an upstream connection when the upstream is ready: the
+    client should pump its stream and, if it paused for the upstream, read again. */
+typedef void (*ProxyWake)(void *client);
+
+/* The upstream connections of a worker, watched by loop. At most max_idle idle
+    connections are kept per upstream, 0 closes every one after its response. */
+Proxy *proxy_new(EventLoop *loop, Metrics *metrics, ProxyBalance balance, int max_idle, ProxyWake wake);
+
+/* Closes every upstream connection. The exchanges must have been finished. */
+void proxy_free(Proxy *proxy);
+
+/* Frees the upstream connections that were closed since the last call. They are
+    kept until the worker is back in its loop, what closed them may still use them. */
+void proxy_collect(Proxy *proxy);
+
+/* Sends request, whose head starts at buf, to an upstream of route and returns the
+    connection, NULL if none could be opened. The part of the body in msg_body goes
+    along, the rest has to come through proxy_body_write(). client_ip is added to
+    X-Forwarded-For. The response closes the client connection if close_client. */
+ProxyConn *proxy_start(Proxy *proxy, int route, const Request *request, const HttpParser *parser,
+                       const char *buf, const char *client_ip, bool close_client, void *client);
+
+/* BodyConsume that sends the body on to the upstream, data is the ProxyConn. */
+bool proxy_body_write(void *data, const char *buf, size_t len);
+
+/* Sends the rest of the body, len bytes from the start of the file fd, the way
+    proxy_body_write() would. fd is closed once they are sent. */
+void proxy_body_file(ProxyConn *conn, int fd, size_t len);
+
+/* Bytes of the request still waiting to go upstream. */
+size_t proxy_backlog(const ProxyConn *conn);
+
+/* StreamProduce of the response, data is the ProxyConn. An upstream that fails before
+    its response started is answered with 502 Bad Gateway. */
+StreamStatus proxy_produce(void *data, char *buf, size_t size, size_t *len);
+
+/* StreamFree: the client is done with the connection, which goes back to the pool if
+    its exchange ended cleanly and is closed otherwise. */
+void proxy_finish(void *data);
+
+#endif
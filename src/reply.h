@@ -0,0 +1,29 @@
+/*
+ * reply.h
+ *
+ * Where a handler puts its response. The response to an HTTP/1.x request
+ * goes straight into the output queue of its connection, the response on an
+ * HTTP/2 stream into a queue of the stream's own, from which h2.c sends it
+ * on in frames.
+ */
+
+#ifndef REPLY_H
+#define REPLY_H
+
+#include <stdbool.h>
+
+#include "arena.h"
+#include "output.h"
+#include "stream.h"
+
+typedef struct {
+    OutputQueue *output;
+    // The segments, and whatever else the response needs until it is sent, come from here.
+    Arena *arena;
+    // Set by a handler whose body is produced while it is sent.
+    Stream *stream;
+    // Set by a handler when the connection has to close after the response.
+    bool close_conn;
+} Reply;
+
+#endif
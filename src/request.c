@@ -0,0 +1,297 @@
+/*
+ * request.c
+ *
+ * Turns the slices recorded by http_parser.c into a Request.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <glib.h>
+
+#include "request.h"
+
+static StrView slice_view(const char *buf, HttpSlice slice) {
+    StrView view = { buf + slice.off, slice.len };
+    return view;
+}
+
+bool view_equals(StrView view, const char *str) {
+    size_t len = strlen(str);
+    return view.len == len && g_ascii_strncasecmp(view.str, str, len) == 0;
+}
+
+bool view_has_token(StrView list, const char *token) {
+    size_t len = strlen(token);
+    const char *p = list.str;
+    const char *end = list.str + list.len;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+        const char *start = p;
+        while (p < end && *p != ',') {
+            p++;
+        }
+        const char *last = p;
+        while (last > start && (last[-1] == ' ' || last[-1] == '\t')) {
+            last--;
+        }
+        if ((size_t) (last - start) == len && g_ascii_strncasecmp(start, token, len) == 0) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// Known header names by header_hash() of the name. The hash was picked so that no two of
+// them share a slot, which makes it a perfect hash: a name is either in its slot or unknown.
+// A new name needs a free slot (or a new hash).
+#define HEADER_SLOTS 32
+
+static const struct {
+    const char *name;
+    size_t len;
+    HeaderField field;
+} header_slots[HEADER_SLOTS] = {
+    [0] = { "connection", 10, HEADER_CONNECTION },
+    [1] = { "if-modified-since", 17, HEADER_IF_MODIFIED_SINCE },
+    [2] = { "content-length", 14, HEADER_CONTENT_LENGTH },
+    [3] = { "range", 5, HEADER_RANGE },
+    [5] = { "upgrade", 7, HEADER_UPGRADE },
+    [10] = { "accept", 6, HEADER_ACCEPT },
+    [12] = { "host", 4, HEADER_HOST },
+    [13] = { "accept-language", 15, HEADER_ACCEPT_LANGUAGE },
+    [15] = { "accept-encoding", 15, HEADER_ACCEPT_ENCODING },
+    [17] = { "transfer-encoding", 17, HEADER_TRANSFER_ENCODING },
+    [18] = { "expect", 6, HEADER_EXPECT },
+    [26] = { "user-agent", 10, HEADER_USER_AGENT },
+    [27] = { "content-type", 12, HEADER_CONTENT_TYPE },
+    [28] = { "if-none-match", 13, HEADER_IF_NONE_MATCH },
+    [31] = { "http2-settings", 14, HEADER_HTTP2_SETTINGS },
+};
+
+/* Setting 0x20 lowercases the letters of a name. Of the other token characters it only changes
+    '^' and '_', into '~' and DEL, which no known name has, so they can not match by mistake. */
+static inline unsigned header_hash(StrView name) {
+    return (2 * (unsigned) name.len + 10 * (unsigned) (name.str[0] | 0x20) +
+            (unsigned) (name.str[name.len - 1] | 0x20)) % HEADER_SLOTS;
+}
+
+HeaderField header_field(StrView name) {
+    if (name.len == 0) {
+        return HEADER_OTHER;
+    }
+    unsigned slot = header_hash(name);
+    if (header_slots[slot].len != name.len) {
+        return HEADER_OTHER;
+    }
+    const char *known = header_slots[slot].name;
+    for (size_t i = 0; i < name.len; i++) {
+        if ((name.str[i] | 0x20) != known[i]) {
+            return HEADER_OTHER;
+        }
+    }
+    return header_slots[slot].field;
+}
+
+void parse_header(StrView name, StrView value, Request *request) {
+    switch (header_field(name)) {
+    case HEADER_HOST:
+        request->host = value;
+        break;
+    case HEADER_USER_AGENT:
+        request->user_agent = value;
+        break;
+    case HEADER_CONTENT_TYPE:
+        request->content_type = value;
+        break;
+    case HEADER_CONTENT_LENGTH:
+        // Two different lengths leave the end of the body unknown (RFC 9112, 6.3). The value is
+        // then emptied, which fill_request() rejects, and stays empty whatever follows.
+        if (request->has_content_length && (value.len != request->content_length.len ||
+                memcmp(value.str, request->content_length.str, value.len) != 0)) {
+            request->content_length.len = 0;
+        }
+        else {
+            request->content_length = value;
+        }
+        request->has_content_length = TRUE;
+        break;
+    case HEADER_ACCEPT:
+        request->accept = value;
+        break;
+    case HEADER_ACCEPT_LANGUAGE:
+        request->accept_language = value;
+        break;
+    case HEADER_ACCEPT_ENCODING:
+        request->accept_encoding = value;
+        break;
+    case HEADER_CONNECTION:
+        request->connection = value;
+        break;
+    case HEADER_TRANSFER_ENCODING:
+        request->transfer_encoding = value;
+        break;
+    case HEADER_RANGE:
+        request->range = value;
+        break;
+    case HEADER_IF_NONE_MATCH:
+        request->if_none_match = value;
+        break;
+    case HEADER_IF_MODIFIED_SINCE:
+        request->if_modified_since = value;
+        break;
+    case HEADER_UPGRADE:
+        request->upgrade = value;
+        break;
+    case HEADER_HTTP2_SETTINGS:
+        request->http2_settings = value;
+        break;
+    case HEADER_EXPECT:
+        // 100-continue is the only expectation there is, anything else fails.
+        if (view_equals(value, "100-continue")) {
+            request->expect_continue = TRUE;
+        }
+        else {
+            request->status_code = 417;
+        }
+        break;
+    case HEADER_OTHER:
+        break;
+    }
+}
+
+bool parse_content_length(StrView value, size_t *length) {
+    size_t result = 0;
+    if (value.len == 0) {
+        return FALSE;
+    }
+    for (size_t i = 0; i < value.len; i++) {
+        if (value.str[i] < '0' || value.str[i] > '9') {
+            return FALSE;
+        }
+        size_t digit = (size_t) (value.str[i] - '0');
+        if (result > (SIZE_MAX - digit) / 10) {
+            return FALSE;
+        }
+        result = result * 10 + digit;
+    }
+    *length = result;
+    return TRUE;
+}
+
+HttpParseResult fill_request(HttpParser *parser, const char *buf, size_t len, Request *request)
+{
+    HttpParseResult result = http_parser_execute(parser, buf, len);
+    if (result == HTTP_PARSE_INCOMPLETE) {
+        return result;
+    }
+    if (result == HTTP_PARSE_ERROR) {
+        // We can not tell where the next request would start, so the connection is closed.
+        request->status_code = parser->error_status;
+        request->keep_alive = FALSE;
+        return result;
+    }
+
+    request->method = slice_view(buf, parser->method);
+    if (!view_equals(request->method, "GET") && !view_equals(request->method, "HEAD") &&
+            !view_equals(request->method, "POST")) {
+        // Method not implemented
+        request->status_code = 501;
+    }
+
+    // Check if we have a query in our path and split the target on the "?".
+    StrView target = slice_view(buf, parser->target);
+    const char *question = memchr(target.str, '?', target.len);
+    if (question != NULL) {
+        request->path.str = target.str;
+        request->path.len = (size_t) (question - target.str);
+        request->query.str = question + 1;
+        request->query.len = target.len - request->path.len - 1;
+    }
+    else {
+        request->path = target;
+    }
+
+    // Assign the http version.
+    request->http_version = slice_view(buf, parser->version);
+    bool http_1_1 = view_equals(request->http_version, "HTTP/1.1");
+    if (!http_1_1 && !view_equals(request->http_version, "HTTP/1.0")) {
+        // HTTP version not supported
+        request->status_code = 505;
+    }
+
+    for (int i = 0; i < parser->nheaders; i++) {
+        parse_header(slice_view(buf, parser->headers[i].name), slice_view(buf, parser->headers[i].value), request);
+    }
+
+    // An HTTP/1.0 client does not know 100 Continue, the expectation is ignored (RFC 9110, 10.1.1).
+    if (!http_1_1) {
+        request->expect_continue = FALSE;
+    }
+
+    // HTTP/1.1 connections are persistent unless the client says otherwise, HTTP/1.0 ones only on request.
+    // Connection is a list ("keep-alive, Upgrade"), so its options are looked for one by one,
+    // and close wins over keep-alive.
+    if (request->connection.len > 0) {
+        request->keep_alive = !view_has_token(request->connection, "close") &&
+            (http_1_1 || view_has_token(request->connection, "keep-alive"));
+    }
+    else {
+        request->keep_alive = http_1_1;
+    }
+
+    // The body is exactly Content-Length bytes, whatever follows belongs to the next request.
+    size_t body_length = 0;
+    if (request->transfer_encoding.len > 0) {
+        // Chunked request bodies are not supported, and without them we can not find the next request.
+        request->status_code = 501;
+        request->keep_alive = FALSE;
+    }
+    else if (request->has_content_length && !parse_content_length(request->content_length, &body_length)) {
+        request->status_code = 400;
+        request->keep_alive = FALSE;
+        return HTTP_PARSE_ERROR;
+    }
+    request->body_length = body_length;
+    if (len - parser->header_end < body_length) {
+        return HTTP_PARSE_INCOMPLETE;
+    }
+
+    request->msg_body.str = buf + parser->header_end;
+    request->msg_body.len = body_length;
+    request->message_length = parser->header_end + body_length;
+    return result;
+}
+
+void init_request(Request *req, Arena *arena) {
+    memset(req, 0, sizeof(*req));
+    req->arena = arena;
+    req->method.str = "";
+    req->path.str = "";
+    req->query.str = "";
+    req->http_version.str = "";
+    req->host.str = "";
+    req->user_agent.str = "";
+    req->content_type.str = "";
+    req->content_length.str = "";
+    req->accept.str = "";
+    req->accept_language.str = "";
+    req->accept_encoding.str = "";
+    req->connection.str = "";
+    req->transfer_encoding.str = "";
+    req->range.str = "";
+    req->if_none_match.str = "";
+    req->if_modified_since.str = "";
+    req->upgrade.str = "";
+    req->http2_settings.str = "";
+    req->msg_body.str = "";
+}
+
+void reset_request(Request *req) {
+    Arena *arena = req->arena;
+    if (arena != NULL) {
+        arena_reset(arena);
+    }
+    init_request(req, arena);
+}
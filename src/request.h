@@ -0,0 +1,113 @@
+/*
+ * request.h
+ *
+ * The Request struct and the functions that fill it from a parsed request
+ * head. The fields point into the connection's receive buffer, so they are
+ * not NUL terminated (print them with "%.*s") and stay valid only until
+ * the buffer is reused for the next request.
+ */
+
+#ifndef REQUEST_H
+#define REQUEST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "arena.h"
+#include "http_parser.h"
+
+typedef struct {
+    const char *str;
+    size_t len;
+} StrView;
+
+typedef struct {
+    StrView method;
+    StrView path;
+    StrView query;
+    StrView http_version;
+    StrView host;
+    StrView user_agent;
+    StrView content_type;
+    StrView content_length;
+    StrView accept;
+    StrView accept_language;
+    StrView accept_encoding;
+    StrView connection;
+    StrView transfer_encoding;
+    StrView range;
+    StrView if_none_match;
+    StrView if_modified_since;
+    // Upgrade and HTTP2-Settings, of a client that asks to switch to HTTP/2 (see h2.h).
+    StrView upgrade;
+    StrView http2_settings;
+    StrView msg_body;
+    // A Content-Length header was sent. With differing values content_length is empty.
+    bool has_content_length;
+    // Content-Length, 0 without a body.
+    size_t body_length;
+    // Bytes of the buffer this request takes up: the head plus Content-Length bytes of body.
+    size_t message_length;
+    // The client sent "Expect: 100-continue" and waits for a 100 before it sends the body.
+    bool expect_continue;
+    // 0 until something goes wrong, the response is then sent with this status.
+    int status_code;
+    bool keep_alive;
+    // Scratch memory for this request and its response, owned by the connection.
+    Arena *arena;
+} Request;
+
+/* The header fields we act on. */
+typedef enum {
+    HEADER_OTHER,
+    HEADER_HOST,
+    HEADER_USER_AGENT,
+    HEADER_CONTENT_TYPE,
+    HEADER_CONTENT_LENGTH,
+    HEADER_ACCEPT,
+    HEADER_ACCEPT_LANGUAGE,
+    HEADER_ACCEPT_ENCODING,
+    HEADER_CONNECTION,
+    HEADER_TRANSFER_ENCODING,
+    HEADER_RANGE,
+    HEADER_IF_NONE_MATCH,
+    HEADER_IF_MODIFIED_SINCE,
+    HEADER_EXPECT,
+    HEADER_UPGRADE,
+    HEADER_HTTP2_SETTINGS
+} HeaderField;
+
+/* TRUE if view equals the NUL terminated str, ignoring ASCII case. */
+bool view_equals(StrView view, const char *str);
+
+/* TRUE if the comma separated list has token as one of its elements, ignoring ASCII
+    case and the whitespace around them. */
+bool view_has_token(StrView list, const char *token);
+
+/* Which field a header name is, ignoring ASCII case. One hash and one compare. */
+HeaderField header_field(StrView name);
+
+/* Should be passed one header field, already split into name and value.
+    The value is stored in the matching field of the request struct. */
+void parse_header(StrView name, StrView value, Request *request);
+
+/* Parses a Content-Length value. Returns FALSE if it is not a plain decimal number. */
+bool parse_content_length(StrView value, size_t *length);
+
+/* Runs the parser over buf[0 .. len) and, once the head and Content-Length
+    bytes of body are in the buffer, fills the request from it. Returns
+    HTTP_PARSE_INCOMPLETE until then. If only (part of) the body is missing
+    the request is filled all the same and body_length is set, so the caller
+    can decide not to wait for it (see body.h). On a parse error
+    request->status_code holds the status to answer with. */
+HttpParseResult fill_request(HttpParser *parser, const char *buf, size_t len, Request *request);
+
+/* Initializes the request struct with empty fields.
+    Everything allocated for the request comes from arena. */
+void init_request(Request *req, Arena *arena);
+
+/* Clears the request so it no longer points into the receive buffer and
+    releases all of its memory at once by resetting the arena. */
+void reset_request(Request *req);
+
+#endif
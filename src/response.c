@@ -0,0 +1,187 @@
+/*
+ * response.c
+ *
+ * The Date line lives in a ring of slots. Whichever thread first notices
+ * that the second has changed formats the next slot and publishes its
+ * index; readers copy from the slot the index points at, which is not
+ * overwritten again until the ring has come around a minute later.
+ */
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <glib.h>
+
+#include "response.h"
+
+#define MAX_STATUS 600
+#define DATE_SLOTS 64
+// "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n", an IMF-fixdate always has the same length.
+#define DATE_LINE_SIZE 40
+
+typedef struct {
+    int status;
+    const char *reason;
+} StatusReason;
+
+static const StatusReason reasons[] = {
+    { 100, "Continue" },
+    { 200, "OK" },
+    { 206, "Partial Content" },
+    { 304, "Not Modified" },
+    { 400, "Bad Request" },
+    { 403, "Forbidden" },
+    { 404, "Not Found" },
+    { 405, "Method Not Allowed" },
+    { 408, "Request Timeout" },
+    { 413, "Content Too Large" },
+    { 415, "Unsupported Media Type" },
+    { 416, "Range Not Satisfiable" },
+    { 417, "Expectation Failed" },
+    { 431, "Request Header Fields Too Large" },
+    { 500, "Internal Server Error" },
+    { 501, "Not Implemented" },
+    { 502, "Bad Gateway" },
+    { 503, "Service Unavailable" },
+    { 504, "Gateway Timeout" },
+    { 505, "HTTP Version not supported" },
+};
+
+// Status lines without the version, indexed by status code. Empty for unknown codes.
+static StrView status_lines[MAX_STATUS];
+
+static const char server_line[] = "Server: S00ber 1337 S3rv3r\r\n";
+static const char length_line[] = "Content-Length: ";
+static const char chunked_line[] = "Transfer-Encoding: chunked\r\n";
+static const char content_type_line[] = "Content-Type: ";
+static const char close_lines[] = "\r\nConnection: close\r\n\r\n";
+static StrView keep_alive_lines;
+static StrView overloaded[2];
+
+static char date_slots[DATE_SLOTS][DATE_LINE_SIZE];
+static size_t date_len;
+static atomic_uint date_slot;
+static atomic_llong date_second = -1;
+static atomic_flag date_updating = ATOMIC_FLAG_INIT;
+
+void response_init(int keep_alive_timeout, int retry_after) {
+    for (size_t i = 0; i < G_N_ELEMENTS(reasons); i++) {
+        StrView *line = &status_lines[reasons[i].status];
+        line->str = g_strdup_printf("%d %s\r\n", reasons[i].status, reasons[i].reason);
+        line->len = strlen(line->str);
+    }
+
+    keep_alive_lines.str = g_strdup_printf("\r\nConnection: keep-alive\r\n"
+                                           "Keep-Alive: timeout=%d, max=100\r\n"
+                                           "\r\n", keep_alive_timeout);
+    keep_alive_lines.len = strlen(keep_alive_lines.str);
+    for (int keep_alive = 0; keep_alive < 2; keep_alive++) {
+        StrView *response = &overloaded[keep_alive];
+        response->str = g_strdup_printf("HTTP/1.1 503 Service Unavailable\r\n%s"
+                                        "Retry-After: %d\r\n"
+                                        "Content-Length: 0\r\n"
+                                        "Connection: %s\r\n"
+                                        "\r\n", server_line, retry_after, keep_alive ? "keep-alive" : "close");
+        response->len = strlen(response->str);
+    }
+    response_date();
+}
+
+StrView response_status(int status) {
+    if (status == 0) {
+        status = 200;
+    }
+    if (status < 0 || status >= MAX_STATUS || status_lines[status].len == 0) {
+        status = 500;
+    }
+    return status_lines[status];
+}
+
+StrView response_date(void) {
+    time_t now = time(NULL);
+    if (now != (time_t) atomic_load_explicit(&date_second, memory_order_acquire) &&
+            !atomic_flag_test_and_set_explicit(&date_updating, memory_order_acquire)) {
+        // Only one thread formats, the others keep using the previous second meanwhile.
+        unsigned next = (atomic_load_explicit(&date_slot, memory_order_relaxed) + 1) % DATE_SLOTS;
+        struct tm tm;
+        date_len = strftime(date_slots[next], DATE_LINE_SIZE, "Date: %a, %d %b %Y %H:%M:%S GMT\r\n",
+                            gmtime_r(&now, &tm));
+        atomic_store_explicit(&date_slot, next, memory_order_release);
+        atomic_store_explicit(&date_second, now, memory_order_release);
+        atomic_flag_clear_explicit(&date_updating, memory_order_release);
+    }
+
+    StrView line = { date_slots[atomic_load_explicit(&date_slot, memory_order_acquire)], date_len };
+    return line;
+}
+
+StrView response_overloaded(bool keep_alive) {
+    return overloaded[keep_alive];
+}
+
+/* Writes value in decimal to buf, returns the number of digits. */
+static size_t format_size(char *buf, size_t value) {
+    char digits[24];
+    size_t n = 0;
+    do {
+        digits[n++] = (char) ('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+    for (size_t i = 0; i < n; i++) {
+        buf[i] = digits[n - 1 - i];
+    }
+    return n;
+}
+
+static char *append(char *p, const char *str, size_t len) {
+    memcpy(p, str, len);
+    return p + len;
+}
+
+StrView response_header(Arena *arena, bool http_1_0, int status, const char *content_type,
+                        size_t content_length, const char *extra_headers, bool close_conn) {
+    StrView status_line = response_status(status);
+    StrView date = response_date();
+    StrView trailer = { close_lines, sizeof(close_lines) - 1 };
+    if (!close_conn) {
+        trailer = keep_alive_lines;
+    }
+    size_t type_len = strlen(content_type);
+    size_t extra_len = strlen(extra_headers);
+
+    // Every fragment plus up to 20 digits of Content-Length.
+    size_t size = 9 + status_line.len + date.len + sizeof(server_line) - 1 + sizeof(length_line) - 1 + 22 +
+        sizeof(chunked_line) - 1 + sizeof(content_type_line) - 1 + type_len + extra_len + trailer.len;
+    char *buf = arena_alloc(arena, size);
+    char *p = buf;
+    p = append(p, http_1_0 ? "HTTP/1.0 " : "HTTP/1.1 ", 9);
+    p = append(p, status_line.str, status_line.len);
+    p = append(p, date.str, date.len);
+    p = append(p, server_line, sizeof(server_line) - 1);
+    if (content_length == RESPONSE_NO_LENGTH) {
+        // No framing at all, the response ends with its header.
+    }
+    else if (content_length != RESPONSE_STREAMED) {
+        p = append(p, length_line, sizeof(length_line) - 1);
+        p += format_size(p, content_length);
+        p = append(p, "\r\n", 2);
+    }
+    else if (!http_1_0) {
+        p = append(p, chunked_line, sizeof(chunked_line) - 1);
+    }
+    p = append(p, content_type_line, sizeof(content_type_line) - 1);
+    p = append(p, content_type, type_len);
+    if (extra_len > 0) {
+        // The extra lines come after the CRLF that ends Content-Type, which is the start of the trailer.
+        p = append(p, "\r\n", 2);
+        p = append(p, extra_headers, extra_len);
+        p = append(p, trailer.str + 2, trailer.len - 2);
+    }
+    else {
+        p = append(p, trailer.str, trailer.len);
+    }
+
+    StrView header = { buf, (size_t) (p - buf) };
+    return header;
+}
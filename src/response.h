@@ -0,0 +1,49 @@
+/*
+ * response.h
+ *
+ * Response headers assembled from fragments that are built once at startup:
+ * a status line per status code and HTTP version, the fixed header lines and
+ * the Connection trailers. The Date line is formatted at most once a second
+ * into a buffer shared by all workers, so writing a header is a handful of
+ * memcpy() calls and no printf.
+ */
+
+#ifndef RESPONSE_H
+#define RESPONSE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "arena.h"
+#include "request.h"
+
+/* Builds the status lines and header fragments. keep_alive_timeout is
+    announced in the Keep-Alive header, retry_after in the Retry-After header
+    of response_overloaded(). Call once, before any worker starts. */
+void response_init(int keep_alive_timeout, int retry_after);
+
+/* The status line of status (0 means 200) without the version, e.g. "404 Not Found".
+    Unknown codes get the line of 500. */
+StrView response_status(int status);
+
+/* The "Date: ...\r\n" line for the current second. */
+StrView response_date(void);
+
+/* The complete 503 Service Unavailable response sent when load is shed, which keeps the
+    connection open if keep_alive and closes it otherwise. It has no Date, so it is made
+    once and goes out with a single write. */
+StrView response_overloaded(bool keep_alive);
+
+// Content length of a body that is streamed: chunked for HTTP/1.1, ended by closing the connection for HTTP/1.0.
+#define RESPONSE_STREAMED ((size_t) -1)
+// Content length of a response without a body whose length is not known (a 304 of a body that
+// would be streamed): it goes out with neither Content-Length nor Transfer-Encoding.
+#define RESPONSE_NO_LENGTH ((size_t) -2)
+
+/* Assembles a response header in arena. extra_headers (complete lines with
+    CRLF, may be empty) goes after Content-Type. A RESPONSE_STREAMED
+    response to HTTP/1.0 has to close the connection. */
+StrView response_header(Arena *arena, bool http_1_0, int status, const char *content_type,
+                        size_t content_length, const char *extra_headers, bool close_conn);
+
+#endif
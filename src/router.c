@@ -0,0 +1,472 @@
+/*
+ * router.c
+ *
+ * The routes of a host are sorted and the trie is built top-down from the
+ * sorted run: the entries under a node share the bytes its first and last
+ * entry share, which become the node's label, and split into children by
+ * their next byte. The children of a node are placed next to each other, so
+ * a node only needs the index of its first child, and their first bytes are
+ * kept in an array of their own for the binary search.
+ */
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "router.h"
+
+// Longer Host headers are not looked up, they go to the default host.
+#define HOST_NAME_MAX_LEN 255
+
+/* A route as it was added, until router_compile(). */
+typedef struct {
+    char *key;
+    size_t len;
+    bool exact;
+    int target;
+} RouteEntry;
+
+/* A node of a trie. Its edge label is labels[label .. label + label_len), the children are
+    nodes[children .. children + child_count), ordered by the first byte of their labels. */
+typedef struct {
+    uint32_t label;
+    uint32_t label_len;
+    uint32_t children;
+    uint32_t child_count;
+    // The targets of a prefix route and of an exact route that end here, -1 if there is none.
+    int32_t prefix;
+    int32_t exact;
+} RadixNode;
+
+typedef struct {
+    // Entries of RouteEntry until compiled.
+    GArray *entries;
+    // The root of the host's trie in nodes.
+    uint32_t root;
+} Host;
+
+struct Router {
+    GArray *hosts;
+    GArray *targets;
+    // Host names, and the suffixes of wildcards with their dot (".example.com"), to the host
+    // number plus one.
+    GHashTable *names;
+    GHashTable *suffixes;
+    // The "*" host, -1 if there is none and the first host is the default.
+    int default_host;
+    // Every trie, flat. first_bytes[i] is the first byte of the label of nodes[i], what the
+    // children of a node are searched by.
+    RadixNode *nodes;
+    char *first_bytes;
+    char *labels;
+    bool compiled;
+};
+
+Router *router_new(void) {
+    Router *router = g_new0(Router, 1);
+    router->hosts = g_array_new(FALSE, FALSE, sizeof(Host));
+    router->targets = g_array_new(FALSE, FALSE, sizeof(RouteTarget));
+    router->names = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    router->suffixes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    router->default_host = -1;
+    return router;
+}
+
+static void free_entries(Host *host) {
+    if (host->entries == NULL) {
+        return;
+    }
+    for (guint i = 0; i < host->entries->len; i++) {
+        g_free(g_array_index(host->entries, RouteEntry, i).key);
+    }
+    g_array_free(host->entries, TRUE);
+    host->entries = NULL;
+}
+
+void router_free(Router *router) {
+    for (guint i = 0; i < router->hosts->len; i++) {
+        free_entries(&g_array_index(router->hosts, Host, i));
+    }
+    g_array_free(router->hosts, TRUE);
+    g_array_free(router->targets, TRUE);
+    g_hash_table_destroy(router->names);
+    g_hash_table_destroy(router->suffixes);
+    g_free(router->nodes);
+    g_free(router->first_bytes);
+    g_free(router->labels);
+    g_free(router);
+}
+
+bool router_alias_host(Router *router, int host, const char *name) {
+    size_t len = strlen(name);
+    if (len == 0 || len > HOST_NAME_MAX_LEN || strchr(name + (name[0] == '*'), '*') != NULL
+            || (name[0] == '*' && name[1] != '\0' && (name[1] != '.' || name[2] == '\0'))) {
+        fprintf(stderr, "Host %s: expected NAME, *.SUFFIX or *\n", name);
+        return FALSE;
+    }
+    if (strcmp(name, "*") == 0) {
+        if (router->default_host >= 0) {
+            fprintf(stderr, "Host *: given twice\n");
+            return FALSE;
+        }
+        router->default_host = host;
+        return TRUE;
+    }
+
+    // Looked up the way router_host() writes the Host header: lowercase, no trailing dot.
+    char *key = g_ascii_strdown(name[0] == '*' ? name + 1 : name, -1);
+    size_t key_len = strlen(key);
+    if (key_len > 1 && key[key_len - 1] == '.') {
+        key[key_len - 1] = '\0';
+    }
+    GHashTable *table = name[0] == '*' ? router->suffixes : router->names;
+    if (g_hash_table_contains(table, key)) {
+        fprintf(stderr, "Host %s: given twice\n", name);
+        g_free(key);
+        return FALSE;
+    }
+    g_hash_table_insert(table, key, GINT_TO_POINTER(host + 1));
+    return TRUE;
+}
+
+int router_add_host(Router *router, const char *name) {
+    int host = (int) router->hosts->len;
+    if (!router_alias_host(router, host, name)) {
+        return -1;
+    }
+    Host h;
+    h.entries = g_array_new(FALSE, FALSE, sizeof(RouteEntry));
+    h.root = 0;
+    g_array_append_val(router->hosts, h);
+    return host;
+}
+
+void router_add_route(Router *router, int host, const char *pattern, const RouteTarget *target) {
+    RouteEntry entry;
+    entry.exact = pattern[0] == '=';
+    entry.key = g_strdup(entry.exact ? pattern + 1 : pattern);
+    entry.len = strlen(entry.key);
+    entry.target = (int) router->targets->len;
+    RouteTarget t = *target;
+    t.prefix_len = entry.len;
+    g_array_append_val(router->targets, t);
+    g_array_append_val(g_array_index(router->hosts, Host, host).entries, entry);
+}
+
+static bool parse_type(const char *name, RouteType *type) {
+    static const struct {
+        const char *name;
+        RouteType type;
+    } types[] = {
+        { "echo", ROUTE_ECHO },
+        { "static", ROUTE_STATIC },
+        { "proxy", ROUTE_PROXY },
+        { "metrics", ROUTE_METRICS },
+    };
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        if (strcmp(name, types[i].name) == 0) {
+            *type = types[i].type;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* Handles one line of a routes file, split into words. host is the host the routes go to. */
+static bool load_line(Router *router, gchar **words, int *host, RouterResolve resolve, void *data,
+                      const char *where) {
+    int count = (int) g_strv_length(words);
+    if (strcmp(words[0], "host") == 0) {
+        if (count < 2) {
+            fprintf(stderr, "%s: expected host NAME...\n", where);
+            return FALSE;
+        }
+        *host = router_add_host(router, words[1]);
+        for (int i = 2; *host >= 0 && i < count; i++) {
+            if (!router_alias_host(router, *host, words[i])) {
+                return FALSE;
+            }
+        }
+        return *host >= 0;
+    }
+
+    const char *pattern = words[0];
+    RouteTarget target;
+    memset(&target, 0, sizeof(target));
+    target.root = -1;
+    target.proxy = -1;
+    if (pattern[pattern[0] == '='] != '/' || count < 2 || !parse_type(words[1], &target.type)) {
+        fprintf(stderr, "%s: expected PREFIX TYPE [ARG] or host NAME...\n", where);
+        return FALSE;
+    }
+    bool wants_arg = target.type == ROUTE_STATIC || target.type == ROUTE_PROXY;
+    if (count != (wants_arg ? 3 : 2)) {
+        fprintf(stderr, "%s: %s %s\n", where, words[1], wants_arg ? "takes one argument" : "takes no argument");
+        return FALSE;
+    }
+    if (*host < 0) {
+        fprintf(stderr, "%s: route before the first host line\n", where);
+        return FALSE;
+    }
+    if (wants_arg && !resolve(data, &target, words[2])) {
+        fprintf(stderr, "%s: can not use %s\n", where, words[2]);
+        return FALSE;
+    }
+    router_add_route(router, *host, pattern, &target);
+    return TRUE;
+}
+
+bool router_load(Router *router, const char *path, RouterResolve resolve, void *data) {
+    gchar *contents;
+    GError *error = NULL;
+    if (!g_file_get_contents(path, &contents, NULL, &error)) {
+        fprintf(stderr, "%s\n", error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+    gchar **lines = g_strsplit(contents, "\n", -1);
+    g_free(contents);
+    int host = -1;
+    bool ok = TRUE;
+    for (int i = 0; ok && lines[i] != NULL; i++) {
+        // Words are separated by any run of blanks.
+        gchar **split = g_strsplit_set(g_strstrip(lines[i]), " \t", -1);
+        GPtrArray *words = g_ptr_array_new();
+        for (int w = 0; split[w] != NULL; w++) {
+            if (split[w][0] != '\0') {
+                g_ptr_array_add(words, split[w]);
+            }
+        }
+        g_ptr_array_add(words, NULL);
+        gchar **line = (gchar **) words->pdata;
+        if (line[0] != NULL && line[0][0] != '#') {
+            char *where = g_strdup_printf("%s:%d", path, i + 1);
+            ok = load_line(router, line, &host, resolve, data, where);
+            g_free(where);
+        }
+        g_ptr_array_free(words, TRUE);
+        g_strfreev(split);
+    }
+    g_strfreev(lines);
+    return ok;
+}
+
+/* ----- Compiling ----- */
+
+/* The tries while they are built. */
+typedef struct {
+    GArray *nodes;
+    GString *labels;
+} Build;
+
+static int compare_entries(const void *a, const void *b) {
+    const RouteEntry *x = a;
+    const RouteEntry *y = b;
+    size_t len = x->len < y->len ? x->len : y->len;
+    int r = memcmp(x->key, y->key, len);
+    if (r != 0) {
+        return r;
+    }
+    if (x->len != y->len) {
+        return x->len < y->len ? -1 : 1;
+    }
+    return (int) x->exact - (int) y->exact;
+}
+
+/* Fills in nodes[index] for entries[0 .. n), which are sorted and share their first depth bytes.
+    The node takes the bytes they all share as its label, the entries that end there as its
+    targets and the rest, grouped by their next byte, as its children. */
+static bool build_node(Build *build, uint32_t index, RouteEntry *entries, size_t n, size_t depth) {
+    // Sorted, the first and the last entry share the least.
+    size_t end = depth;
+    if (n > 0) {
+        size_t shortest = entries[0].len < entries[n - 1].len ? entries[0].len : entries[n - 1].len;
+        end = depth;
+        while (end < shortest && entries[0].key[end] == entries[n - 1].key[end]) {
+            end++;
+        }
+    }
+    RadixNode node;
+    node.label = (uint32_t) build->labels->len;
+    node.label_len = (uint32_t) (end - depth);
+    node.prefix = -1;
+    node.exact = -1;
+    if (n > 0) {
+        g_string_append_len(build->labels, entries[0].key + depth, (gssize) (end - depth));
+    }
+
+    size_t i = 0;
+    for (; i < n && entries[i].len == end; i++) {
+        int32_t *slot = entries[i].exact ? &node.exact : &node.prefix;
+        if (*slot >= 0) {
+            fprintf(stderr, "Route %s%.*s: given twice\n", entries[i].exact ? "=" : "", (int) end, entries[i].key);
+            return FALSE;
+        }
+        *slot = entries[i].target;
+    }
+
+    // The children go next to each other at the end of the nodes, their own children after them.
+    size_t groups = 0;
+    for (size_t j = i; j < n; j++) {
+        if (j == i || entries[j].key[end] != entries[j - 1].key[end]) {
+            groups++;
+        }
+    }
+    node.children = build->nodes->len;
+    node.child_count = (uint32_t) groups;
+    g_array_index(build->nodes, RadixNode, index) = node;
+    g_array_set_size(build->nodes, build->nodes->len + (guint) groups);
+
+    uint32_t child = node.children;
+    while (i < n) {
+        size_t j = i + 1;
+        while (j < n && entries[j].key[end] == entries[i].key[end]) {
+            j++;
+        }
+        if (!build_node(build, child++, entries + i, j - i, end)) {
+            return FALSE;
+        }
+        i = j;
+    }
+    return TRUE;
+}
+
+bool router_compile(Router *router) {
+    Build build;
+    build.nodes = g_array_new(FALSE, TRUE, sizeof(RadixNode));
+    build.labels = g_string_new(NULL);
+    bool ok = TRUE;
+    for (guint h = 0; ok && h < router->hosts->len; h++) {
+        Host *host = &g_array_index(router->hosts, Host, h);
+        GArray *entries = host->entries;
+        qsort(entries->data, entries->len, sizeof(RouteEntry), compare_entries);
+        host->root = build.nodes->len;
+        g_array_set_size(build.nodes, build.nodes->len + 1);
+        ok = build_node(&build, host->root, (RouteEntry *) entries->data, entries->len, 0);
+    }
+
+    if (ok) {
+        g_free(router->nodes);
+        g_free(router->first_bytes);
+        g_free(router->labels);
+        router->first_bytes = g_malloc(build.nodes->len + 1);
+        for (guint i = 0; i < build.nodes->len; i++) {
+            RadixNode *node = &g_array_index(build.nodes, RadixNode, i);
+            router->first_bytes[i] = node->label_len > 0 ? build.labels->str[node->label] : '\0';
+        }
+        router->nodes = (RadixNode *) g_array_free(build.nodes, FALSE);
+        router->labels = g_string_free(build.labels, FALSE);
+        router->compiled = TRUE;
+    }
+    else {
+        g_array_free(build.nodes, TRUE);
+        g_string_free(build.labels, TRUE);
+    }
+    return ok;
+}
+
+/* ----- Lookups ----- */
+
+static int default_host(const Router *router) {
+    if (router->default_host >= 0) {
+        return router->default_host;
+    }
+    return router->hosts->len > 0 ? 0 : -1;
+}
+
+int router_host(const Router *router, StrView host) {
+    // The name, lowercased and without the port, to look it up by. An IPv6 address is in brackets.
+    char name[HOST_NAME_MAX_LEN + 1];
+    size_t len = 0;
+    bool bracket = host.len > 0 && host.str[0] == '[';
+    for (size_t i = 0; i < host.len; i++) {
+        char c = host.str[i];
+        if (c == ':' && !bracket) {
+            break;
+        }
+        if (len == HOST_NAME_MAX_LEN) {
+            return default_host(router);
+        }
+        name[len++] = (char) tolower((unsigned char) c);
+        if (c == ']') {
+            break;
+        }
+    }
+    if (len > 1 && name[len - 1] == '.') {
+        len--;
+    }
+    name[len] = '\0';
+
+    gpointer found = g_hash_table_lookup(router->names, name);
+    if (found != NULL) {
+        return GPOINTER_TO_INT(found) - 1;
+    }
+    // The longest wildcard suffix comes first, so its leading dot is the leftmost one.
+    for (size_t i = 1; i < len && g_hash_table_size(router->suffixes) > 0; i++) {
+        if (name[i] == '.') {
+            found = g_hash_table_lookup(router->suffixes, name + i);
+            if (found != NULL) {
+                return GPOINTER_TO_INT(found) - 1;
+            }
+        }
+    }
+    return default_host(router);
+}
+
+/* The child of node whose label starts with c, -1 if there is none. */
+static int64_t find_child(const Router *router, const RadixNode *node, char c) {
+    const char *first = router->first_bytes + node->children;
+    size_t low = 0;
+    size_t high = node->child_count;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if ((unsigned char) first[mid] < (unsigned char) c) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+    if (low < node->child_count && first[low] == c) {
+        return (int64_t) (node->children + low);
+    }
+    return -1;
+}
+
+const RouteTarget *router_match(const Router *router, int host, StrView path) {
+    if (host < 0 || !router->compiled) {
+        return NULL;
+    }
+    const RadixNode *node = &router->nodes[g_array_index(router->hosts, Host, host).root];
+    size_t pos = 0;
+    int32_t best = -1;
+    for (;;) {
+        if (path.len - pos < node->label_len || memcmp(path.str + pos, router->labels + node->label, node->label_len) != 0) {
+            break;
+        }
+        pos += node->label_len;
+        if (pos == path.len && node->exact >= 0) {
+            best = node->exact;
+            break;
+        }
+        if (node->prefix >= 0) {
+            best = node->prefix;
+        }
+        if (pos == path.len) {
+            break;
+        }
+        int64_t child = find_child(router, node, path.str[pos]);
+        if (child < 0) {
+            break;
+        }
+        node = &router->nodes[child];
+    }
+    return best >= 0 ? &g_array_index(router->targets, RouteTarget, best) : NULL;
+}
+
+const RouteTarget *router_lookup(const Router *router, StrView host, StrView path) {
+    return router_match(router, router_host(router, host), path);
+}
@@ -0,0 +1,95 @@
+/*
+ * router.h
+ *
+ * Picks what answers a request: the virtual host from its Host header, then
+ * the route of that host from its path. A host is found by an exact match in
+ * a hash table, or else by the longest "*.suffix" wildcard it falls under,
+ * or else it is the default host. The routes of a host are compiled into a
+ * radix trie whose edges carry whole runs of bytes, laid out flat in arrays
+ * once everything is added, so matching a path costs one step per edge and
+ * a binary search among at most 256 children, however many routes there are,
+ * and allocates nothing. A route is a path prefix (the longest one wins) or,
+ * written "=PATH", a path that has to match exactly and wins over prefixes.
+ *
+ * The routes come from a file loaded at startup, lines of
+ *
+ *     host NAME...           starts a host: names, *.suffix wildcards, * for the default
+ *     PREFIX TYPE [ARG]      a route of the host above it
+ *
+ * with TYPE one of "static DIR", "proxy HOST:PORT[,HOST:PORT...]", "echo"
+ * and "metrics". Blank lines and lines starting with # are skipped.
+ */
+
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "request.h"
+
+typedef enum {
+    // The generated page that echoes the request.
+    ROUTE_ECHO,
+    // Files below a directory.
+    ROUTE_STATIC,
+    // Upstream servers, see proxy.h.
+    ROUTE_PROXY,
+    // The counters of the workers.
+    ROUTE_METRICS
+} RouteType;
+
+typedef struct {
+    RouteType type;
+    // The length of the prefix or path the route was matched by. A static route serves the
+    // rest of the path from its directory.
+    size_t prefix_len;
+    // ROUTE_STATIC: the descriptor of the directory.
+    int root;
+    // ROUTE_PROXY: the upstreams, as numbered by proxy_add_route().
+    int proxy;
+} RouteTarget;
+
+typedef struct Router Router;
+
+/* Fills in target->root or target->proxy from the argument of a static or proxy route.
+    Returns FALSE, and says why on stderr, if that can not be done. */
+typedef bool (*RouterResolve)(void *data, RouteTarget *target, const char *arg);
+
+/* An empty router, every request is unrouted until hosts and routes are added. */
+Router *router_new(void);
+
+void router_free(Router *router);
+
+/* Adds a host named name, which may be a "*.suffix" wildcard or "*" for the default host, and
+    returns its number. Without a default host the first one added is. Returns -1, and says why
+    on stderr, if there is a host of that name already or the name is malformed. */
+int router_add_host(Router *router, const char *name);
+
+/* Has name go to host as well. Returns FALSE like router_add_host(). */
+bool router_alias_host(Router *router, int host, const char *name);
+
+/* Adds a route for pattern, a path prefix or "=PATH", to host. Only takes effect with
+    router_compile(). */
+void router_add_route(Router *router, int host, const char *pattern, const RouteTarget *target);
+
+/* Adds the hosts and routes of the file at path. Returns FALSE, and says why on stderr, if
+    it can not be read or a line is malformed. */
+bool router_load(Router *router, const char *path, RouterResolve resolve, void *data);
+
+/* Builds the tries of every host from the routes added. Returns FALSE, and says which, if
+    a host has the same pattern twice. Lookups are only valid after this and may run on
+    any number of threads at once. */
+bool router_compile(Router *router);
+
+/* The host a request with this Host header goes to (a port or a trailing dot is left out,
+    case does not matter), -1 if there is no host at all. */
+int router_host(const Router *router, StrView host);
+
+/* The route of host that path goes to, NULL if it has none. */
+const RouteTarget *router_match(const Router *router, int host, StrView path);
+
+/* router_match() of the host of the Host header. */
+const RouteTarget *router_lookup(const Router *router, StrView host, StrView path);
+
+#endif
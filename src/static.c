@@ -0,0 +1,305 @@
+/*
+ * static.c
+ *
+ * Maps request paths to files below the document root.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include "static.h"
+
+typedef struct {
+    const char *extension;
+    const char *content_type;
+} ContentType;
+
+static const ContentType content_types[] = {
+    { "html", "text/html; charset=utf-8" },
+    { "htm", "text/html; charset=utf-8" },
+    { "txt", "text/plain; charset=utf-8" },
+    { "css", "text/css; charset=utf-8" },
+    { "js", "application/javascript" },
+    { "json", "application/json" },
+    { "xml", "application/xml" },
+    { "svg", "image/svg+xml" },
+    { "png", "image/png" },
+    { "jpg", "image/jpeg" },
+    { "jpeg", "image/jpeg" },
+    { "gif", "image/gif" },
+    { "ico", "image/x-icon" },
+    { "pdf", "application/pdf" },
+    { "gz", "application/gzip" },
+};
+
+int static_open_root(const char *root) {
+    int fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        perror("open document root");
+    }
+    return fd;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+char *static_resolve(StrView path, Arena *arena) {
+    if (path.len == 0 || path.str[0] != '/') {
+        return NULL;
+    }
+
+    char *decoded = arena_alloc(arena, path.len + 2);
+    size_t len = 0;
+    for (size_t i = 1; i < path.len; i++) {
+        char c = path.str[i];
+        if (c == '%') {
+            if (i + 2 >= path.len) {
+                return NULL;
+            }
+            int high = hex_value(path.str[i + 1]);
+            int low = hex_value(path.str[i + 2]);
+            if (high < 0 || low < 0) {
+                return NULL;
+            }
+            c = (char) (high * 16 + low);
+            i += 2;
+        }
+        if (c == '\0' || c == '\\') {
+            return NULL;
+        }
+        // Collapse repeated slashes so "//etc" can not turn into an absolute path.
+        if (c == '/' && (len == 0 || decoded[len - 1] == '/')) {
+            continue;
+        }
+        decoded[len++] = c;
+    }
+    decoded[len] = '\0';
+
+    // Reject any ".." segment, after decoding so "%2e%2e" is caught as well.
+    for (char *segment = decoded; *segment != '\0'; ) {
+        char *slash = strchr(segment, '/');
+        size_t segment_len = slash != NULL ? (size_t) (slash - segment) : strlen(segment);
+        if (segment_len == 2 && segment[0] == '.' && segment[1] == '.') {
+            return NULL;
+        }
+        if (slash == NULL) {
+            break;
+        }
+        segment = slash + 1;
+    }
+
+    if (len == 0) {
+        strcpy(decoded, ".");
+    }
+    return decoded;
+}
+
+static int errno_status(int err) {
+    return err == EACCES || err == EPERM ? 403 : 404;
+}
+
+int static_open(int root_fd, const char *name, Arena *arena, StaticFile *file) {
+    int fd = openat(root_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return errno_status(errno);
+    }
+    if (fstat(fd, &file->st) == -1) {
+        close(fd);
+        return 404;
+    }
+    file->name = name;
+    StrView view = { name, strlen(name) };
+    file->content_type = static_content_type(view);
+
+    if (S_ISDIR(file->st.st_mode)) {
+        int index_fd = openat(fd, "index.html", O_RDONLY | O_CLOEXEC);
+        close(fd);
+        if (index_fd == -1) {
+            return errno_status(errno);
+        }
+        fd = index_fd;
+        if (fstat(fd, &file->st) == -1) {
+            close(fd);
+            return 404;
+        }
+        file->name = arena_printf(arena, NULL, "%s/index.html", name);
+        file->content_type = "text/html; charset=utf-8";
+    }
+
+    // Only regular files, never devices or fifos.
+    if (!S_ISREG(file->st.st_mode)) {
+        close(fd);
+        return 403;
+    }
+
+    file->fd = fd;
+    return 200;
+}
+
+void static_etag(const struct stat *st, char *buf, size_t size) {
+    snprintf(buf, size, "\"%llx-%llx-%llx.%lx\"", (unsigned long long) st->st_ino,
+             (unsigned long long) st->st_size, (unsigned long long) st->st_mtim.tv_sec,
+             (unsigned long) st->st_mtim.tv_nsec);
+}
+
+void static_http_date(time_t t, char *buf, size_t size) {
+    struct tm tm;
+    strftime(buf, size, "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&t, &tm));
+}
+
+/* TRUE if etag is one of the tags in the If-None-Match list (or it is "*").
+    Weak tags compare equal to the strong tag with the same value. */
+static bool etag_matches(StrView list, const char *etag) {
+    size_t etag_len = strlen(etag);
+    size_t i = 0;
+    while (i < list.len) {
+        while (i < list.len && (list.str[i] == ' ' || list.str[i] == '\t' || list.str[i] == ',')) {
+            i++;
+        }
+        size_t start = i;
+        while (i < list.len && list.str[i] != ',') {
+            i++;
+        }
+        size_t end = i;
+        while (end > start && (list.str[end - 1] == ' ' || list.str[end - 1] == '\t')) {
+            end--;
+        }
+        if (end - start > 2 && list.str[start] == 'W' && list.str[start + 1] == '/') {
+            start += 2;
+        }
+        if ((end - start == 1 && list.str[start] == '*') ||
+                (end - start == etag_len && memcmp(list.str + start, etag, etag_len) == 0)) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+bool static_not_modified(Request *request, const char *etag, time_t mtime) {
+    // If-None-Match wins, If-Modified-Since is only looked at without it.
+    if (request->if_none_match.len > 0) {
+        return etag_matches(request->if_none_match, etag);
+    }
+    if (request->if_modified_since.len == 0 || request->if_modified_since.len >= STATIC_DATE_SIZE) {
+        return FALSE;
+    }
+
+    char date[STATIC_DATE_SIZE];
+    memcpy(date, request->if_modified_since.str, request->if_modified_since.len);
+    date[request->if_modified_since.len] = '\0';
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    char *end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (end == NULL || *end != '\0') {
+        return FALSE;
+    }
+    return mtime <= timegm(&tm);
+}
+
+/* Parses the decimal number in str[0 .. len). Returns -1 if it is not one. */
+static off_t parse_offset(const char *str, size_t len) {
+    if (len == 0) {
+        return -1;
+    }
+    off_t value = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (str[i] < '0' || str[i] > '9') {
+            return -1;
+        }
+        if (value > (INT64_MAX - 9) / 10) {
+            return -1;
+        }
+        value = value * 10 + (str[i] - '0');
+    }
+    return value;
+}
+
+int static_parse_range(StrView range, off_t size, off_t *start, off_t *length) {
+    const char *prefix = "bytes=";
+    size_t prefix_len = strlen(prefix);
+    if (range.len <= prefix_len || g_ascii_strncasecmp(range.str, prefix, prefix_len) != 0) {
+        return 200;
+    }
+
+    const char *spec = range.str + prefix_len;
+    size_t spec_len = range.len - prefix_len;
+    // Only a single range is supported, for several we are allowed to send the whole file.
+    if (memchr(spec, ',', spec_len) != NULL) {
+        return 200;
+    }
+    const char *dash = memchr(spec, '-', spec_len);
+    if (dash == NULL) {
+        return 200;
+    }
+
+    size_t first_len = (size_t) (dash - spec);
+    size_t last_len = spec_len - first_len - 1;
+    off_t first = first_len > 0 ? parse_offset(spec, first_len) : -1;
+    off_t last = last_len > 0 ? parse_offset(dash + 1, last_len) : -1;
+
+    if (first_len == 0) {
+        // "bytes=-N" is the last N bytes.
+        if (last <= 0) {
+            return last == 0 ? 416 : 200;
+        }
+        if (size == 0) {
+            return 416;
+        }
+        *start = last < size ? size - last : 0;
+        *length = size - *start;
+        return 206;
+    }
+
+    if (first < 0 || (last_len > 0 && (last < 0 || last < first))) {
+        // Syntactically invalid ranges are ignored.
+        return 200;
+    }
+    if (first >= size) {
+        return 416;
+    }
+    if (last_len == 0 || last >= size) {
+        last = size - 1;
+    }
+    *start = first;
+    *length = last - first + 1;
+    return 206;
+}
+
+const char *static_content_type(StrView path) {
+    const char *dot = NULL;
+    for (size_t i = path.len; i > 0; i--) {
+        if (path.str[i - 1] == '.') {
+            dot = path.str + i;
+            break;
+        }
+        if (path.str[i - 1] == '/') {
+            break;
+        }
+    }
+
+    if (dot != NULL) {
+        size_t extension_len = (size_t) (path.str + path.len - dot);
+        for (size_t i = 0; i < G_N_ELEMENTS(content_types); i++) {
+            if (strlen(content_types[i].extension) == extension_len &&
+                    g_ascii_strncasecmp(dot, content_types[i].extension, extension_len) == 0) {
+                return content_types[i].content_type;
+            }
+        }
+    }
+    return "application/octet-stream";
+}
@@ -0,0 +1,64 @@
+/*
+ * static.h
+ *
+ * Helpers for serving files from the document root: mapping a request
+ * path to a file, Range headers and Content-Type. The file body itself is
+ * sent by the connection with sendfile(), so it never passes through user
+ * space.
+ */
+
+#ifndef STATIC_H
+#define STATIC_H
+
+#include <stdbool.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "arena.h"
+#include "request.h"
+
+// Long enough for a strong ETag and an IMF-fixdate, including the quotes and the NUL.
+#define STATIC_ETAG_SIZE 64
+#define STATIC_DATE_SIZE 32
+
+typedef struct {
+    int fd;
+    // The file that was opened, relative to the root. Differs from the request path for index.html.
+    const char *name;
+    struct stat st;
+    const char *content_type;
+} StaticFile;
+
+/* Opens the directory that request paths are resolved against.
+    Returns the directory descriptor or -1. */
+int static_open_root(const char *root);
+
+/* Percent-decodes a request path into a name relative to the root ("." for
+    the root itself). Returns NULL if the path is malformed or has a ".." segment. */
+char *static_resolve(StrView path, Arena *arena);
+
+/* Opens the file for a name from static_resolve() below root_fd. A name that
+    is a directory serves its index.html. On success file describes the open
+    file and 200 is returned, otherwise 403 or 404. */
+int static_open(int root_fd, const char *name, Arena *arena, StaticFile *file);
+
+/* Formats the strong ETag of a file, derived from its inode, size and mtime. */
+void static_etag(const struct stat *st, char *buf, size_t size);
+
+/* Formats t as an HTTP date, e.g. "Sun, 06 Nov 1994 08:49:37 GMT". */
+void static_http_date(time_t t, char *buf, size_t size);
+
+/* TRUE if the If-None-Match or If-Modified-Since header of the request says
+    the client's copy (etag, last modified at mtime) is still current. */
+bool static_not_modified(Request *request, const char *etag, time_t mtime);
+
+/* Applies a "Range: bytes=" header to a file of size bytes. Returns 206 and
+    sets *start and *length for one satisfiable range, 416 if it can not be
+    satisfied and 200 when the whole file should be sent (no or unsupported range). */
+int static_parse_range(StrView range, off_t size, off_t *start, off_t *length);
+
+/* Content-Type for the file extension of path. */
+const char *static_content_type(StrView path);
+
+#endif
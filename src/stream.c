@@ -0,0 +1,126 @@
+/*
+ * stream.c
+ *
+ * A chunk is written around the produced bytes in place: the producer fills
+ * a buffer after room left for the chunk size line, which is then written
+ * right-aligned in front of the data, so a chunk is one queued segment.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+
+#include "stream.h"
+
+// Room for the hex size line of a chunk ("4000\r\n") in front of the data.
+#define STREAM_CHUNK_HEADER 8
+// "\r\n" after the data, and the last chunk "0\r\n\r\n".
+#define STREAM_CHUNK_TRAILER 7
+
+typedef struct {
+    Stream *stream;
+    // Set while the buffer is queued.
+    bool busy;
+    char data[STREAM_CHUNK_HEADER + STREAM_BUFFER_SIZE + STREAM_CHUNK_TRAILER];
+} StreamBuffer;
+
+struct Stream {
+    StreamProduce produce;
+    StreamFree free_data;
+    void *data;
+    bool chunked;
+    bool done;
+    // One reference is held by the owner, one by every queued buffer.
+    int refs;
+    StreamBuffer buffers[STREAM_BUFFERS];
+};
+
+Stream *stream_new(StreamProduce produce, StreamFree free_data, void *data, bool chunked) {
+    Stream *stream = g_new(Stream, 1);
+    stream->produce = produce;
+    stream->free_data = free_data;
+    stream->data = data;
+    stream->chunked = chunked;
+    stream->done = FALSE;
+    stream->refs = 1;
+    for (int i = 0; i < STREAM_BUFFERS; i++) {
+        stream->buffers[i].stream = stream;
+        stream->buffers[i].busy = FALSE;
+    }
+    return stream;
+}
+
+static void stream_unref(Stream *stream) {
+    if (--stream->refs == 0) {
+        g_free(stream);
+    }
+}
+
+/* Called by the output queue once a buffer has been sent. */
+static void release_buffer(void *data) {
+    StreamBuffer *buffer = data;
+    buffer->busy = FALSE;
+    stream_unref(buffer->stream);
+}
+
+static StreamBuffer *free_buffer(Stream *stream) {
+    for (int i = 0; i < STREAM_BUFFERS; i++) {
+        if (!stream->buffers[i].busy) {
+            return &stream->buffers[i];
+        }
+    }
+    return NULL;
+}
+
+StreamStatus stream_pump(Stream *stream, OutputQueue *queue, Arena *arena, size_t high_water) {
+    while (!stream->done && queue->bytes < high_water) {
+        StreamBuffer *buffer = free_buffer(stream);
+        if (buffer == NULL) {
+            return STREAM_MORE;
+        }
+
+        char *start = buffer->data + STREAM_CHUNK_HEADER;
+        size_t len = 0;
+        StreamStatus status = stream->produce(stream->data, start, STREAM_BUFFER_SIZE, &len);
+        if (status == STREAM_ERROR) {
+            return STREAM_ERROR;
+        }
+        stream->done = status == STREAM_DONE;
+        bool wait = status == STREAM_WAIT;
+
+        char *end = start + len;
+        if (stream->chunked) {
+            // An empty chunk would end the body early, it only goes out as the last one.
+            if (len > 0) {
+                char size_line[STREAM_CHUNK_HEADER + 1];
+                int n = snprintf(size_line, sizeof(size_line), "%zx\r\n", len);
+                start -= n;
+                memcpy(start, size_line, (size_t) n);
+                memcpy(end, "\r\n", 2);
+                end += 2;
+            }
+            if (stream->done) {
+                memcpy(end, "0\r\n\r\n", 5);
+                end += 5;
+            }
+        }
+
+        if (end > start) {
+            buffer->busy = TRUE;
+            stream->refs++;
+            output_add_mem(queue, arena, start, (size_t) (end - start), release_buffer, buffer);
+        }
+        if (wait) {
+            return STREAM_MORE;
+        }
+    }
+    return stream->done ? STREAM_DONE : STREAM_MORE;
+}
+
+void stream_free(Stream *stream) {
+    if (stream->free_data != NULL) {
+        stream->free_data(stream->data);
+    }
+    stream->free_data = NULL;
+    stream_unref(stream);
+}
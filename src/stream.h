@@ -0,0 +1,59 @@
+/*
+ * stream.h
+ *
+ * Streamed response bodies: a producer writes the body piece by piece into
+ * buffers owned by the stream, and every piece is queued on the connection's
+ * output as it is made (framed as a chunk for HTTP/1.1). A stream has
+ * STREAM_BUFFERS buffers of STREAM_BUFFER_SIZE bytes; a buffer is only
+ * filled again once the socket has taken it, so the memory a response needs
+ * does not depend on the size of its body and a slow client slows the
+ * producer down.
+ */
+
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "arena.h"
+#include "output.h"
+
+#define STREAM_BUFFER_SIZE (16 * 1024)
+#define STREAM_BUFFERS 4
+
+typedef enum {
+    STREAM_MORE,
+    STREAM_DONE,
+    STREAM_ERROR,
+    // The producer has nothing right now (it waits for a socket), its owner pumps again later.
+    STREAM_WAIT
+} StreamStatus;
+
+/* Writes the next part of the body to buf, at most size bytes, and sets *len.
+    Returns STREAM_DONE with the last part (which may be empty), STREAM_WAIT
+    with what it has if the rest is not there yet. */
+typedef StreamStatus (*StreamProduce)(void *data, char *buf, size_t size, size_t *len);
+
+/* Frees the producer's data. */
+typedef void (*StreamFree)(void *data);
+
+typedef struct Stream Stream;
+
+/* Creates a stream that takes its body from produce. With chunked the body
+    is sent with chunked transfer coding, otherwise as it is (the connection
+    has to be closed after it). free_data (may be NULL) is called with data
+    when the stream is freed. */
+Stream *stream_new(StreamProduce produce, StreamFree free_data, void *data, bool chunked);
+
+/* Produces the body into the free buffers and queues them on queue, until
+    queue holds high_water bytes, no buffer is free or the producer has to wait.
+    The segments come from arena. Returns STREAM_DONE once the end of the body is queued and
+    STREAM_ERROR if the producer failed, in which case the response can not
+    be completed. */
+StreamStatus stream_pump(Stream *stream, OutputQueue *queue, Arena *arena, size_t high_water);
+
+/* Drops the stream. Buffers that are still queued stay valid until they have been sent. */
+void stream_free(Stream *stream);
+
+#endif
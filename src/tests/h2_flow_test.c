@@ -0,0 +1,253 @@
+/*
+ * h2_flow_test.c
+ *
+ * HTTP/2 flow control: a session is fed the frames of a client
+ * that starts with a small window, asks for a big body and then lowers
+ * SETTINGS_INITIAL_WINDOW_SIZE below what it already took, which leaves the
+ * stream window negative (RFC 9113 6.9.2). Every DATA frame the session
+ * writes has to fit the window it is sent against, and nothing may go out
+ * until WINDOW_UPDATE brings the window above zero again. Padded request
+ * DATA is counted once against the windows the session gives back.
+ *
+ *   ./tests/h2_flow_test
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "h2.h"
+#include "hpack.h"
+
+#define BODY_SIZE (400 * 1024)
+
+static char body[BODY_SIZE];
+static char head[128];
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+        fprintf(stderr, __VA_ARGS__); \
+        fprintf(stderr, "\n"); \
+        failures++; \
+    } \
+} while (0)
+
+static void serve(void *data, H2Request *request) {
+    (void) data;
+    Reply *reply = &request->reply;
+    output_add_mem(reply->output, reply->arena, head, strlen(head), NULL, NULL);
+    output_add_mem(reply->output, reply->arena, body, BODY_SIZE, NULL, NULL);
+}
+
+static void done(void *data, H2Request *request) {
+    (void) data;
+    (void) request;
+}
+
+static void frame(GString *buf, uint8_t type, uint8_t flags, uint32_t id, const void *payload, size_t len) {
+    uint8_t header[9] = {
+        (uint8_t) (len >> 16), (uint8_t) (len >> 8), (uint8_t) len, type, flags,
+        (uint8_t) (id >> 24), (uint8_t) (id >> 16), (uint8_t) (id >> 8), (uint8_t) id
+    };
+    g_string_append_len(buf, (const char *) header, 9);
+    g_string_append_len(buf, payload, (gssize) len);
+}
+
+static void settings_window(GString *buf, uint32_t window) {
+    uint8_t payload[6] = { 0, 4, (uint8_t) (window >> 24), (uint8_t) (window >> 16), (uint8_t) (window >> 8),
+                           (uint8_t) window };
+    frame(buf, 0x4, 0, 0, payload, sizeof(payload));
+}
+
+static void window_update(GString *buf, uint32_t id, uint32_t increment) {
+    uint8_t payload[4] = { (uint8_t) (increment >> 24), (uint8_t) (increment >> 16), (uint8_t) (increment >> 8),
+                           (uint8_t) increment };
+    frame(buf, 0x8, 0, id, payload, sizeof(payload));
+}
+
+static void receive(H2Session *session, GString *buf) {
+    int budget = 100;
+    size_t n = h2_receive(session, buf->str, buf->len, &budget, 0);
+    CHECK(n == buf->len, "took %zu of %zu bytes", n, buf->len);
+    g_string_truncate(buf, 0);
+}
+
+/* Lets the session frame what it can and takes it off the queue into wire. */
+static void drain(H2Session *session, OutputQueue *out, GString *wire) {
+    h2_send(session, 1024 * 1024);
+    struct iovec iov[OUTPUT_IOV_MAX];
+    while (!output_empty(out)) {
+        int count = output_iov(out, iov, OUTPUT_IOV_MAX);
+        size_t n = 0;
+        for (int i = 0; i < count; i++) {
+            g_string_append_len(wire, iov[i].iov_base, (gssize) iov[i].iov_len);
+            n += iov[i].iov_len;
+        }
+        output_consume(out, n);
+        h2_sent(session, n);
+    }
+}
+
+/* Drains the session. Returns the DATA bytes that went out, and fails if a frame is
+    malformed or there is more DATA than max_data. */
+static size_t send_data(H2Session *session, OutputQueue *out, size_t max_data) {
+    GString *wire = g_string_new(NULL);
+    drain(session, out, wire);
+    size_t data = 0;
+    size_t pos = 0;
+    while (pos + 9 <= wire->len) {
+        const uint8_t *p = (const uint8_t *) wire->str + pos;
+        size_t len = (size_t) p[0] << 16 | (size_t) p[1] << 8 | p[2];
+        CHECK(len <= 16384, "frame of %zu bytes", len);
+        if (p[3] == 0x0) {
+            data += len;
+        }
+        pos += 9 + len;
+    }
+    CHECK(pos == wire->len, "%zu bytes after the last whole frame", wire->len - pos);
+    CHECK(data <= max_data, "%zu bytes of DATA against a window of %zu", data, max_data);
+    g_string_free(wire, TRUE);
+    return data;
+}
+
+/* Drains the session. Returns the sum of the WINDOW_UPDATE increments it sent for stream id. */
+static uint32_t window_updates(H2Session *session, OutputQueue *out, uint32_t id) {
+    GString *wire = g_string_new(NULL);
+    drain(session, out, wire);
+    uint32_t sum = 0;
+    for (size_t pos = 0; pos + 9 <= wire->len;) {
+        const uint8_t *p = (const uint8_t *) wire->str + pos;
+        size_t len = (size_t) p[0] << 16 | (size_t) p[1] << 8 | p[2];
+        uint32_t frame_id = (uint32_t) (p[5] & 0x7f) << 24 | (uint32_t) p[6] << 16 | (uint32_t) p[7] << 8 | p[8];
+        if (p[3] == 0x8 && frame_id == id && len == 4) {
+            sum += (uint32_t) (p[9] & 0x7f) << 24 | (uint32_t) p[10] << 16 | (uint32_t) p[11] << 8 | p[12];
+        }
+        pos += 9 + len;
+    }
+    g_string_free(wire, TRUE);
+    return sum;
+}
+
+static void headers(GString *buf, HpackTable *encoder, uint32_t id, const char *method, uint8_t flags) {
+    GString *block = g_string_new(NULL);
+    hpack_encode_start(encoder, block);
+    hpack_encode(encoder, block, (StrView) { ":method", 7 }, (StrView) { method, strlen(method) }, FALSE);
+    hpack_encode(encoder, block, (StrView) { ":scheme", 7 }, (StrView) { "http", 4 }, FALSE);
+    hpack_encode(encoder, block, (StrView) { ":path", 5 }, (StrView) { "/big", 4 }, FALSE);
+    hpack_encode(encoder, block, (StrView) { ":authority", 10 }, (StrView) { "localhost", 9 }, FALSE);
+    frame(buf, 0x1, flags | 0x4, id, block->str, block->len);
+    g_string_free(block, TRUE);
+}
+
+static H2Config test_config(void) {
+    H2Config config;
+    memset(&config, 0, sizeof(config));
+    config.max_streams = 100;
+    config.body_buffer = 64 * 1024;
+    config.max_body = 1024 * 1024;
+    config.spool_dir = "/tmp";
+    config.serve = serve;
+    config.done = done;
+    return config;
+}
+
+/* The client lowers SETTINGS_INITIAL_WINDOW_SIZE after it got 100 bytes of the body. */
+static void test_negative_window(void) {
+    H2Config config = test_config();
+    Arena arena;
+    arena_init(&arena, 8192);
+    OutputQueue out;
+    output_init(&out);
+    H2Session *session = h2_session_new(&config, &out, &arena, NULL);
+
+    // The preface with a window of 100 bytes, and a GET of the body.
+    GString *in = g_string_new(H2_PREFACE);
+    settings_window(in, 100);
+    HpackTable encoder;
+    hpack_table_init(&encoder, HPACK_TABLE_SIZE);
+    headers(in, &encoder, 1, "GET", 0x1);
+    receive(session, in);
+    size_t sent = send_data(session, &out, 100);
+    CHECK(sent == 100, "%zu bytes of DATA in the first window of 100", sent);
+
+    // Lowered to 10, the stream window is 10 - 100 = -90: nothing goes out.
+    settings_window(in, 10);
+    receive(session, in);
+    sent = send_data(session, &out, 0);
+    CHECK(sent == 0, "%zu bytes of DATA with the window at -90", sent);
+
+    // Still below zero at -40, then open by 60.
+    window_update(in, 1, 50);
+    receive(session, in);
+    sent = send_data(session, &out, 0);
+    CHECK(sent == 0, "%zu bytes of DATA with the window at -40", sent);
+    window_update(in, 1, 100);
+    receive(session, in);
+    sent = send_data(session, &out, 60);
+    CHECK(sent == 60, "%zu bytes of DATA with the window at 60", sent);
+
+    h2_cancel(session);
+    output_clear(&out);
+    h2_session_free(session);
+    arena_destroy(&arena);
+    hpack_table_free(&encoder);
+    g_string_free(in, TRUE);
+}
+
+/* A POST body in padded DATA frames: each frame takes its whole payload from the stream
+    window, once, and the WINDOW_UPDATE gives back exactly that. */
+static void test_padded_data(void) {
+    H2Config config = test_config();
+    config.body_buffer = 1024 * 1024;
+    Arena arena;
+    arena_init(&arena, 8192);
+    OutputQueue out;
+    output_init(&out);
+    H2Session *session = h2_session_new(&config, &out, &arena, NULL);
+
+    GString *in = g_string_new(H2_PREFACE);
+    frame(in, 0x4, 0, 0, NULL, 0);
+    HpackTable encoder;
+    hpack_table_init(&encoder, HPACK_TABLE_SIZE);
+    headers(in, &encoder, 1, "POST", 0);
+    receive(session, in);
+    window_updates(session, &out, 1);
+
+    // Eight frames of 16384 bytes, 1 of pad length, 255 of padding and 16128 of data, take
+    // half of the 256 KB stream window, which is when it is opened again.
+    static uint8_t payload[16384];
+    memset(payload, 'p', sizeof(payload));
+    payload[0] = 255;
+    for (int i = 0; i < 8; i++) {
+        frame(in, 0x0, 0x8, 1, payload, sizeof(payload));
+    }
+    receive(session, in);
+    uint32_t increment = window_updates(session, &out, 1);
+    CHECK(increment == 8 * sizeof(payload), "WINDOW_UPDATE of %u for %zu bytes of padded DATA", increment,
+          8 * sizeof(payload));
+
+    h2_cancel(session);
+    output_clear(&out);
+    h2_session_free(session);
+    arena_destroy(&arena);
+    hpack_table_free(&encoder);
+    g_string_free(in, TRUE);
+}
+
+int main(void) {
+    memset(body, 'x', sizeof(body));
+    snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n", BODY_SIZE);
+    hpack_init();
+    test_negative_window();
+    test_padded_data();
+
+    if (failures > 0) {
+        fprintf(stderr, "h2_flow_test: %d failure(s)\n", failures);
+        return 1;
+    }
+    printf("h2_flow_test: ok\n");
+    return 0;
+}
@@ -0,0 +1,252 @@
+/*
+ * timer.c
+ *
+ * A cascading timer wheel in the style of the classic BSD/Linux kernel
+ * implementation. The wheel keeps the tick it has processed up to in
+ * wheel->now; a timer that is due in less than 64^(l+1) ticks lives in
+ * level l, in the slot picked by its own expiry tick. Every time the lower
+ * 6*l bits of now wrap around, the current slot of level l is cascaded
+ * into the levels below it.
+ */
+
+#include <time.h>
+#include <glib.h>
+
+#include "timer.h"
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4
+
+// Timers further away than the wheel can represent are clamped to its span.
+#define WHEEL_MAX_TICKS ((UINT64_C(1) << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+struct TimerWheel {
+    uint64_t now;
+    unsigned tick_ms;
+    unsigned armed;
+    uint64_t occupied[WHEEL_LEVELS];
+    TimerLink slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+static void list_init(TimerLink *head) {
+    head->next = head;
+    head->prev = head;
+}
+
+static bool list_empty(const TimerLink *head) {
+    return head->next == head;
+}
+
+static void list_append(TimerLink *head, TimerLink *link) {
+    link->prev = head->prev;
+    link->next = head;
+    head->prev->next = link;
+    head->prev = link;
+}
+
+static void list_unlink(TimerLink *link) {
+    link->prev->next = link->next;
+    link->next->prev = link->prev;
+    link->next = NULL;
+    link->prev = NULL;
+}
+
+/* Moves every element of from to the (empty) list to. */
+static void list_splice(TimerLink *from, TimerLink *to) {
+    if (list_empty(from)) {
+        list_init(to);
+        return;
+    }
+    to->next = from->next;
+    to->prev = from->prev;
+    to->next->prev = to;
+    to->prev->next = to;
+    list_init(from);
+}
+
+uint64_t timer_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+TimerWheel *timer_wheel_new(unsigned tick_ms) {
+    TimerWheel *wheel = g_new0(TimerWheel, 1);
+    wheel->tick_ms = tick_ms > 0 ? tick_ms : 1;
+    wheel->now = timer_now_ms() / wheel->tick_ms;
+    for (int l = 0; l < WHEEL_LEVELS; l++) {
+        for (int s = 0; s < WHEEL_SLOTS; s++) {
+            list_init(&wheel->slots[l][s]);
+        }
+    }
+    return wheel;
+}
+
+void timer_wheel_free(TimerWheel *wheel) {
+    g_free(wheel);
+}
+
+void timer_init(Timer *timer, TimerCallback callback) {
+    timer->link.next = NULL;
+    timer->link.prev = NULL;
+    timer->expires = 0;
+    timer->level = -1;
+    timer->slot = -1;
+    timer->callback = callback;
+}
+
+bool timer_is_armed(const Timer *timer) {
+    return timer->link.next != NULL;
+}
+
+/* Links timer into the slot that matches its expiry tick. */
+static void wheel_insert(TimerWheel *wheel, Timer *timer) {
+    if (timer->expires < wheel->now) {
+        timer->expires = wheel->now;
+    }
+    uint64_t delta = timer->expires - wheel->now;
+    if (delta > WHEEL_MAX_TICKS) {
+        delta = WHEEL_MAX_TICKS;
+        timer->expires = wheel->now + delta;
+    }
+
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (UINT64_C(1) << (WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    int slot = (int) ((timer->expires >> (WHEEL_BITS * level)) & WHEEL_MASK);
+
+    timer->level = level;
+    timer->slot = slot;
+    list_append(&wheel->slots[level][slot], &timer->link);
+    wheel->occupied[level] |= UINT64_C(1) << slot;
+}
+
+/* Unlinks timer from whatever list it is on and keeps the occupancy bitmaps right. */
+static void wheel_unlink(TimerWheel *wheel, Timer *timer) {
+    list_unlink(&timer->link);
+    if (timer->level >= 0 && list_empty(&wheel->slots[timer->level][timer->slot])) {
+        wheel->occupied[timer->level] &= ~(UINT64_C(1) << timer->slot);
+    }
+    timer->level = -1;
+    timer->slot = -1;
+}
+
+void timer_arm(TimerWheel *wheel, Timer *timer, uint64_t expires_ms) {
+    if (timer_is_armed(timer)) {
+        wheel_unlink(wheel, timer);
+    }
+    else {
+        wheel->armed++;
+    }
+    // Round up so a timer never fires before its deadline.
+    timer->expires = (expires_ms + wheel->tick_ms - 1) / wheel->tick_ms;
+    wheel_insert(wheel, timer);
+}
+
+void timer_cancel(TimerWheel *wheel, Timer *timer) {
+    if (!timer_is_armed(timer)) {
+        return;
+    }
+    wheel_unlink(wheel, timer);
+    wheel->armed--;
+}
+
+/* Re-inserts every timer of a higher level slot. They all land on lower levels. */
+static int wheel_cascade(TimerWheel *wheel, int level) {
+    int slot = (int) ((wheel->now >> (WHEEL_BITS * level)) & WHEEL_MASK);
+    TimerLink pending;
+    list_splice(&wheel->slots[level][slot], &pending);
+    wheel->occupied[level] &= ~(UINT64_C(1) << slot);
+
+    while (!list_empty(&pending)) {
+        Timer *timer = (Timer *) pending.next;
+        list_unlink(&timer->link);
+        wheel_insert(wheel, timer);
+    }
+    return slot;
+}
+
+void timer_wheel_advance(TimerWheel *wheel, uint64_t now_ms) {
+    uint64_t target = now_ms / wheel->tick_ms;
+
+    while (wheel->now <= target) {
+        // Nothing can expire, so jump straight to the target tick.
+        if (wheel->armed == 0) {
+            wheel->now = target + 1;
+            break;
+        }
+
+        int slot = (int) (wheel->now & WHEEL_MASK);
+        if (slot == 0) {
+            for (int level = 1; level < WHEEL_LEVELS; level++) {
+                if (wheel_cascade(wheel, level) != 0) {
+                    break;
+                }
+            }
+        }
+
+        // Detach the due slot first and step the clock, so callbacks that
+        // re-arm a timer for "now" land in the next tick instead of this list.
+        TimerLink due;
+        list_splice(&wheel->slots[0][slot], &due);
+        wheel->occupied[0] &= ~(UINT64_C(1) << slot);
+        wheel->now++;
+
+        while (!list_empty(&due)) {
+            Timer *timer = (Timer *) due.next;
+            timer->level = -1;
+            timer_cancel(wheel, timer);
+            timer->callback(timer);
+        }
+    }
+}
+
+/* Number of slots from pos to the next occupied slot in bitmap, wrapping around. */
+static int next_occupied(uint64_t bitmap, int pos) {
+    uint64_t rotated = pos == 0 ? bitmap : (bitmap >> pos) | (bitmap << (WHEEL_SLOTS - pos));
+    return __builtin_ctzll(rotated);
+}
+
+int timer_wheel_next_timeout(TimerWheel *wheel, uint64_t now_ms) {
+    if (wheel->armed == 0) {
+        return -1;
+    }
+
+    uint64_t next = UINT64_MAX;
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        if (wheel->occupied[level] == 0) {
+            continue;
+        }
+        int shift = WHEEL_BITS * level;
+        int pos = (int) ((wheel->now >> shift) & WHEEL_MASK);
+        int k = next_occupied(wheel->occupied[level], pos);
+
+        uint64_t tick;
+        if (level == 0) {
+            // Level 0 slots hold exactly one tick, so this is the real deadline.
+            tick = wheel->now + (uint64_t) k;
+        }
+        else {
+            // Higher levels only tell us when the slot cascades, which is never
+            // later than any deadline in it. The current slot is cascaded at the
+            // start of its turn, so once that has passed it waits a full turn.
+            if (k == 0 && (wheel->now & ((UINT64_C(1) << shift) - 1)) != 0) {
+                k = WHEEL_SLOTS;
+            }
+            tick = ((wheel->now >> shift) + (uint64_t) k) << shift;
+        }
+        if (tick < next) {
+            next = tick;
+        }
+    }
+
+    uint64_t deadline_ms = next * wheel->tick_ms;
+    if (deadline_ms <= now_ms) {
+        return 0;
+    }
+    uint64_t wait = deadline_ms - now_ms;
+    return wait > INT32_MAX ? INT32_MAX : (int) wait;
+}
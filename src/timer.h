@@ -0,0 +1,65 @@
+/*
+ * timer.h
+ *
+ * Hierarchical timer wheel. Timers are embedded in their owner (like
+ * EventHandler), so arming, re-arming and cancelling never allocate and
+ * cost O(1). Each level has 64 slots and covers 64 times the span of the
+ * level below it; timers cascade down a level as their deadline approaches.
+ */
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct TimerLink TimerLink;
+typedef struct Timer Timer;
+
+/* Called once when an armed timer expires. The timer is disarmed
+    before the call, so the callback may re-arm it or free its owner. */
+typedef void (*TimerCallback)(Timer *timer);
+
+struct TimerLink {
+    TimerLink *next;
+    TimerLink *prev;
+};
+
+struct Timer {
+    TimerLink link;
+    uint64_t expires;
+    int level;
+    int slot;
+    TimerCallback callback;
+};
+
+typedef struct TimerWheel TimerWheel;
+
+/* Milliseconds on the monotonic clock. */
+uint64_t timer_now_ms(void);
+
+/* Creates a wheel that advances in steps of tick_ms milliseconds. */
+TimerWheel *timer_wheel_new(unsigned tick_ms);
+
+/* Frees the wheel. Timers still armed on it are simply forgotten. */
+void timer_wheel_free(TimerWheel *wheel);
+
+/* Initializes a disarmed timer. */
+void timer_init(Timer *timer, TimerCallback callback);
+
+/* (Re-)arms timer to expire at expires_ms on the timer_now_ms() clock. */
+void timer_arm(TimerWheel *wheel, Timer *timer, uint64_t expires_ms);
+
+/* Disarms timer. Does nothing if it is not armed. */
+void timer_cancel(TimerWheel *wheel, Timer *timer);
+
+bool timer_is_armed(const Timer *timer);
+
+/* Runs the callbacks of every timer that expired up to now_ms. */
+void timer_wheel_advance(TimerWheel *wheel, uint64_t now_ms);
+
+/* Returns how many milliseconds the event loop may sleep before the wheel
+    needs to be advanced again, or -1 when no timer is armed. */
+int timer_wheel_next_timeout(TimerWheel *wheel, uint64_t now_ms);
+
+#endif
@@ -0,0 +1,143 @@
+/*
+ * upgrade.c
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include "log.h"
+#include "upgrade.h"
+
+#define LISTEN_FDS "HTTPD_LISTEN_FDS"
+#define UPGRADE_READY "HTTPD_UPGRADE_READY"
+
+int upgrade_inherited(int **fds) {
+    *fds = NULL;
+    const char *list = getenv(LISTEN_FDS);
+    if (list == NULL) {
+        return 0;
+    }
+    gchar **items = g_strsplit(list, ",", -1);
+    int count = (int) g_strv_length(items);
+    *fds = g_new(int, count > 0 ? count : 1);
+    for (int i = 0; i < count; i++) {
+        char *end;
+        long fd = strtol(items[i], &end, 10);
+        int listening = 0;
+        socklen_t len = (socklen_t) sizeof(listening);
+        if (*end != '\0' || fd < 3 || fd > INT_MAX ||
+                getsockopt((int) fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) == -1 || !listening) {
+            fprintf(stderr, "%s: %s is not a listening socket\n", LISTEN_FDS, items[i]);
+            g_strfreev(items);
+            g_free(*fds);
+            *fds = NULL;
+            return -1;
+        }
+        (*fds)[i] = (int) fd;
+        // They are only passed on again by the next upgrade_exec().
+        fcntl((int) fd, F_SETFD, FD_CLOEXEC);
+    }
+    g_strfreev(items);
+    unsetenv(LISTEN_FDS);
+    return count;
+}
+
+void upgrade_ready(void) {
+    const char *ready = getenv(UPGRADE_READY);
+    if (ready == NULL) {
+        return;
+    }
+    int fd = atoi(ready);
+    unsetenv(UPGRADE_READY);
+    char byte = 1;
+    if (write(fd, &byte, 1) != 1) {
+        perror("Telling the old server we are ready");
+    }
+    close(fd);
+}
+
+bool upgrade_exec(char **argv, const int *fds, int count, int timeout_ms) {
+    int ready[2];
+    if (pipe2(ready, O_CLOEXEC) == -1) {
+        log_error("Upgrade failed, pipe: %s", strerror(errno));
+        return FALSE;
+    }
+
+    // The environment is put together up front: between fork() and exec() the child
+    // of a threaded process may only make async-signal-safe calls.
+    GString *listen = g_string_new(LISTEN_FDS "=");
+    for (int i = 0; i < count; i++) {
+        g_string_append_printf(listen, "%s%d", i > 0 ? "," : "", fds[i]);
+    }
+    gchar *ready_var = g_strdup_printf(UPGRADE_READY "=%d", ready[1]);
+    size_t n = 0;
+    while (environ[n] != NULL) {
+        n++;
+    }
+    char **envp = g_new(char *, n + 3);
+    size_t e = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (strncmp(environ[i], LISTEN_FDS "=", sizeof(LISTEN_FDS)) != 0 &&
+                strncmp(environ[i], UPGRADE_READY "=", sizeof(UPGRADE_READY)) != 0) {
+            envp[e++] = environ[i];
+        }
+    }
+    envp[e++] = listen->str;
+    envp[e++] = ready_var;
+    envp[e] = NULL;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Only the listening sockets and the write end of the pipe stay open across exec(),
+        // and the new server starts with no signal blocked, whatever thread forked it.
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        for (int i = 0; i < count; i++) {
+            fcntl(fds[i], F_SETFD, 0);
+        }
+        fcntl(ready[1], F_SETFD, 0);
+        execvpe(argv[0], argv, envp);
+        _exit(127);
+    }
+    int fork_errno = errno;
+    close(ready[1]);
+    g_free(envp);
+    g_free(ready_var);
+    g_string_free(listen, TRUE);
+    if (pid == -1) {
+        close(ready[0]);
+        log_error("Upgrade failed, fork: %s", strerror(fork_errno));
+        return FALSE;
+    }
+
+    // The pipe is closed without a byte if the new server exits, exec() included.
+    struct pollfd wait = { ready[0], POLLIN, 0 };
+    int r;
+    do {
+        r = poll(&wait, 1, timeout_ms);
+    } while (r == -1 && errno == EINTR);
+    char byte;
+    bool ok = r == 1 && read(ready[0], &byte, 1) == 1;
+    close(ready[0]);
+    if (!ok) {
+        log_error("Upgrade failed, %s (pid %d) %s, still serving", argv[0], (int) pid,
+                  r == 0 ? "did not get ready in time" : "exited");
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return FALSE;
+    }
+    log_info("Upgrade: %s (pid %d) accepts now, draining", argv[0], (int) pid);
+    return TRUE;
+}
@@ -0,0 +1,30 @@
+/*
+ * upgrade.h
+ *
+ * Binary upgrade without downtime. The running server starts its binary
+ * anew, which inherits the listening sockets (their descriptors are in
+ * HTTPD_LISTEN_FDS) and a pipe (HTTPD_UPGRADE_READY) on which it says when
+ * it accepts. Only then does the old server stop accepting and drain its
+ * connections, so the sockets and their backlogs never go away and no
+ * client is refused.
+ */
+
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <stdbool.h>
+
+/* The listening sockets handed over by the old server if this one was started by
+    upgrade_exec(), in *fds (a new array). Returns how many there are, 0 if there are
+    none and -1, saying why on stderr, if HTTPD_LISTEN_FDS is not what we passed. */
+int upgrade_inherited(int **fds);
+
+/* Tells the old server that this one accepts now. Does nothing if there is none. */
+void upgrade_ready(void);
+
+/* Starts argv (looked up in PATH if it has no slash) with fds[0 .. count) inherited, and
+    waits up to timeout_ms for it to be ready. Returns TRUE if it is; FALSE, after logging
+    why and stopping it, if it exited or took too long. */
+bool upgrade_exec(char **argv, const int *fds, int count, int timeout_ms);
+
+#endif
@@ -0,0 +1,322 @@
+/*
+ * uring.c
+ *
+ * The submission and completion rings are shared with the kernel through
+ * mmap(). We only ever touch the SQ tail and the CQ head, the kernel the
+ * other ends; the barriers are the acquire/release pairs below.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <glib.h>
+
+#include "uring.h"
+
+// Buffer group of the provided receive buffers, the only one we register.
+#define URING_BUFFER_GROUP 0
+
+struct Uring {
+    int fd;
+    unsigned entries;
+
+    // Submission queue, sqes is the array the ring indexes into.
+    void *sq_map;
+    size_t sq_map_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    // SQEs filled in but not handed to the kernel yet.
+    unsigned to_submit;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // Provided receive buffers.
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    unsigned buffer_count;
+    unsigned buffer_size;
+    char *buffers;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+                              const void *arg, size_t arg_size) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* Puts buffer bid back into the provided buffer ring. */
+static void add_buffer(Uring *ring, unsigned bid) {
+    unsigned short tail = ring->buf_ring->tail;
+    struct io_uring_buf *buf = &ring->buf_ring->bufs[tail & (ring->buffer_count - 1)];
+    buf->addr = (uint64_t) (uintptr_t) (ring->buffers + (size_t) bid * ring->buffer_size);
+    buf->len = ring->buffer_size;
+    buf->bid = (unsigned short) bid;
+    atomic_store_explicit((_Atomic unsigned short *) &ring->buf_ring->tail, (unsigned short) (tail + 1),
+                          memory_order_release);
+}
+
+static bool setup_buffers(Uring *ring, unsigned count, unsigned size) {
+    ring->buffer_count = count;
+    ring->buffer_size = size;
+    ring->buf_ring_size = count * sizeof(struct io_uring_buf);
+    ring->buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (ring->buf_ring == MAP_FAILED) {
+        ring->buf_ring = NULL;
+        return FALSE;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) ring->buf_ring;
+    reg.ring_entries = count;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        return FALSE;
+    }
+
+    ring->buffers = g_malloc((size_t) count * size);
+    for (unsigned bid = 0; bid < count; bid++) {
+        add_buffer(ring, bid);
+    }
+    return TRUE;
+}
+
+Uring *uring_new(unsigned entries, unsigned buffer_count, unsigned buffer_size) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    // Completions are only needed when we wait for them, so the kernel need not interrupt us.
+    params.flags = IORING_SETUP_COOP_TASKRUN;
+    int fd = sys_io_uring_setup(entries, &params);
+    if (fd < 0 && errno == EINVAL) {
+        params.flags = 0;
+        fd = sys_io_uring_setup(entries, &params);
+    }
+    if (fd < 0) {
+        return NULL;
+    }
+    // Timed waits need IORING_ENTER_EXT_ARG, and one mmap() for both rings keeps this simple.
+    if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(fd);
+        errno = ENOSYS;
+        return NULL;
+    }
+
+    Uring *ring = g_new0(Uring, 1);
+    ring->fd = fd;
+    ring->entries = params.sq_entries;
+
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_size > ring->sq_map_size) {
+        ring->sq_map_size = cq_size;
+    }
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        fd, IORING_OFF_SQ_RING);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_SQES);
+    if (ring->sq_map == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        int saved = errno;
+        if (ring->sq_map == MAP_FAILED) {
+            ring->sq_map = NULL;
+        }
+        if (ring->sqes == MAP_FAILED) {
+            ring->sqes = NULL;
+        }
+        uring_free(ring);
+        errno = saved;
+        return NULL;
+    }
+
+    char *sq = ring->sq_map;
+    ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+    // With IORING_FEAT_SINGLE_MMAP the completion ring lives in the same mapping.
+    ring->cq_head = (unsigned *) (sq + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (sq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *) (sq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (sq + params.cq_off.cqes);
+
+    if (!setup_buffers(ring, buffer_count, buffer_size)) {
+        int saved = errno;
+        uring_free(ring);
+        errno = saved;
+        return NULL;
+    }
+    return ring;
+}
+
+void uring_free(Uring *ring) {
+    if (ring == NULL) {
+        return;
+    }
+    // Closing the ring cancels what is in flight, after that the buffers are ours again.
+    close(ring->fd);
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->sq_map != NULL) {
+        munmap(ring->sq_map, ring->sq_map_size);
+    }
+    if (ring->buf_ring != NULL) {
+        munmap(ring->buf_ring, ring->buf_ring_size);
+    }
+    g_free(ring->buffers);
+    g_free(ring);
+}
+
+/* Hands the filled in SQEs to the kernel without waiting. */
+static int submit(Uring *ring) {
+    while (ring->to_submit > 0) {
+        int n = sys_io_uring_enter(ring->fd, ring->to_submit, 0, 0, NULL, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        ring->to_submit -= (unsigned) n;
+    }
+    return 0;
+}
+
+/* Returns a cleared SQE for op. If the submission queue is full it is submitted first. */
+static struct io_uring_sqe *get_sqe(Uring *ring, UringOp *op) {
+    unsigned tail = *ring->sq_tail;
+    while (tail - atomic_load_explicit((_Atomic unsigned *) ring->sq_head, memory_order_acquire) >= ring->entries) {
+        submit(ring);
+    }
+    unsigned index = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (uint64_t) (uintptr_t) op;
+    ring->sq_array[index] = index;
+    atomic_store_explicit((_Atomic unsigned *) ring->sq_tail, tail + 1, memory_order_release);
+    ring->to_submit++;
+    return sqe;
+}
+
+void uring_accept_multishot(Uring *ring, UringOp *op, int fd) {
+    struct io_uring_sqe *sqe = get_sqe(ring, op);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+}
+
+bool uring_more(uint32_t flags) {
+    return (flags & IORING_CQE_F_MORE) != 0;
+}
+
+void uring_recv(Uring *ring, UringOp *op, int fd) {
+    struct io_uring_sqe *sqe = get_sqe(ring, op);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+}
+
+void uring_writev(Uring *ring, UringOp *op, int fd, const struct iovec *iov, int count) {
+    struct io_uring_sqe *sqe = get_sqe(ring, op);
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) iov;
+    sqe->len = (unsigned) count;
+}
+
+void uring_poll_out(Uring *ring, UringOp *op, int fd) {
+    struct io_uring_sqe *sqe = get_sqe(ring, op);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLOUT;
+}
+
+void uring_poll_in(Uring *ring, UringOp *op, int fd) {
+    struct io_uring_sqe *sqe = get_sqe(ring, op);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+}
+
+void uring_cancel(Uring *ring, UringOp *op) {
+    // The cancel request itself completes with user data 0, which is not dispatched.
+    struct io_uring_sqe *sqe = get_sqe(ring, NULL);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t) (uintptr_t) op;
+}
+
+const char *uring_buffer(Uring *ring, uint32_t flags) {
+    if (!(flags & IORING_CQE_F_BUFFER)) {
+        return NULL;
+    }
+    unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    return ring->buffers + (size_t) bid * ring->buffer_size;
+}
+
+void uring_buffer_return(Uring *ring, uint32_t flags) {
+    if (flags & IORING_CQE_F_BUFFER) {
+        add_buffer(ring, flags >> IORING_CQE_BUFFER_SHIFT);
+    }
+}
+
+int uring_wait(Uring *ring, int timeout_ms) {
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    if (timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long) (timeout_ms % 1000) * 1000000;
+        arg.ts = (uint64_t) (uintptr_t) &ts;
+    }
+
+    // Submitting and waiting is one system call.
+    int n = sys_io_uring_enter(ring->fd, ring->to_submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                               &arg, sizeof(arg));
+    if (n < 0 && errno != ETIME && errno != EINTR && errno != EBUSY) {
+        return -1;
+    }
+    if (n > 0) {
+        ring->to_submit -= (unsigned) n;
+    }
+
+    // Handlers may submit more while we go through the completions.
+    int count = 0;
+    unsigned head = *ring->cq_head;
+    while (head != atomic_load_explicit((_Atomic unsigned *) ring->cq_tail, memory_order_acquire)) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+        UringOp *op = (UringOp *) (uintptr_t) cqe->user_data;
+        int res = cqe->res;
+        uint32_t flags = cqe->flags;
+        head++;
+        atomic_store_explicit((_Atomic unsigned *) ring->cq_head, head, memory_order_release);
+        if (op != NULL) {
+            op->callback(op, res, flags);
+            count++;
+        }
+    }
+    return count;
+}
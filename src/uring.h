@@ -0,0 +1,74 @@
+/*
+ * uring.h
+ *
+ * io_uring completion engine, used instead of the epoll loop with --io-uring.
+ * It talks to the kernel with the raw system calls (no liburing). Every
+ * operation is described by a UringOp that the owner embeds in its own state,
+ * like an EventHandler; the CQE's user data points straight at it. Received
+ * data lands in a ring of provided buffers that the kernel picks from, so no
+ * connection holds a receive buffer while it waits. Submitting is batched
+ * with waiting, so a wakeup that answers many requests costs one syscall.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+typedef struct UringOp UringOp;
+
+/* Called with the result of a completed operation (bytes, a descriptor or
+    -errno) and the CQE flags. */
+typedef void (*UringCallback)(UringOp *op, int res, uint32_t flags);
+
+struct UringOp {
+    UringCallback callback;
+};
+
+typedef struct Uring Uring;
+
+/* Creates a ring with room for entries submissions and buffer_count receive
+    buffers of buffer_size bytes. Returns NULL with errno set if the kernel
+    lacks io_uring or a feature we rely on (provided buffer rings, 5.19). */
+Uring *uring_new(unsigned entries, unsigned buffer_count, unsigned buffer_size);
+
+/* Closes the ring, cancelling everything still in flight, and frees it. */
+void uring_free(Uring *ring);
+
+/* Accepts connections on fd until cancelled; every one completes op with
+    the new (non-blocking) descriptor. Once uring_more() says it stopped, it
+    has to be submitted again. */
+void uring_accept_multishot(Uring *ring, UringOp *op, int fd);
+
+/* FALSE once a multishot operation has stopped with this completion. */
+bool uring_more(uint32_t flags);
+
+/* Receives once into a provided buffer, see uring_buffer(). */
+void uring_recv(Uring *ring, UringOp *op, int fd);
+
+/* Writes iov[0 .. count), which must stay valid until op completes. */
+void uring_writev(Uring *ring, UringOp *op, int fd, const struct iovec *iov, int count);
+
+/* Completes op once fd is writable. */
+void uring_poll_out(Uring *ring, UringOp *op, int fd);
+
+/* Completes op once fd is readable. */
+void uring_poll_in(Uring *ring, UringOp *op, int fd);
+
+/* Asks the kernel to cancel op. op still completes (with -ECANCELED if it did not finish first). */
+void uring_cancel(Uring *ring, UringOp *op);
+
+/* The provided buffer a recv completed into, NULL if it has none. */
+const char *uring_buffer(Uring *ring, uint32_t flags);
+
+/* Hands the buffer of a recv completion back to the kernel. */
+void uring_buffer_return(Uring *ring, uint32_t flags);
+
+/* Submits what is queued, waits up to timeout_ms (-1 = forever) and
+    dispatches every completion. Returns the number of completions, 0 on
+    timeout and -1 on error. */
+int uring_wait(Uring *ring, int timeout_ms);
+
+#endif